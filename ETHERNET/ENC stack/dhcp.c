@@ -1,134 +1,645 @@
 #include "dhcp.h"
+#include "ethernet.h"
 #include "utilities/util.h"
 
-int16_t beginWithDHCP(Dhcp_t *dhcp,MAC_address_t *mac, uint32_t timeout, uint32_t responseTimeout) {
-    if(responseTimeout == NULL) {
-        responseTimeout = 4000;
+// longest wait for a retransmission, keeps it below 2^31 ms
+#define DHCP_MAX_WAIT 2000000UL
+
+#if IP_TIMERS
+// longest lease timer step, keeps the timer below 2^31 ms
+#define DHCP_TIMER_MAX_STEP 2000000UL
+
+static void arm_lease_timer(Dhcp_t *dhcp);
+
+/**
+ * @brief Counts a lease counter down by the step of the lease timer.
+ * 
+ * @param counter 
+ * @param step 
+ */
+static void count_down(int32_t *counter, uint32_t step) {
+    if (*counter > (int32_t)step)
+        *counter -= step;
+    else
+        *counter = 0;
+}
+
+/**
+ * @brief Lease timer callback: the step it was armed for has passed.
+ * 
+ * @param arg the Dhcp_t
+ */
+static void lease_timer_expired(void *arg) {
+    Dhcp_t *dhcp = (Dhcp_t *)arg;
+
+    count_down(&dhcp->_renewInSec, dhcp->_leaseStep);
+    count_down(&dhcp->_rebindInSec, dhcp->_leaseStep);
+    count_down(&dhcp->_expireInSec, dhcp->_leaseStep);
+    arm_lease_timer(dhcp);
+}
+
+/**
+ * @brief Arms the lease timer for the next of T1 (renew), T2 (rebind) and the end of
+ * the lease that has not passed yet. tickDHCP() then only has to look at the counters.
+ * 
+ * @param dhcp 
+ */
+static void arm_lease_timer(Dhcp_t *dhcp) {
+    int32_t sec = dhcp->_renewInSec > 0 ? dhcp->_renewInSec :
+                  dhcp->_rebindInSec > 0 ? dhcp->_rebindInSec : dhcp->_expireInSec;
+
+    if (sec <= 0)
+        return;
+    dhcp->_leaseStep = (uint32_t)sec < DHCP_TIMER_MAX_STEP ? (uint32_t)sec : DHCP_TIMER_MAX_STEP;
+    ip_timer_set(&dhcp->_leaseTimer, dhcp->_leaseStep * 1000, lease_timer_expired, dhcp);
+}
+
+/**
+ * @brief Retransmission timer callback. Nothing to do: the timer is no longer
+ * pending afterwards and tickDHCP(), run next in the same Ethernetick(), sends.
+ * 
+ * @param arg 
+ */
+static void send_timer_expired(void *arg) {
+}
+#else
+/**
+ * @brief Counts a lease counter down by factor seconds.
+ * 
+ * @param counter 
+ * @param factor 
+ */
+static void count_down(int32_t *counter, signed long factor) {
+    //if we can assume that the cycle time (factor) is fairly constant
+    //and if the remainder is less than cycle time * 2 
+    //do it early instead of late
+    if(*counter < factor*2 )
+        *counter = 0;
+    else
+        *counter -= factor;
+}
+
+/**
+ * @brief Counts the lease seconds down from millis(), for builds without timers.
+ * 
+ * @param dhcp 
+ */
+static void count_lease(Dhcp_t *dhcp) {
+    //this uses a signed / unsigned trick to deal with millis overflow
+    unsigned long now = millis();
+    signed long snow = (long)now;
+    if (dhcp->_lastCheck != 0){
+        signed long factor;
+        //calc how many ms past the timeout we are
+        factor = snow - (long)dhcp->_secTimeout;
+        //if on or passed the timeout, reduce the counters
+        if ( factor >= 0 ){
+            //next timeout should be now plus 1000 ms minus parts of second in factor
+            dhcp->_secTimeout = snow + 1000 - factor % 1000;
+            //how many seconds late are we, minimum 1
+            factor = factor / 1000 +1;
+            
+            //reduce the counters by that mouch
+            count_down(&dhcp->_renewInSec, factor);
+            count_down(&dhcp->_rebindInSec, factor);
+            count_down(&dhcp->_expireInSec, factor);
+        }
     }
-    if(timeout == NULL) {
-        timeout = 60000;
+    else{
+        dhcp->_secTimeout = snow + 1000;
     }
-    dhcp->_LeaseTime = 0;
-    dhcp->_T1=0;
-    dhcp->_T2=0;
-    dhcp->_lastCheck=0;
-    dhcp->_timeout = timeout;
-    dhcp->_responseTimeout = responseTimeout;
+    dhcp->_lastCheck = now;
+}
+#endif
+
+/**
+ * @brief Schedules the next retransmission of the current message.
+ * 
+ * @param dhcp 
+ * @param ms 
+ */
+static void arm_retransmit(Dhcp_t *dhcp, uint32_t ms) {
+#if IP_TIMERS
+    ip_timer_set(&dhcp->_sendTimer, ms, send_timer_expired, dhcp);
+#else
+    dhcp->_sentAt = millis();
+    dhcp->_wait = ms;
+#endif
+}
 
-    // zero out MacAddr
-    memset(&(dhcp->_MacAddr), 0, sizeof(dhcp->_MacAddr)); 
-    reset_lease(dhcp);
-    memcpy(&(dhcp->_MacAddr), mac, sizeof(mac) );
-    dhcp->_state = STATE_DHCP_START;
-    return request_lease(&dhcp);
+/**
+ * @brief Is the retransmission armed by arm_retransmit() due?
+ * 
+ * @param dhcp 
+ * @return true 
+ * @return false 
+ */
+static bool retransmit_due(Dhcp_t *dhcp) {
+#if IP_TIMERS
+    return !ip_timer_pending(&dhcp->_sendTimer);
+#else
+    return (millis() - dhcp->_sentAt) >= dhcp->_wait;
+#endif
 }
 
-void reset_lease(Dhcp_t *dhcp){
-  memset(&(dhcp->_LocalIp), 0, 4);
-  memset(&(dhcp->_SubnetMask), 0, 4);
-  memset(&(dhcp->_GatewayIp), 0, 4);
-  memset(&(dhcp->_DhcpServerIp), 0, 4);
-  memset(&(dhcp->_DnsServerIp), 0, 4);
+/**
+ * @brief Sends a message of the current exchange.
+ * 
+ * @param dhcp 
+ * @param messageType 
+ */
+static void send_message(Dhcp_t *dhcp, uint8_t messageType) {
+    send_DHCP_MESSAGE(dhcp, messageType, (millis() - dhcp->_exchangeStart) / 1000);
 }
 
-//return:0 on error, 1 if request is sent and response is received
-int16_t request_lease(Dhcp_t *dhcp){
-    
-    uint8_t messageType = 0;
+/**
+ * @brief Sends a DISCOVER or the REQUEST for an offer and schedules its retransmission
+ * with exponential backoff (RFC 2131 4.1), randomized by up to a second.
+ * 
+ * @param dhcp 
+ * @param messageType 
+ */
+static void send_with_backoff(Dhcp_t *dhcp, uint8_t messageType) {
+    send_message(dhcp, messageType);
+    arm_retransmit(dhcp, dhcp->_retransmit + random(0UL, 1000UL));
+    dhcp->_retransmit = dhcp->_retransmit < DHCP_RETRANSMIT_MAX / 2 ? dhcp->_retransmit * 2 : DHCP_RETRANSMIT_MAX;
+}
 
-    // Pick an initial transaction ID
-    dhcp->_TransactionId = random(1UL, 2000UL);
-    dhcp->_InitialTransactionId = dhcp->_TransactionId;
+/**
+ * @brief Sends the REQUEST of a renewal or rebinding, again after half the time left
+ * until T2 (or the end of the lease), at least DHCP_RENEW_MIN_WAIT seconds.
+ * 
+ * @param dhcp 
+ * @param left seconds left
+ */
+static void send_renewal(Dhcp_t *dhcp, int32_t left) {
+    uint32_t wait = left > 0 ? (uint32_t)left / 2 : 0;
+
+    if (wait < DHCP_RENEW_MIN_WAIT)
+        wait = DHCP_RENEW_MIN_WAIT;
+    if (wait > DHCP_MAX_WAIT)
+        wait = DHCP_MAX_WAIT;
+    send_message(dhcp, DHCP_REQUEST);
+    arm_retransmit(dhcp, wait * 1000);
+}
 
-    UdpSocket.stop();
-    if (UdpSocket.begin(DHCP_CLIENT_PORT) == 0)
-    {
-      // Couldn't get a socket
-      return 0;
+/**
+ * @brief Opens the socket of an exchange and starts it with a new transaction ID.
+ * 
+ * @param dhcp 
+ * @return true 
+ * @return false if there is no socket or memory, the next tick tries again
+ */
+static bool begin_exchange(Dhcp_t *dhcp) {
+    if (!dhcp->_UdpSocket._ip_udp_conn && EthernetUDP_begin(&dhcp->_UdpSocket, DHCP_CLIENT_PORT) == 0)
+        return false;
+    dhcp->_TransactionId = random(1UL, 0x7FFFFFFFUL);
+    dhcp->_exchangeStart = millis();
+    dhcp->_retransmit = dhcp->_responseTimeout;
+    dhcp->_attempts = 0;
+    return true;
+}
+
+/**
+ * @brief Hands an event to the application.
+ * 
+ * @param dhcp 
+ * @param event DHCP_EVENT_*
+ */
+static void notify(Dhcp_t *dhcp, uint8_t event) {
+    if (dhcp->_callback)
+        dhcp->_callback(dhcp, event, dhcp->_callbackArg);
+}
+
+/**
+ * @brief Takes the lease of an ACK: configures the stack if the address changed and
+ * arms the lease timers. The socket is closed until T1.
+ * 
+ * @param dhcp 
+ * @param lease 
+ */
+static void bind_lease(Dhcp_t *dhcp, const Dhcp_lease_t *lease) {
+    uint8_t previous = dhcp->_state;
+
+    dhcp->_LocalIp = lease->localIp;
+    dhcp->_SubnetMask = lease->subnetMask;
+    dhcp->_GatewayIp = lease->gatewayIp;
+    dhcp->_DnsServerIp = lease->dnsServerIp;
+    if (lease->serverIp.ipv4_word != 0)
+        dhcp->_DhcpServerIp = lease->serverIp;
+
+    //use default lease time if we didn't get it
+    dhcp->_LeaseTime = lease->leaseTime ? lease->leaseTime : DEFAULT_LEASE;
+    //T1 should be 50% of LeaseTime
+    dhcp->_T1 = lease->t1 ? lease->t1 : dhcp->_LeaseTime >> 1;
+    //T2 should be 87.5% (7/8ths) of LeaseTime
+    dhcp->_T2 = lease->t2 ? lease->t2 : dhcp->_LeaseTime - (dhcp->_LeaseTime >> 3);
+    // an infinite lease (0xFFFFFFFF) is counted as the longest the counters hold
+    dhcp->_renewInSec = dhcp->_T1 > 0x7FFFFFFFUL ? 0x7FFFFFFF : (int32_t)dhcp->_T1;
+    dhcp->_rebindInSec = dhcp->_T2 > 0x7FFFFFFFUL ? 0x7FFFFFFF : (int32_t)dhcp->_T2;
+    dhcp->_expireInSec = dhcp->_LeaseTime > 0x7FFFFFFFUL ? 0x7FFFFFFF : (int32_t)dhcp->_LeaseTime;
+#if IP_TIMERS
+    ip_timer_stop(&dhcp->_sendTimer);
+    arm_lease_timer(dhcp);
+#else
+    dhcp->_lastCheck = 0;
+#endif
+    EthernetUDP_stop(&dhcp->_UdpSocket);
+    dhcp->_state = STATE_DHCP_LEASED;
+
+    if (previous == STATE_DHCP_RENEWING)
+        dhcp->_checkResult = DHCP_CHECK_RENEW_OK;
+    else if (previous == STATE_DHCP_REBINDING)
+        dhcp->_checkResult = DHCP_CHECK_REBIND_OK;
+
+    if (dhcp->_BoundIp.ipv4_word != dhcp->_LocalIp.ipv4_word) {
+        ip_sethostaddr(&dhcp->_LocalIp);
+        ip_setnetmask(&dhcp->_SubnetMask);
+        ip_setdraddr(&dhcp->_GatewayIp);
+        dhcp->_BoundIp = dhcp->_LocalIp;
+        notify(dhcp, DHCP_EVENT_BOUND);
+    } else {
+        notify(dhcp, DHCP_EVENT_RENEWED);
     }
-    
-    presend(dhcp);
-    
-    uint16_t result = 0;
-    
-    unsigned long startTime = millis();
-    
-    while(dhcp->_state != STATE_DHCP_LEASED) {
-        if(dhcp->_state == STATE_DHCP_START) {
-            dhcp->_TransactionId++;
-            
-            send_MESSAGE(DHCP_DISCOVER, ((millis() - startTime) / 1000));
-            dhcp->_state = STATE_DHCP_DISCOVER;
+    // the resolver of the interface uses the server of the lease, a renewal may change it
+    ip_ethernet->_dnsServerAddress = dhcp->_DnsServerIp;
+}
+
+/**
+ * @brief Drops the lease, expired or refused, and starts over with a DISCOVER.
+ * 
+ * @param dhcp 
+ */
+static void lose_lease(Dhcp_t *dhcp) {
+    bool bound = dhcp->_BoundIp.ipv4_word != 0;
+
+    reset_DHCP_lease(dhcp);
+    dhcp->_state = STATE_DHCP_START;
+    if (bound) {
+        // the lease fields were zeroed above, this unconfigures the address, mask and router
+        ip_sethostaddr(&dhcp->_LocalIp);
+        ip_setnetmask(&dhcp->_SubnetMask);
+        ip_setdraddr(&dhcp->_GatewayIp);
+        dhcp->_BoundIp = dhcp->_LocalIp;
+        notify(dhcp, DHCP_EVENT_LOST);
+    }
+}
+
+/**
+ * @brief Moves the state machine on with a reply to the current exchange.
+ * 
+ * @param dhcp 
+ * @param messageType 
+ * @param lease 
+ */
+static void handle_reply(Dhcp_t *dhcp, uint8_t messageType, const Dhcp_lease_t *lease) {
+    switch (dhcp->_state) {
+    case STATE_DHCP_DISCOVER:
+#if DHCP_RAPID_COMMIT
+        // a server doing rapid commit answers the DISCOVER with the ACK
+        if (messageType == DHCP_ACK && lease->rapidCommit) {
+            bind_lease(dhcp, lease);
+            break;
         }
-        else if(dhcp->_state == STATE_DHCP_REREQUEST){
-            dhcp->_TransactionId++;
-            send_MESSAGE(DHCP_REQUEST, ((millis() - startTime)/1000));
+#endif
+        if (messageType == DHCP_OFFER) {
+            // request the first offer, from the server that made it
+            dhcp->_LocalIp = lease->localIp;
+            dhcp->_DhcpServerIp = lease->serverIp.ipv4_word ? lease->serverIp : EthernetUDP_remoteIP(&dhcp->_UdpSocket);
             dhcp->_state = STATE_DHCP_REQUEST;
+            dhcp->_retransmit = dhcp->_responseTimeout;
+            dhcp->_attempts = 1;
+            send_with_backoff(dhcp, DHCP_REQUEST);
         }
-        else if(dhcp->_state == STATE_DHCP_DISCOVER) {
-            uint32_t respId;
-            messageType = parseDHCPResponse(dhcp,dhcp->_responseTimeout, respId);
-            if(messageType == DHCP_OFFER) {
-                // We'll use the transaction ID that the offer came with,
-                // rather than the one we were up to
-                dhcp->_TransactionId = respId;
-                send_MESSAGE(DHCP_REQUEST, ((millis() - startTime) / 1000));
-                dhcp->_state = STATE_DHCP_REQUEST;
-            }
+        break;
+    case STATE_DHCP_REQUEST:
+        if (lease->serverIp.ipv4_word && lease->serverIp.ipv4_word != dhcp->_DhcpServerIp.ipv4_word)
+            break; // another server answering a broadcast
+        // fall through
+    case STATE_DHCP_REBOOTING:
+    case STATE_DHCP_RENEWING:
+    case STATE_DHCP_REBINDING:
+        if (messageType == DHCP_ACK)
+            bind_lease(dhcp, lease);
+        else if (messageType == DHCP_NAK)
+            lose_lease(dhcp);
+        break;
+    }
+}
+
+// ctor
+void initDHCP(Dhcp_t *dhcp) {
+    memset(dhcp, 0, sizeof(*dhcp));
+    EthernetUDP_init(&dhcp->_UdpSocket);
+    dhcp->_state = STATE_DHCP_STOPPED;
+}
+
+/**
+ * @brief Starts leasing an address in the background: tickDHCP(), run by Ethernetick(),
+ * sends the DISCOVER and goes on with the exchange, renews the lease at T1 and rebinds
+ * it at T2. The stack is configured with the leased address, callback is told when
+ * it changes.
+ * 
+ * @param dhcp 
+ * @param mac 
+ * @param callback NULL for none
+ * @param arg Passed to callback
+ */
+void startDHCP(Dhcp_t *dhcp, const MAC_address_t *mac, Dhcp_callback callback, void *arg) {
+    stopDHCP(dhcp);
+    reset_DHCP_lease(dhcp);
+    memcpy(&(dhcp->_MacAddr), mac, sizeof(dhcp->_MacAddr));
+    dhcp->_callback = callback;
+    dhcp->_callbackArg = arg;
+    if (dhcp->_responseTimeout == 0)
+        dhcp->_responseTimeout = DHCP_RETRANSMIT_MIN;
+    dhcp->_checkResult = DHCP_CHECK_NONE;
+    dhcp->_state = STATE_DHCP_START;
+}
+
+/**
+ * @brief Reads a 32 bit field of a lease record.
+ * 
+ * @param p 
+ * @return uint32_t 
+ */
+static uint32_t record_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Writes a 32 bit field of a lease record.
+ * 
+ * @param p 
+ * @param value 
+ */
+static void record_put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * @brief Fletcher-16 checksum of a lease record, up to the checksum field. A record
+ * left blank or half written by a power loss does not pass.
+ * 
+ * @param record 
+ * @return uint16_t 
+ */
+static uint16_t record_checksum(const uint8_t *record) {
+    uint16_t sum1 = 0, sum2 = 0;
+
+    for (uint8_t i = 0; i < DHCP_RECORD_CHECKSUM; i++) {
+        sum1 = (sum1 + record[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    return sum2 << 8 | sum1;
+}
+
+/**
+ * @brief Writes the current lease into record, for the application to keep in
+ * non-volatile memory and hand to startDHCPWithLease() after a reboot. Best called
+ * from the callback on DHCP_EVENT_BOUND: the address only changes then. The times
+ * are those of the last ACK, the time spent powered off is not known.
+ * 
+ * @param dhcp 
+ * @param record DHCP_RECORD_SIZE bytes
+ * @return uint8_t DHCP_RECORD_SIZE, 0 if there is no lease to save
+ */
+uint8_t saveDHCPLease(Dhcp_t *dhcp, uint8_t *record) {
+    uint16_t checksum;
+
+    if (dhcp->_state != STATE_DHCP_LEASED && dhcp->_state != STATE_DHCP_RENEWING && dhcp->_state != STATE_DHCP_REBINDING)
+        return 0;
+    memset(record, 0, DHCP_RECORD_SIZE);
+    record[0] = DHCP_RECORD_VERSION;
+    memcpy(record + DHCP_RECORD_MAC, &(dhcp->_MacAddr), 6);
+    memcpy(record + DHCP_RECORD_LOCAL, dhcp->_LocalIp.ipv4_addr_array, 4);
+    memcpy(record + DHCP_RECORD_MASK, dhcp->_SubnetMask.ipv4_addr_array, 4);
+    memcpy(record + DHCP_RECORD_GATEWAY, dhcp->_GatewayIp.ipv4_addr_array, 4);
+    memcpy(record + DHCP_RECORD_SERVER, dhcp->_DhcpServerIp.ipv4_addr_array, 4);
+    memcpy(record + DHCP_RECORD_DNS, dhcp->_DnsServerIp.ipv4_addr_array, 4);
+    record_put32(record + DHCP_RECORD_LEASE, dhcp->_LeaseTime);
+    record_put32(record + DHCP_RECORD_T1, dhcp->_T1);
+    record_put32(record + DHCP_RECORD_T2, dhcp->_T2);
+    checksum = record_checksum(record);
+    record[DHCP_RECORD_CHECKSUM] = checksum >> 8;
+    record[DHCP_RECORD_CHECKSUM + 1] = checksum & 0xFF;
+    return DHCP_RECORD_SIZE;
+}
+
+/**
+ * @brief Starts like startDHCP(), but first asks for the address of a saved lease
+ * with a broadcast REQUEST (INIT-REBOOT, RFC 2131 3.2): one exchange instead of two.
+ * A NAK, or no answer after DHCP_REBOOT_RETRIES REQUESTs, falls back to a DISCOVER.
+ * A record that is missing, damaged or saved for another MAC address is ignored.
+ * 
+ * @param dhcp 
+ * @param mac 
+ * @param record Written by saveDHCPLease(), NULL for none
+ * @param callback NULL for none
+ * @param arg Passed to callback
+ */
+void startDHCPWithLease(Dhcp_t *dhcp, const MAC_address_t *mac, const uint8_t *record, Dhcp_callback callback, void *arg) {
+    uint16_t checksum;
+
+    startDHCP(dhcp, mac, callback, arg);
+    if (record == NULL || record[0] != DHCP_RECORD_VERSION ||
+        memcmp(record + DHCP_RECORD_MAC, &(dhcp->_MacAddr), 6) != 0)
+        return;
+    checksum = record_checksum(record);
+    if (record[DHCP_RECORD_CHECKSUM] != (checksum >> 8) || record[DHCP_RECORD_CHECKSUM + 1] != (checksum & 0xFF))
+        return;
+    memcpy(dhcp->_LocalIp.ipv4_addr_array, record + DHCP_RECORD_LOCAL, 4);
+    if (dhcp->_LocalIp.ipv4_word == 0)
+        return;
+    memcpy(dhcp->_SubnetMask.ipv4_addr_array, record + DHCP_RECORD_MASK, 4);
+    memcpy(dhcp->_GatewayIp.ipv4_addr_array, record + DHCP_RECORD_GATEWAY, 4);
+    memcpy(dhcp->_DhcpServerIp.ipv4_addr_array, record + DHCP_RECORD_SERVER, 4);
+    memcpy(dhcp->_DnsServerIp.ipv4_addr_array, record + DHCP_RECORD_DNS, 4);
+    dhcp->_LeaseTime = record_get32(record + DHCP_RECORD_LEASE);
+    dhcp->_T1 = record_get32(record + DHCP_RECORD_T1);
+    dhcp->_T2 = record_get32(record + DHCP_RECORD_T2);
+    dhcp->_attempts = 0;
+    dhcp->_state = STATE_DHCP_REBOOTING;
+}
+
+/**
+ * @brief Stops the client. The leased address stays configured but is no longer renewed.
+ * 
+ * @param dhcp 
+ */
+void stopDHCP(Dhcp_t *dhcp) {
+    EthernetUDP_stop(&dhcp->_UdpSocket);
+#if IP_TIMERS
+    ip_timer_stop(&dhcp->_leaseTimer);
+    ip_timer_stop(&dhcp->_sendTimer);
+#endif
+    dhcp->_state = STATE_DHCP_STOPPED;
+}
+
+/**
+ * @brief Runs the client for one round, without waiting: reads the replies queued on
+ * its socket, renews or rebinds the lease when T1 or T2 has passed and sends what is
+ * due. Called by Ethernetick().
+ * 
+ * @param dhcp 
+ */
+void tickDHCP(Dhcp_t *dhcp) {
+    Dhcp_lease_t lease;
+    uint32_t xid;
+    uint8_t type;
+
+    if (dhcp->_state == STATE_DHCP_STOPPED)
+        return;
+#if !IP_TIMERS
+    if (dhcp->_state == STATE_DHCP_LEASED || dhcp->_state == STATE_DHCP_RENEWING || dhcp->_state == STATE_DHCP_REBINDING)
+        count_lease(dhcp);
+#endif
+
+    // replies queued since the last round
+    while (dhcp->_UdpSocket._ip_udp_conn && EthernetUDP_parseQueued(&dhcp->_UdpSocket) > 0) {
+        type = parseDHCPResponse(dhcp, &xid, &lease);
+        if (type != 0 && xid == dhcp->_TransactionId)
+            handle_reply(dhcp, type, &lease);
+    }
+
+    //if we have a lease but should renew, ask the server that leased it
+    if (dhcp->_state == STATE_DHCP_LEASED && dhcp->_renewInSec <= 0 && begin_exchange(dhcp)) {
+        dhcp->_state = STATE_DHCP_RENEWING;
+        send_renewal(dhcp, dhcp->_rebindInSec);
+    }
+    //if the server did not answer until T2, ask any server
+    if ((dhcp->_state == STATE_DHCP_LEASED || dhcp->_state == STATE_DHCP_RENEWING) && dhcp->_rebindInSec <= 0 && begin_exchange(dhcp)) {
+        dhcp->_checkResult = DHCP_CHECK_RENEW_FAIL;
+        dhcp->_state = STATE_DHCP_REBINDING;
+        send_renewal(dhcp, dhcp->_expireInSec);
+    }
+    //if the lease ran out, this should basically restart completely
+    if ((dhcp->_state == STATE_DHCP_LEASED || dhcp->_state == STATE_DHCP_RENEWING || dhcp->_state == STATE_DHCP_REBINDING) && dhcp->_expireInSec <= 0) {
+        dhcp->_checkResult = DHCP_CHECK_REBIND_FAIL;
+        lose_lease(dhcp);
+    }
+
+    switch (dhcp->_state) {
+    case STATE_DHCP_START:
+        if (begin_exchange(dhcp)) {
+            dhcp->_state = STATE_DHCP_DISCOVER;
+            send_with_backoff(dhcp, DHCP_DISCOVER);
         }
-        else if(dhcp->_state == STATE_DHCP_REQUEST) {
-            uint32_t respId;
-            messageType = parseDHCPResponse(dhcp,dhcp->_responseTimeout, respId);
-            if(messageType == DHCP_ACK) {
-                dhcp->_state = STATE_DHCP_LEASED;
-                result = 1;
-                //use default lease time if we didn't get it
-                if(dhcp->_LeaseTime == 0){
-                    dhcp->_LeaseTime = DEFAULT_LEASE;
-                }
-                //calculate T1 & T2 if we didn't get it
-                if(dhcp->_T1 == 0){
-                    //T1 should be 50% of LeaseTime
-                    dhcp->_T1 = dhcp->_LeaseTime >> 1;
-                }
-                if(dhcp->_T2 == 0){
-                    //T2 should be 87.5% (7/8ths) of LeaseTime
-                    dhcp->_T2 = dhcp->_T1 << 1;
-                }
-                dhcp->_renewInSec = dhcp->_T1;
-                dhcp->_rebindInSec = dhcp->_T2;
+        break;
+    case STATE_DHCP_DISCOVER:
+        if (retransmit_due(dhcp))
+            send_with_backoff(dhcp, DHCP_DISCOVER);
+        break;
+    case STATE_DHCP_REBOOTING:
+        if (dhcp->_attempts == 0) {
+            if (begin_exchange(dhcp)) {
+                dhcp->_attempts = 1;
+                send_with_backoff(dhcp, DHCP_REQUEST);
             }
-            else if(messageType == DHCP_NAK)
-                dhcp->_state = STATE_DHCP_START;
-        }
-        
-        if(messageType == 0xFF) {
-            messageType = 0;
-            dhcp->_state = STATE_DHCP_START;
+        } else if (retransmit_due(dhcp)) {
+            if (dhcp->_attempts++ < DHCP_REBOOT_RETRIES)
+                send_with_backoff(dhcp, DHCP_REQUEST);
+            else
+                lose_lease(dhcp); // nobody vouches for the saved lease, discover a new one
         }
-        
-        if(result != 1 && ((millis() - startTime) > dhcp->_timeout))
+        break;
+    case STATE_DHCP_REQUEST:
+        if (!retransmit_due(dhcp))
             break;
+        if (dhcp->_attempts++ < DHCP_REQUEST_RETRIES)
+            send_with_backoff(dhcp, DHCP_REQUEST);
+        else
+            dhcp->_state = STATE_DHCP_START; // the offer is gone, discover again next round
+        break;
+    case STATE_DHCP_RENEWING:
+        if (retransmit_due(dhcp))
+            send_renewal(dhcp, dhcp->_rebindInSec);
+        break;
+    case STATE_DHCP_REBINDING:
+        if (retransmit_due(dhcp))
+            send_renewal(dhcp, dhcp->_expireInSec);
+        break;
     }
-    
-    // We're done with the socket now
-    UdpSocket.stop();
-    dhcp->_TransactionId++;
+}
+
+/**
+ * @brief Leases an address, waiting for it: startDHCP() and Ethernetick() until the
+ * ACK. The lease is then renewed in the background.
+ * 
+ * @param dhcp 
+ * @param mac 
+ * @param timeout ms, 0 for 60 s
+ * @param responseTimeout ms before the first retransmission, 0 for DHCP_RETRANSMIT_MIN
+ * @return int16_t 1 once leased, 0 if timeout passed first (the client is then stopped)
+ */
+int16_t beginWithDHCP(Dhcp_t *dhcp,MAC_address_t *mac, uint32_t timeout, uint32_t responseTimeout) {
+    return beginWithDHCPLease(dhcp, mac, NULL, timeout, responseTimeout);
+}
+
+/**
+ * @brief beginWithDHCP() starting with startDHCPWithLease(), to get the address of
+ * the saved lease back after a reboot.
+ * 
+ * @param dhcp 
+ * @param mac 
+ * @param record Written by saveDHCPLease(), NULL for none
+ * @param timeout ms, 0 for 60 s
+ * @param responseTimeout ms before the first retransmission, 0 for DHCP_RETRANSMIT_MIN
+ * @return int16_t 1 once leased, 0 if timeout passed first (the client is then stopped)
+ */
+int16_t beginWithDHCPLease(Dhcp_t *dhcp,MAC_address_t *mac, const uint8_t *record, uint32_t timeout, uint32_t responseTimeout) {
+    unsigned long startTime = millis();
+
+    if(responseTimeout == 0) {
+        responseTimeout = DHCP_RETRANSMIT_MIN;
+    }
+    if(timeout == 0) {
+        timeout = 60000;
+    }
+    dhcp->_timeout = timeout;
+    dhcp->_responseTimeout = responseTimeout;
 
-    return result;
+    startDHCPWithLease(dhcp, mac, record, dhcp->_callback, dhcp->_callbackArg);
+    while (dhcp->_state != STATE_DHCP_LEASED) {
+        if ((millis() - startTime) > dhcp->_timeout) {
+            stopDHCP(dhcp);
+            return 0;
+        }
+        Ethernetick(ip_ethernet); // runs tickDHCP()
+    }
+    return 1;
 }
 
-void presend_DHCP(Dhcp_t *dhcp) {
+void reset_DHCP_lease(Dhcp_t *dhcp){
+    memset(&(dhcp->_LocalIp), 0, 4);
+    memset(&(dhcp->_SubnetMask), 0, 4);
+    memset(&(dhcp->_GatewayIp), 0, 4);
+    memset(&(dhcp->_DhcpServerIp), 0, 4);
+    memset(&(dhcp->_DnsServerIp), 0, 4);
+    dhcp->_LeaseTime = 0;
+    dhcp->_T1 = 0;
+    dhcp->_T2 = 0;
+    dhcp->_renewInSec = 0;
+    dhcp->_rebindInSec = 0;
+    dhcp->_expireInSec = 0;
+#if IP_TIMERS
+    ip_timer_stop(&dhcp->_leaseTimer);
+#endif
 }
 
 void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed) {
     uint8_t buffer[32];
     memset(buffer, 0, 32);
-    IP_address dest_addr; // Broadcast address
+    IP_address dest_addr; // Broadcast address, the server itself when renewing
     dest_addr.ipv4_word = 0xFFFFFFFF; 
+    if (dhcp->_state == STATE_DHCP_RENEWING)
+        dest_addr = dhcp->_DhcpServerIp;
 
-    if (-1 == UdpSocket.beginPacket(dest_addr, DHCP_SERVER_PORT)) {
-        // FIXME Need to return errors
+    if (!EthernetUDP_beginPacket(&dhcp->_UdpSocket, dest_addr, DHCP_SERVER_PORT)) {
+        // the retransmission will try again
         return;
     }
 
@@ -150,20 +661,22 @@ void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed
 //    unsigned short flags = htons(DHCP_FLAGSBROADCAST);
 //    memcpy(buffer + 10, &(flags), 2);
 
-    // ciaddr: already zeroed
+    // ciaddr: the address whose lease is extended, else zeroed
+    if (dhcp->_state == STATE_DHCP_RENEWING || dhcp->_state == STATE_DHCP_REBINDING)
+        memcpy(buffer + 12, dhcp->_LocalIp.ipv4_addr_array, 4);
     // yiaddr: already zeroed
     // siaddr: already zeroed
     // giaddr: already zeroed
 
     //put data in W5100 transmit buffer
-    UdpSocket.write(buffer, 28);
+    EthernetUDP_write(&dhcp->_UdpSocket, buffer, 28);
 
     memset(buffer, 0, 32); // clear local buffer
 
     memcpy(buffer, &(dhcp->_MacAddr), 6); // chaddr
 
     //put data in W5100 transmit buffer
-    UdpSocket.write(buffer, 16);
+    EthernetUDP_write(&dhcp->_UdpSocket, buffer, 16);
 
     memset(buffer, 0, 32); // clear local buffer
 
@@ -171,7 +684,7 @@ void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed
     // put in W5100 transmit buffer x 6 (192 bytes)
   
     for(uint8_t i = 0; i != 6; i++) {
-        UdpSocket.write(buffer, 32);
+        EthernetUDP_write(&dhcp->_UdpSocket, buffer, 32);
     }
   
     // OPT - Magic Cookie
@@ -201,9 +714,11 @@ void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed
     printByte(dhcp,(char*)&(buffer[28]), dhcp->_MacAddr.MAC_array[5]);
 
     //put data in W5100 transmit buffer
-    UdpSocket.write(buffer, 30);
+    EthernetUDP_write(&dhcp->_UdpSocket, buffer, 30);
 
-    if(messageType == DHCP_REQUEST)
+    // the requested address goes in the REQUEST for an offer or a saved lease,
+    // the server only in the former (RFC 2131 4.3.2)
+    if(messageType == DHCP_REQUEST && (dhcp->_state == STATE_DHCP_REQUEST || dhcp->_state == STATE_DHCP_REBOOTING))
     {
         buffer[0] = dhcpRequestedIPaddr;
         buffer[1] = 0x04;
@@ -212,17 +727,32 @@ void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed
         buffer[4] = dhcp->_LocalIp.ipv4_addr_array[2];
         buffer[5] = dhcp->_LocalIp.ipv4_addr_array[3];
 
-        buffer[6] = dhcpServerIdentifier;
-        buffer[7] = 0x04;
-        buffer[8] = dhcp->_DhcpServerIp.ipv4_addr_array[0];
-        buffer[9] = dhcp->_DhcpServerIp.ipv4_addr_array[1];
-        buffer[10] = dhcp->_DhcpServerIp.ipv4_addr_array[2];
-        buffer[11] = dhcp->_DhcpServerIp.ipv4_addr_array[3];
+        //put data in W5100 transmit buffer
+        EthernetUDP_write(&dhcp->_UdpSocket, buffer, 6);
+    }
+    if(messageType == DHCP_REQUEST && dhcp->_state == STATE_DHCP_REQUEST)
+    {
+        buffer[0] = dhcpServerIdentifier;
+        buffer[1] = 0x04;
+        buffer[2] = dhcp->_DhcpServerIp.ipv4_addr_array[0];
+        buffer[3] = dhcp->_DhcpServerIp.ipv4_addr_array[1];
+        buffer[4] = dhcp->_DhcpServerIp.ipv4_addr_array[2];
+        buffer[5] = dhcp->_DhcpServerIp.ipv4_addr_array[3];
 
         //put data in W5100 transmit buffer
-        UdpSocket.write(buffer, 12);
+        EthernetUDP_write(&dhcp->_UdpSocket, buffer, 6);
     }
     
+#if DHCP_RAPID_COMMIT
+    // ask for the ACK right away (RFC 4039)
+    if(messageType == DHCP_DISCOVER)
+    {
+        buffer[0] = dhcpRapidCommit;
+        buffer[1] = 0x00;
+        EthernetUDP_write(&dhcp->_UdpSocket, buffer, 2);
+    }
+#endif
+
     buffer[0] = dhcpParamRequest;
     buffer[1] = 0x06;
     buffer[2] = subnetMask;
@@ -234,137 +764,119 @@ void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed
     buffer[8] = endOption;
     
     //put data in W5100 transmit buffer
-    UdpSocket.write(buffer, 9);
+    EthernetUDP_write(&dhcp->_UdpSocket, buffer, 9);
+
+    EthernetUDP_endPacket(&dhcp->_UdpSocket);
+}
 
-    UdpSocket.endPacket();
+/**
+ * @brief Reads an option into value, which is left alone if the option is shorter,
+ * and skips the rest of it.
+ * 
+ * @param udp 
+ * @param len length of the option
+ * @param value 
+ * @param size 
+ */
+static void read_option(EthernetUDP *udp, int len, void *value, uint8_t size) {
+    if (len >= size) {
+        EthernetUDP_read(udp, (uint8_t*)value, size);
+        len -= size;
+    }
+    // Skip over the rest of this option
+    while (len-- > 0) {
+        EthernetUDP_readByte(udp);
+    }
 }
 
-uint8_t parseDHCPResponse(Dhcp_t *dhcp, uint32_t responseTimeout, uint32_t *transactionId)
+/**
+ * @brief Reads the current datagram of the socket, without waiting for one.
+ * 
+ * @param dhcp 
+ * @param transactionId set to the xid of the reply
+ * @param lease filled in with the address and the options of the reply
+ * @return uint8_t DHCP message type, 0 if it is not a reply to this client
+ */
+uint8_t parseDHCPResponse(Dhcp_t *dhcp, uint32_t *transactionId, Dhcp_lease_t *lease)
 {
+    EthernetUDP *udp = &dhcp->_UdpSocket;
+    RIP_MSG_FIXED fixedMsg;
     uint8_t type = 0;
-    uint8_t opt_len = 0;
-     
-    unsigned long startTime = millis();
+    int opt, opt_len;
 
-    while(UdpSocket.parsePacket() <= 0)
-    {
-        if((millis() - startTime) > responseTimeout)
-        {
-            return 255;
-        }
-        delay(50);
-    }
+    memset(lease, 0, sizeof(*lease));
     // start reading in the packet
-    RIP_MSG_FIXED fixedMsg;
-    UdpSocket.read((uint8_t*)&fixedMsg, sizeof(RIP_MSG_FIXED));
-  
-    if(fixedMsg.op == DHCP_BOOTREPLY && UdpSocket.remotePort() == DHCP_SERVER_PORT) {
-        *transactionId = ntohl(fixedMsg.xid);
-        if(memcmp(fixedMsg.chaddr, &(dhcp->_MacAddr), 6) != 0 || (transactionId < dhcp->_InitialTransactionId) || (*transactionId > dhcp->_TransactionId))
-        {
-            // Need to read the rest of the packet here regardless
-            UdpSocket.discardReceived();
-            return 0;
-        }
-
-        memcpy(&(dhcp->_LocalIp), fixedMsg.yiaddr, 4);
-
-        // Skip to the option part
-        // Doing this a byte at a time so we don't have to put a big buffer
-        // on the stack (as we don't have lots of memory lying around)
-        for (int i =0; i != (240 - (uint8_t)sizeof(RIP_MSG_FIXED)); i++) {
-            UdpSocket.read(); // we don't care about the returned byte
-        }
+    if (EthernetUDP_read(udp, (uint8_t*)&fixedMsg, sizeof(RIP_MSG_FIXED)) != sizeof(RIP_MSG_FIXED))
+        return 0;
+    if (fixedMsg.op != DHCP_BOOTREPLY || EthernetUDP_remotePort(udp) != DHCP_SERVER_PORT ||
+        memcmp(fixedMsg.chaddr, &(dhcp->_MacAddr), 6) != 0)
+        return 0;
+    *transactionId = ntohl(fixedMsg.xid);
+    memcpy(&(lease->localIp), fixedMsg.yiaddr, 4);
+
+    // Skip to the option part
+    for (int i =0; i != (240 - (uint8_t)sizeof(RIP_MSG_FIXED)); i++) {
+        EthernetUDP_readByte(udp); // we don't care about the returned byte
+    }
 
-        while (UdpSocket.available() > 0) {
-            switch (UdpSocket.read()) {
-                case endOption :
-                    break;
-                    
-                case padOption :
-                    break;
-                
-                case dhcpMessageType :
-                    opt_len = UdpSocket.read();
-                    type = UdpSocket.read();
-                    break;
-                
-                case subnetMask :
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read(dhcp->_SubnetMask, 4);
-                    break;
-                
-                case routersOnSubnet :
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read(dhcp->_GatewayIp, 4);
-                    for (int i = 0; i < opt_len-4; i++)
-                    {
-                        UdpSocket.read();
-                    }
-                    break;
-                
-                case dns :
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read(dhcp->_DnsServerIp, 4);
-                    for (int i = 0; i < opt_len-4; i++)
-                    {
-                        UdpSocket.read();
-                    }
-                    break;
-                
-                case dhcpServerIdentifier :
-                    opt_len = UdpSocket.read();
-                    if( dhcp->_DhcpServerIp.ipv4_addr_array[0] == 0 ||
-                        dhcp->_DhcpServerIp.ipv4_word == UdpSocket.remoteIP() )
-                    {
-                        UdpSocket.read(dhcp->_DhcpServerIp, sizeof(dhcp->_DhcpServerIp));
-                    }
-                    else{
-                        // Skip over the rest of this option
-                        while (opt_len--){
-                            UdpSocket.read();
-                        }
-                    }
-                    break;
-
-                case dhcpT1value : 
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read((uint8_t*)&dhcp->_T1, sizeof(dhcp->_T1));
-                    dhcp->_T1 = ntohl(dhcp->_T1);
-                    break;
-
-                case dhcpT2value : 
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read((uint8_t*)&dhcp->_T2, sizeof(dhcp->_T2));
-                    dhcp->_T2 = ntohl(dhcp->_T2);
-                    break;
-
-                case dhcpIPaddrLeaseTime :
-                    opt_len = UdpSocket.read();
-                    UdpSocket.read((uint8_t*)&dhcp->_LeaseTime, sizeof(dhcp->_LeaseTime));
-                    dhcp->_LeaseTime = ntohl(dhcp->_LeaseTime);
-                    dhcp->_renewInSec = dhcp->_LeaseTime;
-                    break;
-
-                default :
-                    opt_len = UdpSocket.read();
-                    // Skip over the rest of this option
-                    while (opt_len--) {
-                        UdpSocket.read();
-                    }
-                    break;
-            }
+    while ((opt = EthernetUDP_readByte(udp)) >= 0 && opt != endOption) {
+        if (opt == padOption)
+            continue;
+        if ((opt_len = EthernetUDP_readByte(udp)) < 0)
+            break;
+        switch (opt) {
+            case dhcpMessageType :
+                read_option(udp, opt_len, &type, 1);
+                break;
+
+            case subnetMask :
+                read_option(udp, opt_len, &lease->subnetMask, 4);
+                break;
+
+            case routersOnSubnet :
+                read_option(udp, opt_len, &lease->gatewayIp, 4);
+                break;
+
+            case dns :
+                read_option(udp, opt_len, &lease->dnsServerIp, 4);
+                break;
+
+            case dhcpServerIdentifier :
+                read_option(udp, opt_len, &lease->serverIp, 4);
+                break;
+
+            case dhcpT1value :
+                read_option(udp, opt_len, &lease->t1, 4);
+                lease->t1 = ntohl(lease->t1);
+                break;
+
+            case dhcpT2value :
+                read_option(udp, opt_len, &lease->t2, 4);
+                lease->t2 = ntohl(lease->t2);
+                break;
+
+            case dhcpRapidCommit :
+                lease->rapidCommit = 1;
+                read_option(udp, opt_len, NULL, 0);
+                break;
+
+            case dhcpIPaddrLeaseTime :
+                read_option(udp, opt_len, &lease->leaseTime, 4);
+                lease->leaseTime = ntohl(lease->leaseTime);
+                break;
+
+            default :
+                read_option(udp, opt_len, NULL, 0);
+                break;
         }
     }
-
-    // Need to skip to end of the packet regardless here
-    UdpSocket.discardReceived();
-
     return type;
 }
 
 
 /*
+    Reports what the background renewal did since the last call, the lease is
+    renewed by tickDHCP() from Ethernetick().
     returns:
     0/DHCP_CHECK_NONE: nothing happened
     1/DHCP_CHECK_RENEW_FAIL: renew failed
@@ -373,55 +885,9 @@ uint8_t parseDHCPResponse(Dhcp_t *dhcp, uint32_t responseTimeout, uint32_t *tran
     4/DHCP_CHECK_REBIND_OK: rebind success
 */
 int16_t checkLease(Dhcp_t *dhcp){
-    //this uses a signed / unsigned trick to deal with millis overflow
-    unsigned long now = millis();
-    signed long snow = (long)now;
-    int rc=DHCP_CHECK_NONE;
-    if (dhcp->_lastCheck != 0){
-        signed long factor;
-        //calc how many ms past the timeout we are
-        factor = snow - (long)dhcp->_secTimeout;
-        //if on or passed the timeout, reduce the counters
-        if ( factor >= 0 ){
-            //next timeout should be now plus 1000 ms minus parts of second in factor
-            dhcp->_secTimeout = snow + 1000 - factor % 1000;
-            //how many seconds late are we, minimum 1
-            factor = factor / 1000 +1;
-            
-            //reduce the counters by that mouch
-            //if we can assume that the cycle time (factor) is fairly constant
-            //and if the remainder is less than cycle time * 2 
-            //do it early instead of late
-            if(dhcp->_renewInSec < factor*2 )
-                dhcp->_renewInSec = 0;
-            else
-                dhcp->_renewInSec -= factor;
-            
-            if(dhcp->_rebindInSec < factor*2 )
-            dhcp->_rebindInSec = 0;
-            else
-                dhcp->_rebindInSec -= factor;
-        }
-
-        //if we have a lease but should renew, do it
-        if (dhcp->_state == STATE_DHCP_LEASED && dhcp->_renewInSec <=0){
-            dhcp->_state = STATE_DHCP_REREQUEST;
-            rc = 1 + request_lease(dhcp);
-        }
-
-        //if we have a lease or is renewing but should bind, do it
-        if( (dhcp->_state == STATE_DHCP_LEASED || dhcp->_state == STATE_DHCP_START) && dhcp->_rebindInSec <=0){
-            //this should basically restart completely
-            dhcp->_state = STATE_DHCP_START;
-            reset_lease(dhcp);
-            rc = 3 + request_lease(dhcp);
-        }
-    }
-    else{
-        dhcp->_secTimeout = snow + 1000;
-    }
+    int rc = dhcp->_checkResult;
 
-    dhcp->_lastCheck = now;
+    dhcp->_checkResult = DHCP_CHECK_NONE;
     return rc;
 }
 
@@ -6,13 +6,21 @@
 #include "../INTERNET/MAC/MAC.h"
 #include <stdint.h>
 
-/* DHCP state machine. */
-#define STATE_DHCP_START 0
-#define STATE_DHCP_DISCOVER 1
-#define STATE_DHCP_REQUEST 2
-#define STATE_DHCP_LEASED 3
-#define STATE_DHCP_REREQUEST 4
+/* DHCP state machine, run by tickDHCP(). */
+#define STATE_DHCP_START 0      // INIT: a DISCOVER is to be sent
+#define STATE_DHCP_DISCOVER 1   // SELECTING: waiting for an OFFER
+#define STATE_DHCP_REQUEST 2    // REQUESTING: waiting for the ACK of the offer
+#define STATE_DHCP_LEASED 3     // BOUND
+#define STATE_DHCP_RENEWING 4   // past T1: REQUEST unicast to the server
 #define STATE_DHCP_RELEASE 5
+#define STATE_DHCP_REBINDING 6  // past T2: REQUEST broadcast to any server
+#define STATE_DHCP_STOPPED 7
+#define STATE_DHCP_REBOOTING 8  // INIT-REBOOT: REQUEST for the address of a saved lease
+
+/* Events handed to the Dhcp_callback */
+#define DHCP_EVENT_BOUND 1      // an address was leased, or the lease changed it
+#define DHCP_EVENT_RENEWED 2    // the lease of the address was extended
+#define DHCP_EVENT_LOST 3       // the lease expired or was refused, the address is gone
 
 #define DHCP_FLAGSBROADCAST 0x8000
 
@@ -53,6 +61,20 @@
 #define DHCP_CHECK_REBIND_FAIL (3)
 #define DHCP_CHECK_REBIND_OK (4)
 
+/* Lease record saved by saveDHCPLease(), all fields in network byte order */
+#define DHCP_RECORD_VERSION 1
+#define DHCP_RECORD_SIZE 42
+#define DHCP_RECORD_MAC 2       // MAC address the lease was given to
+#define DHCP_RECORD_LOCAL 8
+#define DHCP_RECORD_MASK 12
+#define DHCP_RECORD_GATEWAY 16
+#define DHCP_RECORD_SERVER 20
+#define DHCP_RECORD_DNS 24
+#define DHCP_RECORD_LEASE 28
+#define DHCP_RECORD_T1 32
+#define DHCP_RECORD_T2 36
+#define DHCP_RECORD_CHECKSUM 40 // Fletcher-16 of the bytes before it, see record_checksum()
+
 enum {
 	padOption = 0,
 	subnetMask = 1,
@@ -116,6 +138,7 @@ enum {
 	dhcpT2value = 59,
 	/*dhcpClassIdentifier	=	60,*/
 	dhcpClientIdentifier = 61,
+	dhcpRapidCommit = 80,
 	endOption = 255
 };
 
@@ -134,8 +157,29 @@ typedef struct _RIP_MSG_FIXED {
 	uint8_t chaddr[6];
 } RIP_MSG_FIXED;
 
+/**
+ * @brief Lease carried by an OFFER or ACK.
+ */
+typedef struct _Dhcp_lease_t {
+	IP_address localIp;
+	IP_address subnetMask;
+	IP_address gatewayIp;
+	IP_address serverIp;
+	IP_address dnsServerIp;
+	uint32_t leaseTime;          // seconds, 0 if the server did not say
+	uint32_t t1, t2;
+	uint8_t rapidCommit;         // the reply carried the Rapid Commit option (RFC 4039)
+} Dhcp_lease_t;
+
+struct _Dhcp_t;
+
+/**
+ * @brief Called by tickDHCP() when the address of the interface changes.
+ * @param event DHCP_EVENT_*
+ */
+typedef void (*Dhcp_callback)(struct _Dhcp_t *dhcp, uint8_t event, void *arg);
+
 typedef struct _Dhcp_t {
-	uint32_t _InitialTransactionId;
 	uint32_t _TransactionId;
 	MAC_address_t _MacAddr;	
 	
@@ -144,26 +188,40 @@ typedef struct _Dhcp_t {
 	IP_address _GatewayIp;
 	IP_address _DhcpServerIp;
 	IP_address _DnsServerIp;
+	IP_address _BoundIp;         // address configured on the stack, 0 if none
 
 	uint32_t _LeaseTime;
 	uint32_t _T1, _T2;
 	int32_t _renewInSec;
 	int32_t _rebindInSec;
+	int32_t _expireInSec;
 	int32_t _lastCheck;
 	uint32_t _timeout;
 	uint32_t _responseTimeout;
 	uint32_t _secTimeout;
+#if IP_TIMERS
+	struct ip_timer _leaseTimer; // counts _renewInSec, _rebindInSec and _expireInSec down
+	uint32_t _leaseStep;         // seconds the lease timer was armed for
+	struct ip_timer _sendTimer;  // next retransmission, not pending once it is due
+#else
+	uint32_t _sentAt;            // millis() at the last message
+	uint32_t _wait;              // ms from _sentAt to the next retransmission
+#endif
+	uint32_t _exchangeStart;     // millis() at the first message of the exchange
+	uint32_t _retransmit;        // backoff of DISCOVER and REQUEST, ms
+	uint8_t _attempts;           // REQUESTs sent for the offer or the saved lease
+	uint8_t _checkResult;        // DHCP_CHECK_* for checkLease()
 	uint8_t _state;
-	EthernetUDP _UdpSocket;
+	Dhcp_callback _callback;
+	void *_callbackArg;
+	EthernetUDP _UdpSocket;      // open while an exchange is in progress
 } Dhcp_t;
 
 // Funciones privadas
-int16_t request_DHCP_lease(Dhcp_t *dhcp);
 void reset_DHCP_lease(Dhcp_t *dhcp);
-void presend_DHCP(Dhcp_t *dhcp);
 void send_DHCP_MESSAGE(Dhcp_t *dhcp,uint8_t messageType, uint16_t secondsElapsed);
 void printByte(Dhcp_t *dhcp,char *, uint8_t);
-uint8_t parseDHCPResponse(Dhcp_t *dhcp, uint32_t responseTimeout, uint32_t *transactionId);
+uint8_t parseDHCPResponse(Dhcp_t *dhcp, uint32_t *transactionId, Dhcp_lease_t *lease);
 
 // Funciones publicas
 IP_address getLocalIp(Dhcp_t *dhcp);
@@ -172,7 +230,15 @@ IP_address getGatewayIp(Dhcp_t *dhcp);
 IP_address getDhcpServerIp(Dhcp_t *dhcp);
 IP_address getDnsServerIp(Dhcp_t *dhcp);
 
+void initDHCP(Dhcp_t *dhcp);
+void startDHCP(Dhcp_t *dhcp, const MAC_address_t *mac, Dhcp_callback callback, void *arg);
+void startDHCPWithLease(Dhcp_t *dhcp, const MAC_address_t *mac, const uint8_t *record, Dhcp_callback callback, void *arg);
+uint8_t saveDHCPLease(Dhcp_t *dhcp, uint8_t *record);
+void stopDHCP(Dhcp_t *dhcp);
+void tickDHCP(Dhcp_t *dhcp);
+
 int16_t beginWithDHCP(Dhcp_t *dhcp,MAC_address_t *mac, uint32_t timeout, uint32_t responseTimeout);
+int16_t beginWithDHCPLease(Dhcp_t *dhcp,MAC_address_t *mac, const uint8_t *record, uint32_t timeout, uint32_t responseTimeout);
 int16_t checkLease(Dhcp_t *dhcp);
 
 #endif /*DHCP_H*/
\ No newline at end of file
@@ -1,9 +1,33 @@
 #include "dns.h"
+#include "ethernet.h"
+#include "../../TCP-IP/APPLICATION/DNS/dns_parser.h"
 
 // ctor
 void DNS_init(Dns *dns, const IP_address *aDNSServer){
-    dns->iDNSServer.ipv4_word = aDNSServer->ipv4_word;
-    dns->iRequestId = 0;
+    uint8_t i;
+
+    for (i = 0; i < DNS_MAX_SERVERS; i++)
+        dns->iDNSServer[i].ipv4_word = IP_ADDRESS_NONE;
+    dns->iDNSServer[0].ipv4_word = aDNSServer->ipv4_word;
+    dns->iRequestId = (uint16_t)millis();
+    dns->iTtl = 0;
+    EthernetUDP_init(&dns->iUdp);
+    memset(dns->iQueries, 0, sizeof(dns->iQueries));
+#if DNS_CACHE_SIZE
+    DNS_flushCache(dns);
+    memset(&dns->iCacheStats, 0, sizeof(dns->iCacheStats));
+#endif
+}
+
+/**
+ * @brief Sets one of the servers the queries are spread over, e.g. the second DNS
+ * server offered by DHCP. Queries already in flight use it from their next attempt.
+ * @param aIndex 0 for the server given to DNS_init()
+ * @param aDNSServer IP_ADDRESS_NONE to remove it
+ */
+void DNS_setServer(Dns *dns, uint8_t aIndex, const IP_address *aDNSServer){
+    if (aIndex < DNS_MAX_SERVERS)
+        dns->iDNSServer[aIndex].ipv4_word = aDNSServer->ipv4_word;
 }
 
 /** 
@@ -60,66 +84,137 @@ int16_t DNS_inet_aton(Dns *dns, const char *aIPAddrString, IP_address *aResult){
     }
 }
 
-/** Resolve the given hostname to an IP address.
- * @param aHostname Name to be resolved
- * @param aResult IPAddress structure to store the returned IP address
- * @result 1 if aIPAddrString was successfully converted to an IP address, else error code
-*/
-int16_t DNS_getHostByName(Dns *dns, const char* aHostname, IP_address *aResult){
-    uint8_t ret =0;
+#if DNS_CACHE_SIZE
+/**
+ * @brief Lowercases aHostname into aKey and hashes it (FNV-1a).
+ * @param aHostname
+ * @param aKey DNS_CACHE_NAMELEN bytes
+ * @result hash of the name, DNS_CACHE_FREE if it is too long to be cached
+ */
+static uint32_t DNS_cacheKey(const char *aHostname, char *aKey){
+    uint32_t hash = 2166136261UL;
+    uint8_t i;
 
-    // See if it's a numeric IP address
-    if (inet_aton(dns, aHostname, aResult)) {
-        // It is, our work here is done
-        return 1;
+    for (i = 0; aHostname[i]; i++) {
+        if (i == DNS_CACHE_NAMELEN - 1)
+            return DNS_CACHE_FREE;
+        aKey[i] = (aHostname[i] >= 'A' && aHostname[i] <= 'Z') ? aHostname[i] - 'A' + 'a' : aHostname[i];
+        hash = (hash ^ (uint8_t)aKey[i]) * 16777619UL;
     }
+    aKey[i] = '\0';
+    return hash == DNS_CACHE_FREE ? 1 : hash;
+}
 
-    // Check we've got a valid DNS server to use
-    if (dns->iDNSServer.ipv4_word == IP_ADDRESS_NONE) {
-        return INVALID_SERVER;
+/**
+ * @brief An entry is live until its TTL has run out.
+ * @param entry
+ * @result milliseconds left, 0 once stale
+ */
+static uint32_t DNS_cacheLeft(const Dns_cache_entry *entry){
+    int32_t left = (int32_t)(entry->expires - millis());
+
+    return left > 0 ? (uint32_t)left : 0;
+}
+
+/**
+ * @brief Looks up a live entry.
+ * @param hash
+ * @param aKey lowercased name
+ * @param type
+ * @result the entry, NULL if the name is not cached
+ */
+static Dns_cache_entry *DNS_cacheFind(Dns *dns, uint32_t hash, const char *aKey, uint16_t type){
+    Dns_cache_entry *entry;
+
+    for (entry = dns->iCache; entry < dns->iCache + DNS_CACHE_SIZE; entry++) {
+        if (entry->hash == hash && entry->type == type && !strcmp(entry->name, aKey))
+            return DNS_cacheLeft(entry) ? entry : NULL;
     }
-	
-    // Find a socket to use
-    if (iUdp iUdp.begin(1024+(millis() & 0xF)) == 1)
-    {
-        // Try up to three times
-        uint8_t retries = 0;
-        while ((retries < 3) && (ret <= 0))
-        {
-            // Send DNS request
-            ret = iUdp.beginPacket(dns->iDNSServer, DNS_PORT);
-            if (ret != 0)
-            {
-                // Now output the request data
-                ret = BuildRequest(dns, aHostname);
-                if (ret != 0)
-                {
-                    // And finally send the request
-                    ret = iUdp.endPacket();
-                    if (ret != 0)
-                    {
-                        // Now wait for a response
-                        int wait_retries = 0;
-                        ret = TIMED_OUT;
-                        while ((wait_retries < 3) && (ret == TIMED_OUT))
-                        {
-                            ret = ProcessResponse(dns, 5000, aResult);
-                            wait_retries++;
-                        }
-                    }
-                }
-            }
-            retries++;
+    return NULL;
+}
+
+/**
+ * @brief Stores an answer, in place of the entry of the same name, a free or stale
+ * one, or else the one looked up the least.
+ * @param hash
+ * @param aKey lowercased name
+ * @param type
+ * @param result SUCCESS or the error of a negative answer
+ * @param aAddress address of a SUCCESS
+ * @param ttl seconds the answer may be used
+ */
+static void DNS_cacheStore(Dns *dns, uint32_t hash, const char *aKey, uint16_t type, int16_t result, const IP_address *aAddress, uint32_t ttl){
+    Dns_cache_entry *entry, *victim = NULL;
+
+    for (entry = dns->iCache; entry < dns->iCache + DNS_CACHE_SIZE; entry++) {
+        if (entry->hash == hash && entry->type == type && !strcmp(entry->name, aKey)) {
+            victim = entry;
+            break;
         }
+        if (entry->hash == DNS_CACHE_FREE || !DNS_cacheLeft(entry)) {
+            if (!victim || victim->hash != DNS_CACHE_FREE)
+                victim = entry;
+        } else if (!victim || (victim->hash != DNS_CACHE_FREE && DNS_cacheLeft(victim) && entry->hits < victim->hits)) {
+            victim = entry;
+        }
+    }
+    if (victim->hash != DNS_CACHE_FREE && DNS_cacheLeft(victim) && strcmp(victim->name, aKey))
+        dns->iCacheStats.evictions++;
 
-        // We're done with the socket now
-        iUdp.stop();
+    if (ttl > DNS_CACHE_MAX_TTL)
+        ttl = DNS_CACHE_MAX_TTL;
+    victim->hash = hash;
+    victim->type = type;
+    victim->result = result;
+    victim->expires = millis() + ttl * 1000;
+    victim->hits = 0;
+    if (result == SUCCESS)
+        victim->addr.ipv4_word = aAddress->ipv4_word;
+    strcpy(victim->name, aKey);
+}
+
+/**
+ * @brief Caches the outcome of a query: answers for their TTL, names that do not
+ * exist or have no address for DNS_CACHE_NEGATIVE_TTL. Timeouts and server
+ * failures are not cached, the next lookup asks again.
+ */
+static void DNS_cacheResult(Dns *dns, uint32_t hash, const char *aKey, int16_t ret, const IP_address *aAddress){
+    if (ret == SUCCESS) {
+        // A TTL of 0 asks for the answer to be used only once
+        if (dns->iTtl)
+            DNS_cacheStore(dns, hash, aKey, TYPE_A, ret, aAddress, dns->iTtl);
+    } else if (ret == NAME_ERROR || ret == NO_ANSWER || ret == NO_ADDRESS) {
+        DNS_cacheStore(dns, hash, aKey, TYPE_A, ret, aAddress, DNS_CACHE_NEGATIVE_TTL);
     }
+}
 
-    return ret;
+/**
+ * @brief Drops every cached answer.
+ */
+void DNS_flushCache(Dns *dns){
+    memset(dns->iCache, 0, sizeof(dns->iCache));
 }
 
-uint16_t DNS_buildRequest(Dns *dns, const char* aName){
+/**
+ * @brief Share of the lookups answered from the cache.
+ * @result percent
+ */
+uint8_t DNS_cacheHitRate(const Dns *dns){
+    uint32_t hits = dns->iCacheStats.hits + dns->iCacheStats.negativeHits;
+    uint32_t lookups = hits + dns->iCacheStats.misses;
+
+    return lookups ? (uint8_t)((uint64_t)hits * 100 / lookups) : 0;
+}
+#endif
+
+/**
+ * @brief Writes the query for aName into the datagram started with
+ * EthernetUDP_beginPacket().
+ * @param aId transaction ID
+ * @param aName Name to be resolved
+ * @result 1 if the request was buffered
+ */
+static uint16_t DNS_buildRequest(Dns *dns, uint16_t aId, const char* aName){
     // Build header
     //                                    1  1  1  1  1  1
     //      0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
@@ -136,27 +231,26 @@ uint16_t DNS_buildRequest(Dns *dns, const char* aName){
     //    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
     //    |                    ARCOUNT                    |
     //    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
-    // As we only support one request at a time at present, we can simplify
-    // some of this header
-    dns->iRequestId = millis(); // generate a random ID
+    // The ID is only compared with the one of the reply, so it is written
+    // in host byte order
     uint16_t twoByteBuffer;
 
     // FIXME We should also check that there's enough space available to write to, rather
     // FIXME than assume there's enough space (as the code does at present)
-    iUdp.write((uint8_t*)&dns->iRequestId, sizeof(dns->iRequestId));
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&aId, sizeof(aId));
 
-    twoByteBuffer = htons(QUERY_FLAG | OPCODE_STANDARD_QUERY | RECURSION_DESIRED_FLAG);
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    twoByteBuffer = HTONS(QUERY_FLAG | OPCODE_STANDARD_QUERY | RECURSION_DESIRED_FLAG);
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
 
-    twoByteBuffer = htons(1);  // One question record
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    twoByteBuffer = HTONS(1);  // One question record
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
 
     twoByteBuffer = 0;  // Zero answer records
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
 
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
     // and zero additional records
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
 
     // Build question
     const char* start =aName;
@@ -173,9 +267,9 @@ uint16_t DNS_buildRequest(Dns *dns, const char* aName){
         if (end-start > 0) {
             // Write out the size of this section
             len = end-start;
-            iUdp.write(&len, sizeof(len));
+            EthernetUDP_write(&dns->iUdp, &len, sizeof(len));
             // And then write out the section
-            iUdp.write((uint8_t*)start, end-start);
+            EthernetUDP_write(&dns->iUdp, (uint8_t*)start, end-start);
         }
         start = end+1;
     }
@@ -183,17 +277,452 @@ uint16_t DNS_buildRequest(Dns *dns, const char* aName){
     // We've got to the end of the question name, so
     // terminate it with a zero-length section
     len = 0;
-    iUdp.write(&len, sizeof(len));
+    EthernetUDP_write(&dns->iUdp, &len, sizeof(len));
     // Finally the type and class of question
-    twoByteBuffer = htons(TYPE_A);
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    twoByteBuffer = HTONS(TYPE_A);
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
 
-    twoByteBuffer = htons(CLASS_IN);  // Internet class of question
-    iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+    twoByteBuffer = HTONS(CLASS_IN);  // Internet class of question
+    EthernetUDP_write(&dns->iUdp, (uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
     // Success!  Everything buffered okay
     return 1;
 }
-uint16_t DNS_processResponse(Dns *dns, uint16_t aTimeout, IP_address *aAddress){
+#if IP_TIMERS
+/**
+ * @brief Timer callback of the reply timeout. Nothing to do: the timer is no
+ * longer pending afterwards and DNS_poll() sends the query again.
+ * 
+ * @param arg 
+ */
+static void DNS_timeout(void *arg) {
+    (void)arg;
+}
+#endif
+
+/**
+ * @brief Matches a reply to the query in flight with its transaction ID and
+ * follows the answers from the name asked for, through CNAME records, to its
+ * A record. The reply is parsed where it lies, nothing is copied but the address.
+ * @param aMessage the reply
+ * @param aLength
+ * @param aQuery set to the query answered, left NULL for a reply to none of them
+ * @param aAddress IP_address structure to store the returned IP address
+ * @result SUCCESS, else error code
+ */
+static int16_t DNS_readResponse(Dns *dns, const uint8_t *aMessage, uint16_t aLength, Dns_query **aQuery, IP_address *aAddress){
+    Dns_query *query;
+    dns_msg_t msg;
+    dns_rr_t rr;
+    dns_error_t error;
+    uint16_t target;
+    uint8_t cnames = 0;
+
+    *aQuery = NULL;
+    if (EthernetUDP_remotePort(&dns->iUdp) != DNS_PORT)
+    {
+        return INVALID_SERVER;
+    }
+    if (dns_msg_init(&msg, aMessage, aLength) != DNS_OK)
+    {
+        return TRUNCATED;
+    }
+    if ((msg.flags & QUERY_RESPONSE_MASK) != (uint16_t)RESPONSE_FLAG)
+    {
+        return INVALID_RESPONSE;
+    }
+    // Check that it's a response to one of our requests, from the server it
+    // was sent to, about the name we asked for
+    for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++)
+    {
+        if (query->state == DNS_QUERY_SENT && query->id == msg.id)
+            break;
+    }
+    if (query == dns->iQueries + DNS_MAX_QUERIES)
+    {
+        return INVALID_RESPONSE;
+    }
+    if (dns->iDNSServer[query->server].ipv4_word != EthernetUDP_remoteIP(&dns->iUdp).ipv4_word)
+    {
+        return INVALID_SERVER;
+    }
+    if (!msg.question || !dns_name_equal(&msg, msg.question, query->name))
+    {
+        return INVALID_RESPONSE;
+    }
+    *aQuery = query;
+
+    // A name that does not exist is worth remembering
+    if ((msg.flags & RESP_MASK) == RESP_NAME_ERROR)
+    {
+        return NAME_ERROR;
+    }
+    // Check for any errors in the response (or in our request), the next
+    // server is asked
+    if ((msg.flags & TRUNCATION_FLAG) || (msg.flags & RESP_MASK))
+    {
+        return SERVER_ERROR;
+    }
+
+    // And make sure we've got (at least) one answer
+    if (msg.ancount == 0)
+    {
+        return NO_ANSWER;
+    }
+
+    // The answer may be cached for the shortest Time-To-Live of the records
+    // leading to it. A CNAME starts the search over for its target, which
+    // may have been answered before it
+    dns->iTtl = 0xFFFFFFFF;
+    target = msg.question;
+    while ((error = dns_msg_next(&msg, &rr)) == DNS_OK)
+    {
+        if (rr.rclass != DNS_CLASS_IN || !dns_name_same(&msg, rr.name, target))
+            continue;
+        if (rr.ttl < dns->iTtl)
+            dns->iTtl = rr.ttl;
+        if (rr.type == DNS_TYPE_A)
+        {
+            memcpy(aAddress->ipv4_addr_array, &aMessage[rr.rdata], 4);
+            return SUCCESS;
+        }
+        if (rr.type == DNS_TYPE_CNAME && cnames++ < DNS_MAX_CNAMES)
+        {
+            target = rr.rdata;
+            dns_msg_rewind(&msg);
+        }
+    }
+    dns->iTtl = 0;
+    if (error != DNS_END)
+    {
+        // A record runs past the end of the datagram or is malformed
+        return error == DNS_ERR_TRUNCATED ? TRUNCATED : INVALID_RECORD;
+    }
+
+    // If we get here then we haven't found an answer
+    return NO_ADDRESS;
+}
+
+static void DNS_complete(Dns *dns, Dns_query *query, int16_t result, const IP_address *aAddress);
+
+/**
+ * @brief Picks a transaction ID no other query in flight uses.
+ */
+static uint16_t DNS_newId(Dns *dns){
+    Dns_query *query;
+    uint16_t id;
+
+    do {
+        // consecutive IDs would be easy to guess, mix in the clock
+        id = (dns->iRequestId += 0x9E37) ^ (uint16_t)millis();
+        for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++) {
+            if (query->state == DNS_QUERY_SENT && query->id == id)
+                break;
+        }
+    } while (query != dns->iQueries + DNS_MAX_QUERIES);
+    return id;
+}
+
+/**
+ * @brief Sends the next attempt of a query to the next configured server and
+ * arms its reply timeout. A request that could not be sent times out like a
+ * lost one.
+ * @param query
+ */
+static void DNS_send(Dns *dns, Dns_query *query){
+    uint8_t i, servers = 0;
+    uint32_t timeout;
+
+    for (i = 0; i < DNS_MAX_SERVERS; i++) {
+        if (dns->iDNSServer[i].ipv4_word != IP_ADDRESS_NONE)
+            servers++;
+    }
+    if (servers == 0) {
+        // every server was removed with DNS_setServer()
+        DNS_complete(dns, query, INVALID_SERVER, NULL);
+        return;
+    }
+    // the first attempt goes to the first server, every retry to the next one
+    if (query->attempts) {
+        do {
+            query->server = (query->server + 1) % DNS_MAX_SERVERS;
+        } while (dns->iDNSServer[query->server].ipv4_word == IP_ADDRESS_NONE);
+    }
+    // once every server has been asked they get more time
+    timeout = (uint32_t)DNS_TIMEOUT << (query->attempts / servers);
+    query->attempts++;
+    query->id = DNS_newId(dns);
+
+    if (EthernetUDP_beginPacket(&dns->iUdp, dns->iDNSServer[query->server], DNS_PORT)
+        && DNS_buildRequest(dns, query->id, query->name))
+        EthernetUDP_endPacket(&dns->iUdp);
+#if IP_TIMERS
+    ip_timer_set(&query->timer, timeout, DNS_timeout, query);
+#else
+    query->sent = millis();
+    query->timeout = timeout;
+#endif
+}
+
+/**
+ * @brief Hands the outcome of a query to its callback and the cache, and frees it.
+ * @param query
+ * @param result SUCCESS, else error code
+ * @param aAddress address of a SUCCESS
+ */
+static void DNS_complete(Dns *dns, Dns_query *query, int16_t result, const IP_address *aAddress){
+#if DNS_CACHE_SIZE
+    char key[DNS_CACHE_NAMELEN];
+    uint32_t hash = DNS_cacheKey(query->name, key);
+
+    if (hash != DNS_CACHE_FREE)
+        DNS_cacheResult(dns, hash, key, result, aAddress);
+#endif
+#if IP_TIMERS
+    ip_timer_stop(&query->timer);
+#endif
+    // the slot stays taken while the callback may start other queries
+    query->state = DNS_QUERY_DONE;
+    if (query->callback)
+        query->callback(query->arg, query->name, result, aAddress);
+    query->state = DNS_QUERY_FREE;
+}
+
+/**
+ * @brief Takes a free query slot and sends its first attempt; opens the socket for
+ * the first query in flight.
+ * @result SUCCESS, else error code
+ */
+static int16_t DNS_start(Dns *dns, const char *aHostname, Dns_callback aCallback, void *arg){
+    Dns_query *query;
+    uint8_t i;
+
+    if (strlen(aHostname) >= DNS_QUERY_NAMELEN)
+        return NAME_TOO_LONG;
+    for (i = 0; i < DNS_MAX_SERVERS && dns->iDNSServer[i].ipv4_word == IP_ADDRESS_NONE; i++)
+        ;
+    if (i == DNS_MAX_SERVERS)
+        return INVALID_SERVER;
+    for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++) {
+        if (query->state == DNS_QUERY_FREE)
+            break;
+    }
+    if (query == dns->iQueries + DNS_MAX_QUERIES)
+        return QUERY_BUSY;
+    // Find a socket to use
+    if (!dns->iUdp._ip_udp_conn && EthernetUDP_begin(&dns->iUdp, 1024+(millis() & 0xF)) != 1)
+        return QUERY_BUSY;
+
+    query->state = DNS_QUERY_SENT;
+    query->attempts = 0;
+    query->server = i;
+    query->callback = aCallback;
+    query->arg = arg;
+    strcpy(query->name, aHostname);
+    DNS_send(dns, query);
+    return SUCCESS;
+}
+
+/**
+ * @brief Starts resolving aHostname without waiting for the answer, which is handed
+ * to aCallback. Numeric addresses and cached answers are handed to it before this
+ * function returns, other names once DNS_poll() has read the reply.
+ * @param aHostname Name to be resolved, copied
+ * @param aCallback NULL to only fill the cache
+ * @param arg Passed to aCallback
+ * @result SUCCESS if aCallback is or will be called, else error code and it is not
+ */
+int16_t DNS_resolve(Dns *dns, const char *aHostname, Dns_callback aCallback, void *arg){
+    IP_address address;
+#if DNS_CACHE_SIZE
+    Dns_cache_entry *entry;
+    char key[DNS_CACHE_NAMELEN];
+    uint32_t hash;
+#endif
+
+    // See if it's a numeric IP address
+    if (DNS_inet_aton(dns, aHostname, &address)) {
+        // It is, our work here is done
+        if (aCallback)
+            aCallback(arg, aHostname, SUCCESS, &address);
+        return SUCCESS;
+    }
+
+#if DNS_CACHE_SIZE
+    hash = DNS_cacheKey(aHostname, key);
+    if (hash != DNS_CACHE_FREE && (entry = DNS_cacheFind(dns, hash, key, TYPE_A))) {
+        if (entry->hits < 255)
+            entry->hits++;
+        if (entry->result != SUCCESS)
+            dns->iCacheStats.negativeHits++;
+        else
+            dns->iCacheStats.hits++;
+        if (aCallback)
+            aCallback(arg, aHostname, entry->result, &entry->addr);
+        return SUCCESS;
+    }
+    dns->iCacheStats.misses++;
+#endif
+
+    return DNS_start(dns, aHostname, aCallback, arg);
+}
 
+/**
+ * @brief Forgets the queries in flight for aCallback and arg, e.g. before arg is
+ * freed. Their replies are ignored.
+ */
+void DNS_cancel(Dns *dns, Dns_callback aCallback, void *arg){
+    Dns_query *query;
+
+    for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++) {
+        if (query->state == DNS_QUERY_SENT && query->callback == aCallback && query->arg == arg) {
+#if IP_TIMERS
+            ip_timer_stop(&query->timer);
+#endif
+            query->state = DNS_QUERY_FREE;
+        }
+    }
+}
+
+#if DNS_CACHE_SIZE
+/**
+ * @brief Queries again the popular entries (looked up at least DNS_CACHE_REFRESH_HITS
+ * times) that have less than DNS_CACHE_REFRESH_AHEAD seconds left, so that they
+ * never expire while in use. An entry that fails to refresh stays until it expires.
+ */
+static void DNS_refreshCache(Dns *dns){
+    Dns_cache_entry *entry;
+    uint32_t left;
+
+    for (entry = dns->iCache; entry < dns->iCache + DNS_CACHE_SIZE; entry++) {
+        if (entry->hash == DNS_CACHE_FREE || entry->result != SUCCESS || entry->hits < DNS_CACHE_REFRESH_HITS)
+            continue;
+        left = DNS_cacheLeft(entry);
+        if (left == 0 || left >= DNS_CACHE_REFRESH_AHEAD * 1000UL)
+            continue;
+        if (DNS_start(dns, entry->name, NULL, NULL) != SUCCESS)
+            return;
+        // not again before the answer has been stored
+        entry->hits = 0;
+        dns->iCacheStats.refreshes++;
+    }
+}
+#endif
+
+/**
+ * @brief Received reply. Kept off the stack of DNS_poll(): it is parsed before
+ * the query completes, so a callback that polls again may reuse it.
+ */
+static uint8_t dns_message[DNS_MESSAGE_SIZE];
+
+/**
+ * @brief Runs the resolver: reads the replies received since the last call and
+ * completes their queries, sends again the queries whose reply timed out and
+ * closes the socket once none is left. Call it from the main loop.
+ */
+void DNS_poll(Dns *dns){
+    Dns_query *query;
+    IP_address address;
+    int16_t ret;
+    int len;
+
+#if DNS_CACHE_SIZE
+    DNS_refreshCache(dns);
+#endif
+    if (!dns->iUdp._ip_udp_conn)
+        return;
+
+    // parsePacket() runs Ethernetick(), which also expires the timers
+    while (EthernetUDP_parsePacket(&dns->iUdp) > 0) {
+        // a longer reply is parsed as far as it fits
+        len = EthernetUDP_read(&dns->iUdp, dns_message, sizeof(dns_message));
+        ret = DNS_readResponse(dns, dns_message, len, &query, &address);
+        if (!query)
+            continue;
+        if (ret == SERVER_ERROR && query->attempts < DNS_RETRIES)
+            DNS_send(dns, query); // the server failed, ask the next one
+        else
+            DNS_complete(dns, query, ret, &address);
+    }
+
+    for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++) {
+        if (query->state != DNS_QUERY_SENT)
+            continue;
+#if IP_TIMERS
+        if (ip_timer_pending(&query->timer))
+            continue;
+#else
+        if ((millis() - query->sent) <= query->timeout)
+            continue;
+#endif
+        if (query->attempts < DNS_RETRIES)
+            DNS_send(dns, query);
+        else
+            DNS_complete(dns, query, TIMED_OUT, &address);
+    }
+
+    if (!DNS_pending(dns)) {
+        // We're done with the socket now
+        EthernetUDP_stop(&dns->iUdp);
+    }
+}
+
+/**
+ * @brief Number of queries in flight.
+ */
+uint8_t DNS_pending(const Dns *dns){
+    const Dns_query *query;
+    uint8_t n = 0;
+
+    for (query = dns->iQueries; query < dns->iQueries + DNS_MAX_QUERIES; query++) {
+        if (query->state != DNS_QUERY_FREE)
+            n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Outcome of the query DNS_getHostByName() waits for.
+ */
+typedef struct {
+    bool done;
+    int16_t result;
+    IP_address *address;
+} Dns_wait;
+
+/**
+ * @brief Callback of DNS_getHostByName().
+ */
+static void DNS_wakeUp(void *arg, const char *aHostname, int16_t result, const IP_address *aAddress){
+    Dns_wait *wait = (Dns_wait *)arg;
+
+    (void)aHostname;
+    wait->result = result;
+    if (result == SUCCESS)
+        wait->address->ipv4_word = aAddress->ipv4_word;
+    wait->done = true;
 }
 
+/** Resolve the given hostname to an IP address, waiting for the answer. Other
+ * queries in flight go on meanwhile. From an application callback, i.e. inside
+ * Ethernetick(), nothing is received and no timer expires until the callback
+ * returns: a name that must be asked for fails with WOULD_BLOCK there, use
+ * DNS_resolve() instead. Numeric and cached names are still answered.
+ * @param aHostname Name to be resolved
+ * @param aResult IPAddress structure to store the returned IP address
+ * @result 1 if aIPAddrString was successfully converted to an IP address, else error code
+*/
+int16_t DNS_getHostByName(Dns *dns, const char* aHostname, IP_address *aResult){
+    Dns_wait wait = { false, 0, aResult };
+    int16_t ret;
+
+    ret = DNS_resolve(dns, aHostname, DNS_wakeUp, &wait);
+    if (ret != SUCCESS)
+        return ret;
+    if (!wait.done && ip_ethernet && ip_ethernet->ticking) {
+        DNS_cancel(dns, DNS_wakeUp, &wait);
+        return WOULD_BLOCK;
+    }
+    while (!wait.done)
+        DNS_poll(dns);
+    return wait.result;
+}
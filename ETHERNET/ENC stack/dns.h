@@ -5,10 +5,74 @@
 #include "utilities/ip.h"
 #include <stdint.h>
 
+#if DNS_CACHE_SIZE
+/**
+ * @brief Answer of the resolver cache, found by the hash of the lowercased name
+ * and confirmed by the name itself. A negative entry remembers the error the
+ * server answered for a name that does not exist (or has no A record).
+ */
+typedef struct {
+    uint32_t hash;      // DNS_CACHE_FREE for an unused entry
+    uint32_t expires;   // millis() at which the answer is stale
+    IP_address addr;
+    int16_t result;     // SUCCESS, or the error of a negative entry
+    uint16_t type;      // TYPE_A
+    uint8_t hits;       // lookups answered since the entry was stored
+    char name[DNS_CACHE_NAMELEN];
+} Dns_cache_entry;
+
+/**
+ * @brief Hit-rate counters of the resolver cache.
+ */
+typedef struct {
+    uint32_t hits;          // lookups answered with an address
+    uint32_t negativeHits;  // lookups answered with a cached error
+    uint32_t misses;        // lookups that had to query the server
+    uint32_t refreshes;     // entries queried again by DNS_refreshCache()
+    uint32_t evictions;     // live entries replaced by another name
+} Dns_cache_stats;
+#endif
+
+/**
+ * @brief Called once a query started by DNS_resolve() is answered, fails or times
+ * out, from DNS_resolve() itself for numeric and cached names, else from DNS_poll().
+ * @param arg Passed to DNS_resolve()
+ * @param aHostname Name that was resolved
+ * @param result SUCCESS, else error code
+ * @param aAddress address of a SUCCESS
+ */
+typedef void (*Dns_callback)(void *arg, const char *aHostname, int16_t result, const IP_address *aAddress);
+
+/**
+ * @brief Query in flight, matched to its reply by its transaction ID. Every attempt
+ * goes to the next configured server.
+ */
+typedef struct {
+    uint8_t state;      // DNS_QUERY_FREE, DNS_QUERY_SENT or DNS_QUERY_DONE
+    uint8_t attempts;   // requests sent so far
+    uint8_t server;     // index of the server asked last
+    uint16_t id;
+    Dns_callback callback;
+    void *arg;
+#if IP_TIMERS
+    struct ip_timer timer; // reply timeout, not pending once it has expired
+#else
+    uint32_t sent;      // millis() of the last request
+    uint32_t timeout;
+#endif
+    char name[DNS_QUERY_NAMELEN];
+} Dns_query;
+
 typedef struct _Dns{
-    IP_address iDNSServer;
-    uint16_t iRequestId;
-    EthernetUDP iUdp;
+    IP_address iDNSServer[DNS_MAX_SERVERS]; // IP_ADDRESS_NONE when unused
+    uint16_t iRequestId; // transaction ID of the last request
+    uint32_t iTtl; // TTL in seconds of the answer read by DNS_readResponse()
+    EthernetUDP iUdp; // open while queries are in flight
+    Dns_query iQueries[DNS_MAX_QUERIES];
+#if DNS_CACHE_SIZE
+    Dns_cache_entry iCache[DNS_CACHE_SIZE];
+    Dns_cache_stats iCacheStats;
+#endif
 } Dns;
 
 #define SOCKET_NONE	255
@@ -35,6 +99,7 @@ typedef struct _Dns{
 #define RESP_REFUSED             (5)
 #define RESP_MASK                (15)
 #define TYPE_A                   (0x0001)
+#define TYPE_AAAA                (0x001C)
 #define CLASS_IN                 (0x0001)
 #define LABEL_COMPRESSION_MASK   (0xC0)
 // Port number that DNS servers listen on
@@ -46,14 +111,35 @@ typedef struct _Dns{
 #define INVALID_SERVER   -2
 #define TRUNCATED        -3
 #define INVALID_RESPONSE -4
+#define SERVER_ERROR     -5     // the server failed or refused, the next one is asked
+#define NO_ANSWER        -6     // the reply holds no answer records
+#define NAME_ERROR       -7
+#define QUERY_BUSY       -8
+#define INVALID_RECORD   -9     // a record of the reply is malformed
+#define NO_ADDRESS       -10    // the answers lead to no A record
+#define NAME_TOO_LONG    -11
+#define WOULD_BLOCK      -12    // DNS_getHostByName() called from inside Ethernetick()
+
+#define DNS_QUERY_FREE   0
+#define DNS_QUERY_SENT   1
+#define DNS_QUERY_DONE   2
+
+#define DNS_CACHE_FREE   0
 
 void DNS_init(Dns *dns, const IP_address *aDNSServer);
+void DNS_setServer(Dns *dns, uint8_t aIndex, const IP_address *aDNSServer);
 
 int16_t DNS_inet_aton(Dns *dns, const char *aIPAddrString, IP_address *aResult);
 int16_t DNS_getHostByName(Dns *dns, const char* aHostname, IP_address *aResult);
 
-uint16_t DNS_buildRequest(Dns *dns, const char* aName);
-uint16_t DNS_processResponse(Dns *dns, uint16_t aTimeout, IP_address *aAddress);
+int16_t DNS_resolve(Dns *dns, const char *aHostname, Dns_callback aCallback, void *arg);
+void DNS_cancel(Dns *dns, Dns_callback aCallback, void *arg);
+void DNS_poll(Dns *dns);
+uint8_t DNS_pending(const Dns *dns);
 
+#if DNS_CACHE_SIZE
+void DNS_flushCache(Dns *dns);
+uint8_t DNS_cacheHitRate(const Dns *dns);
+#endif
 
 #endif  /* DNS_H */
\ No newline at end of file
@@ -13,6 +13,8 @@
 
 #define ETH_HDR ((struct ip_eth_hdr *)&ip_buf[0])
 
+IP_INSTANCE_LOCAL Ethernet *ip_ethernet;
+
 /**
  * @brief 
  * 
@@ -20,13 +22,27 @@
  * @param mac 
  */
 void ip_ethernet_init(Ethernet *eth, const uint8_t *mac) {
-    eth->initialized = ENC28J60_init(mac);
+    ip_ethernet = eth;
+#if IP_INSTANCES
+    ip_stack_init(&eth->stack);
+#endif
+    eth->initialized = ENC28J60_init(&eth->enc28j60, &eth->mempool, mac);
     eth->in_packet = NOBLOCK;
-    eth->ip_packet = NOBLOCK;
-    eth->ip_hdrlen = 0;
     eth->packetstate = 0;
+    eth->pending = 0;
+    eth->ticking = false;
+    eth->yield = NULL;
+    eth->periodic_timer = millis();
+    ip_ethernet_capture(eth, NULL);
     eth->_dnsServerAddress.ipv4_word = 0;
-    eth->_dhcp = Dhcp
+    initDHCP(&eth->_dhcp);
+    ip_seteth_addr(mac);
+#if IP_DUALSTACK
+    ip6_init();
+#endif
+#if IP_TIMERS
+    ip_timer_init();
+#endif
 }
 
 /**
@@ -43,80 +59,567 @@ void ip_ethernet_configure(Ethernet *eth, IP_address ip, IP_address dns, IP_addr
 }
 
 /**
- * @brief 
+ * @brief Takes the next received frame from the controller and hands it to the stack, the reply (if any) is queued
+ * for transmission. The frame stays in the controller while the sockets copy their data out of it.
+ * 
+ * @param eth 
+ * @return true 
+ * @return false if no frame was waiting
+ */
+static bool ip_ethernet_receive(Ethernet *eth) {
+    eth->in_packet = ENC28J60_receivePacket(&eth->enc28j60);
+    if (eth->in_packet == NOBLOCK)
+        return false;
+
+    eth->packetstate = IPETHERNET_FREEPACKET;
+    ip_len = ENC28J60_blockSize(&eth->enc28j60, eth->in_packet);
+    if (ip_len > 0) {
+        ENC28J60_readPacket(&eth->enc28j60, eth->in_packet, 0, ip_buf, IP_BUFSIZE);
+        if (ETH_HDR->type == HTONS(IP_ETHTYPE_IP)
+#if IP_DUALSTACK
+            || ETH_HDR->type == HTONS(IP_ETHTYPE_IP6)
+#endif
+        ) {
+#if IP_DUALSTACK
+            if (ETH_HDR->type == HTONS(IP_ETHTYPE_IP6))
+                ip6_neighbor_in();
+            else
+#endif
+                ip_arp_ipin();
+            ip_input();
+            if (ip_len > 0) {
+                ip_arp_out();
+                ip_ethernet_network_send(eth);
+            }
+#if IP_REASSEMBLY
+            // a datagram this fragment completed has been delivered, the driver owns its block
+            ip_ethernet_reass_free(ip_reass_packet);
+            ip_reass_packet = IP_REASS_NOBLOCK;
+#endif
+        } else if (ETH_HDR->type == HTONS(IP_ETHTYPE_ARP)) {
+            ip_arp_arpin();
+            if (ip_len > 0)
+                ip_ethernet_network_send(eth);
+        }
+    }
+    if (eth->in_packet != NOBLOCK && (eth->packetstate & IPETHERNET_FREEPACKET)) {
+        ENC28J60_freePacket(&eth->enc28j60);
+        eth->in_packet = NOBLOCK;
+    }
+    return true;
+}
+
+/**
+ * @brief Finds data of the packet being processed that lies beyond ip_buf. It is in the received frame, or in the
+ * reassembly block when the frame completed a fragmented datagram.
+ * 
+ * @param eth 
+ * @param offset Offset of the data from the start of ip_buf
+ * @param pos Set to the position of the data in the returned block
+ * @return memhandle 
+ */
+memhandle ip_ethernet_packet_data(Ethernet *eth, uint16_t offset, memaddress *pos) {
+#if IP_REASSEMBLY
+    if (ip_reass_packet != IP_REASS_NOBLOCK) {
+        *pos = offset - (IP_LLH_LEN + IP_IPH_LEN); // the block holds the datagram without its headers
+        return ip_reass_packet;
+    }
+#endif
+    *pos = offset;
+    return eth->in_packet;
+}
+
+/**
+ * @brief Runs the stack of eth for one round: receives up to IPETHERNET_RX_BUDGET frames, runs up to
+ * IPETHERNET_TIMER_BUDGET due timers and the DHCP client, reaps up to IPETHERNET_TX_BUDGET transmitted frames and calls the yield
+ * callback. Work left over by a budget is taken up by the next call, ip_ethernet_next_deadline() then returns 0.
+ * A call made from inside the round (an application callback reading or writing a socket) returns without doing
+ * anything, ip_buf and the connection being processed belong to the outer call.
  * 
  * @param eth 
  */
 void Ethernetick(Ethernet *eth) {
+    uint8_t n;
+
+    if (eth->ticking)
+        return;
+    eth->ticking = true;
+    ip_ethernet_select(eth);
+    eth->pending = 0;
+
+    for (n = 0; n < IPETHERNET_RX_BUDGET; n++) {
+        if (!ip_ethernet_receive(eth))
+            break;
+    }
+    if (n == IPETHERNET_RX_BUDGET)
+        eth->pending |= IPETHERNET_RXPENDING;
 
+#if IP_TIMERS
+    // ARP, TCP, DHCP and DNS timers that are due
+    if (ip_timer_poll(IPETHERNET_TIMER_BUDGET))
+        eth->pending |= IPETHERNET_TIMERPENDING;
+#endif
+
+#if IP_REASSEMBLY
+    // ages the datagrams being reassembled, a context that times out releases its block
+    if ((uint32_t)(millis() - eth->periodic_timer) >= IP_PERIODIC_TIMER) {
+        eth->periodic_timer = millis();
+        ip_reass_timer();
+    }
+#endif
+
+    // DHCP exchanges and lease renewal, while the stack keeps serving traffic
+    tickDHCP(&eth->_dhcp);
+
+    for (n = 0; n < IPETHERNET_TX_BUDGET; n++) {
+        if (ENC28J60_txPoll(&eth->enc28j60))
+            break;
+    }
+    if (ENC28J60_txFree(&eth->enc28j60) < ENC28J60_TXQUEUE_SIZE)
+        eth->pending |= IPETHERNET_TXPENDING;
+
+    ip_ethernet_call_yield(eth);
+    eth->ticking = false;
 }
 
 /**
- * @brief 
+ * @brief Time the caller of Ethernetick() may sleep (or wait for the controller interrupt) before the next call.
  * 
  * @param eth 
- * @return true 
- * @return false 
+ * @return uint32_t milliseconds, 0 if the last call left work behind, IPETHERNET_NO_DEADLINE if only a received frame
+ * can wake the stack
  */
-bool ip_ethernet_network_send(Ethernet *eth) {
+uint32_t ip_ethernet_next_deadline(Ethernet *eth) {
+    if (eth->pending)
+        return 0;
+#if IP_TIMERS
+    uint32_t next;
 
+    ip_ethernet_select(eth);
+    next = ip_timer_next();
+    return next == IP_TIMER_NEVER ? IPETHERNET_NO_DEADLINE : next;
+#else
+    return 0;
+#endif
 }
 
 /**
- * @brief 
+ * @brief Sets the callback Ethernetick() calls at the end of every round, NULL for none.
  * 
  * @param eth 
+ * @param yield 
  */
-void ip_ethernet_call_yield(Ethernet *eth) {
+void ip_ethernet_set_yield(Ethernet *eth, ip_ethernet_yield_fn yield) {
+    eth->yield = yield;
+}
+
+/**
+ * @brief Copies a frame out of the controller buffer into the capture file.
+ * 
+ * @param enc28j60 
+ * @param handle 
+ * @param pos 
+ * @param len 
+ * @param tx 
+ */
+static void ip_ethernet_capture_frame(Enc28j60_t *enc28j60, memhandle handle, memaddress pos, uint16_t len, bool tx) {
+    Ethernet *eth = (Ethernet *)enc28j60; // the controller is the first member
+    uint32_t left = pcap_write_record(eth->capture, len);
+    uint8_t chunk[32];
+    uint16_t n;
 
+    while (left > 0) {
+        n = left < sizeof(chunk) ? left : sizeof(chunk);
+        ENC28J60_readPacket(enc28j60, handle, pos, chunk, n);
+        if (pcap_write_data(eth->capture, chunk, n) != PCAP_OK)
+            break;
+        pos += n;
+        left -= n;
+    }
 }
 
-#if IP_UDP
+/**
+ * @brief Starts capturing every frame the interface receives or transmits to writer, which must have been set up
+ * with pcap_writer_init(). NULL stops the capture.
+ * 
+ * @param eth 
+ * @param writer 
+ */
+void ip_ethernet_capture(Ethernet *eth, pcap_writer_t *writer) {
+    eth->capture = writer;
+    ENC28J60_setCapture(&eth->enc28j60, writer ? ip_ethernet_capture_frame : NULL);
+}
 
 /**
- * @brief 
+ * @brief Takes a snapshot of the statistics of eth. The protocol counters are only there with IP_CONF_STATISTICS, the
+ * histograms with IP_CONF_HISTOGRAMS.
  * 
  * @param eth 
- * @param proto 
- * @return uint16_t 
+ * @param stats 
  */
-uint16_t ip_ethernet_upper_layer_chksum(Ethernet *eth, uint8_t proto) {
+void ip_ethernet_stats(Ethernet *eth, ip_ethernet_stats_t *stats) {
+    ip_ethernet_select(eth);
+#if IP_STATISTICS == 1
+    stats->ip = ip_stat;
+#endif
+    stats->allocs = eth->mempool.allocs;
+    stats->allocfails = eth->mempool.allocfails;
+    stats->mem_free = MemoryPool_freeSize(&eth->mempool);
+    stats->tx_free = ENC28J60_txFree(&eth->enc28j60);
+}
 
+/**
+ * @brief Clears the counters and histograms of eth.
+ * 
+ * @param eth 
+ */
+void ip_ethernet_stats_reset(Ethernet *eth) {
+    ip_ethernet_select(eth);
+#if IP_STATISTICS == 1
+    memset(&ip_stat, 0, sizeof(ip_stat));
+#endif
+    eth->mempool.allocs = 0;
+    eth->mempool.allocfails = 0;
 }
+
+/**
+ * @brief Makes eth the interface the following calls work on. With IP_INSTANCES this
+ * also selects its IP stack, so applications driving several interfaces call it
+ * before using the sockets of one of them.
+ * 
+ * @param eth 
+ */
+void ip_ethernet_select(Ethernet *eth) {
+    ip_ethernet = eth;
+#if IP_INSTANCES
+    ip_stack_select(&eth->stack);
 #endif
-   
-#if IP_CONF_IPV6
+}
+
 /**
- * @brief 
+ * @brief Releases the transmit block of a frame once the controller is done with it.
+ * 
+ * @param enc28j60 
+ * @param handle 
+ * @param success 
+ */
+static void ip_ethernet_sent(Enc28j60_t *enc28j60, memhandle handle, bool success) {
+    Ethernet *eth = (Ethernet *)enc28j60; // the controller is the first member
+
+    MemoryPool_freeBlock(&eth->mempool, handle);
+}
+
+/**
+ * @brief Queues the packet in ip_buf for transmission. The headers are taken from ip_buf,
+ * the data fragments of ip_send_chain() are gathered behind them into the transmit block:
+ * RAM and ROM fragments are written over SPI, memory pool blocks copied by DMA. A reply
+ * built in place of a received packet longer than ip_buf (an echo) has the part past
+ * IP_BUFSIZE copied by DMA from the received frame, at the same offset. The block is
+ * released by Ethernetick() once the frame has left.
  * 
  * @param eth 
- * @return uint16_t 
+ * @return true 
+ * @return false if no transmit block could be allocated
  */
-uint16_t ip_icmp6chksum(Ethernet *eth) {
+bool ip_ethernet_network_send(Ethernet *eth) {
+    struct ip_pbuf *p;
+    memhandle packet, src;
+    memaddress pos = IP_SENDBUFFER_OFFSET + ip_len - ip_schainlen, srcpos;
+    uint16_t left = ip_schainlen, len = ip_len - ip_schainlen, n, i, k;
+    uint8_t rom[16];
 
+    packet = MemoryPool_allocBlock(&eth->mempool, IP_SENDBUFFER_OFFSET + ip_len + IP_SENDBUFFER_PADDING);
+    if (packet == NOBLOCK)
+        return false;
+    n = len < IP_BUFSIZE ? len : IP_BUFSIZE;
+    ENC28J60_writePacket(&eth->enc28j60, packet, IP_SENDBUFFER_OFFSET, ip_buf, n);
+    if (n < len) {
+        src = ip_ethernet_packet_data(eth, n, &srcpos);
+        ENC28J60_copyPacket(&eth->enc28j60, packet, IP_SENDBUFFER_OFFSET + n, src, srcpos, len - n);
+    }
+    for (p = ip_schain; p && left > 0; p = p->next) {
+        n = p->len < left ? p->len : left;
+        if (p->type == IP_PBUF_BLOCK) {
+            ENC28J60_copyPacket(&eth->enc28j60, packet, pos, p->data.block.handle, p->data.block.pos, n);
+        } else if (p->type == IP_PBUF_ROM) {
+            for (i = 0; i < n; i += k) {
+                k = n - i < sizeof(rom) ? n - i : sizeof(rom);
+                IP_PBUF_ROM_READ(rom, p->data.ptr + i, k);
+                ENC28J60_writePacket(&eth->enc28j60, packet, pos + i, rom, k);
+            }
+        } else {
+            ENC28J60_writePacket(&eth->enc28j60, packet, pos, (uint8_t *)p->data.ptr, n);
+        }
+        pos += n;
+        left -= n;
+    }
+    while (!ENC28J60_queuePacket(&eth->enc28j60, packet, ip_ethernet_sent))
+        ENC28J60_txPoll(&eth->enc28j60);
+    return true;
 }
-#endif /* IP_CONF_IPV6 */
+
 /**
- * @brief 
+ * @brief Sends the packet a stack timer left in ip_buf, if any (IP_CONF_OUTPUT).
+ * 
+ */
+void ip_ethernet_output(void) {
+    if (ip_len > 0) {
+        ip_arp_out();
+        ip_ethernet_network_send(ip_ethernet);
+    }
+}
+
+/**
+ * @brief Calls the yield callback of eth, if any.
  * 
  * @param eth 
+ */
+void ip_ethernet_call_yield(Ethernet *eth) {
+    if (eth->yield)
+        eth->yield(eth);
+}
+
+/**
+ * @brief Receive window advertised for a connection: the free slots among its
+ * IP_SOCKET_NUMPACKETS incoming packet blocks, bounded by the unallocated memory
+ * pool space and IP_RECEIVE_WINDOW.
+ * 
+ * @param conn 
+ * @return uint32_t window in bytes
+ */
+uint32_t ip_ethernet_rcvwnd(struct ip_conn *conn) {
+    ip_userdata_t *data = (ip_userdata_t *)conn->appstate;
+    uint32_t wnd = (uint32_t)IP_SOCKET_NUMPACKETS * IP_SOCKET_DATALEN;
+    memaddress avail = MemoryPool_freeSize(&ip_ethernet->mempool);
+
+    if (data) {
+        wnd = 0;
+        for (uint8_t i = 0; i < IP_SOCKET_NUMPACKETS; i++) {
+            if (data->packets_in[i] == NOBLOCK)
+                wnd += IP_SOCKET_DATALEN;
+        }
+    }
+    if (wnd > avail)
+        wnd = avail;
+    if (wnd > IP_RECEIVE_WINDOW)
+        wnd = IP_RECEIVE_WINDOW;
+    return wnd;
+}
+
+/**
+ * @brief Continues a checksum over data in a memory pool block (IP_PBUF_CHKSUM).
+ * 
  * @param sum 
+ * @param handle 
+ * @param pos 
+ * @param len 
+ * @return uint16_t sum in host byte order
+ */
+uint16_t ip_ethernet_pbuf_chksum(uint16_t sum, memhandle handle, memaddress pos, uint16_t len) {
+    return ENC28J60_chksum(&ip_ethernet->enc28j60, sum, handle, pos, len);
+}
+
+#if IP_REASSEMBLY
+/**
+ * @brief Allocates the memory pool block backing an IP reassembly context.
+ * 
+ * @param size 
+ * @return memhandle NOBLOCK if the pool is exhausted
+ */
+memhandle ip_ethernet_reass_alloc(memaddress size) {
+    return MemoryPool_allocBlock(&ip_ethernet->mempool, size);
+}
+
+/**
+ * @brief Stores fragment data in a reassembly block. ip_buf only holds the start of the received frame, the part of
+ * the fragment past its end is copied from the frame by DMA.
+ * 
+ * @param handle 
+ * @param pos 
+ * @param data Fragment data in ip_buf, possibly extending beyond IP_BUFSIZE
+ * @param len 
+ */
+void ip_ethernet_reass_write(memhandle handle, memaddress pos, const uint8_t *data, uint16_t len) {
+    uint16_t offset = data - ip_buf, n = 0;
+
+    if (offset < IP_BUFSIZE) {
+        n = IP_BUFSIZE - offset < len ? IP_BUFSIZE - offset : len;
+        ENC28J60_writePacket(&ip_ethernet->enc28j60, handle, pos, (uint8_t *)data, n);
+    }
+    if (n < len)
+        ENC28J60_copyPacket(&ip_ethernet->enc28j60, handle, pos + n, ip_ethernet->in_packet, offset + n, len - n);
+}
+
+/**
+ * @brief Reads back reassembled data.
+ * 
+ * @param handle 
+ * @param pos 
  * @param data 
  * @param len 
- * @return uint16_t 
+ */
+void ip_ethernet_reass_read(memhandle handle, memaddress pos, uint8_t *data, uint16_t len) {
+    ENC28J60_readPacket(&ip_ethernet->enc28j60, handle, pos, data, len);
+}
+
+/**
+ * @brief Releases a reassembly block.
+ * 
+ * @param handle 
+ */
+void ip_ethernet_reass_free(memhandle handle) {
+    MemoryPool_freeBlock(&ip_ethernet->mempool, handle);
+}
+#endif
+
+/**
+ * @brief Continues an Internet checksum over data in RAM.
+ * 
+ * @param eth 
+ * @param sum 
+ * @param data 
+ * @param len 
+ * @return uint16_t sum in host byte order
  */
 uint16_t ip_ethernet_chksum(Ethernet *eth, uint16_t sum, const uint8_t* data, uint16_t len) {
+    const uint8_t *last = data + len - 1;
+    uint16_t t;
 
+    (void)eth;
+    for (; data < last; data += 2) {
+        t = (data[0] << 8) + data[1];
+        sum += t;
+        if (sum < t)
+            sum++; /* carry */
+    }
+    if (data == last) {
+        t = data[0] << 8;
+        sum += t;
+        if (sum < t)
+            sum++; /* carry */
+    }
+    return sum;
 }
 
 /**
- * @brief 
+ * @brief Checksum of the IP header in ip_buf.
  * 
  * @param eth 
- * @return uint16_t 
+ * @return uint16_t checksum in host byte order, 0xffff for a valid header
  */
 uint16_t ip_ethernet_ipchksum(Ethernet *eth) {
+    uint16_t sum = ip_ethernet_chksum(eth, 0, &ip_buf[IP_LLH_LEN], IP_IPH_LEN);
+
+    return (sum == 0) ? 0xffff : sum;
+}
+
+/**
+ * @brief Continues a checksum over the first len bytes of an ip_send_chain() chain. A fragment that starts at an odd
+ * offset is summed on its own, the bytes of its sum are then swapped into place.
+ * 
+ * @param eth 
+ * @param sum 
+ * @param p 
+ * @param len 
+ * @return uint16_t 
+ */
+static uint16_t ip_ethernet_chain_chksum(Ethernet *eth, uint16_t sum, const struct ip_pbuf *p, uint16_t len) {
+    uint16_t part, n, i, k;
+    uint8_t odd, rom[16];
+
+    for (odd = 0; p != NULL && len > 0; p = p->next) {
+        n = p->len < len ? p->len : len;
+        if (p->type == IP_PBUF_ROM) {
+            for (part = 0, i = 0; i < n; i += k) {
+                k = n - i < sizeof(rom) ? n - i : sizeof(rom);
+                IP_PBUF_ROM_READ(rom, p->data.ptr + i, k);
+                part = ip_ethernet_chksum(eth, part, rom, k);
+            }
+        } else if (p->type == IP_PBUF_BLOCK) {
+            part = ENC28J60_chksum(&eth->enc28j60, 0, p->data.block.handle, p->data.block.pos, n);
+        } else {
+            part = ip_ethernet_chksum(eth, 0, p->data.ptr, n);
+        }
+        if (odd)
+            part = (part << 8) | (part >> 8);
+        sum += part;
+        if (sum < part)
+            sum++; /* carry */
+        odd ^= n & 1;
+        len -= n;
+    }
+    return sum;
+}
+
+/**
+ * @brief Checksum of the TCP, UDP or ICMPv6 message of the packet in ip_buf. The pseudo header and the part of the
+ * message in ip_buf are summed there, the rest of a received message in the controller (the frame or the
+ * reassembly block, see ip_ethernet_packet_data()) and the data of ip_send_chain() in its fragments.
+ * 
+ * @param eth 
+ * @param proto 
+ * @return uint16_t checksum in host byte order, 0xffff for a valid message
+ */
+uint16_t ip_ethernet_upper_layer_chksum(Ethernet *eth, uint8_t proto) {
+    struct ip_tcpip_hdr *hdr = (struct ip_tcpip_hdr *)&ip_buf[IP_LLH_LEN];
+    uint16_t offset = IP_LLH_LEN + IP_IPH_LEN, len, memlen, sum;
+    memhandle packet;
+    memaddress pos;
+
+#if IP_CONF_IPV6
+    len = ((uint16_t)hdr->len[0] << 8) + hdr->len[1];
+#else
+    len = (((uint16_t)hdr->len[0] << 8) + hdr->len[1]) - IP_IPH_LEN;
+#endif
+
+    // pseudo header, the protocol and length fields cannot carry
+    sum = len + proto;
+    sum = ip_ethernet_chksum(eth, sum, (uint8_t *)&hdr->srcipaddr, 2 * sizeof(IP_address));
 
+    // the part past ip_buf starts on an even offset so the words of the two sums line up
+    len -= ip_schainlen;
+    memlen = len;
+    if (offset + memlen > IP_BUFSIZE)
+        memlen = (IP_BUFSIZE - offset) & ~1;
+    sum = ip_ethernet_chksum(eth, sum, &ip_buf[offset], memlen);
+    if (memlen < len) {
+        packet = ip_ethernet_packet_data(eth, offset + memlen, &pos);
+        if (packet != NOBLOCK)
+            sum = ENC28J60_chksum(&eth->enc28j60, sum, packet, pos, len - memlen);
+    }
+    if (ip_schainlen > 0)
+        sum = ip_ethernet_chain_chksum(eth, sum, ip_schain, ip_schainlen);
+    return (sum == 0) ? 0xffff : sum;
 }
 
+#if IP_ARCH_CHKSUM
+/*
+ * The checksums of ip.c, computed over the frame left in the controller where the packet outgrows ip_buf.
+ */
+
+uint16_t ip_chksum(uint16_t *data, uint16_t len) {
+    return htons(ip_ethernet_chksum(ip_ethernet, 0, (const uint8_t *)data, len));
+}
+
+uint16_t ip_ipchksum(void) {
+    return htons(ip_ethernet_ipchksum(ip_ethernet));
+}
+
+uint16_t ip_tcpchksum(void) {
+    return htons(ip_ethernet_upper_layer_chksum(ip_ethernet, IP_PROTO_TCP));
+}
+
+#if IP_UDP_CHECKSUMS
+uint16_t ip_udpchksum(void) {
+    return htons(ip_ethernet_upper_layer_chksum(ip_ethernet, IP_PROTO_UDP));
+}
+#endif
+
+#if IP_CONF_IPV6
+uint16_t ip_icmp6chksum(void) {
+    return htons(ip_ethernet_upper_layer_chksum(ip_ethernet, IP_PROTO_ICMP6));
+}
+#endif /* IP_CONF_IPV6 */
+#endif /* IP_ARCH_CHKSUM */
+
 
@@ -22,11 +22,22 @@
 #include "utilities/ip-conf.h"
 #include "utilities/ip.h"
 #include "utilities/ip_arp.h"
+#include "utilities/ip6.h"
+#include "utilities/ip_stack.h"
+#include "../../TCP-IP/DATA_LINK/PCAP/pcap.h"
 
 #define IPETHERNET_FREEPACKET 1
 #define IPETHERNET_SENDPACKET 2
 #define IPETHERNET_BUFFERREAD 4
 
+// work an Ethernetick() call left for the next one
+#define IPETHERNET_RXPENDING 1
+#define IPETHERNET_TIMERPENDING 2
+#define IPETHERNET_TXPENDING 4
+
+// returned by ip_ethernet_next_deadline() when no timer is armed
+#define IPETHERNET_NO_DEADLINE 0xFFFFFFFFUL
+
 #define ip_ip_addr(addr, ip)                                   \
 	do                                                          \
 	{                                                           \
@@ -34,7 +45,7 @@
 		((u16_t *)(addr))[1] = HTONS(((ip[2]) << 8) | (ip[3])); \
 	} while (0)
 
-#define ip_addr_ip(a) IP_address(a[0] & 0xFF, a[0] >> 8, a[1] & 0xFF, a[1] >> 8) //TODO this is not IPV6 capable
+#define ip_addr_ip(a) IP_address(a[0] & 0xFF, a[0] >> 8, a[1] & 0xFF, a[1] >> 8) // IPv4 only, ip_srcaddr() returns the source of either family
 
 #define ip_seteth_addr(eaddr)          \
 	do                                  \
@@ -63,41 +74,86 @@ enum EthernetHardwareStatus {
 	EthernetENC28J60 = 10
 };
 
+struct ip_ethernet;
+
+/**
+ * @brief Application callback run by Ethernetick() at the end of every round.
+ */
+typedef void (*ip_ethernet_yield_fn)(struct ip_ethernet *eth);
+
 /**
  * @brief 
  * 
  */
 typedef struct ip_ethernet {
+	Enc28j60_t enc28j60;
+	MemoryPool mempool;
 	bool initialized;
 	memhandle in_packet;
-	memhandle ip_packet;
-	uint8_t ip_hdrlen;
 	uint8_t packetstate;
+	uint8_t pending;            // IPETHERNET_*PENDING work left by the last Ethernetick()
+	bool ticking;               // set while Ethernetick() runs, nested calls return at once
+	ip_ethernet_yield_fn yield;
 
 	IP_address _dnsServerAddress;
 	Dhcp_t _dhcp;
 
-	uint32_t periodic_timer;
+	uint32_t periodic_timer;    // last run of the IP_PERIODIC_TIMER work (fragment reassembly timeouts)
+	pcap_writer_t *capture; // receives the frames seen by the controller, NULL if not capturing
+	ip_userdata_t client_data[IP_CONNS]; // state of every TCP connection, see ipclient_appcall()
+	struct ip_pbuf client_chain; // the outgoing block of a connection, sent in place behind the headers
+	struct ip_pbuf udp_chain; // the outgoing datagram, sent in place behind the headers
+#if IP_INSTANCES
+	struct ip_stack stack; // IP stack of this interface
+#endif
 } Ethernet;
 
+/**
+ * @brief Statistics of an interface in one snapshot, e.g. for export over SNMP or HTTP.
+ * 
+ */
+typedef struct ip_ethernet_stats {
+#if IP_STATISTICS == 1
+	struct ip_stats ip;   // counters of the driver and every protocol, latency histograms
+#endif
+	uint32_t allocs;      // memory pool blocks allocated
+	uint32_t allocfails;  // allocations that found no room
+	memaddress mem_free;  // free bytes in the memory pool
+	uint8_t tx_free;      // free slots in the TX queue
+} ip_ethernet_stats_t;
+
+extern IP_INSTANCE_LOCAL Ethernet *ip_ethernet; // instance driven by the IP stack callbacks
+
+void ip_ethernet_select(Ethernet *eth);
+
 void ip_ethernet_init(Ethernet *eth, const uint8_t *mac);
 void ip_ethernet_configure(Ethernet *eth, IP_address ip, IP_address dns, IP_address gateway, IP_address subnet);
 void Ethernetick(Ethernet *eth);
+uint32_t ip_ethernet_next_deadline(Ethernet *eth);
+void ip_ethernet_set_yield(Ethernet *eth, ip_ethernet_yield_fn yield);
+void ip_ethernet_capture(Ethernet *eth, pcap_writer_t *writer);
+void ip_ethernet_stats(Ethernet *eth, ip_ethernet_stats_t *stats);
+void ip_ethernet_stats_reset(Ethernet *eth);
 
+memhandle ip_ethernet_packet_data(Ethernet *eth, uint16_t offset, memaddress *pos);
 bool ip_ethernet_network_send(Ethernet *eth);
+void ip_ethernet_output(void);
 
 void ip_ethernet_call_yield(Ethernet *eth);
 
-#if IP_UDP
-uint16_t ip_ethernet_upper_layer_chksum(Ethernet *eth, uint8_t proto);
+uint32_t ip_ethernet_rcvwnd(struct ip_conn *conn);
+uint16_t ip_ethernet_pbuf_chksum(uint16_t sum, memhandle handle, memaddress pos, uint16_t len);
+
+#if IP_REASSEMBLY
+memhandle ip_ethernet_reass_alloc(memaddress size);
+void ip_ethernet_reass_write(memhandle handle, memaddress pos, const uint8_t *data, uint16_t len);
+void ip_ethernet_reass_read(memhandle handle, memaddress pos, uint8_t *data, uint16_t len);
+void ip_ethernet_reass_free(memhandle handle);
 #endif
-   
-#if IP_CONF_IPV6
-uint16_t ip_icmp6chksum(Ethernet *eth);
-#endif /* IP_CONF_IPV6 */
 
 uint16_t ip_ethernet_chksum(Ethernet *eth, uint16_t sum, const uint8_t* data, uint16_t len);
 uint16_t ip_ethernet_ipchksum(Ethernet *eth);
+uint16_t ip_ethernet_upper_layer_chksum(Ethernet *eth, uint8_t proto);
 
 
 #endif /*ETHERNET_H*/
\ No newline at end of file
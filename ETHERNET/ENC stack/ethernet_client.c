@@ -9,4 +9,321 @@
  * 
  */
 
-#include "ethernet_client.h"
\ No newline at end of file
+#include "ethernet_client.h"
+#include "utilities/util.h"
+
+/**
+ * @brief Size of the outgoing blocks, one block is sent as one segment. Limited by
+ * the current MSS of the connection, which follows the peer's window and path MTU
+ * discovery, so that a new block always fits what ip_sendwnd() lets through.
+ * 
+ * @param u 
+ * @return memaddress 
+ */
+static memaddress EthernetClient_segmentSize(ip_userdata_t *u) {
+    uint16_t mss = ip_conns[u->conn_index].mss;
+    return mss < IP_SOCKET_DATALEN ? mss : IP_SOCKET_DATALEN;
+}
+
+/**
+ * @brief Index of the last allocated outgoing block.
+ * 
+ * @param u 
+ * @return uint8_t IP_SOCKET_NUMPACKETS if there is none
+ */
+static uint8_t EthernetClient_tailBlock(ip_userdata_t *u) {
+    uint8_t p = IP_SOCKET_NUMPACKETS;
+    for (uint8_t i = 0; i < IP_SOCKET_NUMPACKETS && u->packets_out[i] != NOBLOCK; i++)
+        p = i;
+    return p;
+}
+
+/**
+ * @brief Frees the first n blocks of a packet list and moves the rest to the front.
+ * 
+ * @param blocks 
+ * @param n 
+ */
+static void EthernetClient_eatBlocks(memhandle *blocks, uint8_t n) {
+    uint8_t i;
+    for (i = 0; i < n; i++)
+        MemoryPool_freeBlock(&ip_ethernet->mempool, blocks[i]);
+    for (i = n; i < IP_SOCKET_NUMPACKETS; i++)
+        blocks[i - n] = blocks[i];
+    for (i = IP_SOCKET_NUMPACKETS - n; i < IP_SOCKET_NUMPACKETS; i++)
+        blocks[i] = NOBLOCK;
+}
+
+/**
+ * @brief Frees all blocks of a packet list.
+ * 
+ * @param blocks 
+ */
+static void EthernetClient_flushBlocks(memhandle *blocks) {
+    EthernetClient_eatBlocks(blocks, IP_SOCKET_NUMPACKETS);
+}
+
+/**
+ * @brief Takes a free connection state.
+ * 
+ * @return ip_userdata_t* NULL if all are in use
+ */
+static ip_userdata_t *EthernetClient_allocateData(void) {
+    for (uint8_t sock = 0; sock < IP_CONNS; sock++) {
+        ip_userdata_t *data = &ip_ethernet->client_data[sock];
+        if (!data->state) {
+            memset(data, 0, sizeof(ip_userdata_t));
+            data->state = IP_CLIENT_CONNECTED;
+            return data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Length of outgoing block p if it can be sent now, 0 otherwise.
+ * 
+ * Full blocks are always sent. The partially filled tail block is held back while
+ * earlier data is unacknowledged (Nagle), unless IP_CLIENT_NODELAY is set or a flush
+ * was requested, so that small writes are merged into full segments.
+ * 
+ * @param u 
+ * @param p 
+ * @return memaddress 
+ */
+static memaddress EthernetClient_sendLength(ip_userdata_t *u, uint8_t p) {
+    memaddress size;
+
+    if (p >= IP_SOCKET_NUMPACKETS || u->packets_out[p] == NOBLOCK)
+        return 0;
+    size = MemoryPool_blockSize(&ip_ethernet->mempool, u->packets_out[p]);
+    if (p != EthernetClient_tailBlock(u) || u->out_pos == size)
+        return size;
+    if (p > 0 && !(u->state & (IP_CLIENT_NODELAY | IP_CLIENT_PUSH)))
+        return 0;
+    return u->out_pos;
+}
+
+/**
+ * @brief 
+ * 
+ * @param client 
+ */
+void EthernetClient_init(Ethernet_client *client) {
+    client->data = NULL;
+}
+
+/**
+ * @brief Queues data taken from RAM (buf) or, if buf is NULL, from the memory pool
+ * block src starting at srcpos. See EthernetClient_write().
+ * 
+ * @param u 
+ * @param buf 
+ * @param src 
+ * @param srcpos 
+ * @param size 
+ * @return size_t number of bytes queued
+ */
+static size_t EthernetClient_queue(ip_userdata_t *u, const uint8_t *buf, memhandle src, memaddress srcpos, size_t size) {
+    size_t remain = size;
+    unsigned long start = millis();
+    uint8_t p;
+    memaddress blocksize;
+    uint16_t written;
+
+    while (remain > 0) {
+        if (!u || !u->state || (u->state & (IP_CLIENT_CLOSE | IP_CLIENT_REMOTECLOSED)))
+            break;
+        p = EthernetClient_tailBlock(u);
+        blocksize = p == IP_SOCKET_NUMPACKETS ? 0 : MemoryPool_blockSize(&ip_ethernet->mempool, u->packets_out[p]);
+        // the tail block is full or already sent: start a new one
+        if (p == IP_SOCKET_NUMPACKETS || u->out_pos == blocksize || p < ip_inflight(&ip_conns[u->conn_index])) {
+            p = p == IP_SOCKET_NUMPACKETS ? 0 : p + 1;
+            if (p < IP_SOCKET_NUMPACKETS)
+                u->packets_out[p] = MemoryPool_allocBlock(&ip_ethernet->mempool, EthernetClient_segmentSize(u));
+            if (p == IP_SOCKET_NUMPACKETS || u->packets_out[p] == NOBLOCK) {
+#if IP_WRITE_TIMEOUT > 0
+                if (millis() - start > IP_WRITE_TIMEOUT)
+                    break;
+#endif
+                Ethernetick(ip_ethernet);
+                continue;
+            }
+            u->out_pos = 0;
+            blocksize = EthernetClient_segmentSize(u);
+        }
+        written = remain < blocksize - u->out_pos ? remain : blocksize - u->out_pos;
+        if (buf)
+            written = ENC28J60_writePacket(&ip_ethernet->enc28j60, u->packets_out[p], u->out_pos, (uint8_t *)buf + size - remain, written);
+        else
+            ENC28J60_copyPacket(&ip_ethernet->enc28j60, u->packets_out[p], u->out_pos, src, srcpos + size - remain, written);
+        remain -= written;
+        u->out_pos += written;
+    }
+    return size - remain;
+}
+
+/**
+ * @brief Queues data on the connection. Consecutive writes are coalesced into
+ * segment sized blocks, which are sent from ipclient_appcall(). Waits up to
+ * IP_WRITE_TIMEOUT ms for free blocks.
+ * 
+ * @param client 
+ * @param buf 
+ * @param size 
+ * @return size_t number of bytes queued
+ */
+size_t EthernetClient_write(Ethernet_client *client, const uint8_t *buf, size_t size) {
+    return EthernetClient_queue(client->data, buf, NOBLOCK, 0, size);
+}
+
+/**
+ * @brief Queues data already held in the controller: size bytes of the memory pool
+ * block src from position pos are copied into the outgoing blocks by DMA, without
+ * crossing SPI again. Otherwise like EthernetClient_write().
+ * 
+ * @param client 
+ * @param src 
+ * @param pos 
+ * @param size 
+ * @return size_t number of bytes queued
+ */
+size_t EthernetClient_writeBlock(Ethernet_client *client, memhandle src, memaddress pos, size_t size) {
+    return EthernetClient_queue(client->data, NULL, src, pos, size);
+}
+
+/**
+ * @brief Sends the data still held in the coalescing buffer without waiting for
+ * outstanding acknowledgements. Called from inside Ethernetick() (an application
+ * callback) it only marks the data, ip_buf belongs to the segment being processed:
+ * the next poll of the connection sends it.
+ * 
+ * @param client 
+ */
+void EthernetClient_flush(Ethernet_client *client) {
+    ip_userdata_t *u = client->data;
+
+    if (u && u->out_pos > 0) {
+        u->state |= IP_CLIENT_PUSH;
+        if (ip_ethernet->ticking)
+            return;
+        ip_poll_conn(&ip_conns[u->conn_index]);
+        if (ip_len > 0) {
+            ip_arp_out();
+            ip_ethernet_network_send(ip_ethernet);
+        }
+    }
+}
+
+/**
+ * @brief Disables (TCP_NODELAY) or enables the coalescing of small writes.
+ * 
+ * @param client 
+ * @param nodelay 
+ */
+void EthernetClient_setNoDelay(Ethernet_client *client, bool nodelay) {
+    if (!client->data)
+        return;
+    if (nodelay)
+        client->data->state |= IP_CLIENT_NODELAY;
+    else
+        client->data->state &= ~IP_CLIENT_NODELAY;
+}
+
+/**
+ * @brief TCP application callback of the IP stack.
+ * 
+ */
+void ipclient_appcall(void) {
+    uint16_t send_len = 0;
+    uint8_t p;
+    ip_userdata_t *u = (ip_userdata_t *)ip_conn->appstate;
+
+    if (!u && ip_connected()) {
+        u = EthernetClient_allocateData();
+        if (u) {
+            u->conn_index = ip_conn - ip_conns;
+            ip_conn->appstate = u;
+        }
+    }
+    if (!u)
+        goto finish;
+
+    if (ip_newdata()) {
+        if (ip_len && !(u->state & (IP_CLIENT_CLOSE | IP_CLIENT_REMOTECLOSED))) {
+            for (uint8_t i = 0; i < IP_SOCKET_NUMPACKETS; i++) {
+                if (u->packets_in[i] == NOBLOCK) {
+                    u->packets_in[i] = MemoryPool_allocBlock(&ip_ethernet->mempool, ip_len);
+                    if (u->packets_in[i] != NOBLOCK) {
+                        memaddress src;
+                        memhandle packet = ip_ethernet_packet_data(ip_ethernet, ((uint8_t *)ip_appdata) - ip_buf, &src);
+
+                        ENC28J60_copyPacket(&ip_ethernet->enc28j60, u->packets_in[i], 0, packet, src, ip_len);
+                        if (i == IP_SOCKET_NUMPACKETS - 1)
+                            ip_stop();
+                        goto finish_newdata;
+                    }
+                }
+            }
+            ip_ethernet->packetstate &= ~IPETHERNET_FREEPACKET;
+            ip_stop();
+        }
+    }
+finish_newdata:
+    if (u->state & IP_CLIENT_RESTART) {
+        u->state &= ~IP_CLIENT_RESTART;
+        ip_restart();
+    }
+    // if the connection has been closed, save received but unread data
+    if (ip_closed() || ip_timedout()) {
+        // drop outgoing packets not sent yet
+        EthernetClient_flushBlocks(&u->packets_out[0]);
+        if (u->packets_in[0] != NOBLOCK) {
+            ((ip_userdata_closed_t *)u)->lport = ip_conn->lport;
+            u->state |= IP_CLIENT_REMOTECLOSED;
+        } else {
+            u->state = 0;
+        }
+        ip_conn->appstate = NULL;
+        goto finish;
+    }
+    if (ip_acked()) {
+        EthernetClient_eatBlocks(&u->packets_out[0], ip_ackedsegments());
+    }
+    if (ip_poll() || ip_acked() || ip_rexmit()) {
+        // a retransmission resends the oldest block, otherwise the next unsent one goes out
+        p = ip_rexmit() ? 0 : ip_inflight(ip_conn);
+        send_len = EthernetClient_sendLength(u, p);
+        if (send_len > 0 && !ip_rexmit() && send_len > ip_sendwnd(ip_conn))
+            send_len = 0;   // wait until the whole block fits into the peer's window
+        if (send_len > 0) {
+            if (p == EthernetClient_tailBlock(u)) {
+                // the tail block leaves the coalescing buffer, later writes start a new one
+                MemoryPool_resizeBlock(&ip_ethernet->mempool, u->packets_out[p], 0, send_len);
+                u->state &= ~IP_CLIENT_PUSH;
+            }
+            ip_ethernet->client_chain.next = NULL;
+            ip_ethernet->client_chain.len = send_len;
+            ip_ethernet->client_chain.type = IP_PBUF_BLOCK;
+            ip_ethernet->client_chain.data.block.handle = u->packets_out[p];
+            ip_ethernet->client_chain.data.block.pos = 0;
+        }
+        if (send_len > 0 || u->packets_out[0] != NOBLOCK)
+            goto finish;
+    }
+    // don't close connection unless all outgoing packets are sent
+    if (u->state & IP_CLIENT_CLOSE) {
+        if (u->packets_out[0] == NOBLOCK) {
+            u->state = 0;
+            ip_conn->appstate = NULL;
+            ip_close();
+        } else {
+            ip_stop();
+        }
+    }
+finish:
+    if (send_len > 0)
+        ip_send_chain(&ip_ethernet->client_chain);
+    else
+        ip_send(ip_appdata, 0);
+}
@@ -19,10 +19,6 @@
 #include "utilities/ip-conf.h"
 #include "utilities/ip_arp.h"
 
-#include "ethernet.h"
-#include "ethernet_client.h"
-#include "dns.h"
-
 #define IP_TCP_PHYH_LEN IP_LLH_LEN+IP_IPTCPH_LEN
 
 
@@ -33,6 +29,8 @@
 #define IP_CLIENT_REMOTECLOSED 0x04
 #define IP_CLIENT_RESTART 0x08
 #define IP_CLIENT_ACCEPTED 0x10
+#define IP_CLIENT_NODELAY 0x20
+#define IP_CLIENT_PUSH 0x40
 
 typedef struct {
 	uint8_t conn_index;
@@ -41,6 +39,12 @@ typedef struct {
 	uint16_t lport; /**< The local TCP port, in network byte order. */
 } ip_userdata_closed_t;
 
+/**
+ * @brief Per connection state. packets_out holds the outgoing data in order: the first
+ * ip_inflight() blocks are sent and not yet acknowledged, the others wait to be sent.
+ * out_pos is the fill level of the last (tail) block, writes are coalesced into it until
+ * it holds a full segment.
+ */
 typedef struct {
 	uint8_t conn_index;
 	uint8_t state;
@@ -55,11 +59,18 @@ typedef struct {
  */
 typedef struct {
 	ip_userdata_t *data;
-    ip_userdata_t all_data[IP_CONNS];
 } Ethernet_client;
 
+// after the types above, struct ip_ethernet embeds them
+#include "ethernet.h"
+#include "dns.h"
+
 // Funciones
 void EthernetClient_init(Ethernet_client *client);
+size_t EthernetClient_write(Ethernet_client *client, const uint8_t *buf, size_t size);
+size_t EthernetClient_writeBlock(Ethernet_client *client, memhandle src, memaddress pos, size_t size);
+void EthernetClient_flush(Ethernet_client *client);
+void EthernetClient_setNoDelay(Ethernet_client *client, bool nodelay);
 
 
 #endif /* ETHERNET_CLIENT_H */
@@ -0,0 +1,159 @@
+/**
+ * @file ethernet_replay.c
+ * @brief Feeds the frames of a pcap capture through the IP stack of an interface as fast as possible, to profile the
+ * stack with recorded traffic.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <string.h>
+#include "ethernet_replay.h"
+
+#define ETH_HDR ((struct ip_eth_hdr *)&ip_buf[0])
+
+/**
+ * @brief Hands the reply the stack left in ip_buf to the controller, or drops it.
+ *
+ * @param eth
+ * @param clock
+ * @param transmit
+ * @param stats
+ */
+static void ip_ethernet_replay_output(Ethernet *eth, pcap_clock_fn clock, bool transmit, ip_ethernet_replay_stats_t *stats) {
+    uint32_t t = clock();
+
+    if (transmit)
+        ip_ethernet_network_send(eth);
+    stats->replies++;
+    stats->output_us += clock() - t;
+}
+
+/**
+ * @brief Copies the frame described by record from the capture into a pool block, the way the controller holds a
+ * received frame, and reads its headers into ip_buf.
+ *
+ * @param eth
+ * @param reader
+ * @param record
+ * @return memhandle NOBLOCK if the pool is exhausted or the capture could not be read, the frame is then skipped
+ */
+static memhandle ip_ethernet_replay_load(Ethernet *eth, pcap_reader_t *reader, const pcap_record_t *record) {
+    uint8_t chunk[32];
+    uint16_t len = record->caplen, pos, n;
+    memhandle handle = MemoryPool_allocBlock(&eth->mempool, len);
+
+    if (handle == NOBLOCK) {
+        pcap_read_data(reader, NULL, len);
+        return NOBLOCK;
+    }
+    n = len < IP_BUFSIZE ? len : IP_BUFSIZE;
+    if (pcap_read_data(reader, ip_buf, n) != PCAP_OK) {
+        MemoryPool_freeBlock(&eth->mempool, handle);
+        return NOBLOCK;
+    }
+    ENC28J60_writePacket(&eth->enc28j60, handle, 0, ip_buf, n);
+    for (pos = n; pos < len; pos += n) {
+        n = len - pos < sizeof(chunk) ? len - pos : sizeof(chunk);
+        if (pcap_read_data(reader, chunk, n) != PCAP_OK) {
+            MemoryPool_freeBlock(&eth->mempool, handle);
+            return NOBLOCK;
+        }
+        ENC28J60_writePacket(&eth->enc28j60, handle, pos, chunk, n);
+    }
+    return handle;
+}
+
+/**
+ * @brief Replays the capture read by reader through the stack of eth, the same way Ethernetick() hands received
+ * frames to it: each frame is held in a pool block standing in for the receive buffer, only its headers are in
+ * ip_buf. The timestamps of the capture are ignored, frames follow each other without delay.
+ *
+ * @param eth
+ * @param reader Set up with pcap_reader_init()
+ * @param clock Microsecond clock timing the layers
+ * @param transmit Send the replies through the controller, otherwise they are counted and dropped
+ * @param stats Cleared and filled in
+ * @return pcap_error_t PCAP_EOF once the whole capture has been replayed
+ */
+pcap_error_t ip_ethernet_replay(Ethernet *eth, pcap_reader_t *reader, pcap_clock_fn clock, bool transmit, ip_ethernet_replay_stats_t *stats) {
+    pcap_record_t record;
+    pcap_error_t error;
+    uint32_t start, t0, t1, t2;
+    uint32_t allocs = eth->mempool.allocs, allocfails = eth->mempool.allocfails;
+
+    memset(stats, 0, sizeof(*stats));
+    ip_ethernet_select(eth);
+    start = clock();
+    while ((error = pcap_read_record(reader, &record)) == PCAP_OK) {
+        if (record.caplen == 0 || record.caplen > MAX_FRAMELEN) {
+            stats->truncated++;
+            if ((error = pcap_read_data(reader, NULL, record.caplen)) != PCAP_OK)
+                break;
+            continue;
+        }
+        eth->in_packet = ip_ethernet_replay_load(eth, reader, &record);
+        if (eth->in_packet == NOBLOCK) {
+            stats->ignored++;
+            continue;
+        }
+        eth->packetstate = IPETHERNET_FREEPACKET;
+        ip_len = record.caplen;
+        stats->frames++;
+        stats->bytes += record.caplen;
+
+        t0 = clock();
+        if (ETH_HDR->type == HTONS(IP_ETHTYPE_IP)
+#if IP_DUALSTACK
+            || ETH_HDR->type == HTONS(IP_ETHTYPE_IP6)
+#endif
+        ) {
+#if IP_DUALSTACK
+            if (ETH_HDR->type == HTONS(IP_ETHTYPE_IP6))
+                ip6_neighbor_in();
+            else
+#endif
+                ip_arp_ipin();
+            t1 = clock();
+            ip_input();
+            t2 = clock();
+            stats->link_us += t1 - t0;
+            stats->ip_us += t2 - t1;
+            if (ip_len > 0) {
+                ip_arp_out();
+                stats->link_us += clock() - t2;
+                ip_ethernet_replay_output(eth, clock, transmit, stats);
+            }
+#if IP_REASSEMBLY
+            ip_ethernet_reass_free(ip_reass_packet);
+            ip_reass_packet = IP_REASS_NOBLOCK;
+#endif
+        } else if (ETH_HDR->type == HTONS(IP_ETHTYPE_ARP)) {
+            ip_arp_arpin();
+            stats->link_us += clock() - t0;
+            if (ip_len > 0)
+                ip_ethernet_replay_output(eth, clock, transmit, stats);
+        } else {
+            stats->ignored++;
+        }
+        MemoryPool_freeBlock(&eth->mempool, eth->in_packet);
+        eth->in_packet = NOBLOCK;
+    }
+    stats->total_us = clock() - start;
+    stats->allocs = eth->mempool.allocs - allocs;
+    stats->allocfails = eth->mempool.allocfails - allocfails;
+    ip_len = 0;
+    return error;
+}
+
+/**
+ * @brief Frames per second of a replay.
+ *
+ * @param stats
+ * @return uint32_t
+ */
+uint32_t ip_ethernet_replay_pps(const ip_ethernet_replay_stats_t *stats) {
+    return stats->total_us ? (uint32_t)((uint64_t)stats->frames * 1000000 / stats->total_us) : 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file ethernet_replay.h
+ * @brief Feeds the frames of a pcap capture through the IP stack of an interface as fast as possible, to profile the
+ * stack with recorded traffic.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef ETHERNET_REPLAY_H
+#define ETHERNET_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ethernet.h"
+
+/**
+ * @brief Results of a replay. Times are in microseconds of the clock passed to ip_ethernet_replay(): link covers
+ * ARP and neighbor processing (ip_arp_ipin(), ip_arp_arpin(), ip6_neighbor_in(), ip_arp_out()), ip covers
+ * ip_input() and output the transmission of the replies.
+ *
+ */
+typedef struct ip_ethernet_replay_stats {
+	uint32_t frames;      // frames fed to the stack
+	uint32_t bytes;
+	uint32_t truncated;   // frames larger than MAX_FRAMELEN, skipped
+	uint32_t ignored;     // frames of other ethertypes, or left without a pool block
+	uint32_t replies;     // frames the stack answered with
+	uint32_t link_us;
+	uint32_t ip_us;
+	uint32_t output_us;
+	uint32_t total_us;
+	uint32_t allocs;      // memory pool blocks allocated during the replay
+	uint32_t allocfails;
+} ip_ethernet_replay_stats_t;
+
+pcap_error_t ip_ethernet_replay(Ethernet *eth, pcap_reader_t *reader, pcap_clock_fn clock, bool transmit, ip_ethernet_replay_stats_t *stats);
+uint32_t ip_ethernet_replay_pps(const ip_ethernet_replay_stats_t *stats);
+
+#endif /*ETHERNET_REPLAY_H*/
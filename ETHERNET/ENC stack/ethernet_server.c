@@ -40,13 +40,73 @@ void EthernetServer_end(Ethernet_server *server) {
 }
 
 /**
- * @brief 
+ * @brief Whether a connection state belongs to an open client of the server.
+ * 
+ * @param server 
+ * @param data 
+ * @return true 
+ * @return false 
+ */
+static bool EthernetServer_isClient(Ethernet_server *server, ip_userdata_t *data) {
+    return (data->state & IP_CLIENT_CONNECTED) && !(data->state & (IP_CLIENT_CLOSE | IP_CLIENT_REMOTECLOSED)) &&
+           ip_conns[data->conn_index].lport == HTONS(server->port);
+}
+
+/**
+ * @brief Writes buf to every client connected to the server. With more than one
+ * client the data crosses SPI only once: it is staged in a memory pool block, from
+ * which every connection copies it into its outgoing blocks by DMA; the stack adds
+ * the headers of each connection when it sends them. Without a free block for the
+ * staging every client is written from RAM.
+ * The clients are taken once, before the first chunk: a client accepted during the
+ * broadcast does not get its tail, and a client that could not take a whole chunk
+ * within IP_WRITE_TIMEOUT (or closed) is skipped for the rest of it.
  * 
  * @param server 
  * @param buf 
  * @param size 
- * @return size_t 
+ * @return size_t sum of the bytes queued on each client
  */
 size_t EthernetServer_writeToAllClients(Ethernet_server *server, const uint8_t *buf, size_t size) {
+    Ethernet_client client;
+    memhandle stage = NOBLOCK;
+    size_t ret = 0, done, chunk, n;
+    uint8_t sock, clients = 0;
+    bool members[IP_CONNS];
+
+    for (sock = 0; sock < IP_CONNS; sock++) {
+        members[sock] = EthernetServer_isClient(server, &ip_ethernet->client_data[sock]);
+        if (members[sock])
+            clients++;
+    }
+    if (clients > 1)
+        stage = MemoryPool_allocBlock(&ip_ethernet->mempool, size < IP_SOCKET_DATALEN ? size : IP_SOCKET_DATALEN);
+
+    if (stage == NOBLOCK) {
+        for (sock = 0; sock < IP_CONNS; sock++) {
+            client.data = &ip_ethernet->client_data[sock];
+            if (members[sock])
+                ret += EthernetClient_write(&client, buf, size);
+        }
+        return ret;
+    }
 
+    for (done = 0; done < size && clients > 0; done += chunk) {
+        chunk = size - done < IP_SOCKET_DATALEN ? size - done : IP_SOCKET_DATALEN;
+        ENC28J60_writePacket(&ip_ethernet->enc28j60, stage, 0, (uint8_t *)buf + done, chunk);
+        for (sock = 0; sock < IP_CONNS; sock++) {
+            client.data = &ip_ethernet->client_data[sock];
+            if (!members[sock])
+                continue;
+            n = EthernetServer_isClient(server, client.data) ? EthernetClient_writeBlock(&client, stage, 0, chunk) : 0;
+            ret += n;
+            if (n < chunk) {
+                // the rest of the stream would reach this client with a hole in it
+                members[sock] = false;
+                clients--;
+            }
+        }
+    }
+    MemoryPool_freeBlock(&ip_ethernet->mempool, stage);
+    return ret;
 }
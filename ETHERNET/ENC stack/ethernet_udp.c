@@ -0,0 +1,500 @@
+/**
+ * @file ethernet_udp.c
+ * @author Jose Roberto Parra Trewartha (uedsoldier1990@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2021-11-16
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#include "ethernet.h"
+#include "ethernet_udp.h"
+
+#define UDPBUF ((struct ip_udpip_hdr *)&ip_buf[IP_LLH_LEN])
+#define ETH_HDR ((struct ip_eth_hdr *)&ip_buf[0])
+
+/**
+ * @brief Folds an offset that may run past the end of the receive ring.
+ * 
+ * @param pos less than 2 * IP_UDP_RXRING
+ * @return memaddress
+ */
+static memaddress EthernetUDP_ringWrap(memaddress pos) {
+    return pos >= IP_UDP_RXRING ? pos - IP_UDP_RXRING : pos;
+}
+
+/**
+ * @brief Reads from the receive ring, the second part of data that wraps around is
+ * read from the start of the block.
+ * 
+ * @param u 
+ * @param pos 
+ * @param buf 
+ * @param len 
+ */
+static void EthernetUDP_ringRead(uip_udp_userdata_t *u, memaddress pos, uint8_t *buf, uint16_t len) {
+    memaddress first = IP_UDP_RXRING - pos;
+
+    if (len > first) {
+        ENC28J60_readPacket(&ip_ethernet->enc28j60, u->packet_ring, pos, buf, first);
+        buf += first;
+        len -= first;
+        pos = 0;
+    }
+    ENC28J60_readPacket(&ip_ethernet->enc28j60, u->packet_ring, pos, buf, len);
+}
+
+/**
+ * @brief Writes to the receive ring, wrapping around like EthernetUDP_ringRead().
+ * 
+ * @param u 
+ * @param pos 
+ * @param buf 
+ * @param len 
+ */
+static void EthernetUDP_ringWrite(uip_udp_userdata_t *u, memaddress pos, uint8_t *buf, uint16_t len) {
+    memaddress first = IP_UDP_RXRING - pos;
+
+    if (len > first) {
+        ENC28J60_writePacket(&ip_ethernet->enc28j60, u->packet_ring, pos, buf, first);
+        buf += first;
+        len -= first;
+        pos = 0;
+    }
+    ENC28J60_writePacket(&ip_ethernet->enc28j60, u->packet_ring, pos, buf, len);
+}
+
+/**
+ * @brief Copies the payload of the received packet into the receive ring, inside the
+ * ENC28J60 buffer.
+ * 
+ * @param u 
+ * @param pos 
+ * @param len 
+ */
+static void EthernetUDP_ringCopy(uip_udp_userdata_t *u, memaddress pos, uint16_t len) {
+    memaddress src;
+    memhandle packet = ip_ethernet_packet_data(ip_ethernet, ((uint8_t *)ip_appdata) - ip_buf, &src);
+    memaddress first = IP_UDP_RXRING - pos;
+
+    if (len > first) {
+        ENC28J60_copyPacket(&ip_ethernet->enc28j60, u->packet_ring, pos, packet, src, first);
+        src += first;
+        len -= first;
+        pos = 0;
+    }
+    ENC28J60_copyPacket(&ip_ethernet->enc28j60, u->packet_ring, pos, packet, src, len);
+}
+
+/**
+ * @brief Queues the received datagram at the tail of the receive ring. It is dropped if
+ * the free space of the ring is too small.
+ * 
+ * @param u 
+ */
+static void EthernetUDP_enqueue(uip_udp_userdata_t *u) {
+    uip_udp_msg_rec_t rec;
+    memaddress tail;
+
+    if (u->packet_ring == NOBLOCK || sizeof(rec) + ip_len > IP_UDP_RXRING - u->ring_used)
+        return;
+    memcpy(&rec.remote_ip, UDPBUF->srcipaddr, sizeof(IP_address));
+    rec.remote_port = htons(UDPBUF->srcport);
+    rec.len = ip_len;
+    tail = EthernetUDP_ringWrap(u->ring_head + u->ring_used);
+    EthernetUDP_ringWrite(u, tail, (uint8_t *)&rec, sizeof(rec));
+    EthernetUDP_ringCopy(u, EthernetUDP_ringWrap(tail + sizeof(rec)), ip_len);
+    u->ring_used += sizeof(rec) + ip_len;
+}
+
+/**
+ * @brief Makes the oldest queued datagram the current one.
+ * 
+ * @param u 
+ * @return int its length, 0 if the ring is empty
+ */
+static int EthernetUDP_nextPacket(uip_udp_userdata_t *u) {
+    uip_udp_msg_rec_t rec;
+
+    if (u->ring_used == 0)
+        return 0;
+    EthernetUDP_ringRead(u, u->ring_head, (uint8_t *)&rec, sizeof(rec));
+    u->remote_ip = rec.remote_ip;
+    u->remote_port = rec.remote_port;
+    u->in_rec = sizeof(rec) + rec.len;
+    u->in_pos = 0;
+    u->in_len = rec.len;
+    return rec.len;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ */
+void EthernetUDP_init(EthernetUDP *udp) {
+    udp->_ip_udp_conn = NULL;
+    memset(&udp->appdata, 0, sizeof(uip_udp_userdata_t));
+}
+
+/**
+ * @brief Starts listening on a local port and allocates the IP_UDP_RXRING bytes
+ * receive ring of the socket.
+ * 
+ * @param udp 
+ * @param port 
+ * @return uint8_t 1 if successful, 0 if there are no sockets or memory available
+ */
+uint8_t EthernetUDP_begin(EthernetUDP *udp, uint16_t port) {
+    if (!udp->_ip_udp_conn)
+        udp->_ip_udp_conn = ip_udp_new(NULL, 0);
+    if (!udp->_ip_udp_conn)
+        return 0;
+    if (udp->appdata.packet_ring == NOBLOCK) {
+        udp->appdata.packet_ring = MemoryPool_allocBlock(&ip_ethernet->mempool, IP_UDP_RXRING);
+        udp->appdata.ring_head = 0;
+        udp->appdata.ring_used = 0;
+        udp->appdata.in_rec = 0;
+        if (udp->appdata.packet_ring == NOBLOCK) {
+            EthernetUDP_stop(udp);
+            return 0;
+        }
+    }
+    ip_udp_bind(udp->_ip_udp_conn, htons(port));
+    udp->_ip_udp_conn->appstate = &udp->appdata;
+    return 1;
+}
+
+/**
+ * @brief Closes the socket, unread datagrams are dropped.
+ * 
+ * @param udp 
+ */
+void EthernetUDP_stop(EthernetUDP *udp) {
+    if (udp->_ip_udp_conn) {
+        ip_udp_remove(udp->_ip_udp_conn);
+        udp->_ip_udp_conn->appstate = NULL;
+        udp->_ip_udp_conn = NULL;
+    }
+    MemoryPool_freeBlock(&ip_ethernet->mempool, udp->appdata.packet_ring);
+    MemoryPool_freeBlock(&ip_ethernet->mempool, udp->appdata.packet_out);
+    memset(&udp->appdata, 0, sizeof(uip_udp_userdata_t));
+}
+
+/**
+ * @brief Starts building up a datagram to the given host. A socket that was not
+ * started with EthernetUDP_begin() gets an ephemeral local port.
+ * 
+ * @param udp 
+ * @param ip 
+ * @param port 
+ * @return int 1 if successful, 0 if there are no sockets or memory available
+ */
+int EthernetUDP_beginPacket(EthernetUDP *udp, IP_address ip, uint16_t port) {
+    if (!udp->_ip_udp_conn) {
+        udp->_ip_udp_conn = ip_udp_new(NULL, 0);
+        if (!udp->_ip_udp_conn)
+            return 0;
+        udp->_ip_udp_conn->appstate = &udp->appdata;
+    }
+    if (udp->appdata.packet_out == NOBLOCK) {
+        udp->appdata.packet_out = MemoryPool_allocBlock(&ip_ethernet->mempool, IP_UDP_MAXDATALEN);
+        udp->appdata.out_pos = 0;
+        if (udp->appdata.packet_out == NOBLOCK)
+            return 0;
+    }
+    udp->appdata.remote_ip = ip;
+    udp->appdata.remote_port = port;
+    return 1;
+}
+
+/**
+ * @brief Sends the datagram built up since EthernetUDP_beginPacket().
+ * 
+ * @param udp 
+ * @return int 1 if the datagram was sent, 0 if there was an error
+ */
+int EthernetUDP_endPacket(EthernetUDP *udp) {
+    bool sent = false;
+
+    if (!udp->_ip_udp_conn || udp->appdata.packet_out == NOBLOCK)
+        return 0;
+    udp->appdata.send = true;
+    ip_udp_periodic_conn(udp->_ip_udp_conn);
+    udp->appdata.send = false;
+    // accept datagrams from any peer again
+    udp->_ip_udp_conn->rport = 0;
+    memset(&udp->_ip_udp_conn->ripaddr, 0, sizeof(IP_address));
+    if (ip_len > 0) {
+        ip_arp_out();
+        // a datagram to an unresolved host is replaced by an ARP request and lost
+        sent = ETH_HDR->type == HTONS(IP_ETHTYPE_IP);
+        sent = ip_ethernet_network_send(ip_ethernet) && sent;
+    }
+    // the payload has been gathered into the frame
+    MemoryPool_freeBlock(&ip_ethernet->mempool, udp->appdata.packet_out);
+    udp->appdata.packet_out = NOBLOCK;
+    return sent;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @param buffer 
+ * @param size 
+ * @return size_t number of bytes added to the datagram
+ */
+size_t EthernetUDP_write(EthernetUDP *udp, const uint8_t *buffer, size_t size) {
+    uint16_t written;
+
+    if (udp->appdata.packet_out == NOBLOCK)
+        return 0;
+    written = ENC28J60_writePacket(&ip_ethernet->enc28j60, udp->appdata.packet_out, udp->appdata.out_pos, (uint8_t *)buffer, size);
+    udp->appdata.out_pos += written;
+    return written;
+}
+
+/**
+ * @brief Drops what is left of the current datagram and makes the next queued one
+ * current.
+ * 
+ * @param udp 
+ * @return int its length, 0 if no datagram is available
+ */
+int EthernetUDP_parsePacket(EthernetUDP *udp) {
+    EthernetUDP_discardReceived(udp);
+    Ethernetick(ip_ethernet);
+    return EthernetUDP_nextPacket(&udp->appdata);
+}
+
+/**
+ * @brief EthernetUDP_parsePacket() without running Ethernetick(), for clients that are
+ * run from Ethernetick() itself.
+ * 
+ * @param udp 
+ * @return int length of the datagram made current, 0 if none is queued
+ */
+int EthernetUDP_parseQueued(EthernetUDP *udp) {
+    EthernetUDP_discardReceived(udp);
+    return EthernetUDP_nextPacket(&udp->appdata);
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @return int number of bytes left in the current datagram
+ */
+int EthernetUDP_available(EthernetUDP *udp) {
+    return udp->appdata.in_rec ? udp->appdata.in_len - udp->appdata.in_pos : 0;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @return int the next byte of the current datagram, -1 if none is left
+ */
+int EthernetUDP_readByte(EthernetUDP *udp) {
+    uint8_t c;
+
+    if (EthernetUDP_read(udp, &c, 1) == 1)
+        return c;
+    return -1;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @param buffer 
+ * @param len 
+ * @return int number of bytes read from the current datagram
+ */
+int EthernetUDP_read(EthernetUDP *udp, uint8_t *buffer, size_t len) {
+    uip_udp_userdata_t *u = &udp->appdata;
+    int n = EthernetUDP_available(udp);
+
+    if ((size_t)n > len)
+        n = len;
+    if (n > 0) {
+        EthernetUDP_ringRead(u, EthernetUDP_ringWrap(u->ring_head + sizeof(uip_udp_msg_rec_t) + u->in_pos), buffer, n);
+        u->in_pos += n;
+    }
+    return n;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @return int the next byte of the current datagram without consuming it, -1 if none is left
+ */
+int EthernetUDP_peek(EthernetUDP *udp) {
+    uip_udp_userdata_t *u = &udp->appdata;
+    uint8_t c;
+
+    if (EthernetUDP_available(udp) == 0)
+        return -1;
+    EthernetUDP_ringRead(u, EthernetUDP_ringWrap(u->ring_head + sizeof(uip_udp_msg_rec_t) + u->in_pos), &c, 1);
+    return c;
+}
+
+/**
+ * @brief Releases the ring space of the current datagram.
+ * 
+ * @param udp 
+ */
+void EthernetUDP_discardReceived(EthernetUDP *udp) {
+    uip_udp_userdata_t *u = &udp->appdata;
+
+    if (u->in_rec) {
+        u->ring_head = EthernetUDP_ringWrap(u->ring_head + u->in_rec);
+        u->ring_used -= u->in_rec;
+        u->in_rec = 0;
+        u->in_pos = 0;
+        u->in_len = 0;
+    }
+}
+
+/**
+ * @brief Receives up to vlen queued datagrams in one call, like recvmmsg(). The current
+ * datagram of EthernetUDP_parsePacket() is dropped first.
+ * 
+ * @param udp 
+ * @param msgs buf and size of each entry must be set by the caller
+ * @param vlen 
+ * @return uint8_t number of entries filled in
+ */
+uint8_t EthernetUDP_recvmmsg(EthernetUDP *udp, EthernetUDP_msg_t *msgs, uint8_t vlen) {
+    uip_udp_userdata_t *u = &udp->appdata;
+    uint8_t n;
+
+    EthernetUDP_discardReceived(udp);
+    Ethernetick(ip_ethernet);
+    for (n = 0; n < vlen && u->ring_used > 0; n++) {
+        msgs[n].len = EthernetUDP_nextPacket(u);
+        msgs[n].remote_ip = u->remote_ip;
+        msgs[n].remote_port = u->remote_port;
+        EthernetUDP_read(udp, msgs[n].buf, msgs[n].size);
+        EthernetUDP_discardReceived(udp);
+    }
+    return n;
+}
+
+/**
+ * @brief Sends up to vlen datagrams back-to-back, like sendmmsg(). The payloads are
+ * gathered from RAM straight into the transmit blocks and queued on the controller
+ * without waiting for the previous frame. The ARP table is looked up once for a run of
+ * datagrams to the same host; if the host is not resolved yet a single ARP request is
+ * sent and the datagrams to it are dropped, as EthernetUDP_endPacket() would.
+ * 
+ * @param udp 
+ * @param msgs buf, len, remote_ip and remote_port of each entry must be set by the caller
+ * @param vlen 
+ * @return uint8_t number of datagrams handed to the controller
+ */
+uint8_t EthernetUDP_sendmmsg(EthernetUDP *udp, const EthernetUDP_msg_t *msgs, uint8_t vlen) {
+    struct ip_eth_addr dest;
+    IP_address resolved, missed;
+    bool have_resolved = false, have_missed = false;
+    uint8_t n, sent = 0;
+
+    if (!udp->_ip_udp_conn) {
+        udp->_ip_udp_conn = ip_udp_new(NULL, 0);
+        if (!udp->_ip_udp_conn)
+            return 0;
+        udp->_ip_udp_conn->appstate = &udp->appdata;
+    }
+    for (n = 0; n < vlen; n++) {
+        if (have_missed && memcmp(&missed, &msgs[n].remote_ip, sizeof(IP_address)) == 0)
+            continue;
+        udp->appdata.send_msg = &msgs[n];
+        udp->appdata.send = true;
+        ip_udp_periodic_conn(udp->_ip_udp_conn);
+        udp->appdata.send = false;
+        udp->appdata.send_msg = NULL;
+        if (ip_len == 0)
+            continue;
+
+        if (have_resolved && memcmp(&resolved, &msgs[n].remote_ip, sizeof(IP_address)) == 0) {
+            // same host as the previous datagram: reuse its Ethernet header
+            memcpy(ETH_HDR->dest.addr, dest.addr, 6);
+            memcpy(ETH_HDR->src.addr, ip_ethaddr.addr, 6);
+            ETH_HDR->type = HTONS(IP_ETHTYPE_IP);
+            ip_len += IP_LLH_LEN;
+        } else {
+            ip_arp_out();
+            if (ETH_HDR->type == HTONS(IP_ETHTYPE_ARP)) {
+                // the datagram became an ARP request, the others to this host are dropped
+                missed = msgs[n].remote_ip;
+                have_missed = true;
+                ip_ethernet_network_send(ip_ethernet);
+                continue;
+            }
+            resolved = msgs[n].remote_ip;
+            dest = ETH_HDR->dest;
+            have_resolved = true;
+        }
+        if (ip_ethernet_network_send(ip_ethernet))
+            sent++;
+    }
+    // accept datagrams from any peer again
+    udp->_ip_udp_conn->rport = 0;
+    memset(&udp->_ip_udp_conn->ripaddr, 0, sizeof(IP_address));
+    return sent;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @return IP_address the source of the current datagram
+ */
+IP_address EthernetUDP_remoteIP(EthernetUDP *udp) {
+    return udp->appdata.remote_ip;
+}
+
+/**
+ * @brief 
+ * 
+ * @param udp 
+ * @return uint16_t the source port of the current datagram
+ */
+uint16_t EthernetUDP_remotePort(EthernetUDP *udp) {
+    return udp->appdata.remote_port;
+}
+
+/**
+ * @brief UDP application callback of the IP stack.
+ * 
+ */
+void ipudp_appcall(void) {
+    uip_udp_userdata_t *u = (uip_udp_userdata_t *)ip_udp_conn->appstate;
+
+    if (!u)
+        return;
+    if (ip_newdata())
+        EthernetUDP_enqueue(u);
+    if (ip_poll() && u->send && u->send_msg) {
+        ip_udp_conn->rport = htons(u->send_msg->remote_port);
+        ip_udp_conn->ripaddr = u->send_msg->remote_ip;
+        ip_ethernet->udp_chain.next = NULL;
+        ip_ethernet->udp_chain.len = u->send_msg->len;
+        ip_ethernet->udp_chain.type = IP_PBUF_RAM;
+        ip_ethernet->udp_chain.data.ptr = u->send_msg->buf;
+        ip_send_chain(&ip_ethernet->udp_chain);
+    } else if (ip_poll() && u->send) {
+        ip_udp_conn->rport = htons(u->remote_port);
+        ip_udp_conn->ripaddr = u->remote_ip;
+        ip_ethernet->udp_chain.next = NULL;
+        ip_ethernet->udp_chain.len = u->out_pos;
+        ip_ethernet->udp_chain.type = IP_PBUF_BLOCK;
+        ip_ethernet->udp_chain.data.block.handle = u->packet_out;
+        ip_ethernet->udp_chain.data.block.pos = 0;
+        ip_send_chain(&ip_ethernet->udp_chain);
+    }
+}
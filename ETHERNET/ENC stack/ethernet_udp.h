@@ -1,9 +1,20 @@
+/**
+ * @file ethernet_udp.h
+ * @author Jose Roberto Parra Trewartha (uedsoldier1990@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2021-11-16
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
 #ifndef IPUDP_H
 #define IPUDP_H
 
-//#include "udp.h"
 #include "utilities/mempool.h"
 #include "utilities/util.h"
+#include "utilities/ip.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -11,109 +22,84 @@
 #define IP_UDP_PHYH_LEN IP_LLH_LEN + IP_IPUDPH_LEN
 #define IP_UDP_MAXPACKETSIZE IP_UDP_MAXDATALEN + IP_UDP_PHYH_LEN
 
+/**
+ * @brief Record header stored in the receive ring ahead of every datagram.
+ * 
+ */
 typedef struct
 {
-	memhandle packet;
 	IP_address remote_ip;
-	uint16_t remote_port;
+	uint16_t remote_port; // host byte order
+	uint16_t len;
 } uip_udp_msg_rec_t;
 
+/**
+ * @brief Per socket state. Received datagrams are queued in packet_ring, a memory pool
+ * block of IP_UDP_RXRING bytes used as a ring of uip_udp_msg_rec_t records each followed
+ * by its payload, so the backlog is bounded by bytes rather than by a number of packets.
+ * The datagram being read stays at ring_head until the next one is parsed.
+ */
 typedef struct
 {
 	memaddress out_pos;
-	uip_udp_msg_rec_t packet_next[IP_UDP_BACKLOG];
-	memhandle packet_in;
+	memhandle packet_ring;
+	memaddress ring_head;  // offset of the oldest record
+	memaddress ring_used;  // bytes taken by the queued records
+	memaddress in_rec;     // size of the record being read, 0 if none
+	memaddress in_pos;     // read position in its payload
+	memaddress in_len;
 	memhandle packet_out;
 	bool send;
+	const struct EthernetUDP_msg *send_msg; // datagram of EthernetUDP_sendmmsg() being sent, NULL for packet_out
 	IP_address remote_ip;
-	uint16_t remote_port;
+	uint16_t remote_port;  // host byte order
 } uip_udp_userdata_t;
 
-class EthernetUDP : public UDP
+/**
+ * @brief 
+ * 
+ */
+typedef struct
 {
-
-private:
-	struct uip_udp_conn *_uip_udp_conn;
-
+	struct ip_udp_conn *_ip_udp_conn;
 	uip_udp_userdata_t appdata;
-
-public:
-	EthernetUDP(); // Constructor
-	uint8_t
-		begin(uint16_t); // initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
-	void
-	stop(); // Finish with the UDP socket
-
-	// Sending UDP packets
-
-	// Start building up a packet to send to the remote host specific in ip and port
-	// Returns 1 if successful, 0 if there was a problem with the supplied IP address or port
-	int
-	beginPacket(IP_address ip, uint16_t port);
-	// Start building up a packet to send to the remote host specific in host and port
-	// Returns 1 if successful, 0 if there was a problem resolving the hostname or port
-	int
-	beginPacket(const char *host, uint16_t port);
-	// Finish off this packet and send it
-	// Returns 1 if the packet was sent successfully, 0 if there was an error
-	int
-	endPacket();
-	// Write a single byte into the packet
-	size_t
-		write(uint8_t);
-	// Write size bytes from buffer into the packet
-	size_t
-	write(const uint8_t *buffer, size_t size);
-	// flush() should send the data, but here endPacket does it
-	void
-	flush(){}; // in Print it is empty, UDP makes it pure virtual
-
-	using Print::write;
-
-	// Start processing the next available incoming packet
-	// Returns the size of the packet in bytes, or 0 if no packets are available
-	int
-	parsePacket();
-	// Number of bytes remaining in the current packet
-	int
-	available();
-	// Read a single byte from the current packet
-	int
-	read();
-	// Read up to len bytes from the current packet and place them into buffer
-	// Returns the number of bytes read, or 0 if none are available
-	int
-	read(unsigned char *buffer, size_t len);
-	// Read up to len characters from the current packet and place them into buffer
-	// Returns the number of characters read, or 0 if none are available
-	int
-	read(char *buffer, size_t len)
-	{
-		return read((unsigned char *)buffer, len);
-	};
-	// Return the next byte from the current packet without moving on to the next byte
-	int
-	peek();
-	void
-	discardReceived(); // former flush
-
-	// Return the IP address of the host who sent the current incoming packet
-	IP_address
-	remoteIP();
-
-	// Return the port of the host who sent the current incoming packet
-	uint16_t
-	remotePort();
-
-private:
-	friend void uipudp_appcall(void);
-
-	friend class UIPEthernetClass;
-	static void _send(struct uip_udp_conn *uip_udp_conn);
-
-	static uint8_t _newBlock(uip_udp_msg_rec_t *blocks);
-	static void _moveBlocks(uip_udp_msg_rec_t *blocks);
-	static void _flushBlocks(uip_udp_msg_rec_t *blocks);
-};
-
-#endif /* IPUDP_H */
\ No newline at end of file
+} EthernetUDP;
+
+/**
+ * @brief One datagram returned by EthernetUDP_recvmmsg(). The caller sets buf and size,
+ * len is the length of the datagram, it is truncated to size if it is larger.
+ * For EthernetUDP_sendmmsg() the caller sets buf, len and the destination, size is unused.
+ * 
+ */
+typedef struct EthernetUDP_msg
+{
+	uint8_t *buf;
+	uint16_t size;
+	uint16_t len;
+	IP_address remote_ip;
+	uint16_t remote_port;
+} EthernetUDP_msg_t;
+
+// Funciones
+void EthernetUDP_init(EthernetUDP *udp);
+uint8_t EthernetUDP_begin(EthernetUDP *udp, uint16_t port);
+void EthernetUDP_stop(EthernetUDP *udp);
+
+int EthernetUDP_beginPacket(EthernetUDP *udp, IP_address ip, uint16_t port);
+int EthernetUDP_endPacket(EthernetUDP *udp);
+size_t EthernetUDP_write(EthernetUDP *udp, const uint8_t *buffer, size_t size);
+
+int EthernetUDP_parsePacket(EthernetUDP *udp);
+int EthernetUDP_parseQueued(EthernetUDP *udp);
+int EthernetUDP_available(EthernetUDP *udp);
+int EthernetUDP_readByte(EthernetUDP *udp);
+int EthernetUDP_read(EthernetUDP *udp, uint8_t *buffer, size_t len);
+int EthernetUDP_peek(EthernetUDP *udp);
+void EthernetUDP_discardReceived(EthernetUDP *udp);
+uint8_t EthernetUDP_recvmmsg(EthernetUDP *udp, EthernetUDP_msg_t *msgs, uint8_t vlen);
+uint8_t EthernetUDP_sendmmsg(EthernetUDP *udp, const EthernetUDP_msg_t *msgs, uint8_t vlen);
+
+IP_address EthernetUDP_remoteIP(EthernetUDP *udp);
+uint16_t EthernetUDP_remotePort(EthernetUDP *udp);
+
+#endif /* IPUDP_H */
@@ -0,0 +1,49 @@
+/*
+ * Delayed ACK benchmark
+ *
+ * Bulk transfer from a peer to the stack: the peer sends BURST
+ * full-sized segments every millisecond. Reports the frames the stack
+ * sends back, with and without IP_TCP_DELACK.
+ */
+
+#include "bench_tcp.h"
+
+#define SEGMENTS 4000
+#ifndef BURST
+#define BURST    2
+#endif
+
+static void
+appcall(void)
+{
+}
+
+int
+main(void)
+{
+  struct bench_peer peer = {0};
+  uint32_t frames, i, b;
+
+  bench_init();
+  ip_listen(HTONS(80));
+  peer.port = 3000;
+  peer.wnd = 8192;
+  bench_app = appcall;
+  if(bench_connect(&peer, 80, 1460, 0xff) == NULL) {
+    return 1;
+  }
+
+  frames = bench_frames;
+  for(i = 0; i < SEGMENTS; i += BURST) {
+    for(b = 0; b < BURST; ++b) {
+      bench_seg_in(&peer, TCP_ACK, 1460, NULL, 0);
+    }
+    bench_advance(1);
+  }
+  bench_advance(1000);
+  frames = bench_frames - frames;
+
+  printf("delack=%d burst=%d: %u frames for %u segments, %.3f frames/KB\n",
+         IP_TCP_DELACK, BURST, frames, SEGMENTS, frames * 1024.0 / (SEGMENTS * 1460.0));
+  return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Demultiplexing benchmark
+ *
+ * Time to find the connection of a pure ACK and process it with
+ * IP_CONNS connections open. The ACKs alternate between the first two
+ * connections opened: new connections are linked at the head of their
+ * chain, so with a single bucket (IP_CONF_CONN_HASH_SIZE 1) these are
+ * the last ones found, the worst case of a linear search.
+ */
+
+#include "bench_tcp.h"
+#include <time.h>
+
+#define ITERATIONS 500000
+#define ROUNDS     7
+
+static struct bench_peer peers[IP_CONNS];
+
+int
+main(void)
+{
+  struct timespec t0, t1;
+  double ns, d;
+  long k;
+  int i, r, open = 0;
+
+  bench_init();
+  ip_listen(HTONS(80));
+  for(i = 0; i < IP_CONNS; ++i) {
+    peers[i].port = 2000 + i;
+    peers[i].wnd = 4096;
+    if(bench_connect(&peers[i], 80, 1460, 0xff) != NULL) {
+      ++open;
+    }
+  }
+
+  ns = 1e9;
+  for(r = 0; r < ROUNDS; ++r) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(k = 0; k < ITERATIONS; ++k) {
+      bench_seg_in(&peers[k & 1], TCP_ACK, 0, NULL, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    d = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ITERATIONS;
+    if(d < ns) {
+      ns = d;
+    }
+  }
+  printf("conns=%d open=%d ns/segment=%.1f\n", IP_CONNS, open, ns);
+  return open == IP_CONNS ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+/*
+ * Host build of the stack for the benchmarks
+ *
+ * Force-included (-include bench_host.h) in front of every file of the
+ * host build. Provides what the Arduino core and the port otherwise
+ * define: byte order, the clock, random(), the IPv4 address macros and
+ * the SPI bus.
+ */
+
+#ifndef __BENCH_HOST_H__
+#define __BENCH_HOST_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTONS(n) ((uint16_t)((((uint16_t)(n) & 0xff) << 8) | (((uint16_t)(n) & 0xff00) >> 8)))
+#define ntohs htons
+uint16_t htons(uint16_t val);
+
+uint32_t millis(void);
+uint32_t micros(void);
+
+#define random(a, b) 0
+
+/* ip.c passes the addresses either by value or through a pointer */
+#define BENCH_IPADDR(x) (sizeof(x) == 4 ? (void *)&(x) : *(void **)&(x))
+#define ip_ipaddr_copy(dest, src) memcpy(BENCH_IPADDR(dest), BENCH_IPADDR(src), 4)
+#define ip_ipaddr_cmp(addr1, addr2) (memcmp(BENCH_IPADDR(addr1), BENCH_IPADDR(addr2), 4) == 0)
+
+#define DEBUG_PRINTF(...)
+
+/* the SPI bus of the ENC28J60 driver, fake_enc28j60.c puts a
+   simulated controller on it */
+struct bench_spi {
+  void (*begin)(void);
+  void (*beginTransaction)(int settings);
+  void (*endTransaction)(void);
+  uint8_t (*transfer)(uint8_t data);
+};
+extern const struct bench_spi SPI;
+#define SPI_ETHERNET_SETTINGS 0
+
+#define OUTPUT 1
+#define LOW    0
+#define HIGH   1
+#define csPin  10
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+#define CSACTIVE  digitalWrite(csPin, LOW)
+#define CSPASSIVE digitalWrite(csPin, HIGH)
+
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+/* the glue of ethernet.h, bench_tcp.c stands in for it */
+struct ip_conn;
+void ip_ethernet_output(void);
+uint32_t ip_ethernet_rcvwnd(struct ip_conn *conn);
+uint16_t ip_ethernet_pbuf_chksum(uint16_t sum, uint8_t handle, uint16_t pos, uint16_t len);
+
+#endif /* __BENCH_HOST_H__ */
@@ -0,0 +1,101 @@
+/*
+ * In-flight goodput benchmark
+ *
+ * Bulk transfer from the stack to a peer over a simulated 10 Mbit/s
+ * link with a 1 ms one-way delay. The peer acknowledges every segment
+ * on arrival and the application writes whenever the stack takes data.
+ * Reports the goodput for IP_TCP_MAX_INFLIGHT segments in flight.
+ */
+
+#include "bench_tcp.h"
+
+#define LINK_BYTES_PER_MS 1250
+#define DELAY_MS          1
+#define RUN_MS            2000
+#define ACKS              256
+
+static uint8_t data[1460];
+static struct ip_conn *conn;
+static struct bench_peer peer;
+
+/* ACKs on their way back to the stack */
+static struct {
+  uint32_t at, ack;
+} acks[ACKS];
+static unsigned ahead, atail;
+static uint32_t link_free;   /* time (in us) the link is idle again */
+
+static void
+appcall(void)
+{
+  if(ip_rexmit()) {
+    ip_send(data, ip_conn->seglen[0]);
+  } else if(ip_connected() || ip_acked() || ip_poll()) {
+    ip_send(data, sizeof(data));
+  }
+}
+
+/* A data segment left: it reaches the peer after serialization and the
+   delay, its ACK comes back after another delay. */
+static void
+sent(void)
+{
+  uint32_t now = bench_now * 1000;
+
+  if(link_free < now) {
+    link_free = now;
+  }
+  link_free += (bench_out_len + 54) * 1000 / LINK_BYTES_PER_MS;
+  acks[atail % ACKS].at = link_free / 1000 + 2 * DELAY_MS;
+  acks[atail % ACKS].ack = bench_out_seq + bench_out_len;
+  ++atail;
+}
+
+int
+main(void)
+{
+  uint32_t acked0, acked, frames;
+
+  bench_init();
+  ip_listen(HTONS(80));
+  peer.port = 3000;
+  peer.wnd = 8192;
+  bench_app = appcall;
+  conn = bench_connect(&peer, 80, 1460, 0xff);
+  if(conn == NULL) {
+    return 1;
+  }
+  if(bench_out_len > 0) {
+    sent();
+  }
+  acked0 = peer.ack;
+
+  while(bench_now < RUN_MS) {
+    while(ahead != atail && acks[ahead % ACKS].at <= bench_now) {
+      peer.ack = acks[ahead % ACKS].ack;
+      ++ahead;
+      frames = bench_frames;
+      bench_seg_in(&peer, TCP_ACK, 0, NULL, 0);
+      if(bench_frames != frames && bench_out_len > 0) {
+        sent();
+      }
+    }
+    for(;;) {
+      frames = bench_frames;
+      ip_poll_conn(conn);
+      if(ip_len > 0) {
+        bench_out();
+      }
+      if(bench_frames == frames || bench_out_len == 0) {
+        break;
+      }
+      sent();
+    }
+    bench_advance(1);
+  }
+
+  acked = peer.ack - acked0;
+  printf("inflight=%d goodput %.2f Mbit/s (%u bytes acked in %u ms)\n",
+         IP_TCP_MAX_INFLIGHT, acked * 8.0 / RUN_MS / 1000, acked, RUN_MS);
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Simulated TCP peer for the host benchmarks
+ */
+
+#include "bench_tcp.h"
+
+uint32_t bench_now = 1;
+void (*bench_app)(void);
+
+uint32_t bench_frames, bench_bytes, bench_acks;
+
+uint32_t bench_out_seq, bench_out_ack;
+uint16_t bench_out_len, bench_out_wnd;
+uint8_t bench_out_flags, bench_out_opts[40], bench_out_optlen;
+
+#define BUF ((struct ip_tcpip_hdr *)&ip_buf[IP_LLH_LEN])
+
+/*---------------------------------------------------------------------------*/
+/* What the port and the sketch provide on the target. */
+uint32_t
+millis(void)
+{
+  return bench_now;
+}
+
+uint32_t
+micros(void)
+{
+  return bench_now * 1000;
+}
+
+void
+ip6_input(void)
+{
+  ip_len = 0;
+}
+
+uint16_t
+ip_ethernet_pbuf_chksum(uint16_t sum, uint8_t handle, uint16_t pos, uint16_t len)
+{
+  (void)handle;
+  (void)pos;
+  (void)len;
+  return sum;
+}
+
+uint32_t
+ip_ethernet_rcvwnd(struct ip_conn *conn)
+{
+  (void)conn;
+  return 4 * 1460;
+}
+
+void
+ipclient_appcall(void)
+{
+  if(bench_app) {
+    bench_app();
+  }
+}
+
+void
+ipudp_appcall(void)
+{
+}
+
+void
+ip_ethernet_output(void)
+{
+  if(ip_len > 0) {
+    bench_out();
+  }
+}
+/*---------------------------------------------------------------------------*/
+static uint32_t
+get32(const uint8_t *b)
+{
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static void
+put32(uint8_t *b, uint32_t v)
+{
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+}
+/*---------------------------------------------------------------------------*/
+void
+bench_out(void)
+{
+  uint8_t hlen = (BUF->tcpoffset >> 4) * 4;
+
+  bench_frames++;
+  bench_out_seq = get32(BUF->seqno);
+  bench_out_ack = get32(BUF->ackno);
+  bench_out_flags = BUF->flags;
+  bench_out_wnd = (BUF->wnd[0] << 8) | BUF->wnd[1];
+  bench_out_len = ip_len - IP_IPH_LEN - hlen;
+  bench_out_optlen = hlen - IP_TCPH_LEN;
+  memcpy(bench_out_opts, BUF->optdata, bench_out_optlen);
+  bench_bytes += bench_out_len;
+  if(bench_out_len == 0 && !(bench_out_flags & (TCP_SYN | TCP_FIN))) {
+    bench_acks++;
+  }
+  ip_len = 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+bench_seg_in(struct bench_peer *p, uint8_t flags, uint16_t datalen, const uint8_t *opts, uint8_t optlen)
+{
+  uint16_t len = IP_IPTCPH_LEN + optlen + datalen;
+  uint32_t wnd = p->wnd;
+
+  memset(ip_buf, 0, IP_LLH_LEN + IP_IPTCPH_LEN + optlen);
+  BUF->vhl = 0x45;
+  BUF->len[0] = len >> 8;
+  BUF->len[1] = len & 0xff;
+  BUF->ttl = 64;
+  BUF->proto = IP_PROTO_TCP;
+  BUF->srcipaddr[0] = HTONS(0x0a00);   /* 10.0.0.2 */
+  BUF->srcipaddr[1] = HTONS(0x0002);
+  memcpy(BUF->destipaddr, &ip_hostaddr, 4);
+  BUF->srcport = HTONS(p->port);
+  BUF->destport = HTONS(p->lport);
+  put32(BUF->seqno, p->seq);
+  put32(BUF->ackno, p->ack);
+  BUF->tcpoffset = ((IP_TCPH_LEN + optlen) / 4) << 4;
+  BUF->flags = flags;
+  if(!(flags & TCP_SYN) && p->wscale != 0xff) {
+    wnd >>= p->wscale;
+  }
+  if(wnd > 0xffff) {
+    wnd = 0xffff;
+  }
+  BUF->wnd[0] = wnd >> 8;
+  BUF->wnd[1] = wnd & 0xff;
+  if(optlen > 0) {
+    memcpy(BUF->optdata, opts, optlen);
+  }
+  memset(BUF->optdata + optlen, 0, datalen);
+
+  ip_len = len;
+  BUF->ipchksum = 0;
+  BUF->ipchksum = ~(ip_ipchksum());
+  BUF->tcpchksum = 0;
+  BUF->tcpchksum = ~(ip_tcpchksum());
+  ip_len = IP_LLH_LEN + len;
+
+  p->seq += datalen + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+  ip_input();
+  if(ip_len > 0) {
+    bench_out();
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+bench_init(void)
+{
+  IP_address addr;
+
+  addr.ipv4_word = 0x0100000a;   /* 10.0.0.1 */
+  ip_init();
+  ip_sethostaddr(addr);
+#if IP_TIMERS
+  ip_timer_init();
+#endif /* IP_TIMERS */
+}
+/*---------------------------------------------------------------------------*/
+struct ip_conn *
+bench_connect(struct bench_peer *p, uint16_t lport, uint16_t mss, uint8_t wscale)
+{
+  uint8_t opts[8] = {TCP_OPT_MSS, TCP_OPT_MSS_LEN, mss >> 8, mss & 0xff,
+                     TCP_OPT_NOOP, TCP_OPT_WS, TCP_OPT_WS_LEN, wscale};
+  int c;
+
+  p->lport = lport;
+  p->seq = 1000;
+  p->wscale = wscale;
+  bench_seg_in(p, TCP_SYN, 0, opts, wscale == 0xff ? 4 : 8);
+  p->ack = bench_out_seq + 1;
+  bench_seg_in(p, TCP_ACK, 0, NULL, 0);
+  for(c = 0; c < IP_CONNS; ++c) {
+    if(ip_conns[c].tcpstateflags != IP_CLOSED && ip_conns[c].rport == HTONS(p->port)) {
+      return &ip_conns[c];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+void
+bench_advance(uint32_t ms)
+{
+  while(ms--) {
+    bench_now++;
+#if IP_TIMERS
+    ip_timer_run();
+#endif /* IP_TIMERS */
+  }
+}
+/*---------------------------------------------------------------------------*/
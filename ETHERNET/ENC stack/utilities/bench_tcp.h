@@ -0,0 +1,57 @@
+/*
+ * Simulated TCP peer for the host benchmarks
+ *
+ * The peer builds its segments in ip_buf and hands them to ip_input(),
+ * the segments the stack sends are decoded by bench_out(). The clock
+ * only moves with bench_advance().
+ */
+
+#ifndef __BENCH_TCP_H__
+#define __BENCH_TCP_H__
+
+#include "ip.h"
+#include <stdio.h>
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define TCP_OPT_NOOP    1
+#define TCP_OPT_MSS     2
+#define TCP_OPT_MSS_LEN 4
+#define TCP_OPT_WS      3
+#define TCP_OPT_WS_LEN  3
+
+struct bench_peer {
+  uint16_t port;   /* peer port, host order */
+  uint16_t lport;  /* our port, host order */
+  uint32_t seq;    /* next sequence number the peer sends */
+  uint32_t ack;    /* next sequence number the peer expects from us */
+  uint32_t wnd;    /* window the peer advertises, unscaled */
+  uint8_t wscale;  /* window scale of the peer, 0xff for none */
+};
+
+extern uint32_t bench_now;
+extern void (*bench_app)(void);
+
+/* Counters of the segments the stack sent. */
+extern uint32_t bench_frames, bench_bytes, bench_acks;
+
+/* The last segment the stack sent. */
+extern uint32_t bench_out_seq, bench_out_ack;
+extern uint16_t bench_out_len, bench_out_wnd;
+extern uint8_t bench_out_flags, bench_out_opts[40], bench_out_optlen;
+
+void bench_init(void);
+void bench_advance(uint32_t ms);
+
+/* Sends a segment from the peer, a reply is passed to bench_out(). */
+void bench_seg_in(struct bench_peer *p, uint8_t flags, uint16_t datalen, const uint8_t *opts, uint8_t optlen);
+void bench_out(void);
+
+/* Opens a connection from the peer to a listening port. */
+struct ip_conn *bench_connect(struct bench_peer *p, uint16_t lport, uint16_t mss, uint8_t wscale);
+
+#endif /* __BENCH_TCP_H__ */
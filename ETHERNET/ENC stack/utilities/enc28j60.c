@@ -3,7 +3,32 @@
 #include "enc28j60.h"
 #include "ip.h"
 
-memblock_t receivePkt;
+// the driver was ported from the UIPEthernet class, its members and methods are reached through the enc28j60 argument
+// of every function
+#define spiInitialized (enc28j60->spiInitialized)
+#define nextPacketPtr (enc28j60->nextPacketPtr)
+#define bank (enc28j60->bank)
+#define initSPI() ENC28J60_initSPI(enc28j60)
+#define getrev() ENC28J60_getrev(enc28j60)
+#define readOp(op, address) ENC28J60_readOp(enc28j60, op, address)
+#define writeOp(op, address, data) ENC28J60_writeOp(enc28j60, op, address, data)
+#define setBank(address) ENC28J60_setBank(enc28j60, address)
+#define readReg(address) ENC28J60_readReg(enc28j60, address)
+#define writeReg(address, data) ENC28J60_writeReg(enc28j60, address, data)
+#define writeRegPair(address, data) ENC28J60_writeRegPair(enc28j60, address, data)
+#define phyRead(address) ENC28J60_phyRead(enc28j60, address)
+#define phyWrite(address, data) ENC28J60_phyWrite(enc28j60, address, data)
+#define setERXRDPT() ENC28J60_setERXRDPT(enc28j60)
+#define setReadPtr(handle, position, len) ENC28J60_setReadPtr(enc28j60, handle, position, len)
+#define readBuffer(len, data) ENC28J60_readBuffer(enc28j60, len, data)
+#define writeBuffer(len, data) ENC28J60_writeBuffer(enc28j60, len, data)
+
+// frame counters of the driver, kept in ip_stat.link
+#if IP_STATISTICS == 1
+#define ENC28J60_STAT(s) s
+#else
+#define ENC28J60_STAT(s)
+#endif
 
 void ENC28J60_initSPI(Enc28j60_t *enc28j60) {
     if (spiInitialized)
@@ -14,8 +39,31 @@ void ENC28J60_initSPI(Enc28j60_t *enc28j60) {
     spiInitialized = true;
 }
 
-bool ENC28J60_init(Enc28j60_t *enc28j60, uint8_t *macaddr) {
-    MemoryPool::init(); // 1 byte in between RX_STOP_INIT and pool to allow prepending of controlbyte
+/**
+ * @brief Resets and configures the controller. The transmit buffer memory is handed out through pool, which is
+ * initialized here and must stay valid as long as the controller is used.
+ *
+ * @param enc28j60 
+ * @param pool Memory pool managing the buffer memory outside the receive buffer
+ * @param macaddr 
+ * @return true 
+ * @return false 
+ */
+bool ENC28J60_init(Enc28j60_t *enc28j60, MemoryPool *pool, uint8_t *macaddr) {
+    enc28j60->pool = pool;
+    MemoryPool_init(pool, enc28j60); // 1 byte in between RX_STOP_INIT and pool to allow prepending of controlbyte
+
+    enc28j60->dma_state = ENC28J60_DMA_IDLE;
+    enc28j60->dma_token = ENC28J60_DMA_NOTOKEN;
+    enc28j60->dma_callback = NULL;
+#ifdef ENC28J60_DMA_INTERRUPT
+    enc28j60->dma_irq = false;
+#endif
+    enc28j60->txhead = 0;
+    enc28j60->txcount = 0;
+    enc28j60->txretry = 0;
+    enc28j60->txreset = true;
+    enc28j60->txlast_success = false;
 
     initSPI();
 
@@ -52,7 +100,13 @@ bool ENC28J60_init(Enc28j60_t *enc28j60, uint8_t *macaddr) {
     // 06 08 -- ff ff ff ff ff ff -> ip checksum for theses bytes=f7f9
     // in binary these poitions are:11 0000 0011 1111
     // This is hex 303F->EPMM0=0x3f,EPMM1=0x30
+#if IP_DUALSTACK
+    // IPv6 neighbor solicitations go to the solicited-node multicast MAC 33:33:ff:xx:xx:xx,
+    // so multicast frames are let through as well; ip6_input() drops the ones not for us
+    writeReg(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_MCEN);
+#else
     writeReg(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN);
+#endif
     writeRegPair(EPMM0, 0x303f);
     writeRegPair(EPMCSL, 0xf7f9);
     //
@@ -99,6 +153,7 @@ memhandle ENC28J60_receivePacket(Enc28j60_t *enc28j60) {
     uint8_t rxstat;
     uint16_t len;
 
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 
     // check if a packet has been received and buffered
@@ -140,11 +195,15 @@ memhandle ENC28J60_receivePacket(Enc28j60_t *enc28j60) {
         // need to check this.
         if ((rxstat & 0x80) != 0)
         {
-            receivePkt.begin = readPtr;
-            receivePkt.size = len;
+            enc28j60->receivePkt.begin = readPtr;
+            enc28j60->receivePkt.size = len;
             SPI.endTransaction();
-            return UIP_RECEIVEBUFFERHANDLE;
+            ENC28J60_STAT(++ip_stat.link.recv);
+            if (enc28j60->capture)
+                enc28j60->capture(enc28j60, IP_RECEIVEBUFFERHANDLE, 0, len, false);
+            return IP_RECEIVEBUFFERHANDLE;
         }
+        ENC28J60_STAT(++ip_stat.link.rxerr);
         // Move the RX read pointer to the start of the next received packet
         // This frees the memory we just read out
         setERXRDPT();
@@ -161,24 +220,121 @@ void ENC28J60_setERXRDPT(Enc28j60_t *enc28j60)
 memaddress
 ENC28J60_blockSize(Enc28j60_t *enc28j60, memhandle handle)
 {
-    return handle == NOBLOCK ? 0 : handle == UIP_RECEIVEBUFFERHANDLE ? receivePkt.size
-                                                                     : blocks[handle].size;
+    return handle == NOBLOCK ? 0 : handle == IP_RECEIVEBUFFERHANDLE ? enc28j60->receivePkt.size
+                                                                     : enc28j60->pool->blocks[handle].size;
 }
 
+/**
+ * @brief Sends a packet and waits until it (and every frame queued before it) has left the wire.
+ *
+ * @param enc28j60 
+ * @param handle Block holding the frame, including control byte offset and TSV padding
+ * @return true The frame was transmitted
+ * @return false The transmission failed
+ */
 bool ENC28J60_sendPacket(Enc28j60_t *enc28j60, memhandle handle)
 {
-    memblock *packet = &blocks[handle];
-    uint16_t start = packet->begin;                                   // includes the UIP_SENDBUFFER_OFFSET for control byte
-    uint16_t end = start + packet->size - 1 - UIP_SENDBUFFER_PADDING; // end = start + size - 1 and padding for TSV is no included
+    while (!ENC28J60_queuePacket(enc28j60, handle, NULL))
+        ENC28J60_txPoll(enc28j60);
+    while (!ENC28J60_txPoll(enc28j60))
+        ;
+    return enc28j60->txlast_success;
+}
+
+/**
+ * @brief Queues a packet for transmission and returns without waiting for it. If the transmitter is idle the frame
+ * starts right away, otherwise it is sent back-to-back as soon as the previous one completes, so the next frame can be
+ * prepared in its own block while the current one is on the wire.
+ * The block must not be freed or rewritten until callback reports the completion, memory pool compaction leaves it
+ * in place meanwhile (ENC28J60_txQueued()).
+ *
+ * @param enc28j60 
+ * @param handle Block holding the frame, including control byte offset and TSV padding
+ * @param callback Called from ENC28J60_txPoll() once the frame is sent or dropped, may be NULL
+ * @return true The frame was queued
+ * @return false The TX queue is full, call ENC28J60_txPoll() and retry
+ */
+bool ENC28J60_queuePacket(Enc28j60_t *enc28j60, memhandle handle, ENC28J60_tx_callback_t callback)
+{
+    if (enc28j60->txcount == ENC28J60_TXQUEUE_SIZE)
+        return false;
+
+    if (enc28j60->capture)
+        enc28j60->capture(enc28j60, handle, IP_SENDBUFFER_OFFSET,
+                          enc28j60->pool->blocks[handle].size - IP_SENDBUFFER_OFFSET - IP_SENDBUFFER_PADDING, true);
+    ip_stat_sent();
+    ENC28J60_txdesc_t *desc = &enc28j60->txqueue[(enc28j60->txhead + enc28j60->txcount) % ENC28J60_TXQUEUE_SIZE];
+    desc->handle = handle;
+    desc->callback = callback;
+    if (enc28j60->txcount++ == 0)
+        ENC28J60_txStart(enc28j60);
+    return true;
+}
+
+/**
+ * @brief Installs a capture callback, e.g. a pcap writer, NULL removes it. It runs in the receive and transmit paths,
+ * so it should only copy the frame out.
+ *
+ * @param enc28j60 
+ * @param capture 
+ */
+void ENC28J60_setCapture(Enc28j60_t *enc28j60, ENC28J60_capture_callback_t capture)
+{
+    enc28j60->capture = capture;
+}
+
+/**
+ * @brief Whether a block is queued for transmission (MEMPOOL_MEMBLOCK_PINNED). ETXST/ETXND and the TSV read by
+ * ENC28J60_txPoll() refer to its address until the frame is retired, so the memory pool must not move it.
+ *
+ * @param enc28j60 
+ * @param handle 
+ * @return true 
+ * @return false 
+ */
+bool ENC28J60_txQueued(Enc28j60_t *enc28j60, memhandle handle)
+{
+    uint8_t i;
+
+    for (i = 0; i < enc28j60->txcount; i++)
+    {
+        if (enc28j60->txqueue[(enc28j60->txhead + i) % ENC28J60_TXQUEUE_SIZE].handle == handle)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Number of frames that can still be queued with ENC28J60_queuePacket().
+ *
+ * @param enc28j60 
+ * @return uint8_t 
+ */
+uint8_t ENC28J60_txFree(Enc28j60_t *enc28j60)
+{
+    return ENC28J60_TXQUEUE_SIZE - enc28j60->txcount;
+}
+
+/**
+ * @brief Programs the frame at the head of the TX queue and sets TXRTS.
+ *
+ * @param enc28j60 
+ */
+void ENC28J60_txStart(Enc28j60_t *enc28j60)
+{
+    memblock_t *packet = &enc28j60->pool->blocks[enc28j60->txqueue[enc28j60->txhead].handle];
+    uint16_t start = packet->begin;                                   // includes the IP_SENDBUFFER_OFFSET for control byte
+    uint16_t end = start + packet->size - 1 - IP_SENDBUFFER_PADDING; // end = start + size - 1 and padding for TSV is no included
 
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 
     // write control-byte (if not 0 anyway)
-    writeByte(start, 0);
+    ENC28J60_writeByte(enc28j60, start, 0);
 
 #ifdef ENC28J60DEBUG
     Serial.print("sendPacket(");
-    Serial.print(handle);
+    Serial.print(enc28j60->txqueue[enc28j60->txhead].handle);
     Serial.print(") [");
     Serial.print(start, HEX);
     Serial.print("-");
@@ -186,53 +342,103 @@ bool ENC28J60_sendPacket(Enc28j60_t *enc28j60, memhandle handle)
     Serial.print("]: ");
     for (uint16_t i = start; i <= end; i++)
     {
-        Serial.print(readByte(i), HEX);
+        Serial.print(ENC28J60_readByte(enc28j60, i), HEX);
         Serial.print(" ");
     }
     Serial.println();
 #endif
 
     // TX start
-    writeRegPair(ETXSTL, start);
+    ENC28J60_writeRegPair(enc28j60, ETXSTL, start);
     // Set the TXND pointer to correspond to the packet size given
-    writeRegPair(ETXNDL, end);
+    ENC28J60_writeRegPair(enc28j60, ETXNDL, end);
 
-    bool success = false;
-    // See Rev. B7 Silicon Errata issues 12 and 13
-    for (uint8_t retry = 0; retry < TX_COLLISION_RETRY_COUNT; retry++)
+    // Reset the transmit logic problem. Errata 12
+    // Only needed after a transmit error, a successful frame leaves the TX logic in a clean state
+    if (enc28j60->txreset)
     {
-        // Reset the transmit logic problem. Errata 12
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
-        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
-        writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF | EIR_TXIF);
-
-        // send the contents of the transmit buffer onto the network
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-
-        // wait for transmission to complete or fail
-        uint8_t eir;
-        while (((eir = readReg(EIR)) & (EIR_TXIF | EIR_TXERIF)) == 0)
-            ;
-        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
-        success = ((eir & EIR_TXERIF) == 0);
-        if (success)
-            break; // usual exit of the for(retry) loop
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
+        enc28j60->txreset = false;
+    }
+    ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF | EIR_TXIF);
+
+    // send the contents of the transmit buffer onto the network
+    ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+
+    SPI.endTransaction();
+}
+
+/**
+ * @brief Checks the frame being transmitted. When it has completed its callback is called and the next queued frame is
+ * started; a frame lost to a late collision is retried up to TX_COLLISION_RETRY_COUNT times (Errata 13).
+ *
+ * @param enc28j60 
+ * @return true The TX queue is empty
+ * @return false Frames are still queued or on the wire
+ */
+bool ENC28J60_txPoll(Enc28j60_t *enc28j60)
+{
+    if (enc28j60->txcount == 0)
+        return true;
+
+    ENC28J60_txdesc_t *desc = &enc28j60->txqueue[enc28j60->txhead];
+
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    uint8_t eir = ENC28J60_readReg(enc28j60, EIR);
+    if ((eir & (EIR_TXIF | EIR_TXERIF)) == 0)
+    {
+        SPI.endTransaction();
+        return false;
+    }
+    ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+    SPI.endTransaction();
+
+    bool success = ((eir & EIR_TXERIF) == 0);
+    if (!success)
+    {
+        enc28j60->txreset = true;
 
         // Errata 13 detection
-        uint8_t tsv4 = readByte(end + 4);
-        if (!(tsv4 & 0b00100000)) // is it "late collision" indicated in bit 29 of TSV?
-            break;                // other fail, not the Errata 13 situation
+        // the TSV is in buffer memory, which can't be read while a DMA copy is running
+        ENC28J60_dmaWait(enc28j60);
+        memblock_t *packet = &enc28j60->pool->blocks[desc->handle];
+        uint16_t end = packet->begin + packet->size - 1 - IP_SENDBUFFER_PADDING;
+        SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+        uint8_t tsv4 = ENC28J60_readByte(enc28j60, end + 4);
+        SPI.endTransaction();
+        if ((tsv4 & 0b00100000) && ++enc28j60->txretry < TX_COLLISION_RETRY_COUNT) // is it "late collision" indicated in bit 29 of TSV?
+        {
+            ENC28J60_txStart(enc28j60);
+            return false;
+        }
     }
 
-    SPI.endTransaction();
-    return success;
+    // frame is done, release the slot before the callback so it may queue the next frame
+    memhandle handle = desc->handle;
+    ENC28J60_tx_callback_t callback = desc->callback;
+    enc28j60->txhead = (enc28j60->txhead + 1) % ENC28J60_TXQUEUE_SIZE;
+    enc28j60->txcount--;
+    enc28j60->txretry = 0;
+    enc28j60->txlast_success = success;
+    if (success)
+        ENC28J60_STAT(++ip_stat.link.sent);
+    else
+        ENC28J60_STAT(++ip_stat.link.txerr);
+
+    if (enc28j60->txcount)
+        ENC28J60_txStart(enc28j60);
+    if (callback)
+        callback(enc28j60, handle, success);
+
+    return enc28j60->txcount == 0;
 }
 
 uint16_t
 ENC28J60_setReadPtr(Enc28j60_t *enc28j60, memhandle handle, memaddress position, uint16_t len)
 {
-    memblock *packet = handle == UIP_RECEIVEBUFFERHANDLE ? &receivePkt : &blocks[handle];
-    memaddress start = handle == UIP_RECEIVEBUFFERHANDLE && packet->begin + position > RXSTOP_INIT ? packet->begin + position - ((RXSTOP_INIT + 1) - RXSTART_INIT) : packet->begin + position;
+    memblock_t *packet = handle == IP_RECEIVEBUFFERHANDLE ? &enc28j60->receivePkt : &enc28j60->pool->blocks[handle];
+    memaddress start = handle == IP_RECEIVEBUFFERHANDLE && packet->begin + position > RXSTOP_INIT ? packet->begin + position - ((RXSTOP_INIT + 1) - RXSTART_INIT) : packet->begin + position;
 
     writeRegPair(ERDPTL, start);
 
@@ -244,6 +450,7 @@ ENC28J60_setReadPtr(Enc28j60_t *enc28j60, memhandle handle, memaddress position,
 uint16_t
 ENC28J60_readPacket(Enc28j60_t *enc28j60, memhandle handle, memaddress position, uint8_t *buffer, uint16_t len)
 {
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
     len = setReadPtr(handle, position, len);
     readBuffer(len, buffer);
@@ -254,9 +461,10 @@ ENC28J60_readPacket(Enc28j60_t *enc28j60, memhandle handle, memaddress position,
 uint16_t
 ENC28J60_writePacket(Enc28j60_t *enc28j60, memhandle handle, memaddress position, uint8_t *buffer, uint16_t len)
 {
-    memblock *packet = &blocks[handle];
+    memblock_t *packet = &enc28j60->pool->blocks[handle];
     uint16_t start = packet->begin + position;
 
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 
     writeRegPair(EWRPTL, start);
@@ -296,25 +504,103 @@ void ENC28J60_writeByte(Enc28j60_t *enc28j60, uint16_t addr, uint8_t data)
 
 void ENC28J60_copyPacket(Enc28j60_t *enc28j60, memhandle dest_pkt, memaddress dest_pos, memhandle src_pkt, memaddress src_pos, uint16_t len)
 {
-    memblock *dest = &blocks[dest_pkt];
-    memblock *src = src_pkt == UIP_RECEIVEBUFFERHANDLE ? &receivePkt : &blocks[src_pkt];
-    memaddress start = src_pkt == UIP_RECEIVEBUFFERHANDLE && src->begin + src_pos > RXSTOP_INIT ? src->begin + src_pos - ((RXSTOP_INIT + 1) - RXSTART_INIT) : src->begin + src_pos;
-    enc28J60_mempool_block_move_callback(dest->begin + dest_pos, start, len);
+    // the copy keeps running on-chip, every later buffer access waits for it in ENC28J60_dmaWait()
+    ENC28J60_copyPacketAsync(enc28j60, dest_pkt, dest_pos, src_pkt, src_pos, len, NULL);
     // setERXRDPT(); let it to freePacket after all packets are saved
 }
 
-void enc28J60_mempool_block_move_callback(Enc28j60_t *enc28j60, memaddress dest, memaddress src, memaddress len)
+/**
+ * @brief Starts copying len bytes from a packet (or the receive buffer) into another packet using the on-chip DMA and returns immediately.
+ *
+ * @param enc28j60 
+ * @param dest_pkt Destination block handle
+ * @param dest_pos Offset inside the destination block
+ * @param src_pkt Source block handle, IP_RECEIVEBUFFERHANDLE for the current received frame
+ * @param src_pos Offset inside the source block
+ * @param len Number of bytes to copy
+ * @param callback Called once the copy has finished, may be NULL
+ * @return uint16_t Token identifying the copy, see ENC28J60_dmaComplete()
+ */
+uint16_t ENC28J60_copyPacketAsync(Enc28j60_t *enc28j60, memhandle dest_pkt, memaddress dest_pos, memhandle src_pkt, memaddress src_pos, uint16_t len, ENC28J60_dma_callback_t callback)
 {
-    //void
-    //ENC28J60_memblock_mv_cb(uint16_t dest, uint16_t src, uint16_t len)
-    //{
+    memblock_t *dest = &enc28j60->pool->blocks[dest_pkt];
+    memblock_t *src = src_pkt == IP_RECEIVEBUFFERHANDLE ? &enc28j60->receivePkt : &enc28j60->pool->blocks[src_pkt];
+    memaddress start = src_pkt == IP_RECEIVEBUFFERHANDLE && src->begin + src_pos > RXSTOP_INIT ? src->begin + src_pos - ((RXSTOP_INIT + 1) - RXSTART_INIT) : src->begin + src_pos;
+    return ENC28J60_dmaStart(enc28j60, dest->begin + dest_pos, start, len, callback);
+}
+
+/**
+ * @brief Blocks until the transmitter has finished the frame at the head of the TX queue (TXIF or TXERIF), without
+ * retiring it: ENC28J60_txPoll() still runs its callback later.
+ *
+ * @param enc28j60 
+ */
+static void ENC28J60_txWait(Enc28j60_t *enc28j60)
+{
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    while ((ENC28J60_readOp(enc28j60, ENC28J60_READ_CTRL_REG, ECON1) & ECON1_TXRTS) &&
+           !(ENC28J60_readReg(enc28j60, EIR) & (EIR_TXIF | EIR_TXERIF)))
+        ;
+    SPI.endTransaction();
+}
+
+/**
+ * @brief Moves a memory pool block while the pool is compacted (MEMPOOL_MEMBLOCK_MV). The transmitter reads the frame
+ * at the head of the TX queue from buffer memory while TXRTS is set, a move reading or writing over it waits until
+ * the frame has left.
+ *
+ * @param enc28j60 
+ * @param dest 
+ * @param src 
+ * @param len 
+ */
+void ENC28J60_mempool_block_move_callback(Enc28j60_t *enc28j60, memaddress dest, memaddress src, memaddress len)
+{
+    if (enc28j60->txcount)
+    {
+        memblock_t *packet = &enc28j60->pool->blocks[enc28j60->txqueue[enc28j60->txhead].handle];
+        memaddress begin = packet->begin, end = packet->begin + packet->size;
+
+        if ((src < end && src + len > begin) || (dest < end && dest + len > begin))
+            ENC28J60_txWait(enc28j60);
+    }
+    // consecutive moves are serialized by ENC28J60_dmaStart(), the last one is left running
+    ENC28J60_dmaStart(enc28j60, dest, src, len, NULL);
+}
+
+/**
+ * @brief Programs the ENC28J60 DMA to copy len bytes inside the buffer memory and returns without waiting for it.
+ * A copy still in progress is waited for first, as the EDMA registers can't be changed while DMAST is set.
+ *
+ * @param enc28j60 
+ * @param dest Destination address in buffer memory
+ * @param src Source address in buffer memory
+ * @param len Number of bytes to copy
+ * @param callback Called from ENC28J60_dmaPoll() once the copy has finished, may be NULL
+ * @return uint16_t Token identifying the copy, ENC28J60_DMA_NOTOKEN if len is 0
+ */
+uint16_t ENC28J60_dmaStart(Enc28j60_t *enc28j60, memaddress dest, memaddress src, memaddress len, ENC28J60_dma_callback_t callback)
+{
+    if (len == 0)
+        return ENC28J60_DMA_NOTOKEN;
+
+    ENC28J60_dmaWait(enc28j60);
+
+    if (++enc28j60->dma_token == ENC28J60_DMA_NOTOKEN)
+        enc28j60->dma_token++;
+    enc28j60->dma_callback = callback;
+#ifdef ENC28J60_DMA_INTERRUPT
+    enc28j60->dma_irq = false;
+#endif
 
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 
     //as ENC28J60 DMA is unable to copy single bytes:
     if (len == 1)
     {
-        ENC28J60_writeByte(dest, ENC28J60_readByte(src));
+        ENC28J60_writeByte(enc28j60, dest, ENC28J60_readByte(enc28j60, src));
+        // completion is still reported through ENC28J60_dmaPoll() so callers see a single code path
+        enc28j60->dma_state = ENC28J60_DMA_DONE;
     }
     else
     {
@@ -335,32 +621,120 @@ void enc28J60_mempool_block_move_callback(Enc28j60_t *enc28j60, memaddress dest,
        prevent a never ending DMA operation which
        would overwrite the entire 8-Kbyte buffer.
        */
-        ENC28J60_writeRegPair(EDMASTL, src);
-        ENC28J60_writeRegPair(EDMADSTL, dest);
+        ENC28J60_writeRegPair(enc28j60, EDMASTL, src);
+        ENC28J60_writeRegPair(enc28j60, EDMADSTL, dest);
 
         if ((src <= RXSTOP_INIT) && (len > RXSTOP_INIT))
             len -= ((RXSTOP_INIT + 1) - RXSTART_INIT);
-        ENC28J60_writeRegPair(EDMANDL, len);
+        ENC28J60_writeRegPair(enc28j60, EDMANDL, len);
 
         /*
        2. If an interrupt at the end of the copy process is
        desired, set EIE.DMAIE and EIE.INTIE and
-       clear EIR.DMAIF.
-       3. Verify that ECON1.CSUMEN is clear. */
-        ENC28J60_writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+       clear EIR.DMAIF. */
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, EIR, EIR_DMAIF);
+#ifdef ENC28J60_DMA_INTERRUPT
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_DMAIE);
+#endif
+        /* 3. Verify that ECON1.CSUMEN is clear. */
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
 
         /* 4. Start the DMA copy by setting ECON1.DMAST. */
-        ENC28J60_writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
-
-        // wait until runnig DMA is completed
-        while (ENC28J60_readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
-            ;
+        enc28j60->dma_state = ENC28J60_DMA_RUNNING;
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
     }
     SPI.endTransaction();
+
+    return enc28j60->dma_token;
+}
+
+/**
+ * @brief Checks whether the running DMA copy has finished and, if so, reports its completion through the callback.
+ * Must only be called from the main loop: it talks to the chip over SPI and would corrupt a transfer it interrupted.
+ * With ENC28J60_DMA_INTERRUPT the ECON1 register is only read once ENC28J60_dmaISR() has seen the INT pin.
+ *
+ * @param enc28j60 
+ * @return true No DMA copy is pending anymore
+ * @return false The DMA copy is still running
+ */
+bool ENC28J60_dmaPoll(Enc28j60_t *enc28j60)
+{
+    if (enc28j60->dma_state == ENC28J60_DMA_RUNNING)
+    {
+#ifdef ENC28J60_DMA_INTERRUPT
+        if (!enc28j60->dma_irq)
+            return false;
+#endif
+        SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+        if (ENC28J60_readOp(enc28j60, ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+        {
+            SPI.endTransaction();
+            return false;
+        }
+        // DMAIF is set by hardware when DMAST clears
+        ENC28J60_writeOp(enc28j60, ENC28J60_BIT_FIELD_CLR, EIR, EIR_DMAIF);
+        SPI.endTransaction();
+#ifdef ENC28J60_DMA_INTERRUPT
+        enc28j60->dma_irq = false;
+#endif
+        enc28j60->dma_state = ENC28J60_DMA_DONE;
+    }
+    if (enc28j60->dma_state == ENC28J60_DMA_DONE)
+    {
+        ENC28J60_dma_callback_t callback = enc28j60->dma_callback;
+        enc28j60->dma_callback = NULL;
+        enc28j60->dma_state = ENC28J60_DMA_IDLE;
+        if (callback)
+            callback(enc28j60, enc28j60->dma_token);
+    }
+    return true;
+}
+
+#ifdef ENC28J60_DMA_INTERRUPT
+/**
+ * @brief To be called from the INT pin ISR. Only records the interrupt, no SPI access is made from interrupt
+ * context; the completion is picked up by the next ENC28J60_dmaPoll() from the main loop.
+ *
+ * @param enc28j60 
+ */
+void ENC28J60_dmaISR(Enc28j60_t *enc28j60)
+{
+    enc28j60->dma_irq = true;
+}
+#endif
+
+/**
+ * @brief Tells whether the copy identified by token has finished.
+ *
+ * @param enc28j60 
+ * @param token Value returned by ENC28J60_dmaStart() or ENC28J60_copyPacketAsync()
+ * @return true The copy is finished (or token is ENC28J60_DMA_NOTOKEN)
+ * @return false The copy is still running
+ */
+bool ENC28J60_dmaComplete(Enc28j60_t *enc28j60, uint16_t token)
+{
+    // only the last started copy can still be running; the 16-bit token takes 65535 copies to come round
+    if (token != enc28j60->dma_token)
+        return true;
+    return ENC28J60_dmaPoll(enc28j60);
+}
+
+/**
+ * @brief Blocks until no DMA copy is running. Buffer memory must not be accessed over SPI while the DMA is active,
+ * so every buffer access path calls this first.
+ *
+ * @param enc28j60 
+ */
+void ENC28J60_dmaWait(Enc28j60_t *enc28j60)
+{
+    while (!ENC28J60_dmaPoll(enc28j60))
+        ;
 }
 
 void ENC28J60_freePacket(Enc28j60_t *enc28j60)
 {
+    // a pending copy out of the receive buffer must finish before the memory is released
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
     setERXRDPT();
     SPI.endTransaction();
@@ -514,13 +888,15 @@ uint16_t
 ENC28J60_chksum(Enc28j60_t *enc28j60, uint16_t sum, memhandle handle, memaddress pos, uint16_t len)
 {
     uint16_t t;
+    ENC28J60_dmaWait(enc28j60);
     SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    len = setReadPtr(handle, pos, len) - 1;
+    len = setReadPtr(handle, pos, len);
     CSACTIVE;
     // issue read command
     SPI.transfer(ENC28J60_READ_BUF_MEM);
     uint16_t i;
-    for (i = 0; i != len; i += 2)
+    // whole 16-bit words, the odd byte of an odd length is padded with zero below
+    for (i = 0; i < (len & ~1); i += 2)
     {
         // read data
         t = SPI.transfer(0x00) << 8;
@@ -531,7 +907,7 @@ ENC28J60_chksum(Enc28j60_t *enc28j60, uint16_t sum, memhandle handle, memaddress
             sum++; /* carry */
         }
     }
-    if (i == len)
+    if (len & 1)
     {
         t = (SPI.transfer(0x00) << 8) + 0;
         sum += t;
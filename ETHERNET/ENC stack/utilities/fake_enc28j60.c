@@ -0,0 +1,218 @@
+/*
+ * Simulated ENC28J60 for the host tests
+ */
+
+#include "fake_enc28j60.h"
+#include "enc28j60_regs.h"
+#include <string.h>
+
+struct fake_enc28j60 fake_enc28j60;
+
+#define F fake_enc28j60
+
+/* SPI command being decoded */
+enum { IDLE, OPCODE, RCR, WCR, BFS, BFC, RBM, WBM, DONE };
+static uint8_t state, arg;
+
+/*---------------------------------------------------------------------------*/
+static uint8_t *
+reg(uint8_t addr)
+{
+  addr &= ADDR_MASK;
+  if(addr >= EIE) {
+    return &F.regs[0][addr];
+  }
+  return &F.regs[F.regs[0][ECON1] & (ECON1_BSEL1 | ECON1_BSEL0)][addr];
+}
+
+static uint16_t
+pair(uint8_t addr)
+{
+  return F.regs[0][addr] | (F.regs[0][addr + 1] << 8);
+}
+
+static void
+setpair(uint8_t addr, uint16_t v)
+{
+  F.regs[0][addr] = v & 0xff;
+  F.regs[0][addr + 1] = v >> 8;
+}
+/*---------------------------------------------------------------------------*/
+/* The frame leaves the wire: the transmitter has read ETXST + 1 to
+   ETXND (ETXST holds the control byte). */
+static void
+tx_done(void)
+{
+  uint16_t start = pair(ETXSTL), end = pair(ETXNDL);
+  uint16_t len = end - start;
+
+  if(F.nframes < FAKE_ENC28J60_FRAMES && len <= sizeof(F.frames[0])) {
+    memcpy(F.frames[F.nframes], &F.mem[start + 1], len);
+    F.framelen[F.nframes] = len;
+  }
+  ++F.nframes;
+  memset(&F.mem[end + 1], 0, 7);
+  F.regs[0][ECON1] &= ~ECON1_TXRTS;
+  F.regs[0][EIR] |= EIR_TXIF;
+}
+
+static void
+dma(void)
+{
+  uint16_t src = pair(EDMASTL), end = pair(EDMANDL), dest = pair(EDMADSTL);
+  uint16_t rxstart = pair(ERXSTL), rxend = pair(ERXNDL);
+
+  for(;;) {
+    if((F.regs[0][ECON1] & ECON1_TXRTS) &&
+       dest >= pair(ETXSTL) && dest <= pair(ETXNDL)) {
+      ++F.overwrites;
+    }
+    F.mem[dest] = F.mem[src];
+    dest = (dest + 1) % FAKE_ENC28J60_MEMSIZE;
+    if(src == end) {
+      break;
+    }
+    src = src == rxend ? rxstart : (src + 1) % FAKE_ENC28J60_MEMSIZE;
+  }
+  ++F.dmacopies;
+  F.regs[0][ECON1] &= ~ECON1_DMAST;
+  F.regs[0][EIR] |= EIR_DMAIF;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+reg_read(uint8_t addr)
+{
+  addr &= ADDR_MASK;
+  if((addr == EIR || addr == ECON1) && F.txleft != 0 && --F.txleft == 0) {
+    tx_done();
+  }
+  return *reg(addr);
+}
+
+static void
+reg_write(uint8_t addr, uint8_t v)
+{
+  uint8_t *r = reg(addr), old = *r;
+
+  *r = v;
+  if((addr & ADDR_MASK) == ECON1) {
+    if((v & ECON1_DMAST) && !(old & ECON1_DMAST)) {
+      dma();
+    }
+    if((v & ECON1_TXRTS) && !(old & ECON1_TXRTS)) {
+      F.txleft = F.txreads;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+transfer(uint8_t data)
+{
+  uint8_t c = 0;
+  uint16_t p;
+
+  switch(state) {
+  case OPCODE:
+    arg = data & ADDR_MASK;
+    if(data == ENC28J60_READ_BUF_MEM) {
+      state = RBM;
+    } else if(data == ENC28J60_WRITE_BUF_MEM) {
+      state = WBM;
+    } else if(data == ENC28J60_SOFT_RESET) {
+      memset(F.regs, 0, sizeof(F.regs));
+      F.regs[3][EREVID & ADDR_MASK] = 6;
+      state = DONE;
+    } else {
+      switch(data & ~ADDR_MASK) {
+      case ENC28J60_READ_CTRL_REG:  state = RCR; break;
+      case ENC28J60_WRITE_CTRL_REG: state = WCR; break;
+      case ENC28J60_BIT_FIELD_SET:  state = BFS; break;
+      case ENC28J60_BIT_FIELD_CLR:  state = BFC; break;
+      default:                      state = DONE; break;
+      }
+    }
+    break;
+  case RCR:
+    /* every byte clocked out carries the register, which also covers
+       the dummy byte of the MAC and MII registers */
+    c = reg_read(arg);
+    break;
+  case WCR:
+    reg_write(arg, data);
+    state = DONE;
+    break;
+  case BFS:
+    reg_write(arg, *reg(arg) | data);
+    state = DONE;
+    break;
+  case BFC:
+    reg_write(arg, *reg(arg) & ~data);
+    state = DONE;
+    break;
+  case RBM:
+    p = pair(ERDPTL);
+    c = F.mem[p];
+    setpair(ERDPTL, p == pair(ERXNDL) ? pair(ERXSTL) : (p + 1) % FAKE_ENC28J60_MEMSIZE);
+    break;
+  case WBM:
+    p = pair(EWRPTL);
+    F.mem[p] = data;
+    setpair(EWRPTL, (p + 1) % FAKE_ENC28J60_MEMSIZE);
+    break;
+  }
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+static void
+begin(void)
+{
+}
+
+static void
+beginTransaction(int settings)
+{
+  (void)settings;
+}
+
+static void
+endTransaction(void)
+{
+}
+
+const struct bench_spi SPI = {begin, beginTransaction, endTransaction, transfer};
+
+void
+pinMode(uint8_t pin, uint8_t mode)
+{
+  (void)pin;
+  (void)mode;
+}
+
+void
+digitalWrite(uint8_t pin, uint8_t value)
+{
+  (void)pin;
+  state = value == LOW ? OPCODE : IDLE;
+}
+
+void
+delay(uint32_t ms)
+{
+  (void)ms;
+}
+
+void
+delayMicroseconds(uint32_t us)
+{
+  (void)us;
+}
+/*---------------------------------------------------------------------------*/
+void
+fake_enc28j60_reset(uint16_t txreads)
+{
+  memset(&F, 0, sizeof(F));
+  F.regs[3][EREVID & ADDR_MASK] = 6;
+  F.txreads = txreads;
+  state = IDLE;
+}
+/*---------------------------------------------------------------------------*/
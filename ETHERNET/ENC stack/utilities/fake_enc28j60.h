@@ -0,0 +1,36 @@
+/*
+ * Simulated ENC28J60 for the host tests
+ *
+ * Answers the SPI commands of enc28j60.c from the 8 KB buffer memory
+ * and the control registers of the controller. A DMA copy finishes
+ * at once. A frame stays on the wire for txreads polls of ECON1 or
+ * EIR, then it is captured from ETXST..ETXND, its status vector is
+ * written behind it and TXIF is set.
+ */
+
+#ifndef __FAKE_ENC28J60_H__
+#define __FAKE_ENC28J60_H__
+
+#include <stdint.h>
+
+#define FAKE_ENC28J60_MEMSIZE 8192
+#define FAKE_ENC28J60_FRAMES  8
+
+struct fake_enc28j60 {
+  uint8_t mem[FAKE_ENC28J60_MEMSIZE];
+  uint8_t regs[4][32];          /* the common registers live in bank 0 */
+  uint16_t txreads;             /* polls a frame takes on the wire */
+  uint16_t txleft;
+  uint8_t frames[FAKE_ENC28J60_FRAMES][1518];
+  uint16_t framelen[FAKE_ENC28J60_FRAMES];
+  uint8_t nframes;              /* frames that left the wire */
+  uint16_t dmacopies;
+  uint16_t overwrites;          /* DMA copies into the frame on the wire */
+};
+
+extern struct fake_enc28j60 fake_enc28j60;
+
+/* Powers the controller up, a frame takes txreads polls to send. */
+void fake_enc28j60_reset(uint16_t txreads);
+
+#endif /* __FAKE_ENC28J60_H__ */
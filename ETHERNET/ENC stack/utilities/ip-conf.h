@@ -8,7 +8,7 @@
  * @brief Statistics datatype
  * This typedef defines the dataype used for keeping statistics in uIP
 */
-typedef uint16_t ip_stats_t
+typedef uint16_t ip_stats_t;
 
 
 /**
@@ -19,23 +19,19 @@ typedef uint16_t ip_stats_t
 /**
  * @brief IP buffer size.
  */
+#ifndef IP_CONF_BUFFER_SIZE
 #define IP_CONF_BUFFER_SIZE     98
+#endif
 
 /**
- * @brief The TCP maximum segment size.
- * This is should not be to set to more than
- * IP_BUFSIZE - IP_LLH_LEN - IP_TCPIP_HLEN.
+ * @brief The largest receiver's window that is advertised.
+ * The window actually advertised is the free space of the connection's
+ * receive buffers (see IP_CONF_TCP_RCVWND), limited to this value. Set
+ * IP_CONF_TCP_WSCALE when it exceeds 65535 bytes.
  */
-
-#define IP_CONF_TCP_MSS 512
-
-/**
- * @brief The size of the advertised receiver's window.
- * Should be set low (i.e., to the size of the uip_buf buffer) is the
- * application is slow to process incoming data, or high (32768 bytes)
- * if the application processes data quickly.
- */
-#define IP_CONF_RECEIVE_WINDOW 512
+#ifndef IP_CONF_RECEIVE_WINDOW
+#define IP_CONF_RECEIVE_WINDOW (IP_SOCKET_NUMPACKETS * IP_TCP_MSS)
+#endif
 
 /**
  * @brief CPU byte order.
@@ -82,7 +78,7 @@ typedef void* ip_tcp_appstate_t;
 
 void ipclient_appcall(void);
 
-#define UIP_APPCALL ipclient_appcall
+#define IP_APPCALL ipclient_appcall
 
 typedef void* ip_udp_appstate_t;
 
@@ -92,7 +88,9 @@ void ipudp_appcall(void);
 
 #define CC_REGISTER_ARG register
 
-#define UIP_ARCH_CHKSUM 1
+#ifndef IP_ARCH_CHKSUM
+#define IP_ARCH_CHKSUM 1
+#endif
 
 
 #endif /*IP_CONF_H*/
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include "ip.h"
 #include "ipopt.h"
 #include "ip_arch.h"
+#include "ip6.h"
+#include "ip_stack.h"
 
 #if IP_CONF_IPV6
 #include "ip-neighbor.h"
@@ -14,23 +16,11 @@
 /**
  * Definición de variables
 */
-#if IP_FIXEDADDR > 0
-const IP_address ip_hostaddr = {HTONS((IP_IPADDR0 << 8) | IP_IPADDR1), HTONS((IP_IPADDR2 << 8) | IP_IPADDR3)};
-const IP_address ip_draddr =
-  {HTONS((IP_DRIPADDR0 << 8) | IP_DRIPADDR1),
-   HTONS((IP_DRIPADDR2 << 8) | IP_DRIPADDR3)};
-const IP_address ip_netmask =
-  {HTONS((IP_NETMASK0 << 8) | IP_NETMASK1),
-   HTONS((IP_NETMASK2 << 8) | IP_NETMASK3)};
-#else
-IP_address ip_hostaddr, ip_draddr, ip_netmask;
-#endif /* IP_FIXEDADDR */
-
 static const IP_address all_ones_addr =
 #if IP_CONF_IPV6
   {0xffff,0xffff,0xffff,0xffff,0xffff,0xffff,0xffff,0xffff};
 #else /* IP_CONF_IPV6 */
-  {0xffff,0xffff};
+  {{0xff,0xff,0xff,0xff}};
 #endif /* IP_CONF_IPV6 */
 static const IP_address all_zeroes_addr =
 #if IP_CONF_IPV6
@@ -39,6 +29,33 @@ static const IP_address all_zeroes_addr =
   {0x0000,0x0000};
 #endif /* IP_CONF_IPV6 */
 
+#if IP_INSTANCES
+IP_INSTANCE_LOCAL struct ip_stack *ip_stack;
+                             /* The instance the stack works on, see
+				ip_stack_select(). */
+
+/* The state below is kept in the selected instance. */
+#define ip_df         (ip_stack->df)
+#define ip_sndoff     (ip_stack->sndoff)
+#define ip_conn_hash  (ip_stack->conn_hash)
+#define ip_udp_hash   (ip_stack->udp_hash)
+#define ip_id         (ip_stack->id)
+#define iss           (ip_stack->iss)
+#define lastport      (ip_stack->lastport)
+#define ip_reass_ctxs (ip_stack->reass_ctxs)
+#else /* IP_INSTANCES */
+#if IP_FIXEDADDR > 0
+const IP_address ip_hostaddr = {HTONS((IP_IPADDR0 << 8) | IP_IPADDR1), HTONS((IP_IPADDR2 << 8) | IP_IPADDR3)};
+const IP_address ip_draddr =
+  {HTONS((IP_DRIPADDR0 << 8) | IP_DRIPADDR1),
+   HTONS((IP_DRIPADDR2 << 8) | IP_DRIPADDR3)};
+const IP_address ip_netmask =
+  {HTONS((IP_NETMASK0 << 8) | IP_NETMASK1),
+   HTONS((IP_NETMASK2 << 8) | IP_NETMASK3)};
+#else
+IP_address ip_hostaddr, ip_draddr, ip_netmask;
+#endif /* IP_FIXEDADDR */
+
 
 #if IP_FIXEDETHADDR
 const struct ip_eth_addr ip_ethaddr = {{IP_ETHADDR0,
@@ -73,12 +90,22 @@ uint16_t ip_len, ip_slen;
 				depending on the maximum packet
 				size. */
 
+struct ip_pbuf *ip_schain;   /* The data fragments to be sent, see
+				ip_send_chain(). */
+uint16_t ip_schainlen;       /* The number of bytes of ip_schain in
+				the outgoing packet. */
+
 uint8_t ip_flags;     /* The ip_flags variable is used for
 				communication between the TCP/IP stack
 				and the application program. */
-struct ip_conn *ip_conn;   /* ip_conn always points to the current
-				connection. */
-
+uint8_t ip_acksegs;   /* Number of segments released by the last
+				ACK. */
+#if IP_TCP_PMTUD
+static uint8_t ip_df;      /* Set if the outgoing TCP segment may not
+			      be fragmented. */
+#endif /* IP_TCP_PMTUD */
+static uint16_t ip_sndoff; /* Offset from snd_nxt of the sequence
+				number of the segment being sent. */
 struct ip_conn ip_conns[IP_CONNS];
                              /* The ip_conns array holds all TCP
 				connections. */
@@ -86,16 +113,22 @@ uint16_t ip_listenports[IP_LISTENPORTS];
                              /* The ip_listenports list all currently
 				listning ports. */
 #if IP_UDP
-struct ip_udp_conn *ip_udp_conn;
 struct ip_udp_conn ip_udp_conns[IP_UDP_CONNS];
 #endif /* IP_UDP */
 
-static uint16_t ipid;           /* Ths ipid variable is an increasing
+static uint8_t ip_conn_hash[IP_CONN_HASH_SIZE];
+                             /* Heads (index + 1) of the TCP connection
+				demultiplexing chains. */
+#if IP_UDP
+static uint8_t ip_udp_hash[IP_UDP_HASH_SIZE];
+                             /* Heads (index + 1) of the UDP connection
+				demultiplexing chains. */
+#endif /* IP_UDP */
+
+static uint16_t ip_id;          /* The ip_id variable is an increasing
 				number that is used for the IP ID
 				field. */
 
-void ip_setipid(uint16_t id) { ipid = id; }
-
 static uint8_t iss[4];          /* The iss variable is used for the TCP
 				initial sequence number. */
 
@@ -106,8 +139,18 @@ static uint16_t lastport;       /* Keeps track of the last port used for
 
 /* Temporary variables. */
 uint8_t ip_acc32[4];
-static uint8_t c, opt;
-static uint16_t tmp16;
+#endif /* IP_INSTANCES */
+
+/* The current connections are only valid while the stack runs, so
+   they are not part of an instance. */
+IP_INSTANCE_LOCAL struct ip_conn *ip_conn;
+                             /* ip_conn always points to the current
+				connection. */
+#if IP_UDP
+IP_INSTANCE_LOCAL struct ip_udp_conn *ip_udp_conn;
+#endif /* IP_UDP */
+
+void ip_setipid(uint16_t id) { ip_id = id; }
 
 /* Structures and definitions. */
 #define TCP_FIN 0x01
@@ -121,12 +164,29 @@ static uint16_t tmp16;
 #define TCP_OPT_END     0   /* End of TCP options list */
 #define TCP_OPT_NOOP    1   /* "No-operation" TCP option */
 #define TCP_OPT_MSS     2   /* Maximum segment size TCP option */
+#define TCP_OPT_WS      3   /* Window scale TCP option */
 
 #define TCP_OPT_MSS_LEN 4   /* Length of TCP MSS option. */
+#define TCP_OPT_WS_LEN  3   /* Length of TCP window scale option. */
+
+#define TCP_MAX_WSCALE  14  /* Largest shift allowed by RFC 7323. */
+
+/* MSS assumed if the peer sends no MSS option (RFC 1122, RFC 2460). */
+#if IP_CONF_IPV6
+#define TCP_DEFAULT_MSS 1220
+#else /* IP_CONF_IPV6 */
+#define TCP_DEFAULT_MSS 536
+#endif /* IP_CONF_IPV6 */
 
 #define ICMP_ECHO_REPLY 0
+#define ICMP_DEST_UNREACH 3
 #define ICMP_ECHO       8
 
+#define ICMP_FRAG_NEEDED 4  /* Destination unreachable code. */
+
+#define IP_DF   0x40        /* Don't fragment flag. */
+#define PMTU_MIN 68         /* Smallest MTU of an IPv4 path. */
+
 #define ICMP6_ECHO_REPLY             129
 #define ICMP6_ECHO                   128
 #define ICMP6_NEIGHBOR_SOLICITATION  135
@@ -140,18 +200,37 @@ static uint16_t tmp16;
 
 /* Macros. */
 #define BUF ((struct ip_tcpip_hdr *)&ip_buf[IP_LLH_LEN])
-#define FBUF ((struct ip_tcpip_hdr *)&ip_reassbuf[0])
 #define ICMPBUF ((struct ip_icmpip_hdr *)&ip_buf[IP_LLH_LEN])
+/* The header of our datagram quoted in an ICMP error message. */
+#define ICMPQBUF ((struct ip_tcpip_hdr *)&ip_buf[IP_LLH_LEN + IP_IPH_LEN + 8])
 #define UDPBUF ((struct ip_udpip_hdr *)&ip_buf[IP_LLH_LEN])
 
 
 #if IP_STATISTICS == 1
+#if !IP_INSTANCES
 struct ip_stats ip_stat;
+#endif /* !IP_INSTANCES */
 #define IP_STAT(s) s
 #else
 #define IP_STAT(s)
 #endif /* IP_STATISTICS == 1 */
 
+#if IP_HISTOGRAMS
+#if !IP_INSTANCES
+uint32_t ip_rxstamp, ip_txstamp;
+#endif /* !IP_INSTANCES */
+/* Samples the time the data in ip_buf took to reach the application. */
+#define IP_RXSAMPLE() do { if(ip_flags & IP_NEWDATA) {			\
+      ip_histogram_add(&ip_stat.lat.rx2app, IP_CLOCK_US() - ip_rxstamp); } } while(0)
+/* Stamps data the application is sending, unless earlier data is
+   still on its way to the driver. 0 stands for "not stamped". */
+#define IP_TXSTAMP() do { if(ip_txstamp == 0) {				\
+      ip_txstamp = IP_CLOCK_US() | 1; } } while(0)
+#else /* IP_HISTOGRAMS */
+#define IP_RXSAMPLE()
+#define IP_TXSTAMP()
+#endif /* IP_HISTOGRAMS */
+
 #if IP_LOGGING == 1
 #include <stdio.h>
 void ip_log(char *msg);
@@ -189,6 +268,96 @@ ip_add32(uint8_t *op32, uint16_t op16)
 }
 
 #endif /* IP_ARCH_ADD32 */
+/*---------------------------------------------------------------------------*/
+/* Returns how far the 32-bit sequence number in seq lies past the one
+   in base, or 0xffff if it lies before it or further than that. */
+static uint16_t
+ip_seqdiff(const uint8_t *seq, const uint8_t *base)
+{
+  uint32_t d;
+
+  d = (((uint32_t)seq[0] << 24) | ((uint32_t)seq[1] << 16) |
+       ((uint32_t)seq[2] << 8) | seq[3]) -
+      (((uint32_t)base[0] << 24) | ((uint32_t)base[1] << 16) |
+       ((uint32_t)base[2] << 8) | base[3]);
+  return d > 0xffff? 0xffff: (uint16_t)d;
+}
+/*---------------------------------------------------------------------------*/
+/* Clamps a (scaled) window to what fits in 16 bits. */
+static uint16_t
+ip_tcp_wnd(uint32_t wnd)
+{
+  return wnd > 0xffff? 0xffff: (uint16_t)wnd;
+}
+#if IP_TCP_MSRTT
+/*---------------------------------------------------------------------------*/
+/* Feeds a round-trip time measurement (in ms) into the smoothed RTT
+   and variance estimators of a connection and derives the
+   retransmission timeout from them (RFC 6298, in VJ's fixed point
+   form: srtt is kept scaled by 8, rttvar by 4). */
+static void
+ip_rtt_sample(struct ip_conn *conn, uint32_t rtt)
+{
+  int16_t m;
+
+  m = rtt > IP_TCP_RTO_MAX? IP_TCP_RTO_MAX: (int16_t)rtt;
+  if(conn->srtt == 0) {
+    /* First measurement. */
+    conn->srtt = (uint16_t)m << 3;
+    conn->rttvar = (uint16_t)m << 1;
+  } else {
+    m -= conn->srtt >> 3;
+    conn->srtt += m;
+    if(m < 0) {
+      m = -m;
+    }
+    m -= conn->rttvar >> 2;
+    conn->rttvar += m;
+  }
+  rtt = (uint32_t)(conn->srtt >> 3) + conn->rttvar;
+  conn->rto_ms = rtt < IP_TCP_RTO_MIN? IP_TCP_RTO_MIN:
+    rtt > IP_TCP_RTO_MAX? IP_TCP_RTO_MAX: (uint16_t)rtt;
+}
+#if IP_TIMERS
+/*---------------------------------------------------------------------------*/
+/* Timer wheel callback of the retransmission timer of a connection. */
+static void
+ip_rexmit_expired(void *arg)
+{
+  ip_conn = (struct ip_conn *)arg;
+  ip_process(IP_REXMIT_TIMER);
+  IP_OUTPUT();
+}
+#endif /* IP_TIMERS */
+/*---------------------------------------------------------------------------*/
+/* (Re)starts the retransmission timer of a connection. */
+static void
+ip_rexmit_arm(struct ip_conn *conn, uint16_t ms)
+{
+  conn->rexmit_at = IP_TCP_CLOCK() + ms;
+#if IP_TIMERS
+  ip_timer_set(&conn->rtimer, ms, ip_rexmit_expired, conn);
+#endif /* IP_TIMERS */
+}
+#endif /* IP_TCP_MSRTT */
+#if IP_TIMERS
+/*---------------------------------------------------------------------------*/
+/* Timer wheel callback that does the periodic processing of an open
+   connection. The timer is not armed again once the connection is
+   closed. */
+static void
+ip_tcp_periodic(void *arg)
+{
+  struct ip_conn *conn = (struct ip_conn *)arg;
+
+  if(conn->tcpstateflags == IP_CLOSED) {
+    return;
+  }
+  ip_timer_set(&conn->ptimer, IP_TCP_PERIODIC, ip_tcp_periodic, conn);
+  ip_periodic_conn(conn);
+  IP_OUTPUT();
+}
+#endif /* IP_TIMERS */
 
 #if ! IP_ARCH_CHKSUM
 /*---------------------------------------------------------------------------*/
@@ -241,6 +410,44 @@ ip_ipchksum(void)
 }
 #endif
 /*---------------------------------------------------------------------------*/
+/* Sums the first len bytes of a chain of fragments. A fragment that
+   starts at an odd offset is summed on its own, the bytes of its sum
+   are then swapped into place. */
+static uint16_t
+pbuf_chksum(uint16_t sum, const struct ip_pbuf *p, uint16_t len)
+{
+  uint16_t part, n, i, k;
+  uint8_t odd, rom[16];
+
+  for(odd = 0; p != NULL && len > 0; p = p->next) {
+    n = p->len < len? p->len: len;
+    if(p->type == IP_PBUF_ROM) {
+      /* Read in chunks of even length, so they stay aligned. */
+      for(part = 0, i = 0; i < n; i += k) {
+	k = n - i < sizeof(rom)? n - i: sizeof(rom);
+	IP_PBUF_ROM_READ(rom, p->data.ptr + i, k);
+	part = chksum(part, rom, k);
+      }
+#ifdef IP_PBUF_CHKSUM
+    } else if(p->type == IP_PBUF_BLOCK) {
+      part = IP_PBUF_CHKSUM(0, p->data.block.handle, p->data.block.pos, n);
+#endif /* IP_PBUF_CHKSUM */
+    } else {
+      part = chksum(0, p->data.ptr, n);
+    }
+    if(odd) {
+      part = (part << 8) | (part >> 8);
+    }
+    sum += part;
+    if(sum < part) {
+      sum++;		/* carry */
+    }
+    odd ^= n & 1;
+    len -= n;
+  }
+  return sum;
+}
+/*---------------------------------------------------------------------------*/
 static uint16_t
 upper_layer_chksum(uint8_t proto)
 {
@@ -260,9 +467,13 @@ upper_layer_chksum(uint8_t proto)
   /* Sum IP source and destination addresses. */
   sum = chksum(sum, (uint8_t *)&BUF->srcipaddr[0], 2 * sizeof(IP_address));
 
-  /* Sum TCP header and data. */
+  /* Sum TCP header and data. The data of a chain follows the
+     header. */
   sum = chksum(sum, &ip_buf[IP_IPH_LEN + IP_LLH_LEN],
-	       upper_layer_len);
+	       upper_layer_len - ip_schainlen);
+  if(ip_schainlen > 0) {
+    sum = pbuf_chksum(sum, ip_schain, ip_schainlen);
+  }
     
   return (sum == 0) ? 0xffff : htons(sum);
 }
@@ -291,15 +502,131 @@ ip_udpchksum(void)
 #endif /* IP_UDP_CHECKSUMS */
 #endif /* IP_ARCH_CHKSUM */
 /*---------------------------------------------------------------------------*/
+/* Connection demultiplexing hashes. A TCP connection is hashed on its
+   (remote address, local port, remote port) tuple when it is set up by
+   ip_connect() or by a SYN on a listening port. Closed connections are
+   not removed right away: lookups skip them and they are unlinked when
+   the entry is reused. UDP connections are hashed on their local port
+   only, since their remote side may be a wildcard, and are maintained
+   by ip_udp_new(), ip_udp_bind() and ip_udp_remove(). */
+static uint8_t
+ip_conn_hashfn(const void *ripaddr, uint16_t lport, uint16_t rport)
+{
+  const uint8_t *a = (const uint8_t *)ripaddr;
+  uint8_t h, n;
+
+  h = (lport >> 8) ^ lport ^ (rport >> 8) ^ rport;
+  for(n = 0; n < sizeof(IP_address); ++n) {
+    h = ((h << 3) | (h >> 5)) ^ a[n];
+  }
+  return h & (IP_CONN_HASH_SIZE - 1);
+}
+/*---------------------------------------------------------------------------*/
+static void
+ip_conn_unhash(struct ip_conn *conn)
+{
+  uint8_t *link;
+  uint8_t idx = conn - &ip_conns[0] + 1;
+
+  for(link = &ip_conn_hash[ip_conn_hashfn(&conn->ripaddr, conn->lport, conn->rport)];
+      *link != 0;
+      link = &ip_conns[*link - 1].hnext) {
+    if(*link == idx) {
+      *link = conn->hnext;
+      conn->hnext = 0;
+      return;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+ip_conn_rehash(struct ip_conn *conn, IP_address *ripaddr, uint16_t lport, uint16_t rport)
+{
+  uint8_t h;
+
+  ip_conn_unhash(conn);
+  conn->lport = lport;
+  conn->rport = rport;
+  ip_ipaddr_copy(conn->ripaddr, ripaddr);
+  h = ip_conn_hashfn(&conn->ripaddr, lport, rport);
+  conn->hnext = ip_conn_hash[h];
+  ip_conn_hash[h] = conn - &ip_conns[0] + 1;
+}
+/*---------------------------------------------------------------------------*/
+#if IP_UDP
+#define ip_udp_hashfn(lport) (((lport) ^ ((lport) >> 8)) & (IP_UDP_HASH_SIZE - 1))
+
+static void
+ip_udp_unhash(struct ip_udp_conn *conn)
+{
+  uint8_t *link;
+  uint8_t idx = conn - &ip_udp_conns[0] + 1;
+
+  for(link = &ip_udp_hash[ip_udp_hashfn(conn->lport)];
+      *link != 0;
+      link = &ip_udp_conns[*link - 1].hnext) {
+    if(*link == idx) {
+      *link = conn->hnext;
+      conn->hnext = 0;
+      return;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+ip_udp_bind(struct ip_udp_conn *conn, uint16_t port)
+{
+  uint8_t h;
+
+  if(conn->lport != 0) {
+    ip_udp_unhash(conn);
+  }
+  conn->lport = port;
+  if(port != 0) {
+    h = ip_udp_hashfn(port);
+    conn->hnext = ip_udp_hash[h];
+    ip_udp_hash[h] = conn - &ip_udp_conns[0] + 1;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+ip_udp_remove(struct ip_udp_conn *conn)
+{
+  ip_udp_bind(conn, 0);
+}
+#endif /* IP_UDP */
+/*---------------------------------------------------------------------------*/
+#if IP_INSTANCES
+void
+ip_stack_init(struct ip_stack *stack)
+{
+  memset(stack, 0, sizeof(struct ip_stack));
+  ip_stack_select(stack);
+#if IP_REASSEMBLY && defined(IP_REASS_ALLOC)
+  ip_reass_packet = IP_REASS_NOBLOCK;
+#endif /* IP_REASSEMBLY && IP_REASS_ALLOC */
+}
+/*---------------------------------------------------------------------------*/
+#endif /* IP_INSTANCES */
 void
 ip_init(void)
 {
+  uint8_t c;
+
   for(c = 0; c < IP_LISTENPORTS; ++c) {
     ip_listenports[c] = 0;
   }
   for(c = 0; c < IP_CONNS; ++c) {
     ip_conns[c].tcpstateflags = IP_CLOSED;
+    ip_conns[c].hnext = 0;
+#if IP_TIMERS
+    ip_timer_stop(&ip_conns[c].ptimer);
+#if IP_TCP_MSRTT
+    ip_timer_stop(&ip_conns[c].rtimer);
+#endif /* IP_TCP_MSRTT */
+#endif /* IP_TIMERS */
   }
+  memset(ip_conn_hash, 0, sizeof(ip_conn_hash));
 #if IP_ACTIVE_OPEN
   lastport = 1024;
 #endif /* IP_ACTIVE_OPEN */
@@ -307,7 +634,9 @@ ip_init(void)
 #if IP_UDP
   for(c = 0; c < IP_UDP_CONNS; ++c) {
     ip_udp_conns[c].lport = 0;
+    ip_udp_conns[c].hnext = 0;
   }
+  memset(ip_udp_hash, 0, sizeof(ip_udp_hash));
 #endif /* IP_UDP */
   
 
@@ -323,6 +652,7 @@ struct ip_conn *
 ip_connect(IP_address *ripaddr, uint16_t rport)
 {
   register struct ip_conn *conn, *cconn;
+  uint8_t c;
   
   /* Find an unused local port. */
  again:
@@ -369,16 +699,36 @@ ip_connect(IP_address *ripaddr, uint16_t rport)
   conn->snd_nxt[3] = iss[3];
 
   conn->initialmss = conn->mss = IP_TCP_MSS;
+#if IP_TCP_PMTUD
+  conn->peermss = IP_TCP_MSS;
+#endif /* IP_TCP_PMTUD */
   
   conn->len = 1;   /* TCP length of the SYN is one. */
+  conn->nseg = 0;
+  conn->swnd = IP_TCP_MSS;
+  conn->snd_wscale = 0;
+  conn->rcv_wscale = IP_TCP_WSCALE; /* Offered in the SYN. */
+#if IP_TCP_DELACK
+  conn->ackpend = conn->acktimer = 0;
+#endif /* IP_TCP_DELACK */
   conn->nrtx = 0;
   conn->timer = 1; /* Send the SYN next time around. */
   conn->rto = IP_RTO;
   conn->sa = 0;
   conn->sv = 16;   /* Initial value of the RTT variance. */
-  conn->lport = htons(lastport);
-  conn->rport = rport;
-  ip_ipaddr_copy(&conn->ripaddr, ripaddr);
+#if IP_TCP_MSRTT
+  conn->rto_ms = IP_TCP_RTO_INIT;
+  conn->srtt = conn->rttvar = 0;
+  conn->rtt_seg = 0;
+  ip_rexmit_arm(conn, 0); /* Due at once. */
+#endif /* IP_TCP_MSRTT */
+#if IP_TCP_DUPACKS
+  conn->dupacks = 0;
+#endif /* IP_TCP_DUPACKS */
+  ip_conn_rehash(conn, ripaddr, htons(lastport), rport);
+#if IP_TIMERS
+  ip_timer_set(&conn->ptimer, IP_TCP_PERIODIC, ip_tcp_periodic, conn);
+#endif /* IP_TIMERS */
   
   return conn;
 }
@@ -389,6 +739,7 @@ struct ip_udp_conn *
 ip_udp_new(IP_address *ripaddr, uint16_t rport)
 {
   register struct ip_udp_conn *conn;
+  uint8_t c;
   
   /* Find an unused local port. */
  again:
@@ -417,12 +768,12 @@ ip_udp_new(IP_address *ripaddr, uint16_t rport)
     return 0;
   }
   
-  conn->lport = HTONS(lastport);
+  ip_udp_bind(conn, HTONS(lastport));
   conn->rport = rport;
   if(ripaddr == NULL) {
     memset(&conn->ripaddr, 0, sizeof(IP_address));
   } else {
-    ip_ipaddr_copy(&conn->ripaddr, ripaddr);
+    ip_ipaddr_copy(conn->ripaddr, ripaddr);
   }
   conn->ttl = IP_TTL;
   
@@ -433,6 +784,8 @@ ip_udp_new(IP_address *ripaddr, uint16_t rport)
 void
 ip_unlisten(uint16_t port)
 {
+  uint8_t c;
+
   for(c = 0; c < IP_LISTENPORTS; ++c) {
     if(ip_listenports[c] == port) {
       ip_listenports[c] = 0;
@@ -444,6 +797,8 @@ ip_unlisten(uint16_t port)
 void
 ip_listen(uint16_t port)
 {
+  uint8_t c;
+
   for(c = 0; c < IP_LISTENPORTS; ++c) {
     if(ip_listenports[c] == 0) {
       ip_listenports[c] = port;
@@ -452,138 +807,238 @@ ip_listen(uint16_t port)
   }
 }
 /*---------------------------------------------------------------------------*/
-/* XXX: IP fragment reassembly: not well-tested. */
+/* IP fragment reassembly. Several datagrams can be reassembled at
+   once, each one in its own context keyed by (src, dst, id, proto).
+   Received data is tracked in 8-byte units (the fragment offset
+   granularity); bytes already received are never overwritten, so
+   overlapping fragments cannot alter data that has been accepted. */
 
 #if IP_REASSEMBLY && !IP_CONF_IPV6
-#define IP_REASS_BUFSIZE (IP_BUFSIZE - IP_LLH_LEN)
-static uint8_t ip_reassbuf[IP_REASS_BUFSIZE];
-static uint8_t ip_reassbitmap[IP_REASS_BUFSIZE / (8 * 8)];
-static const uint8_t bitmap_bits[8] = {0xff, 0x7f, 0x3f, 0x1f,
-				    0x0f, 0x07, 0x03, 0x01};
-static uint16_t ip_reasslen;
-static uint8_t ip_reassflags;
 #define IP_REASS_FLAG_LASTFRAG 0x01
-static uint8_t ip_reasstmr;
+
+#if !IP_INSTANCES
+static struct ip_reass_ctx ip_reass_ctxs[IP_REASS_CONTEXTS];
+
+#ifdef IP_REASS_ALLOC
+ip_reass_handle_t ip_reass_packet = IP_REASS_NOBLOCK;
+#endif /* IP_REASS_ALLOC */
+#endif /* !IP_INSTANCES */
 
 #define IP_MF   0x20
+#define REASSHDR(ctx) ((struct ip_tcpip_hdr *)(ctx)->hdr)
 
-static uint8_t
-ip_reass(void)
+static void
+ip_reass_free(struct ip_reass_ctx *ctx)
 {
-  uint16_t offset, len;
-  uint16_t i;
-
-  /* If ip_reasstmr is zero, no packet is present in the buffer, so we
-     write the IP header of the fragment into the reassembly
-     buffer. The timer is updated with the maximum age. */
-  if(ip_reasstmr == 0) {
-    memcpy(ip_reassbuf, &BUF->vhl, IP_IPH_LEN);
-    ip_reasstmr = IP_REASS_MAXAGE;
-    ip_reassflags = 0;
-    /* Clear the bitmap. */
-    memset(ip_reassbitmap, 0, sizeof(ip_reassbitmap));
-  }
-
-  /* Check if the incoming fragment matches the one currently present
-     in the reasembly buffer. If so, we proceed with copying the
-     fragment into the buffer. */
-  if(BUF->srcipaddr[0] == FBUF->srcipaddr[0] &&
-     BUF->srcipaddr[1] == FBUF->srcipaddr[1] &&
-     BUF->destipaddr[0] == FBUF->destipaddr[0] &&
-     BUF->destipaddr[1] == FBUF->destipaddr[1] &&
-     BUF->ipid[0] == FBUF->ipid[0] &&
-     BUF->ipid[1] == FBUF->ipid[1]) {
-
-    len = (BUF->len[0] << 8) + BUF->len[1] - (BUF->vhl & 0x0f) * 4;
-    offset = (((BUF->ipoffset[0] & 0x3f) << 8) + BUF->ipoffset[1]) * 8;
-
-    /* If the offset or the offset + fragment length overflows the
-       reassembly buffer, we discard the entire packet. */
-    if(offset > IP_REASS_BUFSIZE ||
-       offset + len > IP_REASS_BUFSIZE) {
-      ip_reasstmr = 0;
-      goto nullreturn;
-    }
+#ifdef IP_REASS_ALLOC
+  IP_REASS_FREE(ctx->handle);
+  ctx->handle = IP_REASS_NOBLOCK;
+#endif /* IP_REASS_ALLOC */
+  ctx->tmr = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Find the context the fragment in ip_buf belongs to, or set up a new
+   one for it. When all contexts are busy the one closest to its
+   timeout is recycled. */
+static struct ip_reass_ctx *
+ip_reass_lookup(void)
+{
+  struct ip_reass_ctx *ctx, *victim;
 
-    /* Copy the fragment into the reassembly buffer, at the right
-       offset. */
-    memcpy(&ip_reassbuf[IP_IPH_LEN + offset],
-	   (char *)BUF + (int)((BUF->vhl & 0x0f) * 4),
-	   len);
-      
-    /* Update the bitmap. */
-    if(offset / (8 * 8) == (offset + len) / (8 * 8)) {
-      /* If the two endpoints are in the same byte, we only update
-	 that byte. */
-	     
-      ip_reassbitmap[offset / (8 * 8)] |=
-	     bitmap_bits[(offset / 8 ) & 7] &
-	     ~bitmap_bits[((offset + len) / 8 ) & 7];
-    } else {
-      /* If the two endpoints are in different bytes, we update the
-	 bytes in the endpoints and fill the stuff inbetween with
-	 0xff. */
-      ip_reassbitmap[offset / (8 * 8)] |=
-	bitmap_bits[(offset / 8 ) & 7];
-      for(i = 1 + offset / (8 * 8); i < (offset + len) / (8 * 8); ++i) {
-	ip_reassbitmap[i] = 0xff;
+  victim = 0;
+  for(ctx = &ip_reass_ctxs[0]; ctx < &ip_reass_ctxs[IP_REASS_CONTEXTS]; ++ctx) {
+    if(ctx->tmr == 0) {
+      if(victim == 0 || victim->tmr != 0) {
+	victim = ctx;
       }
-      ip_reassbitmap[(offset + len) / (8 * 8)] |=
-	~bitmap_bits[((offset + len) / 8 ) & 7];
+      continue;
     }
-    
-    /* If this fragment has the More Fragments flag set to zero, we
-       know that this is the last fragment, so we can calculate the
-       size of the entire packet. We also set the
-       IP_REASS_FLAG_LASTFRAG flag to indicate that we have received
-       the final fragment. */
-
-    if((BUF->ipoffset[0] & IP_MF) == 0) {
-      ip_reassflags |= IP_REASS_FLAG_LASTFRAG;
-      ip_reasslen = offset + len;
+    if(BUF->srcipaddr[0] == REASSHDR(ctx)->srcipaddr[0] &&
+       BUF->srcipaddr[1] == REASSHDR(ctx)->srcipaddr[1] &&
+       BUF->destipaddr[0] == REASSHDR(ctx)->destipaddr[0] &&
+       BUF->destipaddr[1] == REASSHDR(ctx)->destipaddr[1] &&
+       BUF->ipid[0] == REASSHDR(ctx)->ipid[0] &&
+       BUF->ipid[1] == REASSHDR(ctx)->ipid[1] &&
+       BUF->proto == REASSHDR(ctx)->proto) {
+      return ctx;
     }
-    
-    /* Finally, we check if we have a full packet in the buffer. We do
-       this by checking if we have the last fragment and if all bits
-       in the bitmap are set. */
-    if(ip_reassflags & IP_REASS_FLAG_LASTFRAG) {
-      /* Check all bytes up to and including all but the last byte in
-	 the bitmap. */
-      for(i = 0; i < ip_reasslen / (8 * 8) - 1; ++i) {
-	if(ip_reassbitmap[i] != 0xff) {
-	  goto nullreturn;
-	}
-      }
-      /* Check the last byte in the bitmap. It should contain just the
-	 right amount of bits. */
-      if(ip_reassbitmap[ip_reasslen / (8 * 8)] !=
-	 (uint8_t)~bitmap_bits[ip_reasslen / 8 & 7]) {
-	goto nullreturn;
-      }
+    if(victim == 0 || (victim->tmr != 0 && ctx->tmr < victim->tmr)) {
+      victim = ctx;
+    }
+  }
+
+  if(victim->tmr != 0) {
+    IP_STAT(++ip_stat.ip.fragerr);
+    IP_LOG("ip: reassembly contexts exhausted, oldest datagram dropped.");
+    ip_reass_free(victim);
+  }
+
+#ifdef IP_REASS_ALLOC
+  victim->handle = IP_REASS_ALLOC(IP_REASS_DATASIZE);
+  if(victim->handle == IP_REASS_NOBLOCK) {
+    return 0;
+  }
+#endif /* IP_REASS_ALLOC */
+  memcpy(victim->hdr, &BUF->vhl, IP_IPH_LEN);
+  victim->tmr = IP_REASS_MAXAGE;
+  victim->flags = 0;
+  victim->len = 0;
+  memset(victim->bitmap, 0, sizeof(victim->bitmap));
+  return victim;
+}
+/*---------------------------------------------------------------------------*/
+static uint16_t
+ip_reass(void)
+{
+  struct ip_reass_ctx *ctx;
+  uint16_t offset, len, end, pos, chunk;
+  uint8_t *data;
+  uint8_t mask;
+
+  ctx = ip_reass_lookup();
+  if(ctx == 0) {
+    goto nullreturn;
+  }
+
+  len = (BUF->len[0] << 8) + BUF->len[1] - (BUF->vhl & 0x0f) * 4;
+  offset = (((BUF->ipoffset[0] & 0x1f) << 8) + BUF->ipoffset[1]) * 8;
+  end = offset + len;
+  data = (uint8_t *)BUF + (int)((BUF->vhl & 0x0f) * 4);
+
+  /* If the offset or the offset + fragment length overflows the
+     reassembly buffer, or the fragment contradicts the length given
+     by the last fragment, we discard the entire datagram. Only the
+     last fragment may carry a length that is not a multiple of 8. */
+  if(end > IP_REASS_DATASIZE || end < offset ||
+     ((BUF->ipoffset[0] & IP_MF) && (len & 7) != 0) ||
+     ((ctx->flags & IP_REASS_FLAG_LASTFRAG) &&
+      (end > ctx->len ||
+       ((BUF->ipoffset[0] & IP_MF) == 0 && end != ctx->len)))) {
+    IP_STAT(++ip_stat.ip.fragerr);
+    ip_reass_free(ctx);
+    goto nullreturn;
+  }
+
+  /* The fragment at offset 0 carries the header we forward. */
+  if(offset == 0) {
+    memcpy(ctx->hdr, &BUF->vhl, IP_IPH_LEN);
+  }
+
+  /* Copy the 8-byte units that have not been received yet into the
+     reassembly buffer and mark them in the bitmap. */
+  for(pos = offset; pos < end; pos += chunk) {
+    chunk = end - pos > 8 ? 8 : end - pos;
+    mask = 0x80 >> ((pos / 8) & 7);
+    if(ctx->bitmap[pos / 64] & mask) {
+      continue;
+    }
+#ifdef IP_REASS_ALLOC
+    IP_REASS_WRITE(ctx->handle, pos, data + (pos - offset), chunk);
+#else /* IP_REASS_ALLOC */
+    memcpy(&ctx->buf[pos], data + (pos - offset), chunk);
+#endif /* IP_REASS_ALLOC */
+    ctx->bitmap[pos / 64] |= mask;
+  }
 
-      /* If we have come this far, we have a full packet in the
-	 buffer, so we allocate a pbuf and copy the packet into it. We
-	 also reset the timer. */
-      ip_reasstmr = 0;
-      memcpy(BUF, FBUF, ip_reasslen);
-
-      /* Pretend to be a "normal" (i.e., not fragmented) IP packet
-	 from now on. */
-      BUF->ipoffset[0] = BUF->ipoffset[1] = 0;
-      BUF->len[0] = ip_reasslen >> 8;
-      BUF->len[1] = ip_reasslen & 0xff;
-      BUF->ipchksum = 0;
-      BUF->ipchksum = ~(ip_ipchksum());
-
-      return ip_reasslen;
+  /* If this fragment has the More Fragments flag set to zero, we
+     know that this is the last fragment, so we can calculate the
+     size of the entire packet. */
+  if((BUF->ipoffset[0] & IP_MF) == 0) {
+    ctx->flags |= IP_REASS_FLAG_LASTFRAG;
+    ctx->len = end;
+  }
+
+  /* Finally, we check if we have a full packet in the buffer. We do
+     this by checking if we have the last fragment and if every 8-byte
+     unit up to its end is marked in the bitmap. */
+  if((ctx->flags & IP_REASS_FLAG_LASTFRAG) == 0) {
+    goto nullreturn;
+  }
+  for(pos = 0; pos < ctx->len; pos += 8) {
+    if((ctx->bitmap[pos / 64] & (0x80 >> ((pos / 8) & 7))) == 0) {
+      goto nullreturn;
     }
   }
 
+  /* If we have come this far, we have a full datagram. The header goes
+     in front of the data in ip_buf and the context is released. */
+  memcpy(&BUF->vhl, ctx->hdr, IP_IPH_LEN);
+#ifdef IP_REASS_ALLOC
+  /* Only the part that fits is copied into ip_buf, the whole datagram
+     is left in ip_reass_packet for the driver, which then owns it. */
+  chunk = ctx->len > IP_BUFSIZE - IP_LLH_LEN - IP_IPH_LEN ?
+    IP_BUFSIZE - IP_LLH_LEN - IP_IPH_LEN : ctx->len;
+  IP_REASS_READ(ctx->handle, 0, (uint8_t *)BUF + IP_IPH_LEN, chunk);
+  IP_REASS_FREE(ip_reass_packet);
+  ip_reass_packet = ctx->handle;
+  ctx->handle = IP_REASS_NOBLOCK;
+#else /* IP_REASS_ALLOC */
+  memcpy((uint8_t *)BUF + IP_IPH_LEN, ctx->buf, ctx->len);
+#endif /* IP_REASS_ALLOC */
+  len = ctx->len + IP_IPH_LEN;
+  ip_reass_free(ctx);
+
+  /* Pretend to be a "normal" (i.e., not fragmented) IP packet
+     from now on. */
+  BUF->ipoffset[0] = BUF->ipoffset[1] = 0;
+  BUF->len[0] = len >> 8;
+  BUF->len[1] = len & 0xff;
+  BUF->ipchksum = 0;
+  BUF->ipchksum = ~(ip_ipchksum());
+
+  return len;
+
  nullreturn:
   return 0;
 }
+/*---------------------------------------------------------------------------*/
+void
+ip_reass_timer(void)
+{
+  struct ip_reass_ctx *ctx;
+
+  for(ctx = &ip_reass_ctxs[0]; ctx < &ip_reass_ctxs[IP_REASS_CONTEXTS]; ++ctx) {
+    if(ctx->tmr != 0 && --ctx->tmr == 0) {
+      IP_STAT(++ip_stat.ip.fragerr);
+      IP_STAT(++ip_stat.ip.reasstmo);
+      IP_LOG("ip: reassembly timeout.");
+      ip_reass_free(ctx);
+    }
+  }
+}
 #endif /* IP_REASSEMBLY */
 /*---------------------------------------------------------------------------*/
+uint16_t
+ip_sendwnd(struct ip_conn *conn)
+{
+  uint16_t mss = conn->mss;
+
+  if(conn->nseg >= IP_TCP_MAX_INFLIGHT) {
+    return 0;
+  }
+#if IP_TCP_PMTUD
+  /* Data the application split up before path MTU discovery lowered
+     the MSS may still go out in segments of the MSS the peer
+     announced, as far as the window allows. They are sent without DF
+     and fragmented on the way, see ip_df. */
+  if(conn->swnd > mss) {
+    mss = conn->swnd < conn->peermss? conn->swnd: conn->peermss;
+  }
+#endif /* IP_TCP_PMTUD */
+  /* If the peer advertises a zero window and nothing is in flight,
+     one segment is still sent out. It will not be acknowledged until
+     the window opens and is retransmitted until then; this is the
+     "persistent timer" and uses the retransmission mechanism. */
+  if(conn->nseg == 0) {
+    return mss;
+  }
+  if(conn->swnd <= conn->len) {
+    return 0;
+  }
+  return conn->swnd - conn->len < mss?
+    conn->swnd - conn->len: mss;
+}
+/*---------------------------------------------------------------------------*/
 static void
 ip_add_rcv_nxt(uint16_t n)
 {
@@ -594,11 +1049,142 @@ ip_add_rcv_nxt(uint16_t n)
   ip_conn->rcv_nxt[3] = ip_acc32[3];
 }
 /*---------------------------------------------------------------------------*/
+/* Parses the options of an incoming SYN or SYNACK. The MSS option
+   sets the segment size of the connection. Window scaling is only
+   used if both SYNs carry the option (RFC 7323): wscale is the shift
+   we offer, or 0 if we did not offer one, and both shifts of the
+   connection are cleared unless the peer offered one too. */
+static void
+ip_tcp_options(struct ip_conn *conn, uint8_t wscale)
+{
+  uint8_t c, opt, ws = 0, offered = 0;
+  uint16_t tmp16;
+
+  /* Without an MSS option the peer only takes the default. */
+  conn->initialmss = conn->mss =
+    IP_TCP_MSS > TCP_DEFAULT_MSS? TCP_DEFAULT_MSS: IP_TCP_MSS;
+
+  if((BUF->tcpoffset & 0xf0) > 0x50) {
+    for(c = 0; c < ((BUF->tcpoffset >> 4) - 5) << 2 ;) {
+      opt = ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + c];
+      if(opt == TCP_OPT_END) {
+	/* End of options. */
+	break;
+      } else if(opt == TCP_OPT_NOOP) {
+	++c;
+	/* NOP option. */
+      } else if(opt == TCP_OPT_MSS &&
+		ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == TCP_OPT_MSS_LEN) {
+	/* An MSS option with the right option length. */
+	tmp16 = ((uint16_t)ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 2 + c] << 8) |
+	  (uint16_t)ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 3 + c];
+	conn->initialmss = conn->mss =
+	  tmp16 > IP_TCP_MSS? IP_TCP_MSS: tmp16;
+	c += TCP_OPT_MSS_LEN;
+      } else if(opt == TCP_OPT_WS &&
+		ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == TCP_OPT_WS_LEN) {
+	/* A window scale option with the right option length. */
+	ws = ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 2 + c];
+	if(ws > TCP_MAX_WSCALE) {
+	  ws = TCP_MAX_WSCALE;
+	}
+	offered = 1;
+	c += TCP_OPT_WS_LEN;
+      } else {
+	/* All other options have a length field, so that we easily
+	   can skip past them. */
+	if(ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == 0) {
+	  /* If the length field is zero, the options are malformed
+	     and we don't process them further. */
+	  break;
+	}
+	c += ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c];
+      }
+    }
+  }
+
+#if IP_TCP_PMTUD
+  conn->peermss = conn->initialmss;
+#endif /* IP_TCP_PMTUD */
+
+  if(offered && wscale != 0) {
+    conn->snd_wscale = ws;
+    conn->rcv_wscale = wscale;
+  } else {
+    conn->snd_wscale = conn->rcv_wscale = 0;
+  }
+}
+#if IP_TCP_PMTUD && !IP_CONF_IPV6
+/*---------------------------------------------------------------------------*/
+/* The plateau table of RFC 1191, used when a router does not report
+   the MTU of its next hop. */
+static const uint16_t pmtu_plateaus[] = {
+  32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, PMTU_MIN
+};
+/*---------------------------------------------------------------------------*/
+/* Processes an ICMP "fragmentation needed" message. The MSS of the
+   TCP connection that sent the quoted segment is lowered to fit the
+   MTU of the next hop. The quoted sequence number must lie within the
+   data in flight, so that blind ICMP messages cannot shrink the
+   segments of a connection. */
+static void
+ip_pmtu_input(void)
+{
+  register struct ip_conn *conn;
+  uint16_t mtu, len;
+  uint8_t c;
+
+  if(ip_len < 2 * (IP_IPH_LEN + 8) ||
+     ICMPQBUF->vhl != 0x45 ||
+     ICMPQBUF->proto != IP_PROTO_TCP ||
+     !ip_ipaddr_cmp(ICMPQBUF->srcipaddr, ip_hostaddr)) {
+    return;
+  }
+
+  len = ((uint16_t)ICMPQBUF->len[0] << 8) + ICMPQBUF->len[1];
+  mtu = htons(ICMPBUF->seqno);
+  if(mtu == 0 || mtu >= len) {
+    /* No usable next hop MTU, take the plateau below the size of the
+       datagram that did not fit. */
+    for(c = 0; pmtu_plateaus[c] >= len && pmtu_plateaus[c] > PMTU_MIN; ++c);
+    mtu = pmtu_plateaus[c];
+  }
+  if(mtu < PMTU_MIN) {
+    mtu = PMTU_MIN;
+  }
+  mtu -= IP_IPTCPH_LEN;
+
+  for(c = ip_conn_hash[ip_conn_hashfn(ICMPQBUF->destipaddr,
+				       ICMPQBUF->srcport, ICMPQBUF->destport)];
+      c != 0;
+      c = conn->hnext) {
+    conn = &ip_conns[c - 1];
+    if(conn->tcpstateflags != IP_CLOSED &&
+       ICMPQBUF->srcport == conn->lport &&
+       ICMPQBUF->destport == conn->rport &&
+       ip_ipaddr_cmp(ICMPQBUF->destipaddr, conn->ripaddr)) {
+      if(ip_seqdiff(ICMPQBUF->seqno, conn->snd_nxt) < conn->len &&
+	 mtu < conn->initialmss) {
+	IP_LOG("icmp: path mtu lowered.");
+	conn->initialmss = mtu;
+	if(conn->mss > mtu) {
+	  conn->mss = mtu;
+	}
+      }
+      return;
+    }
+  }
+}
+#endif /* IP_TCP_PMTUD && !IP_CONF_IPV6 */
+/*---------------------------------------------------------------------------*/
 void
 ip_process(uint8_t flag)
 {
   register struct ip_conn *ip_connr = ip_conn;
+  uint8_t c, wndupdate = 0;
+  uint16_t tmp16;
 
+  ip_schainlen = 0;
 #if IP_UDP
   if(flag == IP_UDP_SEND_CONN) {
     goto udp_send;
@@ -606,25 +1192,50 @@ ip_process(uint8_t flag)
 #endif /* IP_UDP */
   
   ip_sappdata = ip_appdata = &ip_buf[IP_IPTCPH_LEN + IP_LLH_LEN];
+  ip_schain = NULL;
+  ip_sndoff = 0;
+#if IP_TCP_PMTUD
+  ip_df = 0;
+#endif /* IP_TCP_PMTUD */
+  ip_acksegs = 0;
 
   /* Check if we were invoked because of a poll request for a
      particular connection. */
   if(flag == IP_POLL_REQUEST) {
     if((ip_connr->tcpstateflags & IP_TS_MASK) == IP_ESTABLISHED &&
-       !ip_outstanding(ip_connr)) {
+       ip_connr->nseg < IP_TCP_MAX_INFLIGHT) {
 	ip_flags = IP_POLL;
 	IP_APPCALL();
 	goto appsend;
     }
     goto drop;
     
+#if IP_TCP_MSRTT
+    /* Check if we were invoked to run the retransmission timer of a
+       connection between two periodic timer pulses. */
+  } else if(flag == IP_REXMIT_TIMER) {
+    ip_len = 0;
+    ip_slen = 0;
+    if(ip_connr->tcpstateflags != IP_CLOSED &&
+       ip_connr->tcpstateflags != IP_TIME_WAIT &&
+       ip_connr->tcpstateflags != IP_FIN_WAIT_2 &&
+       ip_outstanding(ip_connr)) {
+      if((int32_t)(IP_TCP_CLOCK() - ip_connr->rexmit_at) >= 0) {
+	goto rexmit_timeout;
+      }
+#if IP_TIMERS
+      /* The wheel runs in IP_TIMER_TICK steps and may fire a little
+	 early; wait for the rest of the timeout. */
+      ip_timer_set(&ip_connr->rtimer,
+		   ip_connr->rexmit_at - IP_TCP_CLOCK(),
+		   ip_rexmit_expired, ip_connr);
+#endif /* IP_TIMERS */
+    }
+    goto drop;
+#endif /* IP_TCP_MSRTT */
+
     /* Check if we were invoked because of the perodic timer fireing. */
   } else if(flag == IP_TIMER) {
-#if IP_REASSEMBLY
-    if(ip_reasstmr != 0) {
-      --ip_reasstmr;
-    }
-#endif /* IP_REASSEMBLY */
     /* Increase the initial sequence number. */
     if(++iss[3] == 0) {
       if(++iss[2] == 0) {
@@ -649,11 +1260,23 @@ ip_process(uint8_t flag)
 	ip_connr->tcpstateflags = IP_CLOSED;
       }
     } else if(ip_connr->tcpstateflags != IP_CLOSED) {
+#if IP_TCP_DELACK
+      /* Run the delayed ACK timer. An expired timer is noticed below,
+	 unless a retransmission carries the ACK first. */
+      if(ip_connr->acktimer != 0) {
+	--ip_connr->acktimer;
+      }
+#endif /* IP_TCP_DELACK */
       /* If the connection has outstanding data, we increase the
 	 connection's timer and see if it has reached the RTO value
 	 in which case we retransmit. */
       if(ip_outstanding(ip_connr)) {
+#if IP_TCP_MSRTT
+	if((int32_t)(IP_TCP_CLOCK() - ip_connr->rexmit_at) >= 0) {
+	rexmit_timeout:
+#else /* IP_TCP_MSRTT */
 	if(ip_connr->timer-- == 0) {
+#endif /* IP_TCP_MSRTT */
 	  if(ip_connr->nrtx == IP_MAXRTX ||
 	     ((ip_connr->tcpstateflags == IP_SYN_SENT ||
 	       ip_connr->tcpstateflags == IP_SYN_RCVD) &&
@@ -672,9 +1295,17 @@ ip_process(uint8_t flag)
 	  }
 
 	  /* Exponential backoff. */
+#if IP_TCP_MSRTT
+	  ip_connr->rto_ms = ip_connr->rto_ms > IP_TCP_RTO_MAX / 2?
+	    IP_TCP_RTO_MAX: ip_connr->rto_ms << 1;
+	  ip_rexmit_arm(ip_connr, ip_connr->rto_ms);
+	  /* Karn's algorithm: retransmitted segments are not timed. */
+	  ip_connr->rtt_seg = 0;
+#else /* IP_TCP_MSRTT */
 	  ip_connr->timer = IP_RTO << (ip_connr->nrtx > 4?
 					 4:
 					 ip_connr->nrtx);
+#endif /* IP_TCP_MSRTT */
 	  ++(ip_connr->nrtx);
 	  
 	  /* Ok, so we need to retransmit. We do this differently
@@ -703,7 +1334,14 @@ ip_process(uint8_t flag)
                the code for sending out the packet (the apprexmit
                label). */
 	    ip_flags = IP_REXMIT;
+#if IP_TCP_DUPACKS
+	  fast_rexmit:
+#endif /* IP_TCP_DUPACKS */
 	    IP_APPCALL();
+	    /* Only the oldest unacknowledged segment is resent. */
+	    if(ip_slen > ip_connr->seglen[0]) {
+	      ip_slen = ip_connr->seglen[0];
+	    }
 	    goto apprexmit;
 	    
 	  case IP_FIN_WAIT_1:
@@ -714,13 +1352,22 @@ ip_process(uint8_t flag)
 	    
 	  }
 	}
-      } else if((ip_connr->tcpstateflags & IP_TS_MASK) == IP_ESTABLISHED) {
-	/* If there was no need for a retransmission, we poll the
-           application for new data. */
+      }
+      if((ip_connr->tcpstateflags & IP_TS_MASK) == IP_ESTABLISHED &&
+	 ip_connr->nseg < IP_TCP_MAX_INFLIGHT) {
+	/* If there was no need for a retransmission and there is room
+           for another segment in flight, we poll the application for
+           new data. */
 	ip_flags = IP_POLL;
 	IP_APPCALL();
 	goto appsend;
       }
+#if IP_TCP_DELACK
+      if(ip_connr->ackpend != 0 && ip_connr->acktimer == 0) {
+	/* The delayed ACK is due and no data can carry it. */
+	goto tcp_send_ack;
+      }
+#endif /* IP_TCP_DELACK */
     }
     goto drop;
   }
@@ -741,6 +1388,9 @@ ip_process(uint8_t flag)
 
   /* This is where the input processing starts. */
   IP_STAT(++ip_stat.ip.recv);
+#if IP_HISTOGRAMS
+  ip_rxstamp = IP_CLOCK_US();
+#endif /* IP_HISTOGRAMS */
 
   /* Start of IP input header processing code. */
   
@@ -755,6 +1405,15 @@ ip_process(uint8_t flag)
 #else /* IP_CONF_IPV6 */
   /* Check validity of the IP header. */
   if(BUF->vhl != 0x45)  { /* IP version and header length. */
+#if IP_DUALSTACK
+    /* IPv6 is told apart only once the IPv4 check has failed, so
+       IPv4 packets take the same single compare as before. */
+    if((BUF->vhl & 0xf0) == 0x60) {
+      ip6_input();
+      ip_flags = 0;
+      return;
+    }
+#endif /* IP_DUALSTACK */
     IP_STAT(++ip_stat.ip.drop);
     IP_STAT(++ip_stat.ip.vhlerr);
     IP_LOG("ip: invalid version or header length.");
@@ -889,6 +1548,16 @@ ip_process(uint8_t flag)
 #endif /* IP_PINGADDRCONF */
   IP_STAT(++ip_stat.icmp.recv);
 
+#if IP_TCP_PMTUD
+  /* A router could not forward one of our TCP segments without
+     fragmenting it (RFC 1191). */
+  if(ICMPBUF->type == ICMP_DEST_UNREACH &&
+     ICMPBUF->icode == ICMP_FRAG_NEEDED) {
+    ip_pmtu_input();
+    goto drop;
+  }
+#endif /* IP_TCP_PMTUD */
+
   /* ICMP echo (i.e., ping) processing. This is simple, we only change
      the ICMP type from ECHO to ECHO_REPLY and adjust the ICMP
      checksum before we return the packet. */
@@ -1014,10 +1683,12 @@ ip_process(uint8_t flag)
   ip_len = ip_len - IP_IPUDPH_LEN;
 #endif /* IP_UDP_CHECKSUMS */
 
-  /* Demultiplex this UDP packet between the UDP "connections". */
-  for(ip_udp_conn = &ip_udp_conns[0];
-      ip_udp_conn < &ip_udp_conns[IP_UDP_CONNS];
-      ++ip_udp_conn) {
+  /* Demultiplex this UDP packet between the UDP "connections" bound
+     to its destination port. */
+  for(c = ip_udp_hash[ip_udp_hashfn(UDPBUF->destport)];
+      c != 0;
+      c = ip_udp_conn->hnext) {
+    ip_udp_conn = &ip_udp_conns[c - 1];
     /* If the local UDP port is non-zero, the connection is considered
        to be used. If so, the local port number is checked against the
        destination port number in the received packet. If the two port
@@ -1043,12 +1714,16 @@ ip_process(uint8_t flag)
   ip_flags = IP_NEWDATA;
   ip_sappdata = ip_appdata = &ip_buf[IP_LLH_LEN + IP_IPUDPH_LEN];
   ip_slen = 0;
+  IP_RXSAMPLE();
   IP_UDP_APPCALL();
  udp_send:
   if(ip_slen == 0) {
     goto drop;
   }
   ip_len = ip_slen + IP_IPUDPH_LEN;
+  if(ip_schain != NULL) {
+    ip_schainlen = ip_slen;
+  }
 
 #if IP_CONF_IPV6
   /* For IPv6, the IP length field does not include the IPv6 IP header
@@ -1101,9 +1776,11 @@ ip_process(uint8_t flag)
   
   
   /* Demultiplex this segment. */
-  /* First check any active connections. */
-  for(ip_connr = &ip_conns[0]; ip_connr <= &ip_conns[IP_CONNS - 1];
-      ++ip_connr) {
+  /* First check any active connections hashed on this tuple. */
+  for(c = ip_conn_hash[ip_conn_hashfn(BUF->srcipaddr, BUF->destport, BUF->srcport)];
+      c != 0;
+      c = ip_connr->hnext) {
+    ip_connr = &ip_conns[c - 1];
     if(ip_connr->tcpstateflags != IP_CLOSED &&
        BUF->destport == ip_connr->lport &&
        BUF->srcport == ip_connr->rport &&
@@ -1221,9 +1898,19 @@ ip_process(uint8_t flag)
   ip_connr->sa = 0;
   ip_connr->sv = 4;
   ip_connr->nrtx = 0;
-  ip_connr->lport = BUF->destport;
-  ip_connr->rport = BUF->srcport;
-  ip_ipaddr_copy(ip_connr->ripaddr, BUF->srcipaddr);
+#if IP_TCP_MSRTT
+  ip_connr->rto_ms = IP_TCP_RTO_INIT;
+  ip_connr->srtt = ip_connr->rttvar = 0;
+  ip_connr->rtt_seg = 0;
+  ip_rexmit_arm(ip_connr, IP_TCP_RTO_INIT);
+#endif /* IP_TCP_MSRTT */
+#if IP_TIMERS
+  ip_timer_set(&ip_connr->ptimer, IP_TCP_PERIODIC, ip_tcp_periodic, ip_connr);
+#endif /* IP_TIMERS */
+#if IP_TCP_DUPACKS
+  ip_connr->dupacks = 0;
+#endif /* IP_TCP_DUPACKS */
+  ip_conn_rehash(ip_connr, (IP_address *)BUF->srcipaddr, BUF->destport, BUF->srcport);
   ip_connr->tcpstateflags = IP_SYN_RCVD;
 
   ip_connr->snd_nxt[0] = iss[0];
@@ -1231,6 +1918,11 @@ ip_process(uint8_t flag)
   ip_connr->snd_nxt[2] = iss[2];
   ip_connr->snd_nxt[3] = iss[3];
   ip_connr->len = 1;
+  ip_connr->nseg = 0;
+  ip_connr->swnd = IP_TCP_MSS;
+#if IP_TCP_DELACK
+  ip_connr->ackpend = ip_connr->acktimer = 0;
+#endif /* IP_TCP_DELACK */
 
   /* rcv_nxt should be the seqno from the incoming packet + 1. */
   ip_connr->rcv_nxt[3] = BUF->seqno[3];
@@ -1239,38 +1931,9 @@ ip_process(uint8_t flag)
   ip_connr->rcv_nxt[0] = BUF->seqno[0];
   ip_add_rcv_nxt(1);
 
-  /* Parse the TCP MSS option, if present. */
-  if((BUF->tcpoffset & 0xf0) > 0x50) {
-    for(c = 0; c < ((BUF->tcpoffset >> 4) - 5) << 2 ;) {
-      opt = ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + c];
-      if(opt == TCP_OPT_END) {
-	/* End of options. */
-	break;
-      } else if(opt == TCP_OPT_NOOP) {
-	++c;
-	/* NOP option. */
-      } else if(opt == TCP_OPT_MSS &&
-		ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == TCP_OPT_MSS_LEN) {
-	/* An MSS option with the right option length. */
-	tmp16 = ((uint16_t)ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 2 + c] << 8) |
-	  (uint16_t)ip_buf[IP_IPTCPH_LEN + IP_LLH_LEN + 3 + c];
-	ip_connr->initialmss = ip_connr->mss =
-	  tmp16 > IP_TCP_MSS? IP_TCP_MSS: tmp16;
-	
-	/* And we are done processing options. */
-	break;
-      } else {
-	/* All other options have a length field, so that we easily
-	   can skip past them. */
-	if(ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == 0) {
-	  /* If the length field is zero, the options are malformed
-	     and we don't process them further. */
-	  break;
-	}
-	c += ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c];
-      }
-    }
-  }
+  /* Parse the TCP MSS and window scale options, if present. Window
+     scaling is only used if both ends offer it. */
+  ip_tcp_options(ip_connr, IP_TCP_WSCALE);
   
   /* Our response will be a SYNACK. */
 #if IP_ACTIVE_OPEN
@@ -1292,6 +1955,18 @@ ip_process(uint8_t flag)
   BUF->optdata[3] = (IP_TCP_MSS) & 255;
   ip_len = IP_IPTCPH_LEN + TCP_OPT_MSS_LEN;
   BUF->tcpoffset = ((IP_TCPH_LEN + TCP_OPT_MSS_LEN) / 4) << 4;
+#if IP_TCP_WSCALE
+  /* Window scaling is offered in the SYN, and confirmed in the
+     SYNACK if the peer offered it. */
+  if(ip_connr->rcv_wscale != 0) {
+    BUF->optdata[4] = TCP_OPT_NOOP;
+    BUF->optdata[5] = TCP_OPT_WS;
+    BUF->optdata[6] = TCP_OPT_WS_LEN;
+    BUF->optdata[7] = ip_connr->rcv_wscale;
+    ip_len = IP_IPTCPH_LEN + TCP_OPT_MSS_LEN + 1 + TCP_OPT_WS_LEN;
+    BUF->tcpoffset = ((IP_TCPH_LEN + TCP_OPT_MSS_LEN + 1 + TCP_OPT_WS_LEN) / 4) << 4;
+  }
+#endif /* IP_TCP_WSCALE */
   goto tcp_send;
 
   /* This label will be jumped to if we found an active connection. */
@@ -1332,23 +2007,97 @@ ip_process(uint8_t flag)
   }
 
   /* Next, check if the incoming segment acknowledges any outstanding
-     data. If so, we update the sequence number, reset the length of
-     the outstanding data, calculate RTT estimations, and reset the
-     retransmission timer. */
+     data. If so, we release every segment it fully covers, update the
+     sequence number and the length of the outstanding data, calculate
+     RTT estimations, and reset the retransmission timer. An ACK that
+     only covers part of a segment releases nothing; the segment is
+     retransmitted whole. */
+  if(BUF->flags & TCP_ACK) {
+    tmp16 = ip_connr->swnd;
+    /* The window of a SYN segment is never scaled. */
+    ip_connr->swnd = ip_tcp_wnd((((uint32_t)BUF->wnd[0] << 8) +
+				 (uint32_t)BUF->wnd[1]) <<
+				((BUF->flags & TCP_SYN)? 0: ip_connr->snd_wscale));
+    /* Remember whether this is a window update. */
+    wndupdate = ip_connr->swnd != tmp16;
+  }
   if((BUF->flags & TCP_ACK) && ip_outstanding(ip_connr)) {
-    ip_add32(ip_connr->snd_nxt, ip_connr->len);
+    tmp16 = ip_seqdiff(BUF->ackno, ip_connr->snd_nxt);
+
+    if(tmp16 > ip_connr->len) {
+      /* Acknowledges something we have not sent, or is old. */
+      tmp16 = 0;
+#if IP_TCP_DUPACKS
+    } else if(tmp16 == 0) {
+      /* A duplicate ACK: no data, no window change and nothing new
+	 acknowledged while data is in flight. The segments that
+	 follow a lost one each cause one; after IP_TCP_DUPACKS of
+	 them the lost segment is retransmitted without waiting for
+	 the retransmission timer. */
+      if(ip_connr->nseg > 0 && ip_len == 0 &&
+	 (BUF->flags & (TCP_SYN | TCP_FIN)) == 0 &&
+	 !wndupdate &&
+	 ++ip_connr->dupacks == IP_TCP_DUPACKS &&
+	 (ip_connr->tcpstateflags & IP_TS_MASK) == IP_ESTABLISHED) {
+	IP_STAT(++ip_stat.tcp.rexmit);
+#if IP_TCP_MSRTT
+	ip_connr->rtt_seg = 0;
+#endif /* IP_TCP_MSRTT */
+	ip_flags = IP_REXMIT;
+	ip_slen = 0;
+	goto fast_rexmit;
+      }
+#endif /* IP_TCP_DUPACKS */
+    } else if(ip_connr->nseg == 0) {
+      /* A SYN or FIN is outstanding, it must be acknowledged as a
+	 whole. */
+      if(tmp16 != ip_connr->len) {
+	tmp16 = 0;
+      }
+    } else {
+      uint16_t acked = 0;
+      while(ip_acksegs < ip_connr->nseg &&
+	    acked + ip_connr->seglen[ip_acksegs] <= tmp16) {
+	acked += ip_connr->seglen[ip_acksegs];
+	++ip_acksegs;
+      }
+      tmp16 = acked;
+      for(c = ip_acksegs; c < ip_connr->nseg; ++c) {
+	ip_connr->seglen[c - ip_acksegs] = ip_connr->seglen[c];
+      }
+      ip_connr->nseg -= ip_acksegs;
+    }
 
-    if(BUF->ackno[0] == ip_acc32[0] &&
-       BUF->ackno[1] == ip_acc32[1] &&
-       BUF->ackno[2] == ip_acc32[2] &&
-       BUF->ackno[3] == ip_acc32[3]) {
+    if(tmp16 > 0) {
       /* Update sequence number. */
+      ip_add32(ip_connr->snd_nxt, tmp16);
       ip_connr->snd_nxt[0] = ip_acc32[0];
       ip_connr->snd_nxt[1] = ip_acc32[1];
       ip_connr->snd_nxt[2] = ip_acc32[2];
       ip_connr->snd_nxt[3] = ip_acc32[3];
-	
 
+      /* Update length of outstanding data. */
+      ip_connr->len -= tmp16;
+
+#if IP_TCP_DUPACKS
+      ip_connr->dupacks = 0;
+#endif /* IP_TCP_DUPACKS */
+
+#if IP_TCP_MSRTT
+      /* Do RTT estimation if the timed segment was acknowledged. It is
+	 never a retransmitted one (Karn's algorithm). */
+      if(ip_connr->rtt_seg != 0 && ip_connr->rtt_seg <= ip_acksegs) {
+	ip_rtt_sample(ip_connr, IP_TCP_CLOCK() - ip_connr->rtt_ts);
+	ip_connr->rtt_seg = 0;
+      } else if(ip_connr->rtt_seg != 0) {
+	ip_connr->rtt_seg -= ip_acksegs;
+      }
+      /* Set the acknowledged flag. */
+      ip_flags = IP_ACKDATA;
+      /* Restart the retransmission timer for the remaining data. */
+      ip_rexmit_arm(ip_connr, ip_connr->rto_ms);
+      ip_connr->nrtx = 0;
+#else /* IP_TCP_MSRTT */
       /* Do RTT estimation, unless we have done retransmissions. */
       if(ip_connr->nrtx == 0) {
 	signed char m;
@@ -1368,9 +2117,8 @@ ip_process(uint8_t flag)
       ip_flags = IP_ACKDATA;
       /* Reset the retransmission timer. */
       ip_connr->timer = ip_connr->rto;
-
-      /* Reset length of outstanding data. */
-      ip_connr->len = 0;
+      ip_connr->nrtx = 0;
+#endif /* IP_TCP_MSRTT */
     }
     
   }
@@ -1408,38 +2156,10 @@ ip_process(uint8_t flag)
     if((ip_flags & IP_ACKDATA) &&
        (BUF->flags & TCP_CTL) == (TCP_SYN | TCP_ACK)) {
 
-      /* Parse the TCP MSS option, if present. */
-      if((BUF->tcpoffset & 0xf0) > 0x50) {
-	for(c = 0; c < ((BUF->tcpoffset >> 4) - 5) << 2 ;) {
-	  opt = ip_buf[IP_IPTCPH_LEN + IP_LLH_LEN + c];
-	  if(opt == TCP_OPT_END) {
-	    /* End of options. */
-	    break;
-	  } else if(opt == TCP_OPT_NOOP) {
-	    ++c;
-	    /* NOP option. */
-	  } else if(opt == TCP_OPT_MSS &&
-		    ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == TCP_OPT_MSS_LEN) {
-	    /* An MSS option with the right option length. */
-	    tmp16 = (ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 2 + c] << 8) |
-	      ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 3 + c];
-	    ip_connr->initialmss =
-	      ip_connr->mss = tmp16 > IP_TCP_MSS? IP_TCP_MSS: tmp16;
-
-	    /* And we are done processing options. */
-	    break;
-	  } else {
-	    /* All other options have a length field, so that we easily
-	       can skip past them. */
-	    if(ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c] == 0) {
-	      /* If the length field is zero, the options are malformed
-		 and we don't process them further. */
-	      break;
-	    }
-	    c += ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN + 1 + c];
-	  }
-	}
-      }
+      /* Parse the TCP MSS and window scale options, if present. If
+	 either SYN went without the window scale option, neither side
+	 scales its window. */
+      ip_tcp_options(ip_connr, ip_connr->rcv_wscale);
       ip_connr->tcpstateflags = IP_ESTABLISHED;
       ip_connr->rcv_nxt[0] = BUF->seqno[0];
       ip_connr->rcv_nxt[1] = BUF->seqno[1];
@@ -1532,7 +2252,7 @@ ip_process(uint8_t flag)
        and the application will retransmit it. This is called the
        "persistent timer" and uses the retransmission mechanim.
     */
-    tmp16 = ((uint16_t)BUF->wnd[0] << 8) + (uint16_t)BUF->wnd[1];
+    tmp16 = ip_connr->swnd;
     if(tmp16 > ip_connr->initialmss ||
        tmp16 == 0) {
       tmp16 = ip_connr->initialmss;
@@ -1555,6 +2275,7 @@ ip_process(uint8_t flag)
        send, ip_len must be set to 0. */
     if(ip_flags & (IP_NEWDATA | IP_ACKDATA)) {
       ip_slen = 0;
+      IP_RXSAMPLE();
       IP_APPCALL();
 
     appsend:
@@ -1566,7 +2287,10 @@ ip_process(uint8_t flag)
 	goto tcp_send_nodata;
       }
 
-      if(ip_flags & IP_CLOSE) {
+      /* The FIN is sent once all data has been acknowledged. Until
+	 then the request is ignored and the application has to issue
+	 ip_close() again on a later ip_acked() or ip_poll(). */
+      if((ip_flags & IP_CLOSE) && ip_connr->len == 0) {
 	ip_slen = 0;
 	ip_connr->len = 1;
 	ip_connr->tcpstateflags = IP_FIN_WAIT_1;
@@ -1578,44 +2302,52 @@ ip_process(uint8_t flag)
       /* If ip_slen > 0, the application has data to be sent. */
       if(ip_slen > 0) {
 
-	/* If the connection has acknowledged data, the contents of
-	   the ->len variable should be discarded. */
-	if((ip_flags & IP_ACKDATA) != 0) {
-	  ip_connr->len = 0;
-	}
-
-	/* If the ->len variable is non-zero the connection has
-	   already data in transit and cannot send anymore right
-	   now. */
-	if(ip_connr->len == 0) {
+	/* New data can only be sent while there is a free segment
+	   slot and the window advertised by the peer has room for
+	   more, see ip_sendwnd(). */
+	tmp16 = ip_sendwnd(ip_connr);
+	if(tmp16 > 0) {
 
 	  /* The application cannot send more than what is allowed by
 	     the mss (the minumum of the MSS and the available
 	     window). */
-	  if(ip_slen > ip_connr->mss) {
-	    ip_slen = ip_connr->mss;
+	  if(ip_slen > tmp16) {
+	    ip_slen = tmp16;
 	  }
 
-	  /* Remember how much data we send out now so that we know
-	     when everything has been acknowledged. */
-	  ip_connr->len = ip_slen;
+	  /* The new segment follows the data already in flight.
+	     Remember how much data we send out now so that we know
+	     when it has been acknowledged. */
+	  ip_sndoff = ip_connr->len;
+	  ip_connr->seglen[ip_connr->nseg] = ip_slen;
+	  ++ip_connr->nseg;
+	  ip_connr->len += ip_slen;
+#if IP_TCP_MSRTT
+	  /* Time this segment unless another one is being timed. */
+	  if(ip_connr->rtt_seg == 0) {
+	    ip_connr->rtt_seg = ip_connr->nseg;
+	    ip_connr->rtt_ts = IP_TCP_CLOCK();
+	  }
+#endif /* IP_TCP_MSRTT */
 	} else {
 
-	  /* If the application already had unacknowledged data, we
-	     make sure that the application does not send (i.e.,
-	     retransmit) out more than it previously sent out. */
-	  ip_slen = ip_connr->len;
+	  /* All segment slots are in use or the window is full: the
+	     application has to offer the data again later. */
+	  ip_slen = 0;
 	}
       }
-      ip_connr->nrtx = 0;
     apprexmit:
       ip_appdata = ip_sappdata;
       
       /* If the application has data to be sent, or if the incoming
          packet had new data in it, we must send out a packet. */
-      if(ip_slen > 0 && ip_connr->len > 0) {
+      if(ip_slen > 0) {
 	/* Add the length of the IP and TCP headers. */
-	ip_len = ip_connr->len + IP_TCPIP_HLEN;
+	ip_len = ip_slen + IP_TCPIP_HLEN;
+	if(ip_schain != NULL) {
+	  /* The data is not in ip_buf but in the fragments. */
+	  ip_schainlen = ip_slen;
+	}
 	/* We always set the ACK flag in response packets. */
 	BUF->flags = TCP_ACK | TCP_PSH;
 	/* Send the packet. */
@@ -1624,10 +2356,32 @@ ip_process(uint8_t flag)
       /* If there is no data to send, just send out a pure ACK if
 	 there is newdata. */
       if(ip_flags & IP_NEWDATA) {
+#if IP_TCP_DELACK
+	/* With delayed ACKs only every second data segment is
+	   acknowledged right away. The ACK of a single one waits for
+	   outgoing data or for the delayed ACK timer. The ACK that
+	   completes an active open carries no data and is never
+	   delayed. */
+	if(ip_len > 0 && ++ip_connr->ackpend < 2) {
+	  ip_connr->acktimer = IP_TCP_DELACK_TIMEOUT;
+	  goto drop;
+	}
+#endif /* IP_TCP_DELACK */
+	ip_sndoff = ip_connr->len;
 	ip_len = IP_TCPIP_HLEN;
 	BUF->flags = TCP_ACK;
 	goto tcp_send_noopts;
       }
+#if IP_TCP_DELACK
+      /* The application was polled because the delayed ACK is due,
+	 but had nothing to send. */
+      if(ip_connr->ackpend != 0 && ip_connr->acktimer == 0) {
+	ip_sndoff = ip_connr->len;
+	ip_len = IP_TCPIP_HLEN;
+	BUF->flags = TCP_ACK;
+	goto tcp_send_noopts;
+      }
+#endif /* IP_TCP_DELACK */
     }
     goto drop;
   case IP_LAST_ACK:
@@ -1702,6 +2456,11 @@ ip_process(uint8_t flag)
      to set the appropriate TCP sequence numbers in the TCP header. */
  tcp_send_ack:
   BUF->flags = TCP_ACK;
+  if(ip_connr->nseg > 0) {
+    /* A pure ACK carries the sequence number following the data in
+       flight. */
+    ip_sndoff = ip_connr->len;
+  }
  tcp_send_nodata:
   ip_len = IP_IPTCPH_LEN;
  tcp_send_noopts:
@@ -1715,11 +2474,36 @@ ip_process(uint8_t flag)
   BUF->ackno[1] = ip_connr->rcv_nxt[1];
   BUF->ackno[2] = ip_connr->rcv_nxt[2];
   BUF->ackno[3] = ip_connr->rcv_nxt[3];
+#if IP_TCP_DELACK
+  /* Every segment we send acknowledges all data received so far. */
+  ip_connr->ackpend = 0;
+  ip_connr->acktimer = 0;
+#endif /* IP_TCP_DELACK */
   
-  BUF->seqno[0] = ip_connr->snd_nxt[0];
-  BUF->seqno[1] = ip_connr->snd_nxt[1];
-  BUF->seqno[2] = ip_connr->snd_nxt[2];
-  BUF->seqno[3] = ip_connr->snd_nxt[3];
+  /* Segments sent while others are in flight start ip_sndoff bytes
+     past the oldest unacknowledged sequence number. */
+  ip_add32(ip_connr->snd_nxt, ip_sndoff);
+  BUF->seqno[0] = ip_acc32[0];
+  BUF->seqno[1] = ip_acc32[1];
+  BUF->seqno[2] = ip_acc32[2];
+  BUF->seqno[3] = ip_acc32[3];
+
+#if IP_TCP_MSRTT
+  /* A segment that starts at the oldest unacknowledged sequence
+     number and occupies sequence space (re)arms the retransmission
+     timer. */
+  if(ip_sndoff == 0 && ip_outstanding(ip_connr) &&
+     (BUF->flags & TCP_RST) == 0 &&
+     ((BUF->flags & (TCP_SYN | TCP_FIN)) || ip_len > IP_IPTCPH_LEN)) {
+    ip_rexmit_arm(ip_connr, ip_connr->rto_ms);
+  }
+#endif /* IP_TCP_MSRTT */
+
+#if IP_TCP_PMTUD
+  /* Segments sent before the path MTU was lowered may be too large
+     for the path now, they are let through fragmented. */
+  ip_df = ip_len <= IP_IPTCPH_LEN + ip_connr->initialmss;
+#endif /* IP_TCP_PMTUD */
 
   BUF->proto = IP_PROTO_TCP;
   
@@ -1734,8 +2518,12 @@ ip_process(uint8_t flag)
        window so that the remote host will stop sending data. */
     BUF->wnd[0] = BUF->wnd[1] = 0;
   } else {
-    BUF->wnd[0] = ((IP_RECEIVE_WINDOW) >> 8);
-    BUF->wnd[1] = ((IP_RECEIVE_WINDOW) & 0xff);
+    /* The advertised window reflects the buffer space the
+       connection has left, it is never scaled in SYN segments. */
+    tmp16 = ip_tcp_wnd((uint32_t)(IP_TCP_RCVWND(ip_connr)) >>
+		       ((BUF->flags & TCP_SYN)? 0: ip_connr->rcv_wscale));
+    BUF->wnd[0] = tmp16 >> 8;
+    BUF->wnd[1] = tmp16 & 0xff;
   }
 
  tcp_send_noconn:
@@ -1765,10 +2553,15 @@ ip_process(uint8_t flag)
 #else /* IP_CONF_IPV6 */
   BUF->vhl = 0x45;
   BUF->tos = 0;
+#if IP_TCP_PMTUD
+  BUF->ipoffset[0] = ip_df? IP_DF: 0;
+  BUF->ipoffset[1] = 0;
+#else /* IP_TCP_PMTUD */
   BUF->ipoffset[0] = BUF->ipoffset[1] = 0;
-  ++ipid;
-  BUF->ipid[0] = ipid >> 8;
-  BUF->ipid[1] = ipid & 0xff;
+#endif /* IP_TCP_PMTUD */
+  ++ip_id;
+  BUF->ipid[0] = ip_id >> 8;
+  BUF->ipid[1] = ip_id & 0xff;
   /* Calculate IP checksum. */
   BUF->ipchksum = 0;
   BUF->ipchksum = ~(ip_ipchksum());
@@ -1799,10 +2592,42 @@ htons(uint16_t val)
 void
 ip_send(const void *data, int len)
 {
+  ip_schain = NULL;
   ip_slen = len;
   if(len > 0) {
+    IP_TXSTAMP();
     if(data != ip_sappdata) {
       memcpy(ip_sappdata, (data), ip_slen);
     }
   }
-}
\ No newline at end of file
+}
+/*---------------------------------------------------------------------------*/
+void
+ip_send_chain(struct ip_pbuf *chain)
+{
+  struct ip_pbuf *p;
+
+  ip_schain = chain;
+  ip_slen = 0;
+  for(p = chain; p != NULL; p = p->next) {
+    ip_slen += p->len;
+  }
+  if(ip_slen > 0) {
+    IP_TXSTAMP();
+  }
+}
+#if IP_HISTOGRAMS
+/*---------------------------------------------------------------------------*/
+void
+ip_histogram_add(struct ip_histogram *h, uint32_t us)
+{
+  uint8_t i;
+
+  for(i = 0; i < IP_HISTOGRAM_BUCKETS - 1 &&
+	us >= ((uint32_t)IP_HISTOGRAM_BASE << i); ++i);
+  ++h->bucket[i];
+  if(us > h->max) {
+    h->max = us;
+  }
+}
+#endif /* IP_HISTOGRAMS */
\ No newline at end of file
@@ -16,15 +16,20 @@
 #include "../../INTERNET/IPV4/IPv4.h"
 #include "../../INTERNET/IPV6/IPv6.h"
 #include "ipopt.h"
+#include "ip_timer.h"
 
 /**
  * Representación de una dirección IP
+ *
+ * The address of the TCP and UDP connections of the core, chosen per
+ * build: IPv6 with IP_CONF_IPV6, IPv4 otherwise. With IP_CONF_DUALSTACK
+ * the core stays IPv4 and ip6.c answers IPv6 at the network layer;
+ * ip_addr_t (ip6.h) carries an address of either family.
 */
 #if IP_CONF_IPV6
-// TODO
-typedef IPV6_address_t IP_address
+typedef IPV6_address_t IP_address;
 #else /* IP_CONF_IPV6 */
-typedef IPV4_address_t IP_address
+typedef IPV4_address_t IP_address;
 #define IP_ADDRESS_NONE IPV4_ADDRESS_NONE
 #endif
 
@@ -104,6 +109,31 @@ void ip_init(void);
  */
 void ip_setipid(uint16_t id);
 
+#if IP_REASSEMBLY
+/**
+ * @brief Periodic processing of the IP fragment reassembly contexts.
+ *
+ * Ages every datagram being reassembled and drops the ones that have
+ * not been completed within IP_REASS_MAXAGE calls. It should be called
+ * once per IP periodic timer tick.
+ */
+void ip_reass_timer(void);
+
+#ifdef IP_REASS_ALLOC
+typedef IP_REASS_HANDLE ip_reass_handle_t;
+
+/**
+ * @brief Block holding the last datagram completed by the reassembly.
+ *
+ * Only the part of the datagram that fits is copied into ip_buf. If
+ * this is not IP_REASS_NOBLOCK after ip_input(), the whole datagram
+ * (without IP header) is in this block; the driver owns it from then
+ * on and releases it with IP_REASS_FREE().
+ */
+extern ip_reass_handle_t ip_reass_packet;
+#endif /* IP_REASS_ALLOC */
+#endif /* IP_REASSEMBLY */
+
 /**
  * @brief Process an incoming packet.
  * This function should be called when the device driver has received
@@ -151,6 +181,9 @@ void ip_setipid(uint16_t id);
     }
     \endcode
  *
+ * With IP_DUALSTACK, frames of type IP_ETHTYPE_IP6 are handled like
+ * IP_ETHTYPE_IP, with ip6_neighbor_in() in place of ip_arp_ipin();
+ * ip_input() tells the two versions apart.
  */
 #define ip_input() ip_process(IP_DATA)
 
@@ -202,6 +235,64 @@ void ip_setipid(uint16_t id);
       ip_process(IP_TIMER);      \
    } while (0)
 
+#if IP_TCP_MSRTT
+/**
+ * Has the retransmission timer of a connection expired?
+ *
+ * With a millisecond clock (IP_CONF_TCP_CLOCK or IP_CONF_CLOCK)
+ * retransmissions do not have to wait for the periodic timer: the
+ * device driver can check the connections whenever it is idle and
+ * call ip_rexmit_timer() for the ones that are due.
+ *
+   \code
+   for(i = 0; i < IP_CONNS; ++i) {
+     if(ip_rexmit_due(i)) {
+       ip_rexmit_timer(i);
+       if(ip_len > 0) {
+         devicedriver_send();
+       }
+     }
+   }
+   \endcode
+ *
+ * @param conn The number of the connection.
+ */
+#define ip_rexmit_due(conn)                                        \
+   (ip_conns[conn].tcpstateflags != IP_CLOSED &&                   \
+    ip_outstanding(&ip_conns[conn]) &&                             \
+    (int32_t)(IP_TCP_CLOCK() - ip_conns[conn].rexmit_at) >= 0)
+
+/**
+ * Runs the retransmission timer of a connection.
+ *
+ * Retransmits the oldest unacknowledged segment if the timer has
+ * expired; ip_len is set to a value > 0 if a packet is to be sent.
+ *
+ * @param conn The number of the connection.
+ */
+#define ip_rexmit_timer(conn)         \
+   do                                 \
+   {                                  \
+      ip_conn = &ip_conns[conn];      \
+      ip_process(IP_REXMIT_TIMER);    \
+   } while (0)
+
+/**
+ * The smoothed round-trip time of a connection in milliseconds.
+ *
+ * @param conn A pointer to the ip_conn structure for the connection.
+ */
+#define ip_srtt(conn) ((conn)->srtt >> 3)
+
+/**
+ * The current retransmission time-out of a connection in
+ * milliseconds, including any backoff.
+ *
+ * @param conn A pointer to the ip_conn structure for the connection.
+ */
+#define ip_rto(conn) ((conn)->rto_ms)
+#endif /* IP_TCP_MSRTT */
+
 /**
  *
  *
@@ -400,6 +491,44 @@ struct ip_conn *ip_connect(IP_address *ripaddr, uint16_t port);
  */
 #define ip_outstanding(conn) ((conn)->len)
 
+/**
+ * The number of data segments the current connection has in flight.
+ *
+ * When IP_TCP_MAX_INFLIGHT is larger than 1 the application keeps a
+ * copy of every unacknowledged segment. New data sent with ip_send()
+ * becomes segment number ip_inflight(), a retransmission always
+ * concerns segment 0 (the oldest one), and ip_ackedsegments() tells
+ * how many segments from the front were released by the last ACK.
+ *
+ * @param conn A pointer to the ip_conn structure for the connection.
+ */
+#define ip_inflight(conn) ((conn)->nseg)
+
+/**
+ * The number of segments acknowledged by the incoming segment.
+ *
+ * Only valid when ip_acked() is true.
+ *
+ * \hideinitializer
+ */
+#define ip_ackedsegments() (ip_acksegs)
+
+/**
+ * The largest amount of new data the connection can send right now.
+ *
+ * This is the limit ip_send() crops new data to: the segment size,
+ * bounded by the room left in the peer's window. It is 0 when all
+ * IP_TCP_MAX_INFLIGHT segment slots are in use or the window is full.
+ *
+ * With IP_TCP_PMTUD the segment size is the one the peer announced,
+ * not the one path MTU discovery lowered it to, so that data already
+ * split into larger segments is not stuck; such segments are sent
+ * without DF. New data should be split by ip_mss().
+ *
+ * @param conn A pointer to the ip_conn structure for the connection.
+ */
+uint16_t ip_sendwnd(struct ip_conn *conn);
+
 /**
  * Send data on the current connection.
  *
@@ -413,6 +542,11 @@ struct ip_conn *ip_connect(IP_address *ripaddr, uint16_t port);
  * amount of data is sent. The function ip_mss() can be used to query
  * IP for the amount of data that actually will be sent.
  *
+ * Up to IP_TCP_MAX_INFLIGHT segments can be unacknowledged at a time.
+ * When all of them are in use, or the window advertised by the remote
+ * host is full, nothing is sent and the application has to offer the
+ * data again on a later ip_acked() or ip_poll() event.
+ *
  * \note This function does not guarantee that the sent data will
  * arrive at the destination. If the data is lost in the network, the
  * application will be invoked with the ip_rexmit() event being
@@ -427,6 +561,62 @@ struct ip_conn *ip_connect(IP_address *ripaddr, uint16_t port);
  */
 void ip_send(const void *data, int len);
 
+#ifdef IP_PBUF_CHKSUM
+typedef IP_PBUF_HANDLE ip_pbuf_handle_t;
+#endif /* IP_PBUF_CHKSUM */
+
+/**
+ * A fragment of the data of an outgoing packet.
+ *
+ * Fragments are linked into a chain that is handed to
+ * ip_send_chain(). The data is referenced where it is: in RAM, in ROM
+ * (read with IP_PBUF_ROM_READ()) or, if IP_PBUF_CHKSUM is configured,
+ * in a block of the memory of the network device. It must not change
+ * until the device driver has sent the packet.
+ */
+struct ip_pbuf {
+  struct ip_pbuf *next;   /**< The next fragment, NULL for the last one. */
+  uint16_t len;           /**< The number of data bytes. */
+  uint8_t type;           /**< IP_PBUF_RAM, IP_PBUF_ROM or IP_PBUF_BLOCK. */
+  union {
+    const uint8_t *ptr;   /**< The data of a RAM or ROM fragment. */
+#ifdef IP_PBUF_CHKSUM
+    struct {
+      ip_pbuf_handle_t handle;
+      uint16_t pos;
+    } block;              /**< The block and offset of a device memory
+			     fragment. */
+#endif /* IP_PBUF_CHKSUM */
+  } data;
+};
+
+#define IP_PBUF_RAM   0
+#define IP_PBUF_ROM   1
+#define IP_PBUF_BLOCK 2
+
+/**
+ * Send a chain of data fragments on the current connection.
+ *
+ * Works like ip_send(), but the data is not copied into ip_buf: the
+ * headers are built in ip_buf and the device driver sends the
+ * fragments after them. As with ip_send(), TCP may send less than
+ * the whole chain.
+ *
+ * @param chain The first fragment.
+ */
+void ip_send_chain(struct ip_pbuf *chain);
+
+/**
+ * The fragments of the outgoing packet.
+ *
+ * If ip_schainlen is not zero when ip_process() returns, the packet
+ * to be sent is made of the first ip_len - ip_schainlen bytes of
+ * ip_buf followed by the first ip_schainlen bytes of the ip_schain
+ * fragments.
+ */
+extern struct ip_pbuf *ip_schain;
+extern uint16_t ip_schainlen;
+
 /**
  * The length of any incoming data that is currently avaliable (if avaliable)
  * in the ip_appdata buffer.
@@ -455,6 +645,10 @@ void ip_send(const void *data, int len);
  *
  * This function will close the current connection in a nice way.
  *
+ * \note The FIN is only sent once all data in flight has been
+ * acknowledged; until then the request is ignored and has to be
+ * repeated on a later ip_acked() or ip_poll() event.
+ *
 
  */
 #define ip_close() (ip_flags = IP_CLOSE)
@@ -587,7 +781,8 @@ void ip_send(const void *data, int len);
  * Reduces to non-zero if the previously sent data has been lost in
  * the network, and the application should retransmit it. The
  * application should send the exact same data as it did the last
- * time, using the ip_send() function.
+ * time, using the ip_send() function. With several segments in
+ * flight this is the oldest unacknowledged one.
  *
 
  */
@@ -628,6 +823,18 @@ void ip_send(const void *data, int len);
  */
 #define ip_mss() (ip_conn->mss)
 
+/**
+ * Get the effective maximum segment size of a connection.
+ *
+ * The smallest of IP_TCP_MSS, the MSS announced by the peer and,
+ * with IP_TCP_PMTUD, what the path MTU allows.
+ *
+ * \param conn A pointer to the ip_conn structure for the connection.
+ *
+ * \hideinitializer
+ */
+#define ip_conn_mss(conn) ((conn)->initialmss)
+
 /**
  * Set up a new UDP connection.
  *
@@ -664,7 +871,7 @@ struct ip_udp_conn *ip_udp_new(IP_address *ripaddr, uint16_t rport);
  *
 
  */
-#define ip_udp_remove(conn) (conn)->lport = 0
+void ip_udp_remove(struct ip_udp_conn *conn);
 
 /**
  * Bind a UDP connection to a local port.
@@ -676,7 +883,7 @@ struct ip_udp_conn *ip_udp_new(IP_address *ripaddr, uint16_t rport);
  *
 
  */
-#define ip_udp_bind(conn, port) (conn)->lport = port
+void ip_udp_bind(struct ip_udp_conn *conn, uint16_t port);
 
 /**
  * Send a UDP datagram of length len on the current connection.
@@ -757,11 +964,24 @@ struct ip_conn
 			 receive next. */
    uint8_t snd_nxt[4];    /**< The sequence number that was last sent by
                          us. */
-   uint16_t len;          /**< Length of the data that was previously sent. */
+   uint16_t len;          /**< Length of the data that was previously sent
+			 and is not yet acknowledged. */
+   uint16_t swnd;         /**< The window last advertised by the remote
+			 host. */
+   uint16_t seglen[IP_TCP_MAX_INFLIGHT]; /**< Lengths of the unacknowledged
+			 segments, oldest first. */
+   uint8_t nseg;          /**< Number of unacknowledged data segments. */
+   uint8_t snd_wscale;    /**< Window scale shift of the remote host. */
+   uint8_t rcv_wscale;    /**< Window scale shift of our advertised
+			 window, 0 if scaling was not negotiated. */
    uint16_t mss;          /**< Current maximum segment size for the
 			 connection. */
-   uint16_t initialmss;   /**< Initial maximum segment size for the
-			 connection. */
+   uint16_t initialmss;   /**< Effective maximum segment size for the
+			 connection, lowered by path MTU discovery. */
+#if IP_TCP_PMTUD
+   uint16_t peermss;      /**< Maximum segment size announced by the
+			 peer, the limit for segments sent without DF. */
+#endif /* IP_TCP_PMTUD */
    uint8_t sa;            /**< Retransmission time-out calculation state
 			 variable. */
    uint8_t sv;            /**< Retransmission time-out calculation state
@@ -771,6 +991,34 @@ struct ip_conn
    uint8_t timer;         /**< The retransmission timer. */
    uint8_t nrtx;          /**< The number of retransmissions for the last
 			 segment sent. */
+   uint8_t hnext;         /**< Next connection (index + 1) in the same
+			 demultiplexing hash bucket, 0 at the end. */
+#if IP_TCP_MSRTT
+   uint32_t rexmit_at;    /**< When the retransmission timer expires, in
+			 IP_TCP_CLOCK() milliseconds. */
+   uint32_t rtt_ts;       /**< When the segment being timed was sent. */
+   uint16_t srtt;         /**< Smoothed RTT in ms, scaled by 8. */
+   uint16_t rttvar;       /**< RTT variation in ms, scaled by 4. */
+   uint16_t rto_ms;       /**< Retransmission time-out in ms. */
+   uint8_t rtt_seg;       /**< Index + 1 of the segment being timed among
+			 the unacknowledged ones, 0 if none. */
+#endif /* IP_TCP_MSRTT */
+#if IP_TCP_DUPACKS
+   uint8_t dupacks;       /**< Number of duplicate ACKs received in a row. */
+#endif /* IP_TCP_DUPACKS */
+#if IP_TIMERS
+   struct ip_timer ptimer; /**< Runs ip_periodic_conn() every
+			 IP_TCP_PERIODIC ms while the connection is
+			 open. */
+#if IP_TCP_MSRTT
+   struct ip_timer rtimer; /**< Expires at rexmit_at. */
+#endif /* IP_TCP_MSRTT */
+#endif /* IP_TIMERS */
+#if IP_TCP_DELACK
+   uint8_t ackpend;       /**< Number of received segments that have not
+			 been acknowledged yet. */
+   uint8_t acktimer;      /**< The delayed ACK timer. */
+#endif /* IP_TCP_DELACK */
 
    /** The application state. */
    ip_tcp_appstate_t appstate;
@@ -782,7 +1030,7 @@ struct ip_conn
  * The ip_conn pointer can be used to access the current TCP
  * connection.
  */
-extern struct ip_conn *ip_conn;
+extern IP_INSTANCE_LOCAL struct ip_conn *ip_conn;
 /* The array containing all uIP connections. */
 extern struct ip_conn ip_conns[IP_CONNS];
 
@@ -801,6 +1049,8 @@ struct ip_udp_conn
    uint16_t lport;   /**< The local port number in network byte order. */
    uint16_t rport;   /**< The remote port number in network byte order. */
    uint8_t ttl;      /**< Default time-to-live. */
+   uint8_t hnext;    /**< Next connection (index + 1) in the same
+			 demultiplexing hash bucket, 0 at the end. */
 
    /** The application state. */
    ip_udp_appstate_t appstate;
@@ -809,10 +1059,25 @@ struct ip_udp_conn
 /**
  * The current UDP connection.
  */
-extern struct ip_udp_conn *ip_udp_conn;
+extern IP_INSTANCE_LOCAL struct ip_udp_conn *ip_udp_conn;
 extern struct ip_udp_conn ip_udp_conns[IP_UDP_CONNS];
 #endif /* IP_UDP */
 
+#if IP_HISTOGRAMS
+/**
+ * A latency histogram.
+ *
+ * bucket[i] counts the samples shorter than IP_HISTOGRAM_BASE << i
+ * microseconds and longer than the bound of bucket[i - 1], the last
+ * bucket all longer samples.
+ */
+struct ip_histogram
+{
+   ip_stats_t bucket[IP_HISTOGRAM_BUCKETS];
+   uint32_t max; /**< Longest sample in microseconds. */
+};
+#endif /* IP_HISTOGRAMS */
+
 /**
  * The structure holding the TCP/IP statistics that are gathered if
  * IP_STATISTICS is set to 1.
@@ -840,6 +1105,8 @@ struct ip_stats
 			     checksum errors. */
       ip_stats_t protoerr; /**< Number of packets dropped since they
 			     were neither ICMP, UDP nor TCP. */
+      ip_stats_t reasstmo; /**< Number of datagrams dropped since not
+			     all their fragments arrived in time. */
    } ip;                   /**< IP statistics. */
    struct
    {
@@ -875,6 +1142,35 @@ struct ip_stats
 			     checksum. */
    } udp;                /**< UDP statistics. */
 #endif                   /* IP_UDP */
+   struct
+   {
+      ip_stats_t recv;   /**< Number of received ARP packets. */
+      ip_stats_t sent;   /**< Number of sent ARP requests and
+			     replies. */
+      ip_stats_t miss;   /**< Number of packets replaced by an ARP
+			     request since their destination was not
+			     in the ARP table. */
+   } arp;                /**< ARP statistics. */
+   struct
+   {
+      ip_stats_t recv;   /**< Number of frames received by the
+			     device driver. */
+      ip_stats_t sent;   /**< Number of frames transmitted. */
+      ip_stats_t rxerr;  /**< Number of received frames dropped by
+			     the device driver (CRC or length
+			     errors). */
+      ip_stats_t txerr;  /**< Number of frames that could not be
+			     transmitted. */
+   } link;               /**< Device driver statistics. */
+#if IP_HISTOGRAMS
+   struct
+   {
+      struct ip_histogram rx2app; /**< From ip_input() to the
+				    application. */
+      struct ip_histogram app2tx; /**< From ip_send() to the device
+				    driver. */
+   } lat;                         /**< Latency histograms. */
+#endif /* IP_HISTOGRAMS */
 };
 
 /**
@@ -884,6 +1180,32 @@ struct ip_stats
  */
 extern struct ip_stats ip_stat;
 
+#if IP_HISTOGRAMS
+/**
+ * Add a sample of us microseconds to a latency histogram.
+ */
+void ip_histogram_add(struct ip_histogram *h, uint32_t us);
+
+/**
+ * Time the packet in ip_buf entered ip_input() and the application
+ * last handed data to ip_send(), 0 once the latter was sampled.
+ */
+extern uint32_t ip_rxstamp, ip_txstamp;
+
+/**
+ * Sample the application-to-TX latency.
+ *
+ * The device driver calls this when it hands a frame to the hardware.
+ *
+ * \hideinitializer
+ */
+#define ip_stat_sent() do { if(ip_txstamp != 0) {                 \
+      ip_histogram_add(&ip_stat.lat.app2tx, IP_CLOCK_US() - ip_txstamp); \
+      ip_txstamp = 0; } } while(0)
+#else /* IP_HISTOGRAMS */
+#define ip_stat_sent()
+#endif /* IP_HISTOGRAMS */
+
 /*---------------------------------------------------------------------------*/
 /* All the stuff below this point is internal to uIP and should not be
  * used directly by an application or by a device driver.
@@ -897,6 +1219,13 @@ extern struct ip_stats ip_stat;
  */
 extern uint8_t ip_flags;
 
+/* uint8_t ip_acksegs:
+ *
+ * The number of data segments released by the last incoming ACK, see
+ * ip_ackedsegments().
+ */
+extern uint8_t ip_acksegs;
+
 /* The following flags may be set in the global variable ip_flags
    before calling the application callback. The IP_ACKDATA,
    IP_NEWDATA, and IP_CLOSE flags may both be set at the same time,
@@ -960,6 +1289,10 @@ void ip_process(uint8_t flag);
 #if IP_UDP
 #define IP_UDP_TIMER 5
 #endif /* IP_UDP */
+#if IP_TCP_MSRTT
+#define IP_REXMIT_TIMER 6  /* Tells uIP to check the retransmission \
+           timer of a connection. */
+#endif /* IP_TCP_MSRTT */
 
 /* The TCP states used in the ip_conn->tcpstateflags. */
 #define IP_CLOSED 0
@@ -1010,7 +1343,7 @@ struct ip_tcpip_hdr
        wnd[2];
    uint16_t tcpchksum;
    uint8_t urgp[2];
-   uint8_t optdata[4];
+   uint8_t optdata[8];
 };
 
 /* The ICMP and IP headers. */
@@ -1180,4 +1513,51 @@ uint16_t ip_tcpchksum(void);
  */
 uint16_t ip_udpchksum(void);
 
+#if IP_INSTANCES
+/**
+ * The instance of the stack the functions of the stack work on.
+ *
+ * With IP_INSTANCES the global variables declared above, except
+ * ip_conn and ip_udp_conn, are fields of a struct ip_stack (see
+ * ip_stack.h), and their names refer to the fields of the selected
+ * instance. The device driver selects the
+ * instance of an interface before calling into the stack for it.
+ */
+struct ip_stack;
+extern IP_INSTANCE_LOCAL struct ip_stack *ip_stack;
+
+/**
+ * Select the instance of the stack used by the following calls.
+ *
+ * \param stack A pointer to the struct ip_stack of the interface.
+ *
+ * \hideinitializer
+ */
+#define ip_stack_select(stack) (ip_stack = (stack))
+
+#define ip_buf          (ip_stack->buf)
+#define ip_appdata      (ip_stack->appdata)
+#define ip_sappdata     (ip_stack->sappdata)
+#define ip_urgdata      (ip_stack->urgdata)
+#define ip_urglen       (ip_stack->urglen)
+#define ip_surglen      (ip_stack->surglen)
+#define ip_len          (ip_stack->len)
+#define ip_slen         (ip_stack->slen)
+#define ip_schain       (ip_stack->schain)
+#define ip_schainlen    (ip_stack->schainlen)
+#define ip_flags        (ip_stack->flags)
+#define ip_acksegs      (ip_stack->acksegs)
+#define ip_conns        (ip_stack->conns)
+#define ip_listenports  (ip_stack->listenports)
+#define ip_udp_conns    (ip_stack->udp_conns)
+#define ip_acc32        (ip_stack->acc32)
+#define ip_hostaddr     (ip_stack->hostaddr)
+#define ip_draddr       (ip_stack->draddr)
+#define ip_netmask      (ip_stack->netmask)
+#define ip_stat         (ip_stack->stat)
+#define ip_reass_packet (ip_stack->reass_packet)
+#define ip_rxstamp      (ip_stack->rxstamp)
+#define ip_txstamp      (ip_stack->txstamp)
+#endif /* IP_INSTANCES */
+
 #endif /*IP_H*/
\ No newline at end of file
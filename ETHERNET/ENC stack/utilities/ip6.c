@@ -0,0 +1,537 @@
+/**
+ * IPv6 next to the IPv4 core
+ *
+ * With IP_DUALSTACK the IPv4 code in ip.c hands every packet whose
+ * version field is 6 to ip6_input(), so the IPv4 path keeps its
+ * single header check. This module answers neighbor solicitations
+ * and ICMPv6 echo requests for the link-local address derived from
+ * the Ethernet address and for an optional second address, keeps a
+ * small neighbor cache and builds the Ethernet header of outgoing
+ * IPv6 packets. The IPv6 pseudo header checksum is computed here,
+ * apart from the IPv4 one.
+ *
+ * The TCP and UDP connections of the core are IPv4 only. TCP
+ * segments and UDP datagrams that arrive over IPv6 are refused with
+ * an ICMPv6 port unreachable message, so that the peer gives up at
+ * once (and e.g. falls back to IPv4) instead of waiting for a
+ * timeout.
+ */
+
+#include "ip6.h"
+#include "ip_arp.h"
+#include "ip_stack.h"
+
+#include <string.h>
+
+#if IP_DUALSTACK
+
+#define IP6_HLEN   40
+#define ICMP6_HLEN 8
+
+#define ICMP6_DEST_UNREACH           1
+#define ICMP6_PORT_UNREACH           4
+#define ICMP6_ECHO_REPLY             129
+#define ICMP6_ECHO                   128
+#define ICMP6_NEIGHBOR_SOLICITATION  135
+#define ICMP6_NEIGHBOR_ADVERTISEMENT 136
+
+#define ICMP6_FLAG_S (1 << 6)
+#define ICMP6_FLAG_O (1 << 5)
+
+#define ICMP6_OPTION_SOURCE_LINK_ADDRESS 1
+#define ICMP6_OPTION_TARGET_LINK_ADDRESS 2
+
+/* Neighbor discovery messages must carry the largest hop limit
+   (RFC 4861). */
+#define ND_HOPLIMIT 255
+
+/* The length of a neighbor solicitation or advertisement with one
+   link-layer address option. */
+#define ND_LEN (ICMP6_HLEN + sizeof(IPV6_address_t) + 8)
+
+struct ip6_icmp_hdr {
+  struct ip_eth_hdr ethhdr;
+  /* IPv6 header. */
+  uint8_t vtc, tcf;
+  uint16_t flow;
+  uint8_t len[2];
+  uint8_t proto, ttl;
+  /* Byte arrays: IPV6_address_t is 4-byte aligned, the addresses in
+     the packet are not. */
+  uint8_t srcipaddr[16], destipaddr[16];
+  /* ICMPv6 header. */
+  uint8_t type, icode;
+  uint16_t icmpchksum;
+  /* Echo identifier and sequence number, or the neighbor discovery
+     flags followed by the target address and an option. */
+  uint8_t flags, reserved1, reserved2, reserved3;
+  uint8_t target[16];
+  uint8_t options[8];
+};
+
+#define BUF ((struct ip6_icmp_hdr *)&ip_buf[0])
+
+#if IP_STATISTICS == 1
+#define IP_STAT(s) s
+#else
+#define IP_STAT(s)
+#endif /* IP_STATISTICS == 1 */
+
+#if IP_LOGGING == 1
+void ip_log(char *msg);
+#define IP_LOG(m) ip_log(m)
+#else
+#define IP_LOG(m)
+#endif /* IP_LOGGING == 1 */
+
+#if IP_INSTANCES
+#define neighbors    (ip_stack->neighbors)
+#define nextneighbor (ip_stack->nextneighbor)
+#else /* IP_INSTANCES */
+IPV6_address_t ip6_linkaddr, ip6_hostaddr;
+
+static struct ip6_neighbor neighbors[IP6_NEIGHBORS];
+static uint8_t nextneighbor;  /* The entry replaced next. */
+#endif /* IP_INSTANCES */
+/*---------------------------------------------------------------------------*/
+static uint16_t
+ip6_sum(uint16_t sum, const uint8_t *data, uint16_t len)
+{
+  uint16_t t;
+
+  for(; len > 1; len -= 2, data += 2) {
+    t = (data[0] << 8) + data[1];
+    sum += t;
+    if(sum < t) {
+      sum++;		/* carry */
+    }
+  }
+  if(len == 1) {
+    t = data[0] << 8;
+    sum += t;
+    if(sum < t) {
+      sum++;		/* carry */
+    }
+  }
+  return sum;
+}
+/*---------------------------------------------------------------------------*/
+/* The checksum of the ICMPv6 message in ip_buf, including the IPv6
+   pseudo header (RFC 8200). */
+static uint16_t
+ip6_icmpchksum(void)
+{
+  uint16_t len, sum;
+
+  len = (BUF->len[0] << 8) + BUF->len[1];
+  /* Upper layer length and next header. This addition cannot
+     carry. */
+  sum = len + IP_PROTO_ICMP6;
+  sum = ip6_sum(sum, (uint8_t *)&BUF->srcipaddr, 2 * sizeof(IPV6_address_t));
+  sum = ip6_sum(sum, &BUF->type, len);
+  return (sum == 0) ? 0xffff : htons(sum);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+ip6_is_unspecified(const void *a)
+{
+  static const IPV6_address_t zeroes;
+
+  return memcmp(a, &zeroes, sizeof(IPV6_address_t)) == 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Sets a to the solicited-node multicast address of the host address
+   h, ff02::1:ffXX:XXXX. */
+static void
+ip6_solicited(void *a, const void *h)
+{
+  uint8_t *p = (uint8_t *)a;
+
+  memset(a, 0, sizeof(IPV6_address_t));
+  p[0] = 0xff;
+  p[1] = 0x02;
+  p[11] = 0x01;
+  p[12] = 0xff;
+  memcpy(&p[13], &((const uint8_t *)h)[13], 3);
+}
+/*---------------------------------------------------------------------------*/
+/* Is a one of our unicast addresses? */
+static uint8_t
+ip6_is_host(const void *a)
+{
+  return memcmp(a, &ip6_linkaddr, sizeof(IPV6_address_t)) == 0 ||
+    (!ip6_is_unspecified(&ip6_hostaddr) &&
+     memcmp(a, &ip6_hostaddr, sizeof(IPV6_address_t)) == 0);
+}
+/*---------------------------------------------------------------------------*/
+/* Is a packet sent to a for us? Besides our unicast addresses these
+   are the all-nodes address and our solicited-node addresses. */
+static uint8_t
+ip6_accepts(const void *a)
+{
+  static const uint8_t allnodes[16] = {0xff, 0x02, 0, 0, 0, 0, 0, 0,
+				       0, 0, 0, 0, 0, 0, 0, 0x01};
+  IPV6_address_t s;
+
+  if(ip6_is_host(a) || memcmp(a, allnodes, sizeof(allnodes)) == 0) {
+    return 1;
+  }
+  ip6_solicited(&s, &ip6_linkaddr);
+  if(memcmp(a, &s, sizeof(IPV6_address_t)) == 0) {
+    return 1;
+  }
+  ip6_solicited(&s, &ip6_hostaddr);
+  return !ip6_is_unspecified(&ip6_hostaddr) &&
+    memcmp(a, &s, sizeof(IPV6_address_t)) == 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+ip6_neighbor_update(const void *ipaddr, const struct ip_eth_addr *ethaddr)
+{
+  uint8_t i;
+
+  for(i = 0; i < IP6_NEIGHBORS; ++i) {
+    if(memcmp(&neighbors[i].ipaddr, ipaddr, sizeof(IPV6_address_t)) == 0) {
+      break;
+    }
+  }
+  if(i == IP6_NEIGHBORS) {
+    /* Not in the cache: take the entries in turn. */
+    i = nextneighbor;
+    if(++nextneighbor == IP6_NEIGHBORS) {
+      nextneighbor = 0;
+    }
+    memcpy(&neighbors[i].ipaddr, ipaddr, sizeof(IPV6_address_t));
+  }
+  memcpy(&neighbors[i].ethaddr, ethaddr, sizeof(struct ip_eth_addr));
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Initialize the IPv6 module.
+ *
+ * Derives the link-local address fe80::/64 from the Ethernet address
+ * (modified EUI-64, RFC 4291) and empties the neighbor cache.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip6_init(void)
+{
+  uint8_t *p = (uint8_t *)&ip6_linkaddr;
+
+  memset(&ip6_linkaddr, 0, sizeof(IPV6_address_t));
+  p[0] = 0xfe;
+  p[1] = 0x80;
+  p[8] = ip_ethaddr.addr[0] ^ 0x02;
+  p[9] = ip_ethaddr.addr[1];
+  p[10] = ip_ethaddr.addr[2];
+  p[11] = 0xff;
+  p[12] = 0xfe;
+  p[13] = ip_ethaddr.addr[3];
+  p[14] = ip_ethaddr.addr[4];
+  p[15] = ip_ethaddr.addr[5];
+  memset(&ip6_hostaddr, 0, sizeof(IPV6_address_t));
+  memset(neighbors, 0, sizeof(neighbors));
+  nextneighbor = 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Set the second IPv6 address of the host.
+ *
+ * \param addr The address, or NULL to remove it.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip6_sethostaddr(const IPV6_address_t *addr)
+{
+  if(addr == NULL) {
+    memset(&ip6_hostaddr, 0, sizeof(IPV6_address_t));
+  } else {
+    memcpy(&ip6_hostaddr, addr, sizeof(IPV6_address_t));
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Neighbor cache processing for incoming IPv6 packets.
+ *
+ * This function expects an IPv6 packet with a prepended Ethernet
+ * header in the ip_buf[] buffer, and the length of the packet in the
+ * global variable ip_len.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip6_neighbor_in(void)
+{
+  ip_len -= sizeof(struct ip_eth_hdr);
+
+  /* Only link-local senders are neighbors for sure; packets from
+     other prefixes are answered through the router they came
+     from, whose address is just as good a key. */
+  if(!ip6_is_unspecified(&BUF->srcipaddr)) {
+    ip6_neighbor_update(&BUF->srcipaddr, &BUF->ethhdr.src);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * IPv6 input processing.
+ *
+ * Called by ip_process() for every packet with IP version 6, with
+ * ip_len holding the length of the packet without the Ethernet
+ * header.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip6_input(void)
+{
+  IPV6_address_t target;
+  uint16_t len;
+
+  IP_STAT(++ip_stat.ip.recv);
+
+  /* Check the size of the packet. */
+  len = (BUF->len[0] << 8) + BUF->len[1];
+  if(ip_len < IP6_HLEN || len > ip_len - IP6_HLEN) {
+    IP_LOG("ipv6: packet shorter than reported in IP header.");
+    goto drop;
+  }
+  ip_len = IP6_HLEN + len;
+
+  if(!ip6_accepts(&BUF->destipaddr)) {
+    IP_STAT(++ip_stat.ip.drop);
+    goto drop;
+  }
+
+  /* TCP and UDP use the IPv4 core; tell the sender. */
+  if(BUF->proto == IP_PROTO_TCP || BUF->proto == IP_PROTO_UDP) {
+    goto port_unreach;
+  }
+  if(BUF->proto != IP_PROTO_ICMP6) {
+    IP_STAT(++ip_stat.ip.drop);
+    IP_STAT(++ip_stat.ip.protoerr);
+    IP_LOG("ipv6: not icmp6.");
+    goto drop;
+  }
+  IP_STAT(++ip_stat.icmp.recv);
+  if(len < ICMP6_HLEN) {
+    IP_STAT(++ip_stat.icmp.drop);
+    goto drop;
+  }
+
+  /* The checksum can only be verified if the whole message is in
+     ip_buf. Larger echo requests are answered without the check, as
+     ip.c does for ICMP; their checksum is updated, not recomputed. */
+  if(IP_LLH_LEN + IP6_HLEN + len <= IP_BUFSIZE) {
+    if(ip6_icmpchksum() != 0xffff) {
+      IP_STAT(++ip_stat.icmp.drop);
+      IP_LOG("icmp6: bad checksum.");
+      goto drop;
+    }
+  } else if(BUF->type != ICMP6_ECHO) {
+    IP_STAT(++ip_stat.icmp.drop);
+    goto drop;
+  }
+
+  if(BUF->type == ICMP6_NEIGHBOR_SOLICITATION ||
+     BUF->type == ICMP6_NEIGHBOR_ADVERTISEMENT) {
+    /* Neighbor discovery from off the link, where a router has
+       lowered the hop limit, is forged (RFC 4861, 7.1). */
+    if(BUF->ttl != ND_HOPLIMIT || BUF->icode != 0 ||
+       len < ICMP6_HLEN + sizeof(IPV6_address_t)) {
+      IP_STAT(++ip_stat.icmp.drop);
+      IP_LOG("icmp6: invalid neighbor discovery message.");
+      goto drop;
+    }
+  }
+
+  if(BUF->type == ICMP6_NEIGHBOR_ADVERTISEMENT) {
+    /* The answer to one of our solicitations. */
+    if(len >= ND_LEN &&
+       BUF->options[0] == ICMP6_OPTION_TARGET_LINK_ADDRESS) {
+      ip6_neighbor_update(&BUF->target, (struct ip_eth_addr *)&BUF->options[2]);
+    }
+    goto drop;
+  } else if(BUF->type == ICMP6_NEIGHBOR_SOLICITATION) {
+    if(!ip6_is_host(&BUF->target)) {
+      goto drop;
+    }
+    if(len >= ND_LEN &&
+       BUF->options[0] == ICMP6_OPTION_SOURCE_LINK_ADDRESS &&
+       !ip6_is_unspecified(&BUF->srcipaddr)) {
+      /* Save the sender's address in the neighbor cache. */
+      ip6_neighbor_update(&BUF->srcipaddr, (struct ip_eth_addr *)&BUF->options[2]);
+    }
+
+    /* Answer with a neighbor advertisement carrying our link-layer
+       address, to the sender or, if it has no address yet, to all
+       nodes. */
+    BUF->type = ICMP6_NEIGHBOR_ADVERTISEMENT;
+    BUF->flags = ICMP6_FLAG_O;
+    if(ip6_is_unspecified(&BUF->srcipaddr)) {
+      memset(&BUF->destipaddr, 0, sizeof(IPV6_address_t));
+      ((uint8_t *)&BUF->destipaddr)[0] = 0xff;
+      ((uint8_t *)&BUF->destipaddr)[1] = 0x02;
+      ((uint8_t *)&BUF->destipaddr)[15] = 0x01;
+    } else {
+      BUF->flags |= ICMP6_FLAG_S;
+      memcpy(&BUF->destipaddr, &BUF->srcipaddr, sizeof(IPV6_address_t));
+    }
+    memcpy(&BUF->srcipaddr, &BUF->target, sizeof(IPV6_address_t));
+    BUF->reserved1 = BUF->reserved2 = BUF->reserved3 = 0;
+    BUF->options[0] = ICMP6_OPTION_TARGET_LINK_ADDRESS;
+    BUF->options[1] = 1;  /* Options length, 1 = 8 bytes. */
+    memcpy(&BUF->options[2], &ip_ethaddr, sizeof(ip_ethaddr));
+    len = ND_LEN;
+    BUF->ttl = ND_HOPLIMIT;
+  } else if(BUF->type == ICMP6_ECHO) {
+    /* Echo requests to multicast addresses are not answered. */
+    if(!ip6_is_host(&BUF->destipaddr)) {
+      goto drop;
+    }
+    /* The reply is the request with the type changed and the
+       addresses swapped; the data stays where it is, beyond ip_buf
+       in the received frame for a large request. Swapping the
+       addresses leaves the pseudo header sum as it is, so only the
+       type is taken out of the checksum. */
+    BUF->type = ICMP6_ECHO_REPLY;
+    if(BUF->icmpchksum >= HTONS(0x0100)) {
+      BUF->icmpchksum -= HTONS(0x0100);
+    } else {
+      BUF->icmpchksum -= HTONS(0x0100) + 1;
+    }
+    memcpy(&target, &BUF->destipaddr, sizeof(IPV6_address_t));
+    memcpy(&BUF->destipaddr, &BUF->srcipaddr, sizeof(IPV6_address_t));
+    memcpy(&BUF->srcipaddr, &target, sizeof(IPV6_address_t));
+    BUF->vtc = 0x60;
+    BUF->tcf = 0;
+    BUF->flow = 0;
+    BUF->ttl = IP_TTL;
+    IP_STAT(++ip_stat.icmp.sent);
+    IP_STAT(++ip_stat.ip.sent);
+    return;
+  } else {
+    IP_STAT(++ip_stat.icmp.drop);
+    IP_STAT(++ip_stat.icmp.typeerr);
+    IP_LOG("icmp6: unknown ICMP message.");
+    goto drop;
+  }
+  goto send;
+
+ port_unreach:
+  /* No error messages in reply to multicast (RFC 4443, 2.4). */
+  if(!ip6_is_host(&BUF->destipaddr)) {
+    IP_STAT(++ip_stat.ip.drop);
+    goto drop;
+  }
+  /* Quote as much of the packet as fits into ip_buf behind the new
+     IPv6 and ICMPv6 headers. */
+  len = IP6_HLEN + len;
+  if(len > IP_BUFSIZE - IP_LLH_LEN - IP6_HLEN - ICMP6_HLEN) {
+    len = IP_BUFSIZE - IP_LLH_LEN - IP6_HLEN - ICMP6_HLEN;
+  }
+  memmove(&ip_buf[IP_LLH_LEN + IP6_HLEN + ICMP6_HLEN],
+	  &ip_buf[IP_LLH_LEN], len);
+  memcpy(&BUF->destipaddr, &BUF->srcipaddr, sizeof(IPV6_address_t));
+  memcpy(&BUF->srcipaddr,
+	 &((struct ip6_icmp_hdr *)&ip_buf[IP6_HLEN + ICMP6_HLEN])->destipaddr,
+	 sizeof(IPV6_address_t));
+  BUF->proto = IP_PROTO_ICMP6;
+  BUF->ttl = IP_TTL;
+  BUF->type = ICMP6_DEST_UNREACH;
+  BUF->icode = ICMP6_PORT_UNREACH;
+  BUF->flags = BUF->reserved1 = BUF->reserved2 = BUF->reserved3 = 0;
+  len += ICMP6_HLEN;
+
+ send:
+  BUF->vtc = 0x60;
+  BUF->tcf = 0;
+  BUF->flow = 0;
+  BUF->len[0] = len >> 8;
+  BUF->len[1] = len & 0xff;
+  BUF->icmpchksum = 0;
+  BUF->icmpchksum = ~ip6_icmpchksum();
+  ip_len = IP6_HLEN + len;
+  IP_STAT(++ip_stat.icmp.sent);
+  IP_STAT(++ip_stat.ip.sent);
+  return;
+
+ drop:
+  ip_len = 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Prepend the Ethernet header to an outgoing IPv6 packet.
+ *
+ * Multicast destinations map to 33:33:xx:xx:xx:xx (RFC 2464). For a
+ * unicast destination that is not in the neighbor cache, the packet
+ * is overwritten with a neighbor solicitation; the sender has to
+ * retransmit.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip6_neighbor_out(void)
+{
+  const uint8_t *dest = (const uint8_t *)&BUF->destipaddr;
+  IPV6_address_t target;
+  uint8_t i;
+
+  if(dest[0] == 0xff) {
+    BUF->ethhdr.dest.addr[0] = BUF->ethhdr.dest.addr[1] = 0x33;
+    memcpy(&BUF->ethhdr.dest.addr[2], &dest[12], 4);
+  } else {
+    for(i = 0; i < IP6_NEIGHBORS; ++i) {
+      if(memcmp(&neighbors[i].ipaddr, dest, sizeof(IPV6_address_t)) == 0) {
+	break;
+      }
+    }
+    if(i < IP6_NEIGHBORS) {
+      memcpy(&BUF->ethhdr.dest, &neighbors[i].ethaddr, sizeof(struct ip_eth_addr));
+    } else {
+      /* Ask for the neighbor on its solicited-node address. */
+      memcpy(&target, dest, sizeof(IPV6_address_t));
+      ip6_solicited(&BUF->destipaddr, &target);
+      memcpy(&BUF->srcipaddr, &ip6_linkaddr, sizeof(IPV6_address_t));
+      memcpy(&BUF->target, &target, sizeof(IPV6_address_t));
+      BUF->vtc = 0x60;
+      BUF->tcf = 0;
+      BUF->flow = 0;
+      BUF->len[0] = 0;
+      BUF->len[1] = ND_LEN;
+      BUF->proto = IP_PROTO_ICMP6;
+      BUF->ttl = ND_HOPLIMIT;
+      BUF->type = ICMP6_NEIGHBOR_SOLICITATION;
+      BUF->icode = 0;
+      BUF->flags = BUF->reserved1 = BUF->reserved2 = BUF->reserved3 = 0;
+      BUF->options[0] = ICMP6_OPTION_SOURCE_LINK_ADDRESS;
+      BUF->options[1] = 1;
+      memcpy(&BUF->options[2], &ip_ethaddr, sizeof(ip_ethaddr));
+      BUF->icmpchksum = 0;
+      BUF->icmpchksum = ~ip6_icmpchksum();
+      ip_len = IP6_HLEN + ND_LEN;
+      BUF->ethhdr.dest.addr[0] = BUF->ethhdr.dest.addr[1] = 0x33;
+      memcpy(&BUF->ethhdr.dest.addr[2], &((uint8_t *)&BUF->destipaddr)[12], 4);
+    }
+  }
+  memcpy(&BUF->ethhdr.src, &ip_ethaddr, sizeof(ip_ethaddr));
+  BUF->ethhdr.type = HTONS(IP_ETHTYPE_IP6);
+  ip_len += sizeof(struct ip_eth_hdr);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * The source address of the packet in ip_buf.
+ *
+ * \param addr Filled in with the address and its family.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip_srcaddr(ip_addr_t *addr)
+{
+  if((ip_buf[IP_LLH_LEN] & 0xf0) == 0x60) {
+    addr->family = IP_FAMILY_IPV6;
+    memcpy(&addr->addr.ipv6, &BUF->srcipaddr, sizeof(IPV6_address_t));
+  } else {
+    addr->family = IP_FAMILY_IPV4;
+    /* The IPv4 source address is at offset 12 of the header. */
+    memcpy(&addr->addr.ipv4, &ip_buf[IP_LLH_LEN + 12], sizeof(IP_address));
+  }
+}
+/*---------------------------------------------------------------------------*/
+#endif /* IP_DUALSTACK */
@@ -0,0 +1,65 @@
+#ifndef __IP6_H__
+#define __IP6_H__
+
+#include "ip.h"
+
+#if IP_DUALSTACK
+
+#define IP_FAMILY_IPV4 4
+#define IP_FAMILY_IPV6 6
+
+/**
+ * An address of either family.
+ *
+ * The IPv4 core keeps using IP_address; the tagged type is used
+ * where both families meet, e.g. for the source of a received packet.
+ */
+typedef struct {
+  uint8_t family;             /**< IP_FAMILY_IPV4 or IP_FAMILY_IPV6. */
+  union {
+    IP_address ipv4;
+    IPV6_address_t ipv6;
+  } addr;
+} ip_addr_t;
+
+/* The link-local address derived from ip_ethaddr, and the address
+   set with ip6_sethostaddr() (all zeroes if none). */
+#if IP_INSTANCES
+#define ip6_linkaddr (ip_stack->linkaddr6)
+#define ip6_hostaddr (ip_stack->hostaddr6)
+#else /* IP_INSTANCES */
+extern IPV6_address_t ip6_linkaddr, ip6_hostaddr;
+#endif /* IP_INSTANCES */
+
+/* The ip6_init() function must be called after the Ethernet address
+   has been set and before any of the other IPv6 functions. */
+void ip6_init(void);
+
+/* The ip6_sethostaddr() function sets a second (e.g. global) address
+   the host answers to. */
+void ip6_sethostaddr(const IPV6_address_t *addr);
+
+/* The ip6_neighbor_in() function should be called by the device
+   driver, instead of ip_arp_ipin(), when an Ethernet frame of type
+   IP_ETHTYPE_IP6 has been received, before ip_input() is called. It
+   learns the link-layer address of the sender. */
+void ip6_neighbor_in(void);
+
+/* The ip6_input() function is called by ip_process() for packets with
+   IP version 6. When it returns, the reply to be sent is in ip_buf
+   and its length in ip_len, or ip_len is 0. */
+void ip6_input(void);
+
+/* The ip6_neighbor_out() function is called by ip_arp_out() for IPv6
+   packets. It builds the Ethernet header from the neighbor cache. If
+   the neighbor is not known, the packet is overwritten with a
+   neighbor solicitation, the way ip_arp_out() sends ARP requests. */
+void ip6_neighbor_out(void);
+
+/* The ip_srcaddr() function returns the source address of the packet
+   in ip_buf, of either family. */
+void ip_srcaddr(ip_addr_t *addr);
+
+#endif /* IP_DUALSTACK */
+
+#endif /* __IP6_H__ */
@@ -13,6 +13,8 @@
  */
 
 #include "ip_arp.h"
+#include "ip6.h"
+#include "ip_stack.h"
 
 #include <string.h>
 
@@ -49,24 +51,30 @@ struct ethip_hdr {
 
 #define ARP_HWTYPE_ETH 1
 
-struct arp_entry {
-	uint16_t ipaddr[2];
-	struct ip_eth_addr ethaddr;
-	uint8_t time;
-};
+/* The maximum age of an entry in milliseconds. */
+#define ARP_MAXAGE_MS ((uint32_t)IP_ARP_MAXAGE * 10000)
 
 static const struct ip_eth_addr broadcast_ethaddr = {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
 static const uint16_t broadcast_ipaddr[2] = {0xFFFF, 0xFFFF};
 
+#if IP_INSTANCES
+#define arp_table (ip_stack->arp_table)
+#define arptime   (ip_stack->arptime)
+#else /* IP_INSTANCES */
 static struct arp_entry arp_table[IP_ARPTAB_SIZE];
-static uint16_t ipaddr[2];
-static uint8_t i, c;
-
+#if !IP_TIMERS
 static uint8_t arptime;
-static uint8_t tmpage;
+#endif
+#endif /* IP_INSTANCES */
 
 #define BUF ((struct arp_hdr *)&ip_buf[0])
 #define IPBUF ((struct ethip_hdr *)&ip_buf[0])
+
+#if IP_STATISTICS == 1
+#define IP_STAT(s) s
+#else
+#define IP_STAT(s)
+#endif /* IP_STATISTICS == 1 */
 /*-----------------------------------------------------------------------------------*/
 /**
  * Initialize the ARP module.
@@ -74,10 +82,27 @@ static uint8_t tmpage;
  */
 /*-----------------------------------------------------------------------------------*/
 void ip_arp_init(void) {
+	uint8_t i;
+
 	for (i = 0; i < IP_ARPTAB_SIZE; ++i) {
 		memset(arp_table[i].ipaddr, 0, 4);
+#if IP_TIMERS
+		ip_timer_stop(&arp_table[i].timer);
+#endif
 	}
 }
+#if IP_TIMERS
+/*-----------------------------------------------------------------------------------*/
+/**
+ * Timer wheel callback that flushes an ARP table entry which has not
+ * been refreshed for IP_ARP_MAXAGE.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static void ip_arp_expired(void *arg) {
+	memset(((struct arp_entry *)arg)->ipaddr, 0, 4);
+}
+#else
 /*-----------------------------------------------------------------------------------*/
 /**
  * Periodic ARP processing function.
@@ -90,6 +115,7 @@ void ip_arp_init(void) {
 /*-----------------------------------------------------------------------------------*/
 void ip_arp_timer(void) {
 	struct arp_entry *tabptr;
+	uint8_t i;
 
 	++arptime;
 	for (i = 0; i < IP_ARPTAB_SIZE; ++i) {
@@ -99,10 +125,17 @@ void ip_arp_timer(void) {
 		}
 	}
 }
+#endif /* IP_TIMERS */
 /*-----------------------------------------------------------------------------------*/
 static void
 ip_arp_update(uint16_t *ipaddr, struct ip_eth_addr *ethaddr) {
 	register struct arp_entry *tabptr;
+	uint8_t i, c;
+#if IP_TIMERS
+	uint32_t tmpage;
+#else
+	uint8_t tmpage;
+#endif
 	/* Walk through the ARP mapping table and try to find an entry to
      update. If none is found, the IP -> MAC address mapping is
      inserted in the ARP table. */
@@ -117,7 +150,11 @@ ip_arp_update(uint16_t *ipaddr, struct ip_eth_addr *ethaddr) {
 			if (ipaddr[0] == tabptr->ipaddr[0] && ipaddr[1] == tabptr->ipaddr[1]) {
 				/* An old entry found, update this and return. */
 				memcpy(tabptr->ethaddr.addr, ethaddr->addr, 6);
+#if IP_TIMERS
+				ip_timer_set(&tabptr->timer, ARP_MAXAGE_MS, ip_arp_expired, tabptr);
+#else
 				tabptr->time = arptime;
+#endif
 				return;
 			}
 		}
@@ -137,8 +174,19 @@ ip_arp_update(uint16_t *ipaddr, struct ip_eth_addr *ethaddr) {
 	/* If no unused entry is found, we try to find the oldest entry and
      throw it away. */
 	if (i == IP_ARPTAB_SIZE) {
-		tmpage = 0;
 		c = 0;
+#if IP_TIMERS
+		/* The oldest entry is the one whose timer expires first. */
+		tmpage = ARP_MAXAGE_MS;
+		for (i = 0; i < IP_ARPTAB_SIZE; ++i) {
+			tabptr = &arp_table[i];
+			if (ip_timer_remaining(&tabptr->timer) < tmpage) {
+				tmpage = ip_timer_remaining(&tabptr->timer);
+				c = i;
+			}
+		}
+#else
+		tmpage = 0;
 		for (i = 0; i < IP_ARPTAB_SIZE; ++i) {
 			tabptr = &arp_table[i];
 			if (arptime - tabptr->time > tmpage) {
@@ -146,6 +194,7 @@ ip_arp_update(uint16_t *ipaddr, struct ip_eth_addr *ethaddr) {
 				c = i;
 			}
 		}
+#endif
 		i = c;
 		tabptr = &arp_table[i];
 	}
@@ -154,7 +203,11 @@ ip_arp_update(uint16_t *ipaddr, struct ip_eth_addr *ethaddr) {
      information. */
 	memcpy(tabptr->ipaddr, ipaddr, 4);
 	memcpy(tabptr->ethaddr.addr, ethaddr->addr, 6);
+#if IP_TIMERS
+	ip_timer_set(&tabptr->timer, ARP_MAXAGE_MS, ip_arp_expired, tabptr);
+#else
 	tabptr->time = arptime;
+#endif
 }
 /*-----------------------------------------------------------------------------------*/
 /**
@@ -211,6 +264,7 @@ void ip_arp_ipin(void) {
  */
 /*-----------------------------------------------------------------------------------*/
 void ip_arp_arpin(void) {
+	IP_STAT(++ip_stat.arp.recv);
 	if (ip_len < sizeof(struct arp_hdr))
 	{
 		ip_len = 0;
@@ -243,6 +297,7 @@ void ip_arp_arpin(void) {
 
 			BUF->ethhdr.type = HTONS(IP_ETHTYPE_ARP);
 			ip_len = sizeof(struct arp_hdr);
+			IP_STAT(++ip_stat.arp.sent);
 		}
 		break;
 	case HTONS(ARP_REPLY):
@@ -286,6 +341,16 @@ void ip_arp_arpin(void) {
 /*-----------------------------------------------------------------------------------*/
 void ip_arp_out(void) {
 	struct arp_entry *tabptr;
+	uint16_t ipaddr[2];
+	uint8_t i;
+
+#if IP_DUALSTACK
+	/* IPv6 packets are resolved through the neighbor cache. */
+	if ((IPBUF->vhl & 0xf0) == 0x60) {
+		ip6_neighbor_out();
+		return;
+	}
+#endif /* IP_DUALSTACK */
 
 	/* Find the destination IP address in the ARP table and construct
      the Ethernet header. If the destination IP addres isn't on the
@@ -337,7 +402,11 @@ void ip_arp_out(void) {
 
 			ip_appdata = &ip_buf[IP_TCPIP_HLEN + IP_LLH_LEN];
 
+			/* The data fragments of the IP packet are not sent either. */
 			ip_len = sizeof(struct arp_hdr);
+			ip_schainlen = 0;
+			IP_STAT(++ip_stat.arp.miss);
+			IP_STAT(++ip_stat.arp.sent);
 			return;
 		}
 
@@ -4,7 +4,11 @@
 #include "ip.h"
 
 
+#if IP_INSTANCES
+#define ip_ethaddr (ip_stack->ethaddr)
+#else /* IP_INSTANCES */
 extern struct ip_eth_addr ip_ethaddr;
+#endif /* IP_INSTANCES */
 
 /**
  * @brief  The Ethernet header.
@@ -52,9 +56,13 @@ void ip_arp_arpin(void);
    the Ethernet frame that should be transmitted. */
 void ip_arp_out(void);
 
+#if !IP_TIMERS
 /* The ip_arp_timer() function should be called every ten seconds. It
-   is responsible for flushing old entries in the ARP table. */
+   is responsible for flushing old entries in the ARP table. With
+   IP_CONF_CLOCK every entry has its own timer in the timer wheel
+   instead. */
 void ip_arp_timer(void);
+#endif
 
 
 /**
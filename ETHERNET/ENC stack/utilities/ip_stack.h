@@ -0,0 +1,148 @@
+/**
+ * State of the stack
+ *
+ * The types of the state the modules of the stack keep between calls
+ * (reassembly contexts, ARP table, IPv6 neighbor cache) and, with
+ * IP_INSTANCES, the struct ip_stack that holds all of it for one
+ * interface.
+ */
+
+#ifndef __IP_STACK_H__
+#define __IP_STACK_H__
+
+#include "ip.h"
+#include "ip_arp.h"
+#include "ip_timer.h"
+#include "ip6.h"
+
+#if IP_REASSEMBLY && !IP_CONF_IPV6
+#define IP_REASS_DATASIZE (IP_REASS_BUFSIZE - IP_IPH_LEN)
+
+/* A datagram being reassembled. */
+struct ip_reass_ctx {
+  uint8_t tmr;                  /* Remaining age, 0 if the context is free. */
+  uint8_t flags;
+  uint16_t len;                 /* Data length, known once the last
+				   fragment has arrived. */
+  uint8_t hdr[IP_IPH_LEN];      /* IP header of the first fragment. */
+  uint8_t bitmap[(IP_REASS_DATASIZE + 63) / 64];
+#ifdef IP_REASS_ALLOC
+  ip_reass_handle_t handle;
+#else /* IP_REASS_ALLOC */
+  uint8_t buf[IP_REASS_DATASIZE];
+#endif /* IP_REASS_ALLOC */
+};
+#endif /* IP_REASSEMBLY && !IP_CONF_IPV6 */
+
+/* An entry of the ARP table. */
+struct arp_entry {
+  uint16_t ipaddr[2];
+  struct ip_eth_addr ethaddr;
+#if IP_TIMERS
+  struct ip_timer timer; /* Expires when the entry gets too old. */
+#else
+  uint8_t time;
+#endif
+};
+
+#if IP_DUALSTACK
+/* An entry of the IPv6 neighbor cache. */
+struct ip6_neighbor {
+  IPV6_address_t ipaddr;
+  struct ip_eth_addr ethaddr;
+};
+#endif /* IP_DUALSTACK */
+
+#if IP_INSTANCES
+
+#if IP_FIXEDADDR || IP_FIXEDETHADDR
+#error "IP_CONF_INSTANCES requires the addresses to be set at run-time"
+#endif
+#ifdef IP_CONF_EXTERNAL_BUFFER
+#error "IP_CONF_INSTANCES keeps the packet buffer in the instance"
+#endif
+#if IP_CONF_IPV6
+#error "IP_CONF_INSTANCES is not supported with IP_CONF_IPV6"
+#endif
+
+/**
+ * An instance of the stack.
+ *
+ * Every field stands for the global variable of the same name,
+ * e.g. buf for ip_buf, arp_table for the ARP table of ip_arp.c.
+ * ip_conn and ip_udp_conn stay globals (IP_INSTANCE_LOCAL): they
+ * only point into the instance while it is processing.
+ */
+struct ip_stack {
+  /* ip.c */
+  uint8_t buf[IP_BUFSIZE + 2];
+  void *appdata, *sappdata;
+#if IP_URGDATA > 0
+  void *urgdata;
+  uint16_t urglen, surglen;
+#endif /* IP_URGDATA > 0 */
+  uint16_t len, slen;
+  struct ip_pbuf *schain;
+  uint16_t schainlen;
+  uint8_t flags, acksegs;
+#if IP_TCP_PMTUD
+  uint8_t df;
+#endif /* IP_TCP_PMTUD */
+  uint16_t sndoff;
+  struct ip_conn conns[IP_CONNS];
+  uint16_t listenports[IP_LISTENPORTS];
+  uint8_t conn_hash[IP_CONN_HASH_SIZE];
+#if IP_UDP
+  struct ip_udp_conn udp_conns[IP_UDP_CONNS];
+  uint8_t udp_hash[IP_UDP_HASH_SIZE];
+#endif /* IP_UDP */
+  uint16_t id;
+  uint8_t iss[4];
+#if IP_ACTIVE_OPEN
+  uint16_t lastport;
+#endif /* IP_ACTIVE_OPEN */
+  uint8_t acc32[4];
+  IP_address hostaddr, draddr, netmask;
+#if IP_STATISTICS == 1
+  struct ip_stats stat;
+#endif /* IP_STATISTICS == 1 */
+#if IP_HISTOGRAMS
+  uint32_t rxstamp, txstamp;
+#endif /* IP_HISTOGRAMS */
+#if IP_REASSEMBLY
+  struct ip_reass_ctx reass_ctxs[IP_REASS_CONTEXTS];
+#ifdef IP_REASS_ALLOC
+  ip_reass_handle_t reass_packet;
+#endif /* IP_REASS_ALLOC */
+#endif /* IP_REASSEMBLY */
+
+  /* ip_arp.c */
+  struct ip_eth_addr ethaddr;
+  struct arp_entry arp_table[IP_ARPTAB_SIZE];
+#if !IP_TIMERS
+  uint8_t arptime;
+#endif /* !IP_TIMERS */
+
+  /* ip_timer.c */
+#if IP_TIMERS
+  struct ip_timer *wheel[IP_TIMER_WHEEL_LEVELS][1 << IP_TIMER_WHEEL_BITS];
+  uint32_t now_tick, now_ms;
+  uint16_t armed;
+#endif /* IP_TIMERS */
+
+  /* ip6.c */
+#if IP_DUALSTACK
+  IPV6_address_t linkaddr6, hostaddr6;
+  struct ip6_neighbor neighbors[IP6_NEIGHBORS];
+  uint8_t nextneighbor;
+#endif /* IP_DUALSTACK */
+};
+
+/* The ip_stack_init() function clears an instance and selects it.
+   ip_init(), ip_arp_init(), ip_timer_init() and ip6_init() are then
+   called for it as for the single stack. */
+void ip_stack_init(struct ip_stack *stack);
+
+#endif /* IP_INSTANCES */
+
+#endif /* __IP_STACK_H__ */
@@ -0,0 +1,266 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * All timers of the stack are kept in IP_TIMER_WHEEL_LEVELS wheels of
+ * 2^IP_TIMER_WHEEL_BITS slots each. A slot of the lowest level holds
+ * the timers that expire at one tick, a slot of the next level the
+ * ones that expire within 2^IP_TIMER_WHEEL_BITS ticks, and so on.
+ * When the lowest level wraps around, the next slot of the level
+ * above is emptied into the levels below ("cascading"). Arming and
+ * cancelling a timer take constant time, and ip_timer_run() only
+ * looks at the slots of the ticks that have passed.
+ *
+ * The ticks are derived from the IP_CLOCK() millisecond counter.
+ */
+
+#include "ip_timer.h"
+#if IP_INSTANCES
+#include "ip_stack.h"
+#endif /* IP_INSTANCES */
+
+#include <string.h>
+
+#if IP_TIMERS
+
+#define SLOTS (1 << IP_TIMER_WHEEL_BITS)
+#define MASK  (SLOTS - 1)
+
+/* The number of ticks spanned by the given number of levels. */
+#define SPAN(levels) ((uint32_t)1 << (IP_TIMER_WHEEL_BITS * (levels)))
+
+#if IP_INSTANCES
+/* Every instance of the stack has its own wheel. */
+#define wheel    (ip_stack->wheel)
+#define now_tick (ip_stack->now_tick)
+#define now_ms   (ip_stack->now_ms)
+#define armed    (ip_stack->armed)
+#else /* IP_INSTANCES */
+static struct ip_timer *wheel[IP_TIMER_WHEEL_LEVELS][SLOTS];
+static uint32_t now_tick;       /* The last tick processed. */
+static uint32_t now_ms;         /* The clock value at now_tick. */
+static uint16_t armed;          /* The number of armed timers. */
+#endif /* IP_INSTANCES */
+/*---------------------------------------------------------------------------*/
+static void
+ip_timer_link(struct ip_timer *t)
+{
+  uint32_t delta, e;
+  struct ip_timer **slot;
+  uint8_t level;
+
+  delta = t->expires - now_tick;
+  if((int32_t)delta < 0) {
+    t->expires = now_tick;
+    delta = 0;
+  }
+  e = t->expires;
+  if(delta >= SPAN(IP_TIMER_WHEEL_LEVELS)) {
+    /* Beyond the reach of the wheel: park the timer in the slot of
+       the top level that is cascaded last; it is put back then. */
+    e = now_tick + SPAN(IP_TIMER_WHEEL_LEVELS) - 1;
+    delta = e - now_tick;
+  }
+  for(level = 0; level < IP_TIMER_WHEEL_LEVELS - 1 &&
+	delta >= SPAN(level + 1); ++level);
+
+  slot = &wheel[level][(e >> (IP_TIMER_WHEEL_BITS * level)) & MASK];
+  t->next = *slot;
+  if(t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = slot;
+  *slot = t;
+  ++armed;
+}
+/*---------------------------------------------------------------------------*/
+static void
+ip_timer_unlink(struct ip_timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->pprev = NULL;
+  --armed;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Initialize the timer wheel.
+ *
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip_timer_init(void)
+{
+  memset(wheel, 0, sizeof(wheel));
+  now_tick = 0;
+  now_ms = IP_CLOCK();
+  armed = 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Arm a timer.
+ *
+ * \param t A pointer to the timer.
+ * \param ms The time until the timer expires, in milliseconds. It is
+ * rounded up to the next tick and must stay below 2^31.
+ * \param callback The function to call when the timer expires.
+ * \param arg The argument passed to callback.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip_timer_set(struct ip_timer *t, uint32_t ms,
+	     void (*callback)(void *arg), void *arg)
+{
+  uint32_t ticks;
+
+  if(ip_timer_pending(t)) {
+    ip_timer_unlink(t);
+  }
+  t->callback = callback;
+  t->arg = arg;
+  ticks = (IP_CLOCK() - now_ms + ms + IP_TIMER_TICK - 1) / IP_TIMER_TICK;
+  /* The slot of the current tick has been processed already. */
+  t->expires = now_tick + (ticks == 0? 1: ticks);
+  ip_timer_link(t);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Cancel a timer.
+ *
+ * \param t A pointer to the timer.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip_timer_stop(struct ip_timer *t)
+{
+  if(ip_timer_pending(t)) {
+    ip_timer_unlink(t);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * The time left until a timer expires.
+ *
+ * \param t A pointer to an armed timer.
+ *
+ * \return The number of milliseconds, 0 if the timer is due.
+ */
+/*---------------------------------------------------------------------------*/
+uint32_t
+ip_timer_remaining(struct ip_timer *t)
+{
+  uint32_t left, elapsed;
+
+  left = (t->expires - now_tick) * IP_TIMER_TICK;
+  elapsed = IP_CLOCK() - now_ms;
+  return left > elapsed? left - elapsed: 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Periodic timer wheel processing function.
+ *
+ * Advances the wheel to the current clock value and calls the
+ * callbacks of the timers that have expired on the way. It must not
+ * be called from within a timer callback.
+ */
+/*---------------------------------------------------------------------------*/
+void
+ip_timer_run(void)
+{
+  ip_timer_poll(0);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Timer wheel processing with a budget.
+ *
+ * Like ip_timer_run(), but returns after budget callbacks. The
+ * expired timers that are left are called first by the next call.
+ *
+ * \param budget The maximum number of callbacks, 0 for no limit.
+ *
+ * \return Non-zero if expired timers are left.
+ */
+/*---------------------------------------------------------------------------*/
+uint8_t
+ip_timer_poll(uint16_t budget)
+{
+  struct ip_timer *t;
+  uint32_t elapsed;
+  uint16_t calls;
+  uint8_t level, idx;
+
+  calls = 0;
+  elapsed = (IP_CLOCK() - now_ms) / IP_TIMER_TICK;
+  for(;;) {
+    /* The callbacks may arm and cancel timers, including the ones
+       still waiting in this slot. A previous call that ran out of
+       budget left timers in it. */
+    while((t = wheel[0][now_tick & MASK]) != NULL) {
+      if(budget != 0 && calls == budget) {
+	return 1;
+      }
+      ip_timer_unlink(t);
+      t->callback(t->arg);
+      ++calls;
+    }
+
+    if(elapsed == 0) {
+      return 0;
+    }
+    if(armed == 0) {
+      /* Nothing can expire, skip the remaining ticks at once. */
+      now_tick += elapsed;
+      now_ms += elapsed * IP_TIMER_TICK;
+      return 0;
+    }
+    --elapsed;
+    ++now_tick;
+    now_ms += IP_TIMER_TICK;
+
+    /* Every time a level wraps around, the next slot of the level
+       above is distributed over the levels below. */
+    idx = now_tick & MASK;
+    for(level = 1; idx == 0 && level < IP_TIMER_WHEEL_LEVELS; ++level) {
+      idx = (now_tick >> (IP_TIMER_WHEEL_BITS * level)) & MASK;
+      while((t = wheel[level][idx]) != NULL) {
+	ip_timer_unlink(t);
+	ip_timer_link(t);
+      }
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * The time until the wheel has work to do.
+ *
+ * Timers in the upper levels are only looked at when the lowest
+ * level wraps around, so the result may be earlier than the next
+ * timer, never later.
+ *
+ * \return The number of milliseconds until ip_timer_run() should be
+ * called, IP_TIMER_NEVER if no timer is armed.
+ */
+/*---------------------------------------------------------------------------*/
+uint32_t
+ip_timer_next(void)
+{
+  uint32_t ticks, elapsed;
+
+  if(armed == 0) {
+    return IP_TIMER_NEVER;
+  }
+  if(wheel[0][now_tick & MASK] != NULL) {
+    return 0;
+  }
+  /* The first occupied slot of the lowest level, or the wrap-around
+     that cascades the level above. */
+  for(ticks = 1; ticks < SLOTS - (now_tick & MASK) &&
+	wheel[0][(now_tick + ticks) & MASK] == NULL; ++ticks);
+
+  ticks *= IP_TIMER_TICK;
+  elapsed = IP_CLOCK() - now_ms;
+  return ticks > elapsed? ticks - elapsed: 0;
+}
+/*---------------------------------------------------------------------------*/
+#endif /* IP_TIMERS */
@@ -0,0 +1,89 @@
+#ifndef __IP_TIMER_H__
+#define __IP_TIMER_H__
+
+#include <stdint.h>
+#include "ipopt.h"
+
+#if IP_TIMERS
+
+/**
+ * A timer of the stack timer wheel.
+ *
+ * The structure is embedded in the object the timer belongs to (an
+ * ARP entry, a connection, ...); the wheel only links it into one of
+ * its slots, so arming and cancelling a timer take constant time and
+ * no memory is allocated.
+ */
+struct ip_timer {
+  struct ip_timer *next;    /**< Next timer in the same slot. */
+  struct ip_timer **pprev;  /**< The pointer that points to this timer,
+			       NULL if the timer is not armed. */
+  uint32_t expires;         /**< The tick at which the timer expires. */
+  void (*callback)(void *arg); /**< Called when the timer expires. */
+  void *arg;                /**< Argument passed to the callback. */
+};
+
+/* The ip_timer_init() function must be called before any of the
+   other timer functions. */
+void ip_timer_init(void);
+
+/* The ip_timer_set() function arms a timer to call callback(arg) in
+   ms milliseconds, at the earliest. A timer that is already armed is
+   rescheduled. The callback may arm the timer again. */
+void ip_timer_set(struct ip_timer *t, uint32_t ms,
+		  void (*callback)(void *arg), void *arg);
+
+/* The ip_timer_stop() function cancels a timer. It does nothing if
+   the timer is not armed. */
+void ip_timer_stop(struct ip_timer *t);
+
+/* The ip_timer_remaining() function returns the number of
+   milliseconds until an armed timer expires. */
+uint32_t ip_timer_remaining(struct ip_timer *t);
+
+/* The ip_timer_run() function should be called by the device driver
+   whenever ip_buf is free, as often as the timer resolution
+   (IP_TIMER_TICK) requires. It calls the callbacks of all timers that
+   have expired since the last call. The cost of a call is
+   proportional to the number of expired timers, not to the number of
+   armed ones. */
+void ip_timer_run(void);
+
+/* The ip_timer_poll() function is ip_timer_run() with a limit on the
+   number of callbacks, for callers that share the CPU between the
+   timers and other work. It returns non-zero if expired timers are
+   left for the next call. */
+uint8_t ip_timer_poll(uint16_t budget);
+
+/* The ip_timer_next() function returns the number of milliseconds
+   the caller may sleep before ip_timer_run() has work to do. */
+uint32_t ip_timer_next(void);
+
+/* Returned by ip_timer_next() when no timer is armed. */
+#define IP_TIMER_NEVER 0xffffffffUL
+
+/**
+ * Is the timer armed?
+ *
+ * A timer that has expired is no longer armed when its callback is
+ * called.
+ *
+ * \param t A pointer to the timer.
+ *
+ * \hideinitializer
+ */
+#define ip_timer_pending(t) ((t)->pprev != NULL)
+
+/**
+ * Initializes a timer that has never been armed. Timers in zeroed
+ * memory need not be initialized.
+ *
+ * \param t A pointer to the timer.
+ *
+ * \hideinitializer
+ */
+#define ip_timer_clear(t) ((t)->pprev = NULL)
+
+#endif /* IP_TIMERS */
+
+#endif /* __IP_TIMER_H__ */
@@ -11,6 +11,117 @@
 #define IP_CONF_MAX_CONNECTIONS 4
 #endif
 
+/**
+ * packet payloads are kept in the ENC28J60 buffer, so the MSS follows the
+ * Ethernet MTU (MAX_FRAMELEN in enc28j60.h less Ethernet header and CRC)
+ * rather than the size of ip_buf; path MTU discovery lowers it per connection.
+ * Every TCP and UDP block comes out of the memory pool, the 6 KB of ENC28J60
+ * SRAM between TXSTART_INIT and TXSTOP_INIT: with 1460 byte segments only four
+ * full blocks fit, shared by all sockets and both directions. A smaller MTU
+ * (e.g. 576) keeps more segments in flight when several connections are open
+ */
+#ifndef IP_CONF_LINK_MTU
+#define IP_CONF_LINK_MTU        1500
+#endif
+#ifndef IP_CONF_TCP_PMTUD
+#define IP_CONF_TCP_PMTUD       1
+#endif
+
+/**
+ * one IP stack per Ethernet instance instead of global state; costs a pointer
+ * indirection on every access, so it stays off for a single ENC28J60
+ */
+#ifndef IP_CONF_INSTANCES
+#define IP_CONF_INSTANCES       0
+#endif
+
+/**
+ * IPv6 next to IPv4: neighbor discovery and echo on the link-local address,
+ * TCP and UDP stay on IPv4 and are refused over IPv6 with a port unreachable;
+ * IPv4 packets take the same header check as before. the controller then also
+ * receives multicast frames, which neighbor solicitations are sent to
+ */
+#ifndef IP_CONF_DUALSTACK
+#define IP_CONF_DUALSTACK       1
+#endif
+
+/**
+ * number of unacknowledged segments per connection, each one held in one of the
+ * IP_SOCKET_NUMPACKETS outgoing memory pool blocks until it is acknowledged
+ */
+#ifndef IP_CONF_TCP_MAX_INFLIGHT
+#define IP_CONF_TCP_MAX_INFLIGHT IP_SOCKET_NUMPACKETS
+#endif
+
+/**
+ * advertised receive window: the space left in the connection's IP_SOCKET_NUMPACKETS
+ * incoming memory pool blocks, bounded by the free memory pool capacity
+ */
+#ifndef IP_CONF_TCP_RCVWND
+#define IP_CONF_TCP_RCVWND(conn) ip_ethernet_rcvwnd(conn)
+#endif
+
+/**
+ * acknowledge every second received segment, a single one after at most one
+ * IP_PERIODIC_TIMER period (or earlier with outgoing data)
+ */
+#ifndef IP_CONF_TCP_DELACK
+#define IP_CONF_TCP_DELACK      1
+#endif
+#ifndef IP_CONF_TCP_DELACK_TIMEOUT
+#define IP_CONF_TCP_DELACK_TIMEOUT 1
+#endif
+
+/**
+ * millisecond clock of the timer wheel that runs ARP, TCP, DHCP and DNS timers
+ * from Ethernetick(); packets left by a timer go out through ip_ethernet_output()
+ */
+#ifndef IP_CONF_CLOCK
+#define IP_CONF_CLOCK()         ((uint32_t)millis())
+#endif
+#ifndef IP_CONF_OUTPUT
+#define IP_CONF_OUTPUT()        ip_ethernet_output()
+#endif
+#ifndef IP_CONF_TCP_PERIODIC
+#define IP_CONF_TCP_PERIODIC    IP_PERIODIC_TIMER
+#endif
+
+/**
+ * millisecond clock driving RTT estimation and retransmissions, which then no
+ * longer wait for the IP_PERIODIC_TIMER tick
+ */
+#ifndef IP_CONF_TCP_CLOCK
+#define IP_CONF_TCP_CLOCK()     IP_CONF_CLOCK()
+#endif
+
+/**
+ * work done by one Ethernetick() round: frames received, timer callbacks run and
+ * transmitted frames reaped; what a budget leaves over is taken up by the next round
+ */
+#ifndef IPETHERNET_RX_BUDGET
+#define IPETHERNET_RX_BUDGET    4
+#endif
+#ifndef IPETHERNET_TIMER_BUDGET
+#define IPETHERNET_TIMER_BUDGET 8
+#endif
+#ifndef IPETHERNET_TX_BUDGET
+#define IPETHERNET_TX_BUDGET    ENC28J60_TXQUEUE_SIZE
+#endif
+
+/**
+ * counters of every layer (driver, ARP, IP, ICMP, TCP, UDP) read through
+ * ip_ethernet_stats(); the latency histograms also take a microsecond clock
+ */
+#ifndef IP_CONF_STATISTICS
+#define IP_CONF_STATISTICS      0
+#endif
+#ifndef IP_CONF_HISTOGRAMS
+#define IP_CONF_HISTOGRAMS      0
+#endif
+#ifndef IP_CONF_CLOCK_US
+#define IP_CONF_CLOCK_US()      ((uint32_t)micros())
+#endif
+
 /**
  * UDP
  * Set IP_CONF_UDP to 0 to disable UDP (saves aprox. 5kB flash)
@@ -26,12 +137,141 @@
 #endif
 
 /**
- * size of received UDP messages backlog. it must be at least 1
+ * bytes of the per socket ring received UDP datagrams are queued in until they are
+ * read, each one takes 8 bytes more than its payload. datagrams that do not fit are dropped.
+ * every listening socket (the DHCP and DNS clients included) takes its ring out of the
+ * 6 KB memory pool for as long as it is open, so the default holds one full DHCP reply
+ * (548 bytes) and keeps IP_CONF_UDP_CONNS rings below half of the pool
  */
-#ifndef IP_UDP_BACKLOG
-#define IP_UDP_BACKLOG       2
+#ifndef IP_UDP_RXRING
+#define IP_UDP_RXRING        640
 #endif
 
+/**
+ * DHCP client run from Ethernetick(): DISCOVER and REQUEST are sent again after
+ * DHCP_RETRANSMIT_MIN ms, doubling up to DHCP_RETRANSMIT_MAX, and an offer is given up
+ * after DHCP_REQUEST_RETRIES REQUESTs. past T1 (renew) and T2 (rebind) the REQUEST is
+ * sent again after half the time left, at least DHCP_RENEW_MIN_WAIT seconds
+ */
+#ifndef DHCP_RETRANSMIT_MIN
+#define DHCP_RETRANSMIT_MIN     4000
+#endif
+#ifndef DHCP_RETRANSMIT_MAX
+#define DHCP_RETRANSMIT_MAX     64000
+#endif
+#ifndef DHCP_REQUEST_RETRIES
+#define DHCP_REQUEST_RETRIES    4
+#endif
+#ifndef DHCP_RENEW_MIN_WAIT
+#define DHCP_RENEW_MIN_WAIT     60
+#endif
+
+/**
+ * fast start after a reboot: the REQUEST for the address of a saved lease (INIT-REBOOT)
+ * is sent DHCP_REBOOT_RETRIES times before falling back to a DISCOVER. with
+ * DHCP_RAPID_COMMIT the DISCOVER asks for the two message exchange of RFC 4039, a
+ * server that supports it answers with the ACK right away
+ */
+#ifndef DHCP_REBOOT_RETRIES
+#define DHCP_REBOOT_RETRIES     2
+#endif
+#ifndef DHCP_RAPID_COMMIT
+#define DHCP_RAPID_COMMIT       1
+#endif
+
+/**
+ * resolver queries in flight at once and DNS servers they are spread over. a query
+ * is sent up to DNS_RETRIES times, each time to the next server, and waits DNS_TIMEOUT
+ * ms for the reply, twice as long once every server has been asked
+ */
+#ifndef DNS_MAX_QUERIES
+#define DNS_MAX_QUERIES         4
+#endif
+#ifndef DNS_MAX_SERVERS
+#define DNS_MAX_SERVERS         2
+#endif
+#ifndef DNS_QUERY_NAMELEN
+#define DNS_QUERY_NAMELEN       64
+#endif
+#ifndef DNS_RETRIES
+#define DNS_RETRIES             4
+#endif
+#ifndef DNS_TIMEOUT
+#define DNS_TIMEOUT             2000
+#endif
+
+/**
+ * replies are parsed in a static buffer of DNS_MESSAGE_SIZE bytes shared by all resolvers
+ * (512 is the largest reply over UDP), following at most DNS_MAX_CNAMES aliases
+ */
+#ifndef DNS_MESSAGE_SIZE
+#define DNS_MESSAGE_SIZE        512
+#endif
+#ifndef DNS_MAX_CNAMES
+#define DNS_MAX_CNAMES          8
+#endif
+
+/**
+ * resolver cache of DNS_resolve(): answers are kept for their TTL (clamped to
+ * DNS_CACHE_MAX_TTL seconds), names that do not exist for DNS_CACHE_NEGATIVE_TTL.
+ * names longer than DNS_CACHE_NAMELEN - 1 are not cached. set DNS_CACHE_SIZE to 0 to disable
+ */
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE          4
+#endif
+#ifndef DNS_CACHE_NAMELEN
+#define DNS_CACHE_NAMELEN       32
+#endif
+#ifndef DNS_CACHE_MAX_TTL
+#define DNS_CACHE_MAX_TTL       86400
+#endif
+#ifndef DNS_CACHE_NEGATIVE_TTL
+#define DNS_CACHE_NEGATIVE_TTL  60
+#endif
+
+/**
+ * DNS_poll() queries again an entry looked up at least DNS_CACHE_REFRESH_HITS
+ * times once less than DNS_CACHE_REFRESH_AHEAD seconds of its TTL are left
+ */
+#ifndef DNS_CACHE_REFRESH_HITS
+#define DNS_CACHE_REFRESH_HITS  2
+#endif
+#ifndef DNS_CACHE_REFRESH_AHEAD
+#define DNS_CACHE_REFRESH_AHEAD 30
+#endif
+
+/**
+ * IP fragment reassembly. Set IP_CONF_REASSEMBLY to 1 to accept fragmented datagrams,
+ * fragments are collected in memory pool blocks of IP_CONF_REASS_BUFSIZE bytes (one per context)
+ * the default takes in one datagram of up to 1500 bytes at a time: the blocks come out of the
+ * 6 KB pool next to the UDP rings, the TCP blocks and the frames being sent, mempool_conf.h
+ * refuses a setting that leaves no room for them
+ */
+#ifndef IP_CONF_REASSEMBLY
+#define IP_CONF_REASSEMBLY      0
+#endif
+#ifndef IP_CONF_REASS_CONTEXTS
+#define IP_CONF_REASS_CONTEXTS  1
+#endif
+#ifndef IP_CONF_REASS_BUFSIZE
+#define IP_CONF_REASS_BUFSIZE   1500
+#endif
+
+#if IP_CONF_REASSEMBLY
+#define IP_REASS_HANDLE                         uint8_t
+#define IP_REASS_ALLOC(size)                    ip_ethernet_reass_alloc(size)
+#define IP_REASS_WRITE(handle,pos,data,len)     ip_ethernet_reass_write(handle,pos,data,len)
+#define IP_REASS_READ(handle,pos,data,len)      ip_ethernet_reass_read(handle,pos,data,len)
+#define IP_REASS_FREE(handle)                   ip_ethernet_reass_free(handle)
+#endif
+
+/**
+ * data fragments sent with ip_send_chain() may be memory pool blocks, they are
+ * checksummed by the ENC28J60 and copied to the frame by its DMA
+ */
+#define IP_PBUF_HANDLE                          uint8_t
+#define IP_PBUF_CHKSUM(sum,handle,pos,len)      ip_ethernet_pbuf_chksum(sum,handle,pos,len)
+
 /** timeout in ms for attempts to get a free memory block to write
  * before returning number of bytes sent so far
  * set to 0 to block until connection is closed by timeout */
@@ -73,6 +73,35 @@
  */
 #define IP_FIXED_ETHADDR 0
 
+/**
+ * @brief Keep the state of the stack in instances instead of globals.
+ *
+ * If this option is set, the packet buffer, the connections, the
+ * ARP table, the timer wheel and the other state of the stack live
+ * in a struct ip_stack. The names of the global variables (ip_buf,
+ * ip_len, ip_conn, ...) then refer to the instance selected with
+ * ip_stack_select(), so several interfaces can each run their own
+ * stack. Requires IP_FIXEDADDR, IP_FIXEDETHADDR and
+ * IP_CONF_EXTERNAL_BUFFER to be off.
+ */
+#ifdef IP_CONF_INSTANCES
+#define IP_INSTANCES IP_CONF_INSTANCES
+#else /* IP_CONF_INSTANCES */
+#define IP_INSTANCES 0
+#endif /* IP_CONF_INSTANCES */
+
+/**
+ * @brief Storage class of the pointer to the selected instance.
+ *
+ * Leave empty for a single thread. Set it to _Thread_local (or
+ * __thread) to let every thread select and drive its own instance.
+ */
+#ifdef IP_CONF_INSTANCE_LOCAL
+#define IP_INSTANCE_LOCAL IP_CONF_INSTANCE_LOCAL
+#else /* IP_CONF_INSTANCE_LOCAL */
+#define IP_INSTANCE_LOCAL
+#endif /* IP_CONF_INSTANCE_LOCAL */
+
 /**
  * Opciones de configuración IP
 */
@@ -84,6 +113,34 @@
 */
 #define IP_TTL  64
 
+/**
+ * @brief Answer IPv6 next to IPv4 in the same build.
+ *
+ * The core stays an IPv4 stack (IP_CONF_IPV6 must be 0); packets
+ * with version 6 are handed to ip6_input(), which resolves neighbors
+ * and answers ICMPv6 echo requests for the link-local address of
+ * the host and the one set with ip6_sethostaddr().
+ */
+#ifdef IP_CONF_DUALSTACK
+#define IP_DUALSTACK IP_CONF_DUALSTACK
+#else /* IP_CONF_DUALSTACK */
+#define IP_DUALSTACK 0
+#endif /* IP_CONF_DUALSTACK */
+
+#if IP_DUALSTACK && IP_CONF_IPV6
+#error "IP_CONF_DUALSTACK requires the IPv4 core (IP_CONF_IPV6 0)"
+#endif
+
+/**
+ * @brief The size of the IPv6 neighbor cache of the dual-stack
+ * configuration.
+ */
+#ifdef IP_CONF_IP6_NEIGHBORS
+#define IP6_NEIGHBORS IP_CONF_IP6_NEIGHBORS
+#else /* IP_CONF_IP6_NEIGHBORS */
+#define IP6_NEIGHBORS 4
+#endif /* IP_CONF_IP6_NEIGHBORS */
+
 /**
  * @brief Turn on support for IP packet reassembly.
  *
@@ -97,14 +154,95 @@
  *
 
  */
+#ifdef IP_CONF_REASSEMBLY
+#define IP_REASSEMBLY IP_CONF_REASSEMBLY
+#else /* IP_CONF_REASSEMBLY */
 #define IP_REASSEMBLY   0
+#endif /* IP_CONF_REASSEMBLY */
 
 /**
  * @brief The maximum time an IP fragment should wait in the reassembly
- * buffer before it is dropped.
+ * buffer before it is dropped, counted in calls to ip_reass_timer().
  */
 #define IP_REASS_MAXAGE 40
 
+/**
+ * @brief The number of IP datagrams that can be reassembled at the same
+ * time.
+ *
+ * Each reassembly context is keyed by source and destination address,
+ * IP identification and protocol. When all contexts are in use, the
+ * oldest one is dropped to make room for a new datagram.
+ */
+#ifdef IP_CONF_REASS_CONTEXTS
+#define IP_REASS_CONTEXTS IP_CONF_REASS_CONTEXTS
+#else /* IP_CONF_REASS_CONTEXTS */
+#define IP_REASS_CONTEXTS 2
+#endif /* IP_CONF_REASS_CONTEXTS */
+
+/**
+ * @brief The largest datagram (IP header included) that can be
+ * reassembled.
+ *
+ * Without external storage every context holds a buffer of this size
+ * in RAM, so it defaults to the size of the ip_buf buffer.
+ */
+#ifdef IP_CONF_REASS_BUFSIZE
+#define IP_REASS_BUFSIZE IP_CONF_REASS_BUFSIZE
+#else /* IP_CONF_REASS_BUFSIZE */
+#define IP_REASS_BUFSIZE (IP_BUFSIZE - IP_LLH_LEN)
+#endif /* IP_CONF_REASS_BUFSIZE */
+
+/**
+ * @brief External storage for reassembly buffers.
+ *
+ * If IP_REASS_ALLOC is defined, fragment data is not kept in RAM but
+ * in blocks obtained through these macros (e.g. MemoryPool blocks in
+ * the ENC28J60 buffer memory), so large datagrams can be reassembled
+ * with a small ip_buf:
+ *
+ * - IP_REASS_ALLOC(size): returns a handle, or IP_REASS_NOBLOCK
+ * - IP_REASS_WRITE(handle, pos, data, len)
+ * - IP_REASS_READ(handle, pos, data, len)
+ * - IP_REASS_FREE(handle)
+ *
+ * IP_REASS_HANDLE is the type of the handles (uint8_t by default).
+ */
+#ifdef IP_REASS_ALLOC
+#ifndef IP_REASS_NOBLOCK
+#define IP_REASS_NOBLOCK 0
+#endif
+#ifndef IP_REASS_HANDLE
+#define IP_REASS_HANDLE uint8_t
+#endif
+#endif /* IP_REASS_ALLOC */
+
+/**
+ * @brief Packet data kept outside of RAM.
+ *
+ * ip_send_chain() sends data fragments after the headers in ip_buf
+ * without copying them into it. IP_PBUF_ROM fragments are read with
+ * IP_PBUF_ROM_READ(dest, src, len), memcpy() by default; targets with
+ * a separate program memory map it to their own copy function.
+ *
+ * If IP_PBUF_CHKSUM is defined, fragments can also be IP_PBUF_BLOCK
+ * blocks of the memory of the network device (e.g. MemoryPool blocks
+ * in the ENC28J60 buffer memory):
+ *
+ * - IP_PBUF_CHKSUM(sum, handle, pos, len): adds len bytes of the
+ *   block to the checksum sum, in host byte order
+ *
+ * IP_PBUF_HANDLE is the type of the handles (uint8_t by default).
+ */
+#ifndef IP_PBUF_ROM_READ
+#define IP_PBUF_ROM_READ(dest, src, len) memcpy(dest, src, len)
+#endif
+#ifdef IP_PBUF_CHKSUM
+#ifndef IP_PBUF_HANDLE
+#define IP_PBUF_HANDLE uint8_t
+#endif
+#endif /* IP_PBUF_CHKSUM */
+
 /**
  * Opciones de configuración UDP
 */
@@ -142,10 +280,36 @@
 #define IP_UDP_CONNS    10
 #endif /* IP_CONF_UDP_CONNS */
 
+/**
+ * @brief Number of hash buckets used to demultiplex incoming UDP
+ * datagrams on their local port.
+ *
+ * Must be a power of two.
+ */
+#ifdef IP_CONF_UDP_HASH_SIZE
+#define IP_UDP_HASH_SIZE IP_CONF_UDP_HASH_SIZE
+#else /* IP_CONF_UDP_HASH_SIZE */
+#define IP_UDP_HASH_SIZE 4
+#endif /* IP_CONF_UDP_HASH_SIZE */
+
 /**
  * Opciones de configuracion TCP
  */
 
+/**
+ * @brief Number of hash buckets used to demultiplex incoming TCP
+ * segments on their (remote address, local port, remote port) tuple.
+ *
+ * Must be a power of two. About as many buckets as connections keeps
+ * the chains one entry long; a value of 1 degrades the lookup to the
+ * linear walk over ip_conns[] it replaces.
+ */
+#ifdef IP_CONF_CONN_HASH_SIZE
+#define IP_CONN_HASH_SIZE IP_CONF_CONN_HASH_SIZE
+#else /* IP_CONF_CONN_HASH_SIZE */
+#define IP_CONN_HASH_SIZE 8
+#endif /* IP_CONF_CONN_HASH_SIZE */
+
 /**
  * @brief Determines if support for opening connections from IP should be
  * compiled in.
@@ -221,18 +385,47 @@
  */
 #define IP_MAXSYNRTX      5
 
+/**
+ * @brief The MTU of the link: the largest IP datagram it carries.
+ *
+ * Defaults to what fits in the packet buffer. A port that keeps
+ * packet payloads outside of ip_buf sets it to the MTU of the
+ * interface.
+ */
+#ifdef IP_CONF_LINK_MTU
+#define IP_LINK_MTU IP_CONF_LINK_MTU
+#else /* IP_CONF_LINK_MTU */
+#define IP_LINK_MTU (IP_BUFSIZE - IP_LLH_LEN)
+#endif /* IP_CONF_LINK_MTU */
+
 /**
  * @brief The TCP maximum segment size.
  *
- * This is should not be to set to more than
- * IP_BUFSIZE - IP_LLH_LEN - IP_TCPIP_HLEN.
+ * The MSS announced to the peer and the upper bound of the segments
+ * sent. Derived from the link MTU by default; the MSS used on a
+ * connection is the smallest of this, the MSS the peer announced and
+ * the path MTU (see ip_conn_mss()).
  */
 #ifndef IP_CONF_TCP_MSS
-#define IP_TCP_MSS     (IP_BUFSIZE - IP_LLH_LEN - IP_TCPIP_HLEN)
+#define IP_TCP_MSS     (IP_LINK_MTU - IP_TCPIP_HLEN)
 #else
 #define IP_TCP_MSS IP_CONF_TCP_MSS
 #endif
 
+/**
+ * @brief Path MTU discovery (RFC 1191).
+ *
+ * TCP segments are sent with the Don't Fragment bit set, and an ICMP
+ * "fragmentation needed" message lowers the MSS of the connection it
+ * refers to. Segments that were already sent larger than the new
+ * path MTU are retransmitted without the Don't Fragment bit.
+ */
+#ifdef IP_CONF_TCP_PMTUD
+#define IP_TCP_PMTUD IP_CONF_TCP_PMTUD
+#else /* IP_CONF_TCP_PMTUD */
+#define IP_TCP_PMTUD 0
+#endif /* IP_CONF_TCP_PMTUD */
+
 /**
  * @brief The size of the advertised receiver's window.
  *
@@ -247,6 +440,39 @@
 #define IP_RECEIVE_WINDOW IP_CONF_RECEIVE_WINDOW
 #endif
 
+/**
+ * @brief The receive window advertised for a connection.
+ *
+ * Evaluated for every outgoing segment with a pointer to the
+ * connection. Defaults to the fixed IP_RECEIVE_WINDOW; a port can map
+ * it to a function returning the buffer space the connection has
+ * left, so that the peer never sends more than can be stored.
+ */
+#ifdef IP_CONF_TCP_RCVWND
+#define IP_TCP_RCVWND(conn) IP_CONF_TCP_RCVWND(conn)
+#else /* IP_CONF_TCP_RCVWND */
+#define IP_TCP_RCVWND(conn) (IP_RECEIVE_WINDOW)
+#endif /* IP_CONF_TCP_RCVWND */
+
+/**
+ * @brief The TCP window scale shift (RFC 7323) offered to the peer.
+ *
+ * Only needed when the receive window can exceed 65535 bytes. With
+ * the default of 0 the option is neither sent nor accepted.
+ */
+#ifdef IP_CONF_TCP_WSCALE
+#define IP_TCP_WSCALE IP_CONF_TCP_WSCALE
+#else /* IP_CONF_TCP_WSCALE */
+#define IP_TCP_WSCALE 0
+#endif /* IP_CONF_TCP_WSCALE */
+
+#if IP_TCP_WSCALE > 14
+#error "IP_TCP_WSCALE can not be larger than 14"
+#endif
+#if (IP_RECEIVE_WINDOW) > (0xffffUL << IP_TCP_WSCALE)
+#error "IP_RECEIVE_WINDOW does not fit the window field, raise IP_CONF_TCP_WSCALE"
+#endif
+
 /**
  * @brief How long a connection should stay in the TIME_WAIT state.
  *
@@ -255,6 +481,114 @@
  */
 #define IP_TIME_WAIT_TIMEOUT 120
 
+/**
+ * @brief The maximum number of unacknowledged TCP segments a connection
+ * may have in flight.
+ *
+ * With the default of 1 the stack behaves like classic uIP and sends
+ * one segment per round trip. Larger values let the application keep
+ * several segments outstanding (bounded by the peer's window); it must
+ * then keep a copy of every unacknowledged segment so that the oldest
+ * one can be resent on ip_rexmit().
+ *
+ * On a path with a 2 ms round trip a value of 1 limits a full-sized
+ * sender to about 2 Mbit/s; 4 is enough to fill a 10 Mbit/s link.
+ */
+#ifdef IP_CONF_TCP_MAX_INFLIGHT
+#define IP_TCP_MAX_INFLIGHT IP_CONF_TCP_MAX_INFLIGHT
+#else /* IP_CONF_TCP_MAX_INFLIGHT */
+#define IP_TCP_MAX_INFLIGHT 1
+#endif /* IP_CONF_TCP_MAX_INFLIGHT */
+
+/**
+ * @brief Determines if acknowledgements of incoming data should be
+ * delayed.
+ *
+ * With delayed ACKs every second data segment is acknowledged at
+ * once, while a single one is acknowledged by the next outgoing
+ * segment or when the delayed ACK timer expires, whatever comes
+ * first. Out-of-order segments are always acknowledged immediately.
+ * This halves the frames sent back during a bulk receive.
+ */
+#ifdef IP_CONF_TCP_DELACK
+#define IP_TCP_DELACK IP_CONF_TCP_DELACK
+#else /* IP_CONF_TCP_DELACK */
+#define IP_TCP_DELACK 0
+#endif /* IP_CONF_TCP_DELACK */
+
+/**
+ * @brief The delayed ACK timeout, counted in timer pulses.
+ *
+ * Together with the timer period it must stay below the 500 ms
+ * allowed by RFC 1122.
+ */
+#ifdef IP_CONF_TCP_DELACK_TIMEOUT
+#define IP_TCP_DELACK_TIMEOUT IP_CONF_TCP_DELACK_TIMEOUT
+#else /* IP_CONF_TCP_DELACK_TIMEOUT */
+#define IP_TCP_DELACK_TIMEOUT 1
+#endif /* IP_CONF_TCP_DELACK_TIMEOUT */
+
+/**
+ * @brief Millisecond clock for TCP retransmissions.
+ *
+ * If IP_CONF_TCP_CLOCK() is defined to return a free running 32-bit
+ * millisecond counter, the RTT is estimated (Jacobson/Karels) and the
+ * retransmission timer runs in milliseconds instead of timer pulses,
+ * and ip_rexmit_timer() can be called as soon as ip_rexmit_due()
+ * reports an expired timer, without waiting for the periodic timer.
+ *
+ * With the timer wheel (IP_CONF_CLOCK) the retransmission deadlines
+ * are kept in IP_CONF_CLOCK() time, so that the wheel and the RTT
+ * estimator agree on when a timer is due; IP_CONF_TCP_CLOCK is then
+ * not used.
+ */
+#if defined(IP_CONF_CLOCK)
+#define IP_TCP_CLOCK() IP_CONF_CLOCK()
+#define IP_TCP_MSRTT 1
+#elif defined(IP_CONF_TCP_CLOCK)
+#define IP_TCP_CLOCK() IP_CONF_TCP_CLOCK()
+#define IP_TCP_MSRTT 1
+#else /* IP_CONF_TCP_CLOCK */
+#define IP_TCP_MSRTT 0
+#endif /* IP_CONF_TCP_CLOCK */
+
+/**
+ * @brief Initial, lower and upper bound of the millisecond
+ * retransmission timeout.
+ *
+ * Only used with IP_CONF_TCP_CLOCK. IP_TCP_RTO_MAX must not exceed
+ * 8191 ms.
+ */
+#ifdef IP_CONF_TCP_RTO_INIT
+#define IP_TCP_RTO_INIT IP_CONF_TCP_RTO_INIT
+#else /* IP_CONF_TCP_RTO_INIT */
+#define IP_TCP_RTO_INIT 1000
+#endif /* IP_CONF_TCP_RTO_INIT */
+
+#ifdef IP_CONF_TCP_RTO_MIN
+#define IP_TCP_RTO_MIN IP_CONF_TCP_RTO_MIN
+#else /* IP_CONF_TCP_RTO_MIN */
+#define IP_TCP_RTO_MIN 200
+#endif /* IP_CONF_TCP_RTO_MIN */
+
+#ifdef IP_CONF_TCP_RTO_MAX
+#define IP_TCP_RTO_MAX IP_CONF_TCP_RTO_MAX
+#else /* IP_CONF_TCP_RTO_MAX */
+#define IP_TCP_RTO_MAX 8000
+#endif /* IP_CONF_TCP_RTO_MAX */
+
+/**
+ * @brief Number of duplicate ACKs that trigger a fast retransmit of
+ * the oldest unacknowledged segment; 0 disables fast retransmit.
+ *
+ * Duplicate ACKs are only seen with IP_TCP_MAX_INFLIGHT larger than 1.
+ */
+#ifdef IP_CONF_TCP_DUPACKS
+#define IP_TCP_DUPACKS IP_CONF_TCP_DUPACKS
+#else /* IP_CONF_TCP_DUPACKS */
+#define IP_TCP_DUPACKS 3
+#endif /* IP_CONF_TCP_DUPACKS */
+
 /**
  * Opciones de configuracion ARP
  * 
@@ -281,6 +615,80 @@
  */
 #define IP_ARP_MAXAGE 120
 
+/**
+ * Opciones de configuracion de temporizadores
+ * 
+ */
+
+/**
+ * @brief Millisecond clock of the stack timers.
+ *
+ * If IP_CONF_CLOCK() is defined to return a free running 32-bit
+ * millisecond counter, the stack keeps its timers (ARP entries, TCP
+ * connections, DHCP lease, DNS queries) in a hierarchical timer wheel
+ * driven by ip_timer_run(), instead of scanning every table on every
+ * periodic tick. IP_CONF_OUTPUT() must then send out the packet that
+ * a timer may leave in ip_buf.
+ */
+#ifdef IP_CONF_CLOCK
+#define IP_CLOCK() IP_CONF_CLOCK()
+#define IP_TIMERS 1
+#else /* IP_CONF_CLOCK */
+#define IP_TIMERS 0
+#endif /* IP_CONF_CLOCK */
+
+#ifdef IP_CONF_OUTPUT
+#define IP_OUTPUT() IP_CONF_OUTPUT()
+#elif IP_TIMERS
+#error "IP_CONF_OUTPUT() must be defined together with IP_CONF_CLOCK()"
+#endif /* IP_CONF_OUTPUT */
+
+/**
+ * @brief Resolution of the timer wheel in milliseconds.
+ */
+#ifdef IP_CONF_TIMER_TICK
+#define IP_TIMER_TICK IP_CONF_TIMER_TICK
+#else /* IP_CONF_TIMER_TICK */
+#define IP_TIMER_TICK 10
+#endif /* IP_CONF_TIMER_TICK */
+
+/**
+ * @brief Number of slots (as a power of two) and levels of the timer
+ * wheel.
+ *
+ * The wheel spans 2^(IP_TIMER_WHEEL_BITS * IP_TIMER_WHEEL_LEVELS)
+ * ticks, 655 seconds with the defaults. Longer timers go round the
+ * top level again until they are due.
+ */
+#ifdef IP_CONF_TIMER_WHEEL_BITS
+#define IP_TIMER_WHEEL_BITS IP_CONF_TIMER_WHEEL_BITS
+#else /* IP_CONF_TIMER_WHEEL_BITS */
+#define IP_TIMER_WHEEL_BITS 4
+#endif /* IP_CONF_TIMER_WHEEL_BITS */
+
+#ifdef IP_CONF_TIMER_WHEEL_LEVELS
+#define IP_TIMER_WHEEL_LEVELS IP_CONF_TIMER_WHEEL_LEVELS
+#else /* IP_CONF_TIMER_WHEEL_LEVELS */
+#define IP_TIMER_WHEEL_LEVELS 4
+#endif /* IP_CONF_TIMER_WHEEL_LEVELS */
+
+#if IP_TIMER_WHEEL_BITS * IP_TIMER_WHEEL_LEVELS > 30
+#error "IP_TIMER_WHEEL_BITS * IP_TIMER_WHEEL_LEVELS must not exceed 30"
+#endif
+
+/**
+ * @brief Period of the TCP connection timer in milliseconds.
+ *
+ * With IP_CONF_CLOCK every open connection runs ip_periodic_conn()
+ * at this interval from its own timer; closed connections cost
+ * nothing.
+ */
+#ifdef IP_CONF_TCP_PERIODIC
+#define IP_TCP_PERIODIC IP_CONF_TCP_PERIODIC
+#else /* IP_CONF_TCP_PERIODIC */
+#define IP_TCP_PERIODIC 500
+#endif /* IP_CONF_TCP_PERIODIC */
+
 /**
  * Opciones de configuracion general
  * 
@@ -312,6 +720,49 @@
 #define IP_STATISTICS IP_CONF_STATISTICS
 #endif /* IP_CONF_STATISTICS */
 
+/**
+ * @brief Determines if latency histograms should be compiled in.
+ *
+ * The histograms in ip_stat.lat show how long received data takes
+ * from ip_input() to the application, and data handed to ip_send()
+ * to the device driver. They need IP_STATISTICS and a free running
+ * 32-bit microsecond counter in IP_CONF_CLOCK_US().
+ */
+#ifndef IP_CONF_HISTOGRAMS
+#define IP_HISTOGRAMS  0
+#else /* IP_CONF_HISTOGRAMS */
+#define IP_HISTOGRAMS IP_CONF_HISTOGRAMS
+#endif /* IP_CONF_HISTOGRAMS */
+
+#if IP_HISTOGRAMS
+#if IP_STATISTICS != 1
+#error "IP_CONF_HISTOGRAMS requires IP_CONF_STATISTICS"
+#endif /* IP_STATISTICS != 1 */
+#ifndef IP_CONF_CLOCK_US
+#error "IP_CONF_HISTOGRAMS requires IP_CONF_CLOCK_US()"
+#endif /* IP_CONF_CLOCK_US */
+#define IP_CLOCK_US() IP_CONF_CLOCK_US()
+#endif /* IP_HISTOGRAMS */
+
+/**
+ * @brief Number of buckets of a latency histogram and the upper
+ * bound of the first one in microseconds.
+ *
+ * Every bucket is twice as wide as the one before, the last one
+ * counts all longer samples.
+ */
+#ifndef IP_CONF_HISTOGRAM_BUCKETS
+#define IP_HISTOGRAM_BUCKETS 12
+#else /* IP_CONF_HISTOGRAM_BUCKETS */
+#define IP_HISTOGRAM_BUCKETS IP_CONF_HISTOGRAM_BUCKETS
+#endif /* IP_CONF_HISTOGRAM_BUCKETS */
+
+#ifndef IP_CONF_HISTOGRAM_BASE
+#define IP_HISTOGRAM_BASE 16
+#else /* IP_CONF_HISTOGRAM_BASE */
+#define IP_HISTOGRAM_BASE IP_CONF_HISTOGRAM_BASE
+#endif /* IP_CONF_HISTOGRAM_BASE */
+
 /**
  * @brief Determines if logging of certain events should be compiled in.
  *
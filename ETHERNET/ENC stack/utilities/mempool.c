@@ -2,33 +2,47 @@
 
 #define POOLOFFSET 1
 
-memblock_t MemoryPool_blocks[MEMPOOL_NUM_MEMBLOCKS+1];
-
 /**
  * @brief 
  * 
  * @param mp 
+ * @param arg Owner of the pooled memory, handed to MEMPOOL_MEMBLOCK_MV when blocks are moved
  */
-void MemoryPool_init(MemoryPool *mp) {
+void MemoryPool_init(MemoryPool *mp, void *arg) {
     memset(mp->blocks, 0, sizeof(mp->blocks));
+    mp->arg = arg;
     mp->blocks[POOLSTART].begin = MEMPOOL_STARTADDRESS;
     mp->blocks[POOLSTART].size = 0;
     mp->blocks[POOLSTART].nextblock = NOBLOCK;
+    mp->allocs = 0;
+    mp->allocfails = 0;
 }
 
+#ifndef MEMPOOL_MEMBLOCK_PINNED
+#define MEMPOOL_MEMBLOCK_PINNED(mp,handle) 0
+#endif
+
 /**
- * @brief 
+ * @brief Allocates a block from the smallest gap that fits. Without one the pool is compacted, moving the blocks down
+ * with MEMPOOL_MEMBLOCK_MV, and searched again. Blocks MEMPOOL_MEMBLOCK_PINNED reports in use by the hardware (frames
+ * queued for transmission) keep their place, the free space around them stays split.
  * 
  * @param mp 
  * @param size 
  * @return memhandle 
  */
 memhandle MemoryPool_allocBlock(MemoryPool *mp, memaddress size) {
-    memblock_t *best = NULL;
-    memhandle cur = POOLSTART;
-    memblock_t *block = &mp->blocks[POOLSTART];
-    memaddress bestsize = MEMPOOL_SIZE + 1;
+    memblock_t *best;
+    memhandle cur;
+    memblock_t *block;
+    memaddress bestsize;
+    bool compacted = false;
 
+    search:
+    best = NULL;
+    cur = POOLSTART;
+    block = &mp->blocks[POOLSTART];
+    bestsize = MEMPOOL_SIZE + 1;
     do {
         memhandle next = block->nextblock;
         memaddress freesize = ( next == NOBLOCK ? mp->blocks[POOLSTART].begin + MEMPOOL_SIZE : mp->blocks[next].begin) - block->begin - block->size;
@@ -43,6 +57,8 @@ memhandle MemoryPool_allocBlock(MemoryPool *mp, memaddress size) {
         if (next == NOBLOCK) {
             if (best)
             goto found;
+            else if (compacted)
+            goto notfound;
             else
             goto collect;
         }
@@ -60,19 +76,17 @@ memhandle MemoryPool_allocBlock(MemoryPool *mp, memaddress size) {
             memaddress dest = block->begin + block->size;
             memblock_t* nextblock = &mp->blocks[next];
             memaddress* src = &nextblock->begin;
-            if (dest != *src)
+            if (dest != *src && !MEMPOOL_MEMBLOCK_PINNED(mp,next))
             {
     #ifdef MEMPOOL_MEMBLOCK_MV
-                MEMPOOL_MEMBLOCK_MV(dest,*src,nextblock->size);
+                MEMPOOL_MEMBLOCK_MV(mp,dest,*src,nextblock->size);
     #endif
                 *src = dest;
             }
             block = nextblock;
         }
-        if (mp->blocks[POOLSTART].begin + MEMPOOL_SIZE - block->begin - block->size >= size)
-        best = block;
-        else
-        goto notfound;
+        compacted = true;
+        goto search;
     }
 
     found:
@@ -93,11 +107,14 @@ memhandle MemoryPool_allocBlock(MemoryPool *mp, memaddress size) {
             block->size = size;
             block->nextblock = best->nextblock;
             best->nextblock = cur;
+            mp->allocs++;
             return cur;
         }
     }
 
-    notfound: return NOBLOCK;
+    notfound:
+    mp->allocfails++;
+    return NOBLOCK;
 }
 
 /**
@@ -143,4 +160,23 @@ void MemoryPool_resizeBlock(MemoryPool *mp, memhandle handle, memaddress positio
  */
 memaddress MemoryPool_blockSize(MemoryPool *mp, memhandle handle) {
     return mp->blocks[handle].size;
+}
+
+/**
+ * @brief Returns the number of unallocated bytes in the pool. Free space is
+ * compacted on allocation, so a block of this size can be obtained unless pinned
+ * blocks (frames queued for transmission) split it.
+ * 
+ * @param mp 
+ * @return memaddress 
+ */
+memaddress MemoryPool_freeSize(MemoryPool *mp) {
+    memaddress used = 0;
+    memhandle cur = mp->blocks[POOLSTART].nextblock;
+
+    while (cur != NOBLOCK) {
+        used += mp->blocks[cur].size;
+        cur = mp->blocks[cur].nextblock;
+    }
+    return MEMPOOL_SIZE - used;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define MEMPOOL_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 
 #define POOLSTART 0
@@ -17,13 +18,17 @@ typedef struct memblock {
 
 typedef struct {
     memblock_t blocks[MEMPOOL_NUM_MEMBLOCKS+1]; 
+    uint32_t allocs;        // blocks handed out since MemoryPool_init()
+    uint32_t allocfails;    // requests that found no room
+    void *arg;              // owner of the memory, passed to MEMPOOL_MEMBLOCK_MV
 } MemoryPool;
 
 // Funciones
-void MemoryPool_init(MemoryPool *mp);
+void MemoryPool_init(MemoryPool *mp, void *arg);
 memhandle MemoryPool_allocBlock(MemoryPool *mp, memaddress);
 void MemoryPool_freeBlock(MemoryPool *mp, memhandle);
 void MemoryPool_resizeBlock(MemoryPool *mp, memhandle handle, memaddress position, memaddress size);
 memaddress MemoryPool_blockSize(MemoryPool *mp, memhandle);
+memaddress MemoryPool_freeSize(MemoryPool *mp);
 
 #endif /* MEMPOOL_H */
\ No newline at end of file
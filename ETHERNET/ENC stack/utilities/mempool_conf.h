@@ -2,31 +2,67 @@
 #define MEMPOOLCONF_H
 #include "ipethernet-conf.h"
 #include "ipopt.h"
-#include "enc28j60.h"
+#include "enc28j60_regs.h"
 #include <stdint.h>
 
 typedef uint16_t memaddress;
 typedef uint8_t memhandle;
 
-#if IP_SOCKET_NUMPACKETS and IP_CONNS
+#if IP_SOCKET_NUMPACKETS && IP_CONNS
 #define NUM_TCP_MEMBLOCKS (IP_SOCKET_NUMPACKETS*2)*IP_CONNS
 #else
 #define NUM_TCP_MEMBLOCKS 0
 #endif
 
-#if IP_UDP and IP_UDP_CONNS
-#define NUM_UDP_MEMBLOCKS ((2+IP_UDP_BACKLOG)*IP_UDP_CONNS)
+// receive ring and outgoing datagram of every socket
+#if IP_UDP && IP_UDP_CONNS
+#define NUM_UDP_MEMBLOCKS (2*IP_UDP_CONNS)
 #else
 #define NUM_UDP_MEMBLOCKS 0
 #endif
 
-#define MEMPOOL_NUM_MEMBLOCKS (NUM_TCP_MEMBLOCKS+NUM_UDP_MEMBLOCKS)
+// one block per reassembly context plus the last completed datagram handed to the driver
+#if IP_REASSEMBLY
+#define NUM_REASS_MEMBLOCKS (IP_REASS_CONTEXTS+1)
+#else
+#define NUM_REASS_MEMBLOCKS 0
+#endif
+
+#define MEMPOOL_NUM_MEMBLOCKS (NUM_TCP_MEMBLOCKS+NUM_UDP_MEMBLOCKS+NUM_REASS_MEMBLOCKS)
 
 #define MEMPOOL_STARTADDRESS TXSTART_INIT+1
 #define MEMPOOL_SIZE TXSTOP_INIT-TXSTART_INIT
 
-void enc28J60_mempool_block_move_callback(memaddress,memaddress,memaddress);
+// the UDP receive rings must leave room for the TCP blocks and the frames being sent
+#if IP_UDP && IP_UDP_CONNS
+#if IP_UDP_RXRING * IP_UDP_CONNS > (MEMPOOL_SIZE) / 2
+#error "IP_UDP_RXRING * IP_CONF_UDP_CONNS takes more than half of the memory pool"
+#endif
+#endif
+
+// the reassembly blocks must leave room for a full frame being sent next to the UDP rings; a completed datagram is
+// handed to the driver in the block of its context, so delivering it takes no extra space
+#if IP_REASSEMBLY
+#define MEMPOOL_REASS_SIZE (IP_REASS_CONTEXTS * IP_REASS_BUFSIZE)
+#if MEMPOOL_REASS_SIZE > (MEMPOOL_SIZE) / 2
+#error "IP_CONF_REASS_CONTEXTS * IP_CONF_REASS_BUFSIZE takes more than half of the memory pool"
+#endif
+#if IP_UDP && IP_UDP_CONNS
+#if IP_UDP_RXRING * IP_UDP_CONNS + MEMPOOL_REASS_SIZE + IP_SENDBUFFER_OFFSET + MAX_FRAMELEN + IP_SENDBUFFER_PADDING > (MEMPOOL_SIZE)
+#error "the UDP receive rings and the reassembly blocks leave no room in the memory pool for a frame to send"
+#endif
+#endif
+#endif
+
+struct Enc28j60;
+void ENC28J60_mempool_block_move_callback(struct Enc28j60 *enc28j60, memaddress dest, memaddress src, memaddress len);
+
+// blocks are moved inside the buffer memory of the controller the pool was initialized for
+#define MEMPOOL_MEMBLOCK_MV(mp,dest,src,size) ENC28J60_mempool_block_move_callback((struct Enc28j60 *)(mp)->arg,dest,src,size)
+
+bool ENC28J60_txQueued(struct Enc28j60 *enc28j60, memhandle handle);
 
-#define MEMPOOL_MEMBLOCK_MV(dest,src,size) enc28J60_mempool_block_move_callback(dest,src,size)
+// ETXST/ETXND point into a queued frame until it has been sent, compaction leaves it in place
+#define MEMPOOL_MEMBLOCK_PINNED(mp,handle) ENC28J60_txQueued((struct Enc28j60 *)(mp)->arg,handle)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+/*
+ * Frames sent back to back while the memory pool is compacted
+ *
+ * Two frames are queued on the simulated controller. While they are on
+ * the wire a block is freed and a block is allocated that only fits
+ * once the pool has been compacted. The queued frames must stay where
+ * the transmitter reads them, the block moved down must keep its
+ * contents, and every frame must leave the wire as it was written.
+ * The frames are queued and their blocks freed on completion the way
+ * ip_ethernet_network_send() and EthernetUDP_sendmmsg() do.
+ */
+
+#include "enc28j60.h"
+#include "fake_enc28j60.h"
+#include <stdio.h>
+
+#define FRAMELEN 1500
+#define BLOCKSIZE(len) ((len) + IP_SENDBUFFER_OFFSET + IP_SENDBUFFER_PADDING)
+
+static Enc28j60_t enc;
+static MemoryPool pool;
+static int failures;
+
+static void
+check(int ok, const char *what)
+{
+  if(!ok) {
+    printf("FAIL: %s\n", what);
+    ++failures;
+  }
+}
+
+static void
+pattern(uint8_t *buf, uint8_t id, uint16_t len)
+{
+  uint16_t i;
+
+  for(i = 0; i < len; ++i) {
+    buf[i] = id * 31 + i;
+  }
+}
+
+/* Allocates a block and writes len bytes of pattern id into it. */
+static memhandle
+block(uint8_t id, uint16_t len)
+{
+  uint8_t buf[FRAMELEN];
+  memhandle h = MemoryPool_allocBlock(&pool, BLOCKSIZE(len));
+
+  if(h != NOBLOCK) {
+    pattern(buf, id, len);
+    ENC28J60_writePacket(&enc, h, IP_SENDBUFFER_OFFSET, buf, len);
+  }
+  return h;
+}
+
+static int
+holds(memhandle h, uint8_t id, uint16_t len)
+{
+  uint8_t buf[FRAMELEN], want[FRAMELEN];
+
+  pattern(want, id, len);
+  ENC28J60_readPacket(&enc, h, IP_SENDBUFFER_OFFSET, buf, len);
+  return memcmp(buf, want, len) == 0;
+}
+
+static int
+sent_as(uint8_t n, uint8_t id, uint16_t len)
+{
+  uint8_t want[FRAMELEN];
+
+  pattern(want, id, len);
+  return fake_enc28j60.framelen[n] == len &&
+    memcmp(fake_enc28j60.frames[n], want, len) == 0;
+}
+
+static void
+sent(Enc28j60_t *e, memhandle h, bool success)
+{
+  (void)e;
+  (void)success;
+  MemoryPool_freeBlock(&pool, h);
+}
+
+static void
+queue(memhandle h)
+{
+  while(!ENC28J60_queuePacket(&enc, h, sent)) {
+    ENC28J60_txPoll(&enc);
+  }
+}
+
+int
+main(void)
+{
+  uint8_t mac[6] = {0x02, 0, 0, 0, 0, 1};
+  memhandle z, b, c, a, e, d;
+  memaddress bbegin, cbegin, ebegin;
+
+  fake_enc28j60_reset(50);
+  check(ENC28J60_init(&enc, &pool, mac), "init");
+
+  /* z | b | c | a | e | free */
+  z = block(6, 500);
+  b = block(1, FRAMELEN);
+  c = block(2, FRAMELEN);
+  a = block(3, 1000);
+  e = block(4, 800);
+  check(z != NOBLOCK && b != NOBLOCK && c != NOBLOCK && a != NOBLOCK && e != NOBLOCK, "allocate");
+  bbegin = pool.blocks[b].begin;
+  cbegin = pool.blocks[c].begin;
+  ebegin = pool.blocks[e].begin;
+
+  queue(b);
+  queue(c);
+  check(ENC28J60_txFree(&enc) == 0, "b on the wire, c queued");
+
+  /* the gaps left by z and a and the end of the pool are all too small
+     for another frame. Compaction would move b and c down into the gap
+     of z, but they are on the wire: only e may move */
+  MemoryPool_freeBlock(&pool, z);
+  MemoryPool_freeBlock(&pool, a);
+  d = block(5, FRAMELEN);
+  check(d != NOBLOCK, "allocate after compaction");
+  check(fake_enc28j60.dmacopies > 0 && pool.blocks[e].begin < ebegin, "e moved down");
+  check(pool.blocks[b].begin == bbegin && pool.blocks[c].begin == cbegin, "queued frames stay in place");
+  check(holds(e, 4, 800), "e keeps its contents");
+
+  /* back to back behind c */
+  queue(d);
+  while(!ENC28J60_txPoll(&enc))
+    ;
+
+  check(fake_enc28j60.nframes == 3, "three frames sent");
+  check(sent_as(0, 1, FRAMELEN), "b sent as written");
+  check(sent_as(1, 2, FRAMELEN), "c sent as written");
+  check(sent_as(2, 5, FRAMELEN), "d sent as written");
+  check(fake_enc28j60.overwrites == 0, "no DMA copy into the frame on the wire");
+  check(MemoryPool_freeSize(&pool) == MEMPOOL_SIZE - BLOCKSIZE(800), "sent blocks freed");
+
+  if(failures == 0) {
+    printf("ok\n");
+  }
+  return failures != 0;
+}
@@ -11,3 +11,103 @@
 
 #include "socket.h"
 
+#include "../../TCP-IP/DATA_LINK/ETHERNET/W5500/w5500.h"
+
+/**
+ * @brief Capture file of the MACRAW frames, NULL if not capturing.
+ *
+ */
+static pcap_writer_t *socket_capture_writer;
+
+/**
+ * @brief Issues a socket command and waits until the chip has accepted it.
+ *
+ * @param socket_number
+ * @param command
+ */
+static void socket_command(uint8_t socket_number, uint8_t command)
+{
+    setSn_CR(socket_number, command);
+    while (getSn_CR(socket_number))
+        ;
+}
+
+/**
+ * @brief Sends a whole Ethernet frame through a socket opened in MACRAW mode, waiting for room in the TX buffer.
+ *
+ * @param socket_number
+ * @param frame Destination MAC first, without CRC
+ * @param len
+ * @return socket_error_t
+ */
+socket_error_t macraw_send(uint8_t socket_number, uint8_t *frame, uint16_t len)
+{
+    CHECK_SOCKNUM(socket_number);
+    CHECK_SOCKMODE(socket_number, Sn_MR_MACRAW);
+    CHECK_SOCKDATA(len);
+    if (len > getSn_TxMAX(socket_number))
+        return SOCKERR_DATALEN;
+
+    while (getSn_TX_FSR(socket_number) < len)
+    {
+        if (getSn_SR(socket_number) == SOCK_CLOSED)
+            return SOCKERR_SOCKCLOSED;
+    }
+    wiz_send_data(socket_number, frame, len);
+    socket_command(socket_number, Sn_CR_SEND);
+    if (socket_capture_writer)
+        pcap_write_frame(socket_capture_writer, frame, len);
+    return SOCK_OK;
+}
+
+/**
+ * @brief Receives the next Ethernet frame of a socket opened in MACRAW mode. The chip stores every frame behind a
+ * 2 byte length header; a frame longer than size is cut and the rest discarded.
+ *
+ * @param socket_number
+ * @param frame
+ * @param size
+ * @param recv_size Bytes stored in frame, 0 if no frame was waiting
+ * @return socket_error_t SOCKFATAL_PACKLEN if the receive buffer lost track of the frames, the socket is closed
+ */
+socket_error_t macraw_recv(uint8_t socket_number, uint8_t *frame, uint16_t size, uint16_t *recv_size)
+{
+    uint8_t head[2];
+    uint16_t pack_len, n;
+
+    CHECK_SOCKNUM(socket_number);
+    CHECK_SOCKMODE(socket_number, Sn_MR_MACRAW);
+    *recv_size = 0;
+    if (getSn_RX_RSR(socket_number) == 0)
+        return SOCK_OK;
+
+    wiz_recv_data(socket_number, head, 2);
+    socket_command(socket_number, Sn_CR_RECV);
+    pack_len = ((uint16_t)head[0] << 8 | head[1]) - 2;
+    if (pack_len > MACRAW_MAX_FRAME)
+    {
+        close(socket_number);
+        return SOCKFATAL_PACKLEN;
+    }
+
+    n = pack_len < size ? pack_len : size;
+    wiz_recv_data(socket_number, frame, n);
+    if (pack_len > n)
+        wiz_recv_ignore(socket_number, pack_len - n);
+    socket_command(socket_number, Sn_CR_RECV);
+    if (socket_capture_writer)
+        pcap_write_frame(socket_capture_writer, frame, n);
+    *recv_size = n;
+    return SOCK_OK;
+}
+
+/**
+ * @brief Starts capturing the frames sent and received through macraw_send() and macraw_recv() to writer, which must
+ * have been set up with pcap_writer_init(). NULL stops the capture.
+ *
+ * @param writer
+ */
+void socket_capture(pcap_writer_t *writer)
+{
+    socket_capture_writer = writer;
+}
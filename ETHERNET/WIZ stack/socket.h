@@ -22,6 +22,7 @@ extern "C"
 #include <stdbool.h>
 #include <stdio.h>
 #include "../../INTERNET/IPV4/IPv4.h"
+#include "../../TCP-IP/DATA_LINK/PCAP/pcap.h"
 #pragma endregion
 
 #pragma region Useful macros
@@ -87,6 +88,12 @@ extern "C"
  */
 #define SOCK_IO_NONBLOCK 1
 
+/**
+ * @brief Longest frame exchanged by a MACRAW socket (Ethernet frame without CRC).
+ *
+ */
+#define MACRAW_MAX_FRAME 1514
+
 #pragma endregion
 
 #pragma region Custom types
@@ -229,6 +236,10 @@ extern "C"
     socket_error_t ctlsocket(uint8_t socket_number, ctlsock_type cstype, void *arg);
     socket_error_t setockopt(uint8_t socket_number, sockopt_type sotype, void *arg);
     socket_error_t getsockopt(uint8_t socket_number, sockopt_type sotype, void *arg);
+
+    socket_error_t macraw_send(uint8_t socket_number, uint8_t *frame, uint16_t len);
+    socket_error_t macraw_recv(uint8_t socket_number, uint8_t *frame, uint16_t size, uint16_t *recv_size);
+    void socket_capture(pcap_writer_t *writer);
 #pragma endregion
 
 #ifdef __cplusplus
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dns_parser.h"
+
+#define ROUNDS 1000000
+
+/* Reply to a query for www.example.com: a CNAME to example.com, then its A record. */
+static const uint8_t reply[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01,
+    0xC0, 12, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x02,
+    0xC0, 16,
+    0xC0, 16, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x04,
+    93, 184, 216, 34
+};
+
+/**
+ * @brief Resolves the address the way the DNS client does: checks the question, follows the CNAME and returns the
+ * offset of the A record data, 0 if there is none.
+ */
+static uint16_t resolve(const uint8_t *buf, uint16_t len) {
+    dns_msg_t msg;
+    dns_rr_t rr;
+    uint16_t name;
+
+    if (dns_msg_init(&msg, buf, len) != DNS_OK || !dns_name_equal(&msg, msg.question, "www.example.com"))
+        return 0;
+    name = msg.question;
+    while (dns_msg_next(&msg, &rr) == DNS_OK) {
+        if (!dns_name_same(&msg, rr.name, name))
+            continue;
+        if (rr.type == DNS_TYPE_A)
+            return rr.rdata;
+        if (rr.type == DNS_TYPE_CNAME) {
+            name = rr.rdata;
+            dns_msg_rewind(&msg);
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    struct timespec start, end;
+    volatile uint16_t found = 0;
+    uint32_t i;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ROUNDS; i++)
+        found += resolve(reply, sizeof(reply));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%u replies resolved, %.1f ns per reply\n", ROUNDS, ns / ROUNDS);
+    return found == (uint16_t)(ROUNDS * 59u) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,279 @@
+#include "dns_parser.h"
+
+#include <string.h>
+
+/**
+ * @brief Reads a 16 bit field in network byte order.
+ *
+ * @param p
+ * @return uint16_t
+ */
+static uint16_t dns_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * @brief Lowercases an ASCII letter, names compare case-insensitively.
+ *
+ * @param c
+ * @return uint8_t
+ */
+static uint8_t dns_lower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/**
+ * @brief Steps over the name at *pos without following its compression pointer: labels are checked against the
+ * message and name length limits.
+ *
+ * @param msg
+ * @param pos Offset of the name, set to the first byte after it
+ * @return dns_error_t
+ */
+static dns_error_t dns_name_skip(const dns_msg_t *msg, uint16_t *pos) {
+    uint32_t p = *pos, total = 0;
+    uint8_t c;
+
+    for (;;) {
+        if (p >= msg->len)
+            return DNS_ERR_TRUNCATED;
+        c = msg->buf[p];
+        if ((c & 0xC0) == 0xC0) {
+            if (p + 2 > msg->len)
+                return DNS_ERR_TRUNCATED;
+            *pos = p + 2;
+            return DNS_OK;
+        }
+        if (c > DNS_LABEL_MAX) // extended label types
+            return DNS_ERR_FORMAT;
+        total += c + 1;
+        if (total > DNS_NAME_MAX)
+            return DNS_ERR_FORMAT;
+        p += c + 1;
+        if (c == 0) {
+            *pos = p;
+            return DNS_OK;
+        }
+    }
+}
+
+/**
+ * @brief Finds the next label of a name, following compression pointers. A pointer must lead to an earlier offset
+ * than its own, so following them always ends.
+ *
+ * @param msg
+ * @param pos Offset of a label or pointer, set to the length byte of the label
+ * @param hops Pointers followed so far in this name
+ * @return int Length of the label, 0 at the end of the name, -1 if the name is malformed
+ */
+static int dns_label(const dns_msg_t *msg, uint16_t *pos, uint8_t *hops) {
+    uint16_t target;
+    uint8_t c;
+
+    for (;;) {
+        if (*pos >= msg->len)
+            return -1;
+        c = msg->buf[*pos];
+        if ((c & 0xC0) == 0xC0) {
+            if (*pos + 2 > msg->len || ++*hops > DNS_MAX_POINTERS)
+                return -1;
+            target = (uint16_t)((c & 0x3F) << 8 | msg->buf[*pos + 1]);
+            if (target >= *pos)
+                return -1;
+            *pos = target;
+            continue;
+        }
+        if (c > DNS_LABEL_MAX || (uint32_t)*pos + 1 + c > msg->len)
+            return -1;
+        return c;
+    }
+}
+
+/**
+ * @brief Opens a message: reads the header and steps over the questions.
+ *
+ * @param msg
+ * @param buf The datagram, parsed in place
+ * @param len
+ * @return dns_error_t
+ */
+dns_error_t dns_msg_init(dns_msg_t *msg, const uint8_t *buf, uint16_t len) {
+    dns_error_t error;
+    uint16_t pos, i;
+
+    msg->buf = buf;
+    msg->len = len;
+    msg->left = 0;
+    if (len < DNS_MSG_HEADER_LEN)
+        return DNS_ERR_TRUNCATED;
+    memcpy(&msg->id, buf, 2);
+    msg->flags = dns_get16(&buf[2]);
+    msg->qdcount = dns_get16(&buf[4]);
+    msg->ancount = dns_get16(&buf[6]);
+
+    pos = DNS_MSG_HEADER_LEN;
+    msg->question = msg->qdcount ? pos : 0;
+    for (i = 0; i < msg->qdcount; i++) {
+        if ((error = dns_name_skip(msg, &pos)) != DNS_OK)
+            return error;
+        if ((uint32_t)pos + 4 > len) // type and class
+            return DNS_ERR_TRUNCATED;
+        pos += 4;
+    }
+    msg->answers = pos;
+    dns_msg_rewind(msg);
+    return DNS_OK;
+}
+
+/**
+ * @brief Returns the next record of the answer section, whatever its type. A, AAAA and CNAME records are checked
+ * to be well-formed, nothing is copied.
+ *
+ * @param msg
+ * @param rr
+ * @return dns_error_t DNS_END after the last answer
+ */
+dns_error_t dns_msg_next(dns_msg_t *msg, dns_rr_t *rr) {
+    dns_error_t error;
+    uint16_t pos = msg->pos, end;
+    const uint8_t *p;
+
+    if (msg->left == 0)
+        return DNS_END;
+    rr->name = pos;
+    if ((error = dns_name_skip(msg, &pos)) != DNS_OK)
+        return error;
+    if ((uint32_t)pos + DNS_MSG_RR_LEN > msg->len)
+        return DNS_ERR_TRUNCATED;
+    p = &msg->buf[pos];
+    rr->type = dns_get16(&p[0]);
+    rr->rclass = dns_get16(&p[2]);
+    rr->ttl = (uint32_t)dns_get16(&p[4]) << 16 | dns_get16(&p[6]);
+    if (rr->ttl & 0x80000000UL) // RFC 2181: treated as 0
+        rr->ttl = 0;
+    rr->rdlength = dns_get16(&p[8]);
+    rr->rdata = pos + DNS_MSG_RR_LEN;
+    if ((uint32_t)rr->rdata + rr->rdlength > msg->len)
+        return DNS_ERR_TRUNCATED;
+
+    switch (rr->type) {
+    case DNS_TYPE_A:
+        if (rr->rdlength != 4)
+            return DNS_ERR_FORMAT;
+        break;
+    case DNS_TYPE_AAAA:
+        if (rr->rdlength != 16)
+            return DNS_ERR_FORMAT;
+        break;
+    case DNS_TYPE_CNAME:
+        end = rr->rdata;
+        if (dns_name_skip(msg, &end) != DNS_OK || end != rr->rdata + rr->rdlength)
+            return DNS_ERR_FORMAT;
+        break;
+    }
+    msg->pos = rr->rdata + rr->rdlength;
+    msg->left--;
+    return DNS_OK;
+}
+
+/**
+ * @brief Starts dns_msg_next() over from the first answer, e.g. to follow a CNAME to a record returned before it.
+ *
+ * @param msg
+ */
+void dns_msg_rewind(dns_msg_t *msg) {
+    msg->pos = msg->answers;
+    msg->left = msg->ancount;
+}
+
+/**
+ * @brief Compares the name at pos with a dotted name, ignoring case and a trailing dot.
+ *
+ * @param msg
+ * @param pos Offset of a name in the message
+ * @param name
+ * @return true
+ * @return false if they differ or the name in the message is malformed
+ */
+bool dns_name_equal(const dns_msg_t *msg, uint16_t pos, const char *name) {
+    const char *s = name;
+    uint8_t hops = 0;
+    int n, i;
+
+    for (;;) {
+        n = dns_label(msg, &pos, &hops);
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return *s == '\0' || (*s == '.' && s[1] == '\0');
+        if (s != name && *s++ != '.')
+            return false;
+        for (i = 1; i <= n; i++, s++) {
+            if (*s == '\0' || dns_lower(msg->buf[pos + i]) != dns_lower((uint8_t)*s))
+                return false;
+        }
+        pos += n + 1;
+    }
+}
+
+/**
+ * @brief Compares two names of the message, ignoring case, e.g. the owner of a record with the target of a CNAME.
+ *
+ * @param msg
+ * @param pos1
+ * @param pos2
+ * @return true
+ * @return false if they differ or one is malformed
+ */
+bool dns_name_same(const dns_msg_t *msg, uint16_t pos1, uint16_t pos2) {
+    uint8_t hops1 = 0, hops2 = 0;
+    int n1, n2, i;
+
+    for (;;) {
+        n1 = dns_label(msg, &pos1, &hops1);
+        n2 = dns_label(msg, &pos2, &hops2);
+        if (n1 < 0 || n1 != n2)
+            return false;
+        if (n1 == 0)
+            return true;
+        for (i = 1; i <= n1; i++) {
+            if (dns_lower(msg->buf[pos1 + i]) != dns_lower(msg->buf[pos2 + i]))
+                return false;
+        }
+        pos1 += n1 + 1;
+        pos2 += n2 + 1;
+    }
+}
+
+/**
+ * @brief Copies the name at pos out of the message in dotted form, for the names the caller needs to keep.
+ *
+ * @param msg
+ * @param pos
+ * @param name
+ * @param size Size of name, terminator included
+ * @return uint16_t Length of the name, 0 if it is the root, malformed or does not fit
+ */
+uint16_t dns_name_copy(const dns_msg_t *msg, uint16_t pos, char *name, uint16_t size) {
+    uint16_t len = 0;
+    uint8_t hops = 0;
+    int n;
+
+    for (;;) {
+        n = dns_label(msg, &pos, &hops);
+        if (n < 0)
+            return 0;
+        if (n == 0)
+            break;
+        if ((uint32_t)len + (len ? 1 : 0) + n >= size)
+            return 0;
+        if (len)
+            name[len++] = '.';
+        memcpy(&name[len], &msg->buf[pos + 1], n);
+        len += n;
+        pos += n + 1;
+    }
+    if (size)
+        name[len] = '\0';
+    return len;
+}
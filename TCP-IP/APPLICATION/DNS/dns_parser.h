@@ -0,0 +1,93 @@
+/**
+ * @file dns_parser.h
+ * @brief Bounds-checked parser of DNS messages (RFC 1035) working in place on the received datagram: records are
+ * returned as offsets into the buffer, names are compared where they lie, following compression pointers, and only
+ * copied out on request.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef DNS_PARSER_H
+#define DNS_PARSER_H
+
+#pragma region Dependencies
+#include <stdint.h>
+#include <stdbool.h>
+#pragma endregion
+
+#pragma region Useful macros
+#define DNS_MSG_HEADER_LEN  12
+#define DNS_MSG_RR_LEN      10  // type, class, TTL and data length of a record
+
+#define DNS_TYPE_A          1
+#define DNS_TYPE_CNAME      5
+#define DNS_TYPE_AAAA       28
+#define DNS_CLASS_IN        1
+
+/**
+ * @brief Longest name and label, in bytes of the wire format.
+ */
+#define DNS_NAME_MAX        255
+#define DNS_LABEL_MAX       63
+
+/**
+ * @brief Compression pointers followed within one name. Pointers only lead backwards, so a name always ends; the
+ * limit bounds the work a crafted message can cause.
+ */
+#ifndef DNS_MAX_POINTERS
+#define DNS_MAX_POINTERS    16
+#endif
+#pragma endregion
+
+#pragma region Custom types
+/**
+ * @brief
+ *
+ */
+typedef enum dns_error {
+    DNS_OK, DNS_END, DNS_ERR_TRUNCATED, DNS_ERR_FORMAT
+} dns_error_t;
+
+/**
+ * @brief View of a message. The buffer is only read and must outlive the view.
+ */
+typedef struct dns_msg {
+    const uint8_t *buf;
+    uint16_t len;
+    uint16_t id;        // as found in the message, not byte-swapped
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t question;  // offset of the name of the first question, 0 if there is none
+    uint16_t answers;   // offset of the first answer
+    uint16_t pos;       // offset of the next answer returned by dns_msg_next()
+    uint16_t left;      // answers not yet returned
+} dns_msg_t;
+
+/**
+ * @brief Resource record of the answer section. Names are offsets into the message.
+ */
+typedef struct dns_rr {
+    uint16_t name;      // owner name
+    uint16_t type;
+    uint16_t rclass;
+    uint32_t ttl;
+    uint16_t rdlength;
+    uint16_t rdata;     // offset of the data, of the target name of a CNAME
+} dns_rr_t;
+#pragma endregion
+
+#pragma region Function prototypes
+dns_error_t dns_msg_init(dns_msg_t *msg, const uint8_t *buf, uint16_t len);
+dns_error_t dns_msg_next(dns_msg_t *msg, dns_rr_t *rr);
+void dns_msg_rewind(dns_msg_t *msg);
+
+bool dns_name_equal(const dns_msg_t *msg, uint16_t pos, const char *name);
+bool dns_name_same(const dns_msg_t *msg, uint16_t pos1, uint16_t pos2);
+uint16_t dns_name_copy(const dns_msg_t *msg, uint16_t pos, char *name, uint16_t size);
+#pragma endregion
+
+#endif /* DNS_PARSER_H */
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dns_parser.h"
+
+/* Mutants of each seed, on top of its truncations and single bit flips. */
+#ifndef MUTATIONS
+#define MUTATIONS 20000
+#endif
+
+static uint32_t violations = 0;
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        printf("violated: %s (line %d)\n", #cond, __LINE__); \
+        violations++; \
+    } \
+} while (0)
+
+/**
+ * @brief Checks what holds for a name of any message: a copy fits and is terminated, and a name that copies is
+ * well-formed, so it is the same as itself. Labels may hold dots and NULs, the copy is compared back but not checked.
+ */
+static void fuzz_name(const dns_msg_t *msg, uint16_t pos) {
+    char name[DNS_NAME_MAX + 1];
+    uint16_t len;
+
+    len = dns_name_copy(msg, pos, name, sizeof(name));
+    EXPECT(len < sizeof(name));
+    if (!len)
+        return;
+    EXPECT(name[len] == '\0');
+    EXPECT(dns_name_same(msg, pos, pos));
+    dns_name_equal(msg, pos, name);
+}
+
+/**
+ * @brief Runs one message through the parser the way the DNS client does. The bytes are copied to a buffer of their
+ * exact size, so a sanitizer catches any read past the end.
+ */
+static void fuzz_one(const uint8_t *data, size_t size) {
+    dns_msg_t msg;
+    dns_rr_t rr;
+    dns_error_t error;
+    uint8_t *buf;
+    uint32_t records = 0;
+    uint16_t len = size > 0xFFFF ? 0xFFFF : (uint16_t)size;
+
+    buf = malloc(len ? len : 1);
+    if (!buf)
+        return;
+    memcpy(buf, data, len);
+    if (dns_msg_init(&msg, buf, len) == DNS_OK) {
+        EXPECT(msg.answers <= len);
+        if (msg.question) {
+            fuzz_name(&msg, msg.question);
+            dns_name_equal(&msg, msg.question, "www.example.com");
+        }
+        while ((error = dns_msg_next(&msg, &rr)) == DNS_OK) {
+            EXPECT((uint32_t)rr.rdata + rr.rdlength <= len);
+            EXPECT(++records <= msg.ancount);
+            fuzz_name(&msg, rr.name);
+            if (msg.question)
+                dns_name_same(&msg, rr.name, msg.question);
+            if (rr.type == DNS_TYPE_CNAME)
+                fuzz_name(&msg, rr.rdata);
+        }
+        EXPECT(error == DNS_END || error == DNS_ERR_TRUNCATED || error == DNS_ERR_FORMAT);
+    }
+    free(buf);
+}
+
+/* libFuzzer takes the same seeds: clang -fsanitize=fuzzer -DDNS_FUZZ_LIBFUZZER */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+
+#ifndef DNS_FUZZ_LIBFUZZER
+static uint32_t rng = 0x2545F491;
+
+/**
+ * @brief xorshift32, the mutants of a seed are the same on every run.
+ */
+static uint32_t fuzz_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/**
+ * @brief Overwrites a few bytes of the seed, favouring the values the parser branches on: label lengths around the
+ * limit, compression pointers to nearby offsets and record counts.
+ */
+static void fuzz_mutate(uint8_t *buf, uint16_t len) {
+    static const uint8_t values[] = { 0x00, 0x01, 0x3F, 0x40, 0x80, 0xC0, 0xFF };
+    uint32_t n = 1 + fuzz_random() % 4;
+    uint16_t pos;
+
+    while (n--) {
+        pos = (uint16_t)(fuzz_random() % len);
+        switch (fuzz_random() % 4) {
+        case 0:
+            buf[pos] = values[fuzz_random() % sizeof(values)];
+            break;
+        case 1:
+            if (pos + 1 < len) { // pointer to an offset around this one
+                buf[pos] = 0xC0;
+                buf[pos + 1] = (uint8_t)(pos + 2 - fuzz_random() % 16);
+            }
+            break;
+        case 2:
+            buf[pos] = (uint8_t)fuzz_random();
+            break;
+        default:
+            buf[pos] ^= (uint8_t)(1 << fuzz_random() % 8);
+            break;
+        }
+    }
+}
+
+static uint32_t fuzz_seed(const uint8_t *seed, uint16_t len) {
+    uint8_t *buf;
+    uint32_t runs = 0, i;
+
+    buf = malloc(len ? len : 1);
+    if (!buf)
+        return 0;
+    for (i = 0; i <= len; i++, runs++)
+        fuzz_one(seed, i);
+    for (i = 0; i < 8u * len; i++, runs++) {
+        memcpy(buf, seed, len);
+        buf[i / 8] ^= (uint8_t)(1 << i % 8);
+        fuzz_one(buf, len);
+    }
+    for (i = 0; len && i < MUTATIONS; i++, runs++) {
+        memcpy(buf, seed, len);
+        fuzz_mutate(buf, len);
+        fuzz_one(buf, fuzz_random() % 8 ? len : fuzz_random() % len);
+    }
+    free(buf);
+    return runs;
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t seed[0xFFFF];
+    uint32_t runs = 0;
+    size_t len;
+    FILE *f;
+    int i;
+
+    if (argc < 2) {
+        printf("usage: %s seed...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i < argc; i++) {
+        f = fopen(argv[i], "rb");
+        if (!f) {
+            printf("cannot read %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        len = fread(seed, 1, sizeof(seed), f);
+        fclose(f);
+        runs += fuzz_seed(seed, (uint16_t)len);
+    }
+
+    printf("%d seeds, %u messages parsed, %u violations\n", argc - 1, runs, violations);
+    return violations ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
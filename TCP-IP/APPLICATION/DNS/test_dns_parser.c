@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dns_parser.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+    if (cond) { \
+        printf("OK   %s\n", what); \
+    } else { \
+        printf("FAIL %s\n", what); \
+        failures++; \
+    } \
+} while (0)
+
+/* Reply to a query for www.example.com: a CNAME to example.com, then its A record. */
+static const uint8_t reply[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    /* question, offset 12 */
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01,
+    /* CNAME, offset 33: owner -> 12, target -> 16 */
+    0xC0, 12, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x02,
+    0xC0, 16,
+    /* A, offset 47: owner -> 16 */
+    0xC0, 16, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x04,
+    93, 184, 216, 34
+};
+static const uint8_t address[] = { 93, 184, 216, 34 };
+
+static void test_reply(void) {
+    dns_msg_t msg;
+    dns_rr_t rr;
+    char name[64];
+
+    CHECK(dns_msg_init(&msg, reply, sizeof(reply)) == DNS_OK, "reply: header and question");
+    CHECK(msg.ancount == 2 && msg.answers == 33, "reply: answer section found");
+    CHECK(dns_name_equal(&msg, msg.question, "WWW.example.com."), "reply: question name");
+
+    CHECK(dns_msg_next(&msg, &rr) == DNS_OK && rr.type == DNS_TYPE_CNAME, "reply: CNAME record");
+    CHECK(dns_name_copy(&msg, rr.rdata, name, sizeof(name)) == 11 && strcmp(name, "example.com") == 0,
+          "reply: CNAME target copied");
+    CHECK(dns_msg_next(&msg, &rr) == DNS_OK && rr.type == DNS_TYPE_A && rr.rdlength == 4, "reply: A record");
+    CHECK(memcmp(msg.buf + rr.rdata, address, sizeof(address)) == 0, "reply: A address");
+    CHECK(dns_name_same(&msg, rr.name, 33 + 12), "reply: A owner is the CNAME target");
+    CHECK(dns_msg_next(&msg, &rr) == DNS_END, "reply: end of the answers");
+}
+
+static void test_truncated(void) {
+    dns_msg_t msg;
+    dns_rr_t rr;
+    uint16_t len;
+    int bad = 0;
+
+    CHECK(dns_msg_init(&msg, reply, DNS_MSG_HEADER_LEN - 1) == DNS_ERR_TRUNCATED, "truncated: header");
+    CHECK(dns_msg_init(&msg, reply, 20) == DNS_ERR_TRUNCATED, "truncated: question name");
+    CHECK(dns_msg_init(&msg, reply, 31) == DNS_ERR_TRUNCATED, "truncated: question type and class");
+
+    /* Every shorter length must fail cleanly before the last answer. */
+    for (len = 33; len < sizeof(reply); len++) {
+        if (dns_msg_init(&msg, reply, len) != DNS_OK)
+            bad++;
+        else if (dns_msg_next(&msg, &rr) == DNS_OK && dns_msg_next(&msg, &rr) == DNS_OK)
+            bad++;
+    }
+    CHECK(bad == 0, "truncated: every cut inside the answers");
+}
+
+static void test_compression_loop(void) {
+    /* The owner of the answer points to itself, then to a pointer after it. */
+    static const uint8_t self[] = {
+        0x00, 0x01, 0x81, 0x80, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0xC0, 12, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04, 10, 0, 0, 1
+    };
+    static const uint8_t forward[] = {
+        0x00, 0x01, 0x81, 0x80, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0xC0, 14, 0xC0, 12, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04, 10, 0, 0, 1
+    };
+    dns_msg_t msg;
+    dns_rr_t rr;
+    char name[64];
+
+    CHECK(dns_msg_init(&msg, self, sizeof(self)) == DNS_OK && dns_msg_next(&msg, &rr) == DNS_OK,
+          "loop: record read without following the pointer");
+    CHECK(!dns_name_equal(&msg, rr.name, "a"), "loop: self pointer rejected by compare");
+    CHECK(dns_name_copy(&msg, rr.name, name, sizeof(name)) == 0, "loop: self pointer rejected by copy");
+    CHECK(!dns_name_same(&msg, rr.name, rr.name), "loop: self pointer rejected by same");
+
+    CHECK(dns_msg_init(&msg, forward, sizeof(forward)) == DNS_OK, "loop: forward pointer message");
+    CHECK(dns_name_copy(&msg, 12, name, sizeof(name)) == 0, "loop: forward pointer rejected");
+}
+
+static void test_oversize(void) {
+    uint8_t buf[DNS_MSG_HEADER_LEN + 300 + 4];
+    dns_msg_t msg;
+    char name[4];
+    uint16_t pos, i;
+
+    /* A label of 64 bytes. */
+    memset(buf, 0, sizeof(buf));
+    buf[5] = 1;
+    buf[DNS_MSG_HEADER_LEN] = DNS_LABEL_MAX + 1;
+    memset(&buf[DNS_MSG_HEADER_LEN + 1], 'a', DNS_LABEL_MAX + 1);
+    CHECK(dns_msg_init(&msg, buf, sizeof(buf)) == DNS_ERR_FORMAT, "oversize: label of 64 bytes");
+
+    /* 0x40 and 0x80 are the reserved label types. */
+    buf[DNS_MSG_HEADER_LEN] = 0x80;
+    CHECK(dns_msg_init(&msg, buf, sizeof(buf)) == DNS_ERR_FORMAT, "oversize: reserved label type");
+
+    /* A name of 60 labels of 4 bytes, 300 bytes in all. */
+    for (pos = DNS_MSG_HEADER_LEN, i = 0; i < 60; i++, pos += 5) {
+        buf[pos] = 4;
+        memset(&buf[pos + 1], 'b', 4);
+    }
+    CHECK(dns_msg_init(&msg, buf, sizeof(buf)) == DNS_ERR_FORMAT, "oversize: name longer than 255 bytes");
+
+    /* A name longer than the buffer it is copied to copies as nothing. */
+    buf[DNS_MSG_HEADER_LEN + 5 * 3] = 0;
+    CHECK(dns_msg_init(&msg, buf, sizeof(buf)) == DNS_OK, "oversize: name of three labels");
+    CHECK(dns_name_copy(&msg, DNS_MSG_HEADER_LEN, name, sizeof(name)) == 0, "oversize: copy buffer too small");
+}
+
+int main(void) {
+    test_reply();
+    test_truncated();
+    test_compression_loop();
+    test_oversize();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+#include "pcap.h"
+
+#include <string.h>
+
+/**
+ * @brief Byte-swaps a 32 bit field of a file written on a machine of the other byte order.
+ *
+ * @param value
+ * @return uint32_t
+ */
+static uint32_t pcap_swap32(uint32_t value) {
+    return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+/**
+ * @brief Reads exactly len bytes.
+ *
+ * @param reader
+ * @param data
+ * @param len
+ * @return true
+ * @return false at the end of the file
+ */
+static bool pcap_read_all(pcap_reader_t *reader, void *data, size_t len) {
+    size_t n, done = 0;
+
+    while (done < len) {
+        n = reader->read(reader->ctx, (uint8_t *)data + done, len - done);
+        if (n == 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Starts a capture file: writes the global header. The fields are written in the byte order of this machine,
+ * readers recognize it by the magic number.
+ *
+ * @param writer
+ * @param write Sink of the file
+ * @param ctx Passed to write
+ * @param clock Timestamps of the frames, in microseconds
+ * @param snaplen Longest part of a frame stored, 0 for PCAP_SNAPLEN
+ * @return pcap_error_t
+ */
+pcap_error_t pcap_writer_init(pcap_writer_t *writer, pcap_write_fn write, void *ctx, pcap_clock_fn clock, uint32_t snaplen) {
+    uint8_t header[PCAP_FILE_HEADER_LEN];
+    uint32_t word;
+    uint16_t half;
+
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->clock = clock;
+    writer->snaplen = snaplen ? snaplen : PCAP_SNAPLEN;
+    writer->last_us = clock();
+    writer->sec = 0;
+    writer->usec = 0;
+    writer->frames = 0;
+    writer->dropped = 0;
+
+    memset(header, 0, sizeof(header)); // thiszone and sigfigs are 0
+    word = PCAP_MAGIC;
+    memcpy(&header[0], &word, 4);
+    half = PCAP_VERSION_MAJOR;
+    memcpy(&header[4], &half, 2);
+    half = PCAP_VERSION_MINOR;
+    memcpy(&header[6], &half, 2);
+    memcpy(&header[16], &writer->snaplen, 4);
+    word = PCAP_LINKTYPE_ETHERNET;
+    memcpy(&header[20], &word, 4);
+    return write(ctx, header, PCAP_FILE_HEADER_LEN) == PCAP_FILE_HEADER_LEN ? PCAP_OK : PCAP_IO_ERROR;
+}
+
+/**
+ * @brief Writes the header of a frame of len bytes, stamped with the current clock. Exactly the returned number of
+ * bytes must then be written with pcap_write_data(), e.g. while the frame is read out of the controller buffer.
+ *
+ * @param writer
+ * @param len Length of the frame
+ * @return uint32_t Bytes of the frame to store, 0 if the header could not be written
+ */
+uint32_t pcap_write_record(pcap_writer_t *writer, uint16_t len) {
+    uint32_t now = writer->clock();
+    uint32_t header[4];
+
+    writer->usec += now - writer->last_us;
+    writer->last_us = now;
+    writer->sec += writer->usec / 1000000;
+    writer->usec %= 1000000;
+
+    header[0] = writer->sec;
+    header[1] = writer->usec;
+    header[2] = len < writer->snaplen ? len : writer->snaplen;
+    header[3] = len;
+    if (writer->write(writer->ctx, header, PCAP_RECORD_HEADER_LEN) != PCAP_RECORD_HEADER_LEN) {
+        writer->dropped++;
+        return 0;
+    }
+    writer->frames++;
+    return header[2];
+}
+
+/**
+ * @brief Writes part of the frame announced by pcap_write_record().
+ *
+ * @param writer
+ * @param data
+ * @param len
+ * @return pcap_error_t
+ */
+pcap_error_t pcap_write_data(pcap_writer_t *writer, const uint8_t *data, uint16_t len) {
+    return writer->write(writer->ctx, data, len) == len ? PCAP_OK : PCAP_IO_ERROR;
+}
+
+/**
+ * @brief Captures a frame held in RAM.
+ *
+ * @param writer
+ * @param frame
+ * @param len
+ * @return pcap_error_t
+ */
+pcap_error_t pcap_write_frame(pcap_writer_t *writer, const uint8_t *frame, uint16_t len) {
+    uint32_t caplen = pcap_write_record(writer, len);
+
+    if (caplen == 0)
+        return len == 0 ? PCAP_OK : PCAP_IO_ERROR;
+    return pcap_write_data(writer, frame, caplen);
+}
+
+/**
+ * @brief Opens a capture file: reads and checks the global header. Files of either byte order are accepted, only
+ * the Ethernet link type is.
+ *
+ * @param reader
+ * @param read Source of the file
+ * @param ctx Passed to read
+ * @return pcap_error_t
+ */
+pcap_error_t pcap_reader_init(pcap_reader_t *reader, pcap_read_fn read, void *ctx) {
+    uint32_t header[6];
+
+    reader->read = read;
+    reader->ctx = ctx;
+    if (!pcap_read_all(reader, header, PCAP_FILE_HEADER_LEN))
+        return PCAP_IO_ERROR;
+    if (header[0] == PCAP_MAGIC)
+        reader->swapped = false;
+    else if (header[0] == PCAP_MAGIC_SWAPPED)
+        reader->swapped = true;
+    else
+        return PCAP_BAD_MAGIC;
+    reader->snaplen = reader->swapped ? pcap_swap32(header[4]) : header[4];
+    if ((reader->swapped ? pcap_swap32(header[5]) : header[5]) != PCAP_LINKTYPE_ETHERNET)
+        return PCAP_BAD_LINKTYPE;
+    return PCAP_OK;
+}
+
+/**
+ * @brief Reads the header of the next frame. Its caplen bytes must then be taken with pcap_read_data(), e.g. to store
+ * a frame that does not fit a RAM buffer piece by piece.
+ *
+ * @param reader
+ * @param record Header of the frame, caplen as stored in the file
+ * @return pcap_error_t PCAP_EOF after the last frame
+ */
+pcap_error_t pcap_read_record(pcap_reader_t *reader, pcap_record_t *record) {
+    uint32_t header[4];
+    uint8_t n;
+
+    if (!pcap_read_all(reader, header, PCAP_RECORD_HEADER_LEN))
+        return PCAP_EOF;
+    if (reader->swapped) {
+        for (n = 0; n < 4; n++)
+            header[n] = pcap_swap32(header[n]);
+    }
+    record->ts_sec = header[0];
+    record->ts_usec = header[1];
+    record->caplen = header[2];
+    record->len = header[3];
+    return PCAP_OK;
+}
+
+/**
+ * @brief Reads part of the frame announced by pcap_read_record(). A NULL data skips len bytes.
+ *
+ * @param reader
+ * @param data
+ * @param len
+ * @return pcap_error_t
+ */
+pcap_error_t pcap_read_data(pcap_reader_t *reader, uint8_t *data, uint32_t len) {
+    uint8_t skip[16];
+    uint16_t n;
+
+    if (data)
+        return pcap_read_all(reader, data, len) ? PCAP_OK : PCAP_IO_ERROR;
+    for (; len > 0; len -= n) {
+        n = len < sizeof(skip) ? len : sizeof(skip);
+        if (!pcap_read_all(reader, skip, n))
+            return PCAP_IO_ERROR;
+    }
+    return PCAP_OK;
+}
+
+/**
+ * @brief Reads the next frame. A frame longer than the buffer is cut to its size and the rest is skipped.
+ *
+ * @param reader
+ * @param record Header of the frame, caplen as stored in the file
+ * @param buffer
+ * @param size
+ * @return pcap_error_t PCAP_EOF after the last frame, PCAP_TRUNCATED if the frame did not fit
+ */
+pcap_error_t pcap_read_frame(pcap_reader_t *reader, pcap_record_t *record, uint8_t *buffer, uint16_t size) {
+    pcap_error_t error;
+    uint16_t n;
+
+    if ((error = pcap_read_record(reader, record)) != PCAP_OK)
+        return error;
+    n = record->caplen < size ? record->caplen : size;
+    if (pcap_read_data(reader, buffer, n) != PCAP_OK || pcap_read_data(reader, NULL, record->caplen - n) != PCAP_OK)
+        return PCAP_IO_ERROR;
+    return record->caplen > size ? PCAP_TRUNCATED : PCAP_OK;
+}
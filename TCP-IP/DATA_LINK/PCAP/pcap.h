@@ -0,0 +1,120 @@
+/**
+ * @file pcap.h
+ * @brief Writer and reader of the libpcap capture format (Ethernet link type), for recording the frames a network
+ * stack exchanges at the MAC boundary and replaying them later. The file is accessed through read/write callbacks,
+ * so it can live on an SD card, a serial link or a host file.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#pragma region Dependencies
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#pragma endregion
+
+#pragma region Useful macros
+/**
+ * @brief Magic number of a pcap file with microsecond timestamps.
+ */
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_SWAPPED  0xD4C3B2A1
+
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+
+/**
+ * @brief Link type of the captured frames, LINKTYPE_ETHERNET.
+ */
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/**
+ * @brief Largest frame captured by default (Ethernet frame without CRC).
+ */
+#ifndef PCAP_SNAPLEN
+#define PCAP_SNAPLEN        1514
+#endif
+
+#define PCAP_FILE_HEADER_LEN    24
+#define PCAP_RECORD_HEADER_LEN  16
+#pragma endregion
+
+#pragma region Custom types
+/**
+ * @brief Writes len bytes to the capture file, returns the number of bytes written.
+ */
+typedef size_t (*pcap_write_fn)(void *ctx, const void *data, size_t len);
+
+/**
+ * @brief Reads up to len bytes from the capture file, returns the number of bytes read (0 at the end).
+ */
+typedef size_t (*pcap_read_fn)(void *ctx, void *data, size_t len);
+
+/**
+ * @brief Monotonic clock stamping the captured frames, in microseconds.
+ */
+typedef uint32_t (*pcap_clock_fn)(void);
+
+/**
+ * @brief
+ *
+ */
+typedef enum pcap_error {
+    PCAP_OK, PCAP_EOF, PCAP_IO_ERROR, PCAP_BAD_MAGIC, PCAP_BAD_LINKTYPE, PCAP_TRUNCATED
+} pcap_error_t;
+
+/**
+ * @brief Capture file being written. The frames are stamped with clock, seconds are counted across its wrap-around.
+ */
+typedef struct pcap_writer {
+    pcap_write_fn write;
+    void *ctx;
+    pcap_clock_fn clock;
+    uint32_t snaplen;
+    uint32_t last_us;   // clock value of the previous frame
+    uint32_t sec;       // time elapsed up to last_us
+    uint32_t usec;
+    uint32_t frames;    // frames written
+    uint32_t dropped;   // frames lost to write errors
+} pcap_writer_t;
+
+/**
+ * @brief Header of a captured frame.
+ */
+typedef struct pcap_record {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;    // bytes stored in the file
+    uint32_t len;       // length of the frame on the wire
+} pcap_record_t;
+
+/**
+ * @brief Capture file being read.
+ */
+typedef struct pcap_reader {
+    pcap_read_fn read;
+    void *ctx;
+    bool swapped;       // file written with the other byte order
+    uint32_t snaplen;
+} pcap_reader_t;
+#pragma endregion
+
+#pragma region Function prototypes
+pcap_error_t pcap_writer_init(pcap_writer_t *writer, pcap_write_fn write, void *ctx, pcap_clock_fn clock, uint32_t snaplen);
+pcap_error_t pcap_write_frame(pcap_writer_t *writer, const uint8_t *frame, uint16_t len);
+uint32_t pcap_write_record(pcap_writer_t *writer, uint16_t len);
+pcap_error_t pcap_write_data(pcap_writer_t *writer, const uint8_t *data, uint16_t len);
+
+pcap_error_t pcap_reader_init(pcap_reader_t *reader, pcap_read_fn read, void *ctx);
+pcap_error_t pcap_read_record(pcap_reader_t *reader, pcap_record_t *record);
+pcap_error_t pcap_read_data(pcap_reader_t *reader, uint8_t *data, uint32_t len);
+pcap_error_t pcap_read_frame(pcap_reader_t *reader, pcap_record_t *record, uint8_t *buffer, uint16_t size);
+#pragma endregion
+
+#endif /* PCAP_H */
@@ -43,7 +43,7 @@ typedef union IPV6_address {
  * @brief 
  * 
  */
-typedef enum IPV4_error {
+typedef enum IPV6_error {
     IPV6_NULL_STRING, IPV6_NULL_TOKEN, IPV6_NaN, IPV6_INVALID_NUMBER, IPV6_INVALID_ADDRESS, IPV6_INVALID_ARRAY_LENGTH ,IPV6_ADDRESS_OK
 } IPV6_error_t;
 